@@ -0,0 +1,186 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Deadline-aware admission control for view queries.
+ *
+ * Under overload, queued queries eventually time out after using cluster
+ * capacity anyway. The controller is consulted by the caller's executor
+ * before a query is queued. It estimates when the query would complete:
+ *
+ *     now + wait + latency
+ *
+ * where 'latency' is a moving average of recent latencies of the same
+ * view, and 'wait' is the estimated remaining work of the queries
+ * already queued or in flight, divided by the number of queries the
+ * executor runs at once (0 if a slot is free). A query which would
+ * complete by its deadline is accepted. One which would not is rejected
+ * at once, leaving the capacity to queries which can still succeed, or,
+ * if the caller allows it, downgraded: a stale result (from a result
+ * cache, or a stale=ok query, which the view engine answers without
+ * updating the index) is acceptable, and its own latency average is used.
+ *
+ * lcbex does not perform I/O: the caller reports when each admitted query
+ * is sent and when it completes. The controller is not thread safe.
+ */
+
+#ifndef LCBEX_ADMIT_H
+#define LCBEX_ADMIT_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* default time constant of the latency averages: 10 seconds */
+#define LCBEX_ADMIT_DECAY_DEFAULT 10000000000ULL
+
+    /* default latency of a view without samples: 100ms */
+#define LCBEX_ADMIT_LATENCY_DEFAULT 100000000ULL
+
+    enum {
+        /* a stale result is acceptable if a fresh one would be late */
+        LCBEX_ADMIT_F_CAN_DOWNGRADE = 1 << 0
+    };
+
+    typedef enum {
+        LCBEX_ADMIT_ACCEPT = 0,
+        /* serve a cached result, or query with stale=ok */
+        LCBEX_ADMIT_DOWNGRADE,
+        /* fail the query now (e.g. with LCB_ETIMEDOUT) */
+        LCBEX_ADMIT_REJECT
+    } lcbex_admit_decision_t;
+
+    typedef struct {
+        /* queries the executor runs at once. Default 8 */
+        unsigned int concurrency;
+        /* time constant of the latency averages, in nanoseconds */
+        lcb_uint64_t decay;
+        /* latency assumed for a view without samples */
+        lcb_uint64_t initial_latency;
+    } lcbex_admit_config_t;
+
+    /**
+     * An admitted query. The fields are private.
+     */
+    typedef struct {
+        size_t view;
+        lcb_uint64_t estimate;
+        lcb_uint64_t deadline;
+        lcb_uint64_t started;
+        int stale;
+        int state;
+    } lcbex_admit_ticket_t;
+
+    typedef struct {
+        lcb_uint64_t accepted;
+        lcb_uint64_t downgraded;
+        lcb_uint64_t rejected;
+        lcb_uint64_t completed;
+        /* completed queries which missed their deadline */
+        lcb_uint64_t late;
+        /* admitted queries not yet sent */
+        unsigned int queued;
+        unsigned int inflight;
+    } lcbex_admit_stats_t;
+
+    typedef struct lcbex_admit_st lcbex_admit_t;
+
+    /**
+     * Initializes a configuration with the defaults
+     */
+    LCBEX_API
+    void lcbex_admit_config_init(lcbex_admit_config_t *config);
+
+    LCBEX_API
+    lcb_error_t lcbex_admit_create(lcbex_admit_t **adm,
+                                   const lcbex_admit_config_t *config);
+
+    /**
+     * Decides whether to run a query.
+     *
+     * @param deadline the time by which the query must complete, in
+     * lcbex_hrtime() terms; 0 if it has none
+     * @param flags LCBEX_ADMIT_F_* flags
+     * @param now the current time
+     * @param ticket will be initialized for an accepted or downgraded
+     * query, which counts as queued until lcbex_admit_start. It must be
+     * passed to lcbex_admit_done or lcbex_admit_cancel
+     * @param estimate if not NULL, will contain the estimated completion
+     * time of a fresh query
+     * @return the decision. LCBEX_ADMIT_REJECT is also returned if the
+     * view could not be added (out of memory)
+     */
+    LCBEX_API
+    lcbex_admit_decision_t lcbex_admit_request(lcbex_admit_t *adm,
+                                               const char *design,
+                                               size_t ndesign,
+                                               const char *view,
+                                               size_t nview,
+                                               lcb_uint64_t deadline,
+                                               int flags,
+                                               lcb_uint64_t now,
+                                               lcbex_admit_ticket_t *ticket,
+                                               lcb_uint64_t *estimate);
+
+    /**
+     * Reports that an admitted query was sent
+     */
+    LCBEX_API
+    void lcbex_admit_start(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket,
+                           lcb_uint64_t now);
+
+    /**
+     * Reports the completion of a query. Its latency (from
+     * lcbex_admit_start) updates the view's average if it succeeded or
+     * timed out.
+     */
+    LCBEX_API
+    void lcbex_admit_done(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket,
+                          lcb_error_t status, lcb_uint64_t now);
+
+    /**
+     * Releases an admitted query which will not be sent, e.g. one served
+     * from a cache after being downgraded
+     */
+    LCBEX_API
+    void lcbex_admit_cancel(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket);
+
+    /**
+     * Returns the latency average of a view, or the initial latency if it
+     * has no samples
+     * @param stale non-zero for the average of stale=ok queries
+     */
+    LCBEX_API
+    lcb_uint64_t lcbex_admit_get_latency(lcbex_admit_t *adm,
+                                         const char *design, size_t ndesign,
+                                         const char *view, size_t nview,
+                                         int stale);
+
+    LCBEX_API
+    void lcbex_admit_get_stats(const lcbex_admit_t *adm,
+                               lcbex_admit_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_admit_destroy(lcbex_admit_t *adm);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_ADMIT_H */
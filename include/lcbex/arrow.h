@@ -0,0 +1,143 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Apache Arrow IPC stream writer for view rows.
+ *
+ * Rows are appended to column buffers as they are parsed and written out
+ * as Arrow record batches, in the IPC streaming format: a schema message,
+ * one message per batch, and an end-of-stream marker. Any Arrow reader
+ * can consume the stream directly; the column buffers are laid out as
+ * Arrow expects them, so a reader maps them rather than converting.
+ *
+ * Every stream has three UTF-8 columns:
+ *
+ * o "key" - the row's key, as JSON text
+ * o "id" - the document ID, unescaped; null for reduce rows
+ * o "value" - the row's value, as JSON text
+ *
+ * Further columns may be extracted from each row's value (see
+ * lcbex_arrow_writer_add_column). All columns are nullable.
+ *
+ * The metadata is encoded by hand, so there is no dependency on libarrow
+ * or flatbuffers. Buffers are in the host's byte order, which is declared
+ * in the schema.
+ *
+ * The writer is not thread safe.
+ */
+
+#ifndef LCBEX_ARROW_H
+#define LCBEX_ARROW_H
+
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        /* strings are unescaped; other values are kept as JSON text */
+        LCBEX_ARROW_UTF8 = 0,
+        /* numbers without a fractional part which fit in 64 bits */
+        LCBEX_ARROW_INT64,
+        /* any number */
+        LCBEX_ARROW_DOUBLE,
+        /* true or false */
+        LCBEX_ARROW_BOOL
+    } lcbex_arrow_type_t;
+
+    /* rows per record batch, unless changed */
+#define LCBEX_ARROW_BATCH_DEFAULT 65536
+
+    typedef struct lcbex_arrow_writer_st lcbex_arrow_writer_t;
+
+    /**
+     * Receives the encoded stream, in order.
+     * @return LCB_SUCCESS, or an error which aborts the write and is
+     * returned to the caller
+     */
+    typedef lcb_error_t (*lcbex_arrow_sink)(const void *data, size_t ndata,
+                                            void *cookie);
+
+    LCBEX_API
+    lcb_error_t lcbex_arrow_writer_create(lcbex_arrow_writer_t **writer,
+                                          lcbex_arrow_sink sink,
+                                          void *cookie);
+
+    /**
+     * Adds a column extracted from each row's value. Values which are
+     * missing or of the wrong type are null.
+     * @param name the name of the column
+     * @param path dotted path of the field within the value (see
+     * lcbex_jsoncur_path), or NULL for the value itself
+     * @return LCB_EINVAL if the schema has already been written (i.e. a
+     * batch was flushed)
+     */
+    LCBEX_API
+    lcb_error_t lcbex_arrow_writer_add_column(lcbex_arrow_writer_t *writer,
+                                              const char *name,
+                                              const char *path,
+                                              lcbex_arrow_type_t type);
+
+    /**
+     * Sets the number of rows after which a record batch is written
+     */
+    LCBEX_API
+    void lcbex_arrow_writer_set_batch_rows(lcbex_arrow_writer_t *writer,
+                                           size_t nrows);
+
+    /**
+     * Appends a row, writing a record batch if one is full.
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, LCB_E2BIG if a single value
+     * is 2GB or larger, or an error from the sink
+     */
+    LCBEX_API
+    lcb_error_t lcbex_arrow_writer_add_row(lcbex_arrow_writer_t *writer,
+                                           const lcbex_vrow_t *row);
+
+    /**
+     * Row parser callback (see lcbex_vrow_parser_create); the cookie is
+     * the writer. The first error is kept and returned by
+     * lcbex_arrow_writer_finish, and later rows are ignored.
+     */
+    LCBEX_API
+    void lcbex_arrow_writer_row_callback(lcbex_vrow_parser_t *parser,
+                                         const lcbex_vrow_t *row,
+                                         void *cookie);
+
+    /**
+     * Writes the rows appended so far as a record batch, if there are any
+     */
+    LCBEX_API
+    lcb_error_t lcbex_arrow_writer_flush(lcbex_arrow_writer_t *writer);
+
+    /**
+     * Writes the remaining rows and the end-of-stream marker. The schema
+     * is written even if there were no rows.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_arrow_writer_finish(lcbex_arrow_writer_t *writer);
+
+    LCBEX_API
+    void lcbex_arrow_writer_destroy(lcbex_arrow_writer_t *writer);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_ARROW_H */
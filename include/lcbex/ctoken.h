@@ -0,0 +1,146 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Continuation tokens for stateless keyset paging.
+ *
+ * Paging with 'skip' makes the server walk past every skipped row, so
+ * later pages get slower. Keyset paging resumes at the key and document
+ * ID of the next row instead, but a stateless tier must hand that
+ * position to its client. A continuation token carries it: the next
+ * startkey and startkey_docid, and the direction, in a compact URL-safe
+ * string (base64url without padding) which any process holding the same
+ * secret key can decode.
+ *
+ * Tokens are authenticated with SipHash-2-4 over their contents and a
+ * fingerprint of the query (design document, view and options other than
+ * those that change from page to page), so a client can neither forge a
+ * position nor resume one query's token with another query. The key and
+ * position themselves are not encrypted: clients can decode the key of
+ * the next row, which they would see in the page anyway.
+ */
+
+#ifndef LCBEX_CTOKEN_H
+#define LCBEX_CTOKEN_H
+
+#include <lcbex/viewopts.h>
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* size of the secret key, in bytes */
+#define LCBEX_CTOKEN_KEY_SIZE 16
+
+    enum {
+        /* the query walks the view in descending order */
+        LCBEX_CTOKEN_F_DESCENDING = 1 << 0
+    };
+
+    typedef struct {
+        /* JSON-encoded key of the next row */
+        const char *startkey;
+        /* the document ID of the next row (not JSON-encoded), or NULL */
+        const char *startkey_docid;
+        size_t nstartkey;
+        size_t nstartkey_docid;
+        int flags;
+        /* private; owned by the token */
+        char *buf;
+    } lcbex_ctoken_t;
+
+    /**
+     * Fingerprints a query. The order of the options does not matter, nor
+     * do the options that change from page to page or are set from the
+     * token (startkey, startkey_docid, skip, limit and descending).
+     */
+    LCBEX_API
+    lcb_uint64_t lcbex_ctoken_fingerprint(const char *design, size_t ndesign,
+                                          const char *view, size_t nview,
+                                          const lcbex_vopt_t *const *options,
+                                          size_t noptions);
+
+    /**
+     * Sets the position of a token to a row. Query one row more than
+     * the page size: that extra row is where the next page starts.
+     *
+     * @param token a zeroed token, or one used before
+     * @param row the row. The token points into it, and is valid for as
+     * long as the row, until cleaned up
+     * @param flags LCBEX_CTOKEN_F_* flags
+     * @return LCB_SUCCESS, LCB_EINVAL for a malformed document ID, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_ctoken_from_row(lcbex_ctoken_t *token,
+                                      const lcbex_vrow_t *row, int flags);
+
+    /**
+     * Encodes a token.
+     *
+     * @param key the secret key, LCBEX_CTOKEN_KEY_SIZE bytes
+     * @param fingerprint the fingerprint of the query
+     * @param out will contain the NUL-terminated token. Free with free()
+     * @param nout if not NULL, will contain the length of the token
+     * @return LCB_SUCCESS, LCB_EINVAL if the token has no startkey, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_ctoken_encode(const lcbex_ctoken_t *token,
+                                    const unsigned char *key,
+                                    lcb_uint64_t fingerprint,
+                                    char **out, size_t *nout);
+
+    /**
+     * Decodes a token received from a client.
+     *
+     * @param token the token to initialize. Clean it up after use, even
+     * if decoding failed
+     * @param str the token. -1 if NUL-terminated
+     * @return LCB_SUCCESS, LCB_EINVAL if the token is malformed, was not
+     * issued with this key or for a query with this fingerprint, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_ctoken_decode(lcbex_ctoken_t *token,
+                                    const char *str, size_t nstr,
+                                    const unsigned char *key,
+                                    lcb_uint64_t fingerprint);
+
+    /**
+     * Builds the URI of the page starting at a token's position.
+     *
+     * @param options the options of the query, which should have no 'skip'.
+     * startkey, startkey_docid and descending are set from the token
+     * @return the URI, or NULL. Free with free()
+     */
+    LCBEX_API
+    char *lcbex_ctoken_make_uri(const lcbex_ctoken_t *token,
+                                const char *design, size_t ndesign,
+                                const char *view, size_t nview,
+                                const lcbex_vopt_t *const *options,
+                                size_t noptions);
+
+    LCBEX_API
+    void lcbex_ctoken_cleanup(lcbex_ctoken_t *token);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_CTOKEN_H */
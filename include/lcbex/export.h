@@ -0,0 +1,146 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Sharded export of a view to files.
+ *
+ * Writing a large export through a single stream leaves fast storage
+ * idle. Here each partition of a RANGE_PARTITIONED plan (see planner.h)
+ * is exported to its own file, part-00000, part-00001... in a directory,
+ * and the parts are independent of each other: each can be fed by a
+ * different thread (e.g. one with its own libcouchbase instance) without
+ * locking. A SINGLE plan exports to one part.
+ *
+ * Each file holds one row per line, as a JSON object with the row's
+ * "id" (if any), "key" and "value".
+ *
+ * Once every part is done, lcbex_export_write_manifest() writes
+ * manifest.json, listing the parts in the query's key order with the key
+ * range each was assigned, its row count, and its first and last keys,
+ * so that consumers can process the files in parallel or in sequence:
+ *
+ *   {"design":"d","view":"v","parts":[
+ *     {"file":"part-00000","start_key":0,"end_key":25,
+ *      "inclusive_end":false,"rows":5012,"first_key":0,"last_key":24.5},
+ *     ...]}
+ *
+ * For a SINGLE plan the bounds are null.
+ */
+
+#ifndef LCBEX_EXPORT_H
+#define LCBEX_EXPORT_H
+
+#include <lcbex/planner.h>
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_export_st lcbex_export_t;
+    typedef struct lcbex_export_part_st lcbex_export_part_t;
+
+    /**
+     * Creates an export. No files are created yet.
+     *
+     * @param dir an existing directory for the files
+     * @param plan a SINGLE or RANGE_PARTITIONED plan for the query
+     * @param options the query's options; they are used to build the
+     * parts' URIs and must stay valid while the export is used
+     * @return LCB_EINVAL for other strategies
+     */
+    LCBEX_API
+    lcb_error_t lcbex_export_create(lcbex_export_t **exp,
+                                    const char *dir,
+                                    const lcbex_plan_t *plan,
+                                    const char *design, size_t ndesign,
+                                    const char *view, size_t nview,
+                                    const lcbex_vopt_t *const *options,
+                                    size_t noptions);
+
+    LCBEX_API
+    size_t lcbex_export_nparts(const lcbex_export_t *exp);
+
+    /**
+     * Returns a part, from 0 to lcbex_export_nparts() - 1
+     */
+    LCBEX_API
+    lcbex_export_part_t *lcbex_export_get_part(lcbex_export_t *exp,
+                                               size_t index);
+
+    /**
+     * Builds the URI to query for a part
+     * @return an allocated string, or NULL on error
+     */
+    LCBEX_API
+    char *lcbex_export_part_make_uri(const lcbex_export_part_t *part);
+
+    /**
+     * Feeds part of the part's response body. The part's file is created
+     * on the first call.
+     * @return LCB_SUCCESS, LCB_EINVAL if the response is malformed,
+     * LCB_CLIENT_ENOMEM, or LCB_ERROR if the file could not be written
+     */
+    LCBEX_API
+    lcb_error_t lcbex_export_part_feed(lcbex_export_part_t *part,
+                                       const void *data, size_t ndata);
+
+    /**
+     * Completes a part, closing its file.
+     * @param status the status of the part's query. If it is not
+     * LCB_SUCCESS the part is failed; it may be retried after
+     * lcbex_export_part_reset()
+     * @return the first error of the part, if any
+     */
+    LCBEX_API
+    lcb_error_t lcbex_export_part_done(lcbex_export_part_t *part,
+                                       lcb_error_t status);
+
+    /**
+     * Discards what was written for a part, so its query can be retried
+     */
+    LCBEX_API
+    lcb_error_t lcbex_export_part_reset(lcbex_export_part_t *part);
+
+    /**
+     * Returns the number of rows written for a part so far
+     */
+    LCBEX_API
+    lcb_uint64_t lcbex_export_part_rows(const lcbex_export_part_t *part);
+
+    /**
+     * Writes manifest.json. Must be called after every part is done, and
+     * not concurrently with anything else on the export.
+     * @return LCB_EINVAL if a part is not done, the error of a failed part,
+     * or LCB_ERROR if the manifest could not be written
+     */
+    LCBEX_API
+    lcb_error_t lcbex_export_write_manifest(lcbex_export_t *exp);
+
+    /**
+     * Destroys the export, closing any open files. Files are left in
+     * place.
+     */
+    LCBEX_API
+    void lcbex_export_destroy(lcbex_export_t *exp);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_EXPORT_H */
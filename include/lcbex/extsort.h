@@ -0,0 +1,147 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * External merge sort of view rows by a field of their values.
+ *
+ * Rows are accumulated in memory until the memory limit is reached;
+ * they are then sorted and written to a temporary file as a 'run', in a
+ * compact binary form (varint lengths followed by the row's fields). When
+ * the input is finished the runs are merged back, at most 'max_fanin' at
+ * a time, and the sorted rows are read with a streaming iterator. If the
+ * rows fit in memory nothing is written.
+ *
+ * The sort field is located with a JSON cursor (see jsoncur.h) and is
+ * compared either as a number or in view collation order (see
+ * lcbex_vrow_collate). Rows without the field (or, for a numeric sort,
+ * where it is not a number) come after all others. The sort is stable:
+ * rows comparing equal keep the order they were added in.
+ *
+ * The sorter is not thread safe.
+ */
+
+#ifndef LCBEX_EXTSORT_H
+#define LCBEX_EXTSORT_H
+
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        /* compare the field as a number */
+        LCBEX_EXTSORT_NUMERIC = 0,
+        /* compare the field's JSON in view collation order */
+        LCBEX_EXTSORT_COLLATE
+    } lcbex_extsort_compare_t;
+
+    typedef struct {
+        /* dotted path (see lcbex_jsoncur_path) of the sort field within
+         * the value, or NULL for the value itself */
+        const char *path;
+        lcbex_extsort_compare_t compare;
+        /* sort in descending order */
+        int descending;
+        /* bytes of memory for rows before a run is written, 0 for no
+         * limit */
+        size_t memory_limit;
+        /* most runs merged at once (default 64); more runs take several
+         * passes */
+        unsigned int max_fanin;
+    } lcbex_extsort_config_t;
+
+    typedef struct {
+        lcb_uint64_t rows;
+        /* rows without a usable sort field */
+        lcb_uint64_t unsorted;
+        /* runs written, including those written by intermediate merges */
+        lcb_uint64_t runs;
+        lcb_uint64_t spilled_bytes;
+        /* merge passes before the final one */
+        lcb_uint64_t merge_passes;
+    } lcbex_extsort_stats_t;
+
+    typedef struct lcbex_extsort_st lcbex_extsort_t;
+
+    /**
+     * Initializes a configuration with defaults: a numeric, ascending sort
+     * on the value, with no memory limit
+     */
+    LCBEX_API
+    void lcbex_extsort_config_init(lcbex_extsort_config_t *config);
+
+    /**
+     * @param config the configuration. The path is copied
+     */
+    LCBEX_API
+    lcb_error_t lcbex_extsort_create(lcbex_extsort_t **sorter,
+                                     const lcbex_extsort_config_t *config);
+
+    /**
+     * Adds a batch of rows, e.g. from a row parser's callback
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, LCB_EINVAL if the input was
+     * already finished, or LCB_ERROR if writing a run failed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_extsort_add_rows(lcbex_extsort_t *sorter,
+                                       const lcbex_vrow_t *rows,
+                                       size_t nrows);
+
+    /**
+     * Ends the input and prepares the rows for reading, merging runs
+     * down to at most max_fanin if needed
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_ERROR on I/O errors
+     */
+    LCBEX_API
+    lcb_error_t lcbex_extsort_finish(lcbex_extsort_t *sorter);
+
+    /**
+     * Reads the next row in sorted order.
+     * @param row will point to the row, or NULL after the last one. The
+     * row is valid until the next call
+     * @return LCB_SUCCESS, LCB_EINVAL if the input was not finished, or
+     * LCB_ERROR on I/O errors
+     */
+    LCBEX_API
+    lcb_error_t lcbex_extsort_next(lcbex_extsort_t *sorter,
+                                   const lcbex_vrow_t **row);
+
+    /**
+     * Discards all rows and runs, so the sorter may be reused
+     */
+    LCBEX_API
+    void lcbex_extsort_reset(lcbex_extsort_t *sorter);
+
+    /**
+     * Returns the memory currently used by rows held in memory, in bytes
+     */
+    LCBEX_API
+    size_t lcbex_extsort_memory(const lcbex_extsort_t *sorter);
+
+    LCBEX_API
+    void lcbex_extsort_get_stats(const lcbex_extsort_t *sorter,
+                                 lcbex_extsort_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_extsort_destroy(lcbex_extsort_t *sorter);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_EXTSORT_H */
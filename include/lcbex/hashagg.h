@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Client-side grouping and aggregation of map-only view rows.
+ *
+ * For views queried with reduce=false, rows can be grouped and aggregated
+ * as they stream in, either by a prefix of an array key (like
+ * group_level) or by a field of the row's value. For each group the
+ * count, sum, min, max and mean of a numeric measure (the value itself,
+ * or a field of it) are kept.
+ *
+ * Groups live in an open-addressing hash table; keys of up to
+ * LCBEX_HASHAGG_INLINE_KEY bytes are stored inside the table itself.
+ * Rows are processed in batches: the group keys and measures of a whole
+ * batch are extracted and hashed before any of them touches the table.
+ *
+ * If the table would grow beyond the memory limit, its partial
+ * aggregates are written out to temporary files, partitioned by hash,
+ * and the table starts again empty. When the input is finished, each
+ * partition is read back and aggregated on its own, so only one
+ * partition needs to fit in memory at a time.
+ *
+ * The aggregator is not thread safe.
+ */
+
+#ifndef LCBEX_HASHAGG_H
+#define LCBEX_HASHAGG_H
+
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LCBEX_HASHAGG_INLINE_KEY 24
+
+    typedef enum {
+        /**
+         * Group by the first 'group_level' elements of an array key.
+         * Non-array keys, and a group_level of 0, group by the whole key
+         */
+        LCBEX_HASHAGG_GROUP_KEY_PREFIX = 0,
+        /* group by the field at 'group_path' in the value */
+        LCBEX_HASHAGG_GROUP_VALUE_FIELD
+    } lcbex_hashagg_group_t;
+
+    typedef struct {
+        lcbex_hashagg_group_t group_by;
+        unsigned int group_level;
+        /* dotted path (see lcbex_jsoncur_path) of the grouping field */
+        const char *group_path;
+        /* dotted path of the measure within the value, or NULL for the
+         * value itself */
+        const char *measure_path;
+        /* bytes of memory for the table before spilling, 0 for no limit */
+        size_t memory_limit;
+        /* number of spill partitions (default 16) */
+        unsigned int npartitions;
+    } lcbex_hashagg_config_t;
+
+    typedef struct {
+        /* rows in the group */
+        lcb_uint64_t count;
+        /* rows whose measure was a number; the remaining fields only
+         * cover these */
+        lcb_uint64_t nvalues;
+        double sum;
+        double min;
+        double max;
+        double mean;
+    } lcbex_hashagg_result_t;
+
+    typedef struct {
+        lcb_uint64_t rows;
+        /* rows without the grouping field, which are not aggregated */
+        lcb_uint64_t skipped;
+        /* groups emitted by lcbex_hashagg_finish */
+        lcb_uint64_t groups;
+        /* number of times the table was written out */
+        lcb_uint64_t spills;
+        lcb_uint64_t spilled_bytes;
+    } lcbex_hashagg_stats_t;
+
+    typedef struct lcbex_hashagg_st lcbex_hashagg_t;
+
+    /**
+     * Invoked once for each group, in no particular order.
+     * @param key the JSON-encoded group key
+     */
+    typedef void (*lcbex_hashagg_callback)(lcbex_hashagg_t *agg,
+                                           const char *key, size_t nkey,
+                                           const lcbex_hashagg_result_t *res,
+                                           void *cookie);
+
+    /**
+     * Initializes a configuration with defaults: grouping by the whole
+     * key, the value as the measure, and no memory limit
+     */
+    LCBEX_API
+    void lcbex_hashagg_config_init(lcbex_hashagg_config_t *config);
+
+    /**
+     * @param config the configuration. The paths are copied
+     */
+    LCBEX_API
+    lcb_error_t lcbex_hashagg_create(lcbex_hashagg_t **agg,
+                                     const lcbex_hashagg_config_t *config);
+
+    /**
+     * Aggregates a batch of rows
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_ERROR if spilling
+     * failed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_hashagg_add_rows(lcbex_hashagg_t *agg,
+                                       const lcbex_vrow_t *rows,
+                                       size_t nrows);
+
+    /**
+     * Emits every group and resets the aggregator so it may be reused
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_ERROR if reading back
+     * spilled partitions failed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_hashagg_finish(lcbex_hashagg_t *agg,
+                                     lcbex_hashagg_callback callback,
+                                     void *cookie);
+
+    /**
+     * Returns the memory currently used by the table, in bytes
+     */
+    LCBEX_API
+    size_t lcbex_hashagg_memory(const lcbex_hashagg_t *agg);
+
+    LCBEX_API
+    void lcbex_hashagg_get_stats(const lcbex_hashagg_t *agg,
+                                 lcbex_hashagg_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_hashagg_destroy(lcbex_hashagg_t *agg);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_HASHAGG_H */
@@ -0,0 +1,192 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * On-demand navigation of JSON values.
+ *
+ * Most consumers read one or two fields from each row's value or document.
+ * Rather than building a DOM, a JSON index records the position of every
+ * structural character ({}[]:, and string quotes) and, for each opening
+ * bracket or quote, where it closes. A cursor walks this index: moving to
+ * an object member or array element jumps over unvisited subtrees in
+ * constant time, and nothing is decoded until it is asked for.
+ *
+ *     lcbex_json_index_build(idx, row->doc, row->ndoc);
+ *     lcbex_jsoncur_root(idx, &doc);
+ *     if (lcbex_jsoncur_path(&doc, "address.city", &city) == LCB_SUCCESS) {
+ *         lcbex_jsoncur_string(&city, buf, &s, &ns);
+ *     }
+ *
+ * The index is reusable: building it again for the next row reuses its
+ * allocations. Cursors are plain values and remain valid until the index
+ * is rebuilt or destroyed.
+ */
+
+#ifndef LCBEX_JSONCUR_H
+#define LCBEX_JSONCUR_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        LCBEX_JSON_INVALID = 0,
+        LCBEX_JSON_NULL,
+        LCBEX_JSON_FALSE,
+        LCBEX_JSON_TRUE,
+        LCBEX_JSON_NUMBER,
+        LCBEX_JSON_STRING,
+        LCBEX_JSON_ARRAY,
+        LCBEX_JSON_OBJECT
+    } lcbex_json_type_t;
+
+    typedef struct lcbex_json_index_st lcbex_json_index_t;
+
+    /**
+     * A position within an indexed JSON value. The fields are private.
+     */
+    typedef struct {
+        const lcbex_json_index_t *index;
+        /* offset of the value in the text */
+        size_t offset;
+        /* index of the first structural character at or after 'offset' */
+        size_t si;
+        /* structural index of the member name's opening quote, or
+         * SIZE_MAX if this is not an object member */
+        size_t name_si;
+    } lcbex_jsoncur_t;
+
+    LCBEX_API
+    lcb_error_t lcbex_json_index_create(lcbex_json_index_t **index);
+
+    /**
+     * Indexes a JSON value. The text is not copied and must remain valid
+     * while the index (and any cursor) is in use.
+     *
+     * Brackets and strings are checked for balance; scalars are only
+     * checked when they are read.
+     *
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, LCB_E2BIG if the text is
+     * 4GB or larger, or LCB_EINVAL if it is malformed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_json_index_build(lcbex_json_index_t *index,
+                                       const char *json, size_t njson);
+
+    LCBEX_API
+    void lcbex_json_index_destroy(lcbex_json_index_t *index);
+
+    /**
+     * Positions a cursor at the top-level value
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_root(const lcbex_json_index_t *index,
+                                   lcbex_jsoncur_t *cur);
+
+    LCBEX_API
+    lcbex_json_type_t lcbex_jsoncur_type(const lcbex_jsoncur_t *cur);
+
+    /**
+     * Moves to an object member. Names are compared after unescaping.
+     * nname may be -1 if the name is NUL-terminated.
+     *
+     * @param cur an object
+     * @param child will point to the member's value (may be cur itself)
+     * @return LCB_SUCCESS, LCB_KEY_ENOENT if there is no such member, or
+     * LCB_EINVAL if cur is not an object
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_get(const lcbex_jsoncur_t *cur,
+                                  const char *name, size_t nname,
+                                  lcbex_jsoncur_t *child);
+
+    /**
+     * Moves to an array element
+     * @return LCB_SUCCESS, LCB_KEY_ENOENT if the array is too short, or
+     * LCB_EINVAL if cur is not an array
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_at(const lcbex_jsoncur_t *cur, size_t ii,
+                                 lcbex_jsoncur_t *child);
+
+    /**
+     * Follows a dotted path such as "address.city" or "tags.0". Components
+     * which are all digits index arrays when applied to an array; all
+     * others name object members. Member names containing a '.' cannot be
+     * reached this way.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_path(const lcbex_jsoncur_t *cur,
+                                   const char *path, lcbex_jsoncur_t *child);
+
+    /**
+     * Moves to the first member or element of an object or array
+     * @return LCB_SUCCESS, LCB_KEY_ENOENT if it is empty, or LCB_EINVAL if
+     * cur is not a container
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_first(const lcbex_jsoncur_t *cur,
+                                    lcbex_jsoncur_t *child);
+
+    /**
+     * Moves to the following member or element
+     * @return LCB_SUCCESS, or LCB_KEY_ENOENT if cur is the last one
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_next(const lcbex_jsoncur_t *cur,
+                                   lcbex_jsoncur_t *sibling);
+
+    /**
+     * Returns the raw JSON text of the current value
+     */
+    LCBEX_API
+    void lcbex_jsoncur_raw(const lcbex_jsoncur_t *cur,
+                           const char **out, size_t *nout);
+
+    /**
+     * Returns the member name (as a JSON string, including its quotes) if
+     * the cursor is positioned at an object member
+     * @return LCB_SUCCESS or LCB_EINVAL
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_name(const lcbex_jsoncur_t *cur,
+                                   const char **out, size_t *nout);
+
+    /**
+     * Returns the contents of a string value; see lcbex_vrow_unescape.
+     * 'buf' must be at least as long as the raw value.
+     * @return LCB_SUCCESS, or LCB_EINVAL if the value is not a string
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_string(const lcbex_jsoncur_t *cur, char *buf,
+                                     const char **out, size_t *nout);
+
+    /**
+     * Returns the value of a number
+     * @return LCB_SUCCESS, or LCB_EINVAL if the value is not a number
+     */
+    LCBEX_API
+    lcb_error_t lcbex_jsoncur_double(const lcbex_jsoncur_t *cur, double *out);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_JSONCUR_H */
@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Negative lookup filter for single-key view queries.
+ *
+ * A key filter holds a blocked Bloom filter of the keys known to be
+ * present in a view. It is built from a full scan of the view's keys
+ * (e.g. a reduce=false query) and rebuilt periodically. A key= query for
+ * a key which is definitely not in the filter can be answered as empty
+ * without contacting the cluster.
+ *
+ * Keys are compared by their JSON encoding with insignificant whitespace
+ * removed. Keys containing string escapes or non-integer numbers may have
+ * several encodings, so they are never reported as absent.
+ *
+ * Keys emitted after the scan was taken are unknown to the filter until
+ * the next rebuild, unless they are added with lcbex_keyfilter_add.
+ *
+ * The filter is not thread safe.
+ */
+
+#ifndef LCBEX_KEYFILTER_H
+#define LCBEX_KEYFILTER_H
+
+#include <lcbex/viewopts.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_keyfilter_st lcbex_keyfilter_t;
+
+    typedef struct {
+        /* number of lookups performed */
+        lcb_uint64_t lookups;
+        /* lookups for which the key was definitely absent */
+        lcb_uint64_t negatives;
+        /* lookups which passed the filter but returned no rows, as
+         * reported by lcbex_keyfilter_report_empty */
+        lcb_uint64_t false_positives;
+        /* number of keys in the current filter */
+        lcb_uint64_t nkeys;
+        /* size of the current filter, in bits */
+        lcb_uint64_t nbits;
+        /* number of completed rebuilds */
+        lcb_uint64_t rebuilds;
+    } lcbex_keyfilter_stats_t;
+
+    /**
+     * Creates an empty filter. Until the first rebuild is committed every
+     * key is reported as possibly present.
+     *
+     * @param filter will contain the filter
+     * @param refresh_interval nanoseconds after which the filter should be
+     * rebuilt (see lcbex_keyfilter_needs_rebuild). 0 for never
+     */
+    LCBEX_API
+    lcb_error_t lcbex_keyfilter_create(lcbex_keyfilter_t **filter,
+                                       lcb_uint64_t refresh_interval);
+
+    /**
+     * Begins a rebuild. The current filter keeps answering lookups until
+     * the rebuild is committed.
+     *
+     * @param expected_keys the expected number of keys (e.g. total_rows)
+     * @param bits_per_key filter bits per key. 10 gives a false positive
+     * rate of roughly 1%. 0 uses the default
+     */
+    LCBEX_API
+    lcb_error_t lcbex_keyfilter_rebuild_begin(lcbex_keyfilter_t *filter,
+                                              size_t expected_keys,
+                                              unsigned int bits_per_key);
+
+    /**
+     * Adds a key from the scan to the filter being built
+     * @param key the JSON-encoded key, as found in the row
+     */
+    LCBEX_API
+    lcb_error_t lcbex_keyfilter_rebuild_add(lcbex_keyfilter_t *filter,
+                                            const char *key, size_t nkey);
+
+    /**
+     * Replaces the current filter with the one being built
+     * @param now the current time, from lcbex_hrtime()
+     */
+    LCBEX_API
+    lcb_error_t lcbex_keyfilter_rebuild_commit(lcbex_keyfilter_t *filter,
+                                               lcb_uint64_t now);
+
+    /**
+     * Discards the filter being built, e.g. if the scan failed
+     */
+    LCBEX_API
+    void lcbex_keyfilter_rebuild_abort(lcbex_keyfilter_t *filter);
+
+    /**
+     * Returns non-zero if no filter has been built yet, or the refresh
+     * interval has elapsed since the last one was committed. Returns zero
+     * while a rebuild is in progress.
+     */
+    LCBEX_API
+    int lcbex_keyfilter_needs_rebuild(const lcbex_keyfilter_t *filter,
+                                      lcb_uint64_t now);
+
+    /**
+     * Adds a key known to be present (e.g. one the application just
+     * emitted) to the current filter and to any rebuild in progress.
+     */
+    LCBEX_API
+    void lcbex_keyfilter_add(lcbex_keyfilter_t *filter,
+                             const char *key, size_t nkey);
+
+    /**
+     * Checks a JSON-encoded key
+     * @return 0 if the key is definitely absent, non-zero if it may be
+     * present
+     */
+    LCBEX_API
+    int lcbex_keyfilter_may_contain(lcbex_keyfilter_t *filter,
+                                    const char *key, size_t nkey);
+
+    /**
+     * Checks a query's options. Only queries with a single 'key' option
+     * are considered; queries which also have 'keys', range options
+     * (startkey, endkey, their docid variants, inclusive_end, bbox,
+     * start_range, end_range), reduce, group or group_level, or any
+     * passthrough option always return non-zero.
+     *
+     * Percent-encoded values (assigned with one of the PCTENCODE flags) are
+     * decoded before the lookup.
+     *
+     * @return 0 if the query is certain to return no rows, non-zero
+     * otherwise
+     */
+    LCBEX_API
+    int lcbex_keyfilter_check_vopts(lcbex_keyfilter_t *filter,
+                                    const lcbex_vopt_t *const *options,
+                                    size_t noptions);
+
+    /**
+     * Reports that a query which passed the filter returned no rows.
+     * This only updates the false positive counter.
+     */
+    LCBEX_API
+    void lcbex_keyfilter_report_empty(lcbex_keyfilter_t *filter);
+
+    LCBEX_API
+    void lcbex_keyfilter_get_stats(const lcbex_keyfilter_t *filter,
+                                   lcbex_keyfilter_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_keyfilter_destroy(lcbex_keyfilter_t *filter);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_KEYFILTER_H */
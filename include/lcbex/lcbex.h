@@ -10,6 +10,12 @@ extern "C" {
 
 #define LCBEX_API LIBCOUCHBASE_API
 
+    /**
+     * Returns a monotonic timestamp in nanoseconds. The epoch is arbitrary;
+     * only differences between two values are meaningful.
+     */
+    LCBEX_API
+    lcb_uint64_t lcbex_hrtime(void);
 
 
 #ifdef __cplusplus
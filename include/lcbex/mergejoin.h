@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Streaming merge-join of two views on their keys.
+ *
+ * Two views which emit the same kind of key (e.g. orders by customer and
+ * payments by customer) can be joined without loading either into memory.
+ * Both views are queried concurrently over the same key range, and their
+ * rows are fed to the join as they arrive (e.g. from a row parser's
+ * callback). Since each view returns its rows in collation order, the join
+ * advances whichever side is behind, and emits each key's group of rows
+ * as soon as it is complete on both sides.
+ *
+ * Only the rows of the current key group are held, plus any rows from a
+ * side which has run ahead of the other. Use lcbex_mergejoin_buffered to
+ * watch the latter.
+ *
+ * Keys are compared by code point, which only matches the server's ICU
+ * collation for some keys (see lcbex_vrow_collate_class). Strings mixing
+ * cases across the join, or containing anything but ASCII letters and
+ * digits, may be ordered differently (the server sorts "a" < "B" < "c").
+ * Rather than silently dropping rows, the join fails as soon as such a key
+ * is fed to either side, and must be discarded.
+ *
+ * The join is not thread safe; feed both sides from the same thread (or
+ * under a lock).
+ */
+
+#ifndef LCBEX_MERGEJOIN_H
+#define LCBEX_MERGEJOIN_H
+
+#include <lcbex/viewopts.h>
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum {
+        LCBEX_MERGEJOIN_LEFT = 0,
+        LCBEX_MERGEJOIN_RIGHT = 1
+    };
+
+    enum {
+        /* also emit left rows which have no matching right rows */
+        LCBEX_MERGEJOIN_F_LEFT_OUTER = 1 << 0,
+        /* also emit right rows which have no matching left rows */
+        LCBEX_MERGEJOIN_F_RIGHT_OUTER = 1 << 1,
+        /* both views are queried with descending=true */
+        LCBEX_MERGEJOIN_F_DESCENDING = 1 << 2
+    };
+
+#define LCBEX_MERGEJOIN_F_FULL_OUTER \
+    (LCBEX_MERGEJOIN_F_LEFT_OUTER | LCBEX_MERGEJOIN_F_RIGHT_OUTER)
+
+    typedef struct lcbex_mergejoin_st lcbex_mergejoin_t;
+
+    /**
+     * Invoked once for each key group.
+     *
+     * @param key the JSON-encoded key shared by all the rows
+     * @param left the left rows with this key (nleft may be 0 for an outer
+     * join)
+     * @param right the right rows with this key (nright may be 0 for an
+     * outer join)
+     *
+     * The rows are only valid for the duration of the callback.
+     */
+    typedef void (*lcbex_mergejoin_callback)(lcbex_mergejoin_t *join,
+                                             const char *key, size_t nkey,
+                                             const lcbex_vrow_t *left,
+                                             size_t nleft,
+                                             const lcbex_vrow_t *right,
+                                             size_t nright,
+                                             void *cookie);
+
+    typedef struct {
+        /* rows fed to each side */
+        lcb_uint64_t rows[2];
+        /* groups emitted */
+        lcb_uint64_t groups;
+        /* the largest number of rows held at any one time */
+        lcb_uint64_t max_buffered;
+    } lcbex_mergejoin_stats_t;
+
+    /**
+     * @param join will contain the join
+     * @param flags LCBEX_MERGEJOIN_F_* flags. An inner join by default
+     * @param callback invoked for each joined group
+     * @param cookie passed to the callback
+     */
+    LCBEX_API
+    lcb_error_t lcbex_mergejoin_create(lcbex_mergejoin_t **join, int flags,
+                                       lcbex_mergejoin_callback callback,
+                                       void *cookie);
+
+    /**
+     * Creates the URI for one side of the join. The options are typically
+     * the same for both sides (startkey, endkey, stale...). Options which
+     * would make the two sides disagree are rejected: skip and limit (they
+     * apply to each view separately), keys (rows would not be in collation
+     * order), and a 'descending' which does not match the join's flags.
+     *
+     * @param uri will contain the URI, to be freed with free()
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_EINVAL
+     */
+    LCBEX_API
+    lcb_error_t lcbex_mergejoin_make_uri(const lcbex_mergejoin_t *join,
+                                         const char *design, size_t ndesign,
+                                         const char *view, size_t nview,
+                                         const lcbex_vopt_t *const *options,
+                                         size_t noptions,
+                                         char **uri);
+
+    /**
+     * Feeds a row from one side. The row is copied. Groups which become
+     * complete are emitted before this returns.
+     *
+     * @param side LCBEX_MERGEJOIN_LEFT or LCBEX_MERGEJOIN_RIGHT
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_EINVAL if the row's
+     * key sorts before the previous row of the same side, or may not sort
+     * as the server does. In the latter case the join has failed, and
+     * every later call returns LCB_EINVAL
+     */
+    LCBEX_API
+    lcb_error_t lcbex_mergejoin_add_row(lcbex_mergejoin_t *join, int side,
+                                        const lcbex_vrow_t *row);
+
+    /**
+     * Signals that a side's query has returned all of its rows. Once both
+     * sides are done, all remaining groups have been emitted.
+     *
+     * @return LCB_SUCCESS, or LCB_EINVAL if the join has failed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_mergejoin_side_done(lcbex_mergejoin_t *join, int side);
+
+    /**
+     * Returns the number of rows currently held for a side
+     */
+    LCBEX_API
+    size_t lcbex_mergejoin_buffered(const lcbex_mergejoin_t *join, int side);
+
+    LCBEX_API
+    void lcbex_mergejoin_get_stats(const lcbex_mergejoin_t *join,
+                                   lcbex_mergejoin_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_mergejoin_destroy(lcbex_mergejoin_t *join);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_MERGEJOIN_H */
@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Load-aware node selection for view requests.
+ *
+ * Picking view nodes round-robin gives a node which is slow (compacting,
+ * rebuilding an index) its full share of requests. The selector instead
+ * tracks, for each node, the number of requests in flight and a moving
+ * average of their latency, and estimates a node's cost as
+ *
+ *     latency average * (requests in flight + 1)
+ *
+ * For each request two distinct nodes are drawn at random and the cheaper
+ * one is used ("power of two choices"). This avoids sending every request
+ * to the single cheapest node, whose cost is only known once the
+ * requests complete.
+ *
+ * The average is weighted by time: a sample's weight depends on how long
+ * it has been since the previous one, with 'decay' as the time constant.
+ * A sample above the average replaces it outright, so a node which slows
+ * down is avoided at once. While a node is not used its average decays
+ * towards zero, so it is eventually tried again and can recover.
+ *
+ * lcbex does not perform I/O: the caller picks a node, sends the request
+ * (e.g. to the host of that index in the cluster configuration), and
+ * reports its completion.
+ *
+ * The selector is not thread safe.
+ */
+
+#ifndef LCBEX_NODESEL_H
+#define LCBEX_NODESEL_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* default time constant of the latency average: 10 seconds */
+#define LCBEX_NODESEL_DECAY_DEFAULT 10000000000ULL
+
+    /* latency recorded for a failed request, if it took less: 1 second */
+#define LCBEX_NODESEL_ERROR_PENALTY 1000000000ULL
+
+    typedef struct lcbex_nodesel_st lcbex_nodesel_t;
+
+    typedef struct {
+        /* requests sent to the node */
+        lcb_uint64_t selected;
+        lcb_uint64_t completed;
+        lcb_uint64_t errors;
+        unsigned int inflight;
+        /* latency average as of the last sample, in nanoseconds */
+        lcb_uint64_t latency;
+        /* fraction of all requests which were sent to the node */
+        double share;
+    } lcbex_nodesel_stats_t;
+
+    /**
+     * Creates a selector
+     * @param nnodes the number of nodes
+     * @param decay the time constant of the latency average, in
+     * nanoseconds; 0 for LCBEX_NODESEL_DECAY_DEFAULT
+     * @param seed seed for the random choices
+     */
+    LCBEX_API
+    lcb_error_t lcbex_nodesel_create(lcbex_nodesel_t **sel,
+                                     size_t nnodes,
+                                     lcb_uint64_t decay,
+                                     lcb_uint64_t seed);
+
+    /**
+     * Changes the number of nodes, e.g. after a topology change. Nodes
+     * below the new count keep their state; new nodes start with the
+     * average latency of the others.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_nodesel_resize(lcbex_nodesel_t *sel, size_t nnodes);
+
+    /**
+     * Picks the node for a request, and counts the request as in flight
+     * @param now the current time, from lcbex_hrtime()
+     * @return the index of the node, or SIZE_MAX if there are no nodes
+     */
+    LCBEX_API
+    size_t lcbex_nodesel_pick(lcbex_nodesel_t *sel, lcb_uint64_t now);
+
+    /**
+     * Reports the completion of a request sent to a node returned by
+     * lcbex_nodesel_pick
+     * @param latency the time the request took, in nanoseconds
+     * @param failed non-zero if the request failed; its latency is then
+     * taken to be at least LCBEX_NODESEL_ERROR_PENALTY
+     * @param now the current time
+     */
+    LCBEX_API
+    void lcbex_nodesel_done(lcbex_nodesel_t *sel, size_t node,
+                            lcb_uint64_t latency, int failed,
+                            lcb_uint64_t now);
+
+    LCBEX_API
+    void lcbex_nodesel_get_stats(const lcbex_nodesel_t *sel, size_t node,
+                                 lcbex_nodesel_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_nodesel_destroy(lcbex_nodesel_t *sel);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_NODESEL_H */
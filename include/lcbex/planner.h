@@ -0,0 +1,191 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Cost-based strategy planner for view queries.
+ *
+ * The planner inspects a query's options ('keys' cardinality, the
+ * startkey/endkey range, 'limit', 'skip', reduce and grouping) and
+ * picks one of:
+ *
+ * o SINGLE: one request
+ * o PAGINATED: sequential keyset pages of 'page_size' rows
+ * o RANGE_PARTITIONED: the numeric startkey..endkey range is split into
+ *   sub-ranges queried in parallel
+ * o KEYS_CHUNKED: the 'keys' array is split into chunks queried in
+ *   parallel
+ *
+ * The row estimate can be improved with a probe: a limit=0 query (see
+ * lcbex_plan_make_probe_uri) whose 'total_rows' is passed to
+ * lcbex_plan_create.
+ *
+ * Strategies which would change the result are never chosen. Partitioning
+ * or chunking a query which has 'limit' or 'skip', or which may reduce
+ * without grouping, would give a different result, so those queries are
+ * never split. Pages replace 'limit' with the page size, so queries with
+ * 'limit' are never paginated either.
+ */
+
+#ifndef LCBEX_PLANNER_H
+#define LCBEX_PLANNER_H
+
+#include <lcbex/viewopts.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef enum {
+        LCBEX_PLAN_SINGLE = 0,
+        LCBEX_PLAN_PAGINATED,
+        LCBEX_PLAN_RANGE_PARTITIONED,
+        LCBEX_PLAN_KEYS_CHUNKED
+    } lcbex_plan_strategy_t;
+
+    typedef struct {
+        /* rows per page for PAGINATED. Default 1000 */
+        size_t page_size;
+        /* largest number of rows fetched by a single request. Default 10000 */
+        size_t max_request_rows;
+        /* keys per chunk for KEYS_CHUNKED. Default 256 */
+        size_t keys_chunk_size;
+        /* longest URI sent in one request. Default 8192 */
+        size_t max_uri_length;
+        /* most requests outstanding at once. Default 4 */
+        unsigned int max_parallelism;
+        /* cost of a request round trip, in rows. Default 200 */
+        double request_cost;
+    } lcbex_plan_config_t;
+
+    typedef struct {
+        lcbex_plan_strategy_t strategy;
+        /* how many requests to run concurrently */
+        unsigned int parallelism;
+        /* number of partitions or chunks; estimated number of pages */
+        size_t nparts;
+        /* estimated number of rows. SIZE_MAX if unknown */
+        size_t estimated_rows;
+        /* number of elements in 'keys' (0 if not present) */
+        size_t nkeys;
+        /* estimated cost of each strategy (in rows); < 0 if not applicable */
+        double costs[4];
+
+        /* private */
+        lcbex_plan_config_t config;
+        double range_start;
+        double range_end;
+        int descending;
+    } lcbex_plan_t;
+
+    /**
+     * Initializes a configuration with the defaults
+     */
+    LCBEX_API
+    void lcbex_plan_config_init(lcbex_plan_config_t *config);
+
+    /**
+     * Builds the URI of the probe query: the user's query with limit=0 and
+     * skip=0. The 'total_rows' of its response may be passed to
+     * lcbex_plan_create
+     *
+     * @return an allocated string (via malloc)
+     */
+    LCBEX_API
+    char *lcbex_plan_make_probe_uri(const char *design, size_t ndesign,
+                                    const char *view, size_t nview,
+                                    const lcbex_vopt_t *const *options,
+                                    size_t noptions);
+
+    /**
+     * Plans a query
+     *
+     * @param plan the plan to fill in
+     * @param config the configuration, or NULL for the defaults
+     * @param options the query's options
+     * @param noptions how many options
+     * @param total_rows total_rows from a probe, or SIZE_MAX if not probed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_plan_create(lcbex_plan_t *plan,
+                                  const lcbex_plan_config_t *config,
+                                  const lcbex_vopt_t *const *options,
+                                  size_t noptions,
+                                  size_t total_rows);
+
+    /**
+     * Writes a human readable description of the plan and the cost of each
+     * strategy, snprintf-style.
+     *
+     * @return the length of the full description (which may be larger than
+     * nbuf)
+     */
+    LCBEX_API
+    size_t lcbex_plan_explain(const lcbex_plan_t *plan, char *buf, size_t nbuf);
+
+    /**
+     * Builds the URI for one partition or chunk of a RANGE_PARTITIONED or
+     * KEYS_CHUNKED plan, or the single query of a SINGLE plan.
+     *
+     * @param plan the plan
+     * @param index the partition, from 0 to plan->nparts - 1
+     * @return an allocated string, or NULL on error
+     */
+    LCBEX_API
+    char *lcbex_plan_make_part_uri(const lcbex_plan_t *plan, size_t index,
+                                   const char *design, size_t ndesign,
+                                   const char *view, size_t nview,
+                                   const lcbex_vopt_t *const *options,
+                                   size_t noptions);
+
+    /**
+     * Returns the key range of a partition of a RANGE_PARTITIONED plan, in
+     * the query's order (start > end for descending queries). Each
+     * partition's end is the next one's start and is excluded from it; the
+     * first and last partitions keep the query's own bounds.
+     *
+     * @return LCB_EINVAL if the plan is not range partitioned or the index
+     * is out of range
+     */
+    LCBEX_API
+    lcb_error_t lcbex_plan_get_part_range(const lcbex_plan_t *plan,
+                                          size_t index,
+                                          double *start, double *end);
+
+    /**
+     * Builds the URI of a page of a PAGINATED plan.
+     *
+     * @param last_key the JSON key of the last row of the previous page, or
+     * NULL for the first page
+     * @param last_id the JSON-encoded document ID of that row, as found in
+     * lcbex_vrow_t::id (may be NULL). It is unescaped before being used as
+     * startkey_docid
+     * @return an allocated string, or NULL on error
+     */
+    LCBEX_API
+    char *lcbex_plan_make_page_uri(const lcbex_plan_t *plan,
+                                   const char *design, size_t ndesign,
+                                   const char *view, size_t nview,
+                                   const lcbex_vopt_t *const *options,
+                                   size_t noptions,
+                                   const char *last_key, size_t nlast_key,
+                                   const char *last_id, size_t nlast_id);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_PLANNER_H */
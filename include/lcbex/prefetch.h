@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Prefetching of predictable follow-up view queries.
+ *
+ * Interfaces which scroll through a view tend to query it in steps: the
+ * next page (skip=0, 20, 40, ...) or the adjacent bucket of a range
+ * (startkey=[2014,3]&endkey=[2014,4], then [2014,4] and [2014,5]). The
+ * prefetcher is shown each query the application makes. Queries which
+ * differ only in the integers of their 'skip', 'startkey' and 'endkey'
+ * options (the whole value, or the last element of an array) form a
+ * stream; once a stream has moved by the same step twice in a row, the
+ * next step is predicted and queued for prefetching.
+ *
+ * The prefetcher does not perform any I/O. The application asks it for a
+ * prefetch when it has idle capacity, so that prefetches never delay its
+ * own queries, issues the query, and hands the result back; it is then
+ * stored in a result cache (see rcache.h) under the URI the application
+ * itself would build, where its next query will find it. The number of
+ * prefetches is limited by a budget, earned by the application's queries,
+ * and by the number in flight.
+ *
+ * A prefetched result counts as a hit when the application later makes
+ * the same query. Pages which resume after the last key of the previous
+ * page (see lcbex_plan_make_page_uri) depend on that page's rows, and are
+ * not predicted.
+ *
+ * The prefetcher is not thread safe.
+ */
+
+#ifndef LCBEX_PREFETCH_H
+#define LCBEX_PREFETCH_H
+
+#include <lcbex/viewopts.h>
+#include <lcbex/rcache.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_prefetch_st lcbex_prefetch_t;
+
+    typedef struct {
+        /* prefetches earned by each query of the application. Default 0.5 */
+        double budget;
+        /* most prefetches which may be earned ahead of use. Default 4 */
+        unsigned int burst;
+        /* most prefetches in flight at once. Default 2 */
+        unsigned int max_inflight;
+        /* streams followed at once; the least recent is forgotten.
+         * Default 64 */
+        size_t max_streams;
+        /* prefetched results remembered to detect hits. Default 256 */
+        size_t max_tracked;
+        /* time to live of prefetched results in the cache. Default 0, so
+         * that they are kept until invalidated or evicted */
+        lcb_uint64_t ttl;
+    } lcbex_prefetch_config_t;
+
+    typedef struct {
+        /* queries shown by the application */
+        lcb_uint64_t observed;
+        /* queries predicted */
+        lcb_uint64_t predicted;
+        /* prefetches handed out by lcbex_prefetch_next */
+        lcb_uint64_t issued;
+        /* prefetched results stored in the cache */
+        lcb_uint64_t completed;
+        lcb_uint64_t failed;
+        /* prefetched results later queried by the application */
+        lcb_uint64_t hits;
+        /* application queries made while their prefetch was in flight */
+        lcb_uint64_t late;
+        /* prefetched results forgotten without being queried */
+        lcb_uint64_t wasted;
+        /* hits / completed */
+        double hit_rate;
+        unsigned int pending;
+        unsigned int inflight;
+    } lcbex_prefetch_stats_t;
+
+    /**
+     * Initializes a configuration with the defaults
+     */
+    LCBEX_API
+    void lcbex_prefetch_config_init(lcbex_prefetch_config_t *config);
+
+    LCBEX_API
+    lcb_error_t lcbex_prefetch_create(lcbex_prefetch_t **pf,
+                                      const lcbex_prefetch_config_t *config);
+
+    /**
+     * Shows the prefetcher a query made by the application, typically as
+     * it is looked up in the result cache. Its options are those used to
+     * build the query's URI with lcbex_vqstr_make_uri; predicted queries
+     * keep their order and encoding, so that they have the same URI as the
+     * application's.
+     *
+     * @return LCB_SUCCESS, or LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_prefetch_observe(lcbex_prefetch_t *pf,
+                                       const char *design, size_t ndesign,
+                                       const char *view, size_t nview,
+                                       const lcbex_vopt_t *const *options,
+                                       size_t noptions,
+                                       lcb_uint64_t now);
+
+    /**
+     * Returns the next query to prefetch, if any is pending and the budget
+     * allows it. The most recent prediction is returned first.
+     *
+     * @param id will contain the prefetch's ID, to pass to
+     * lcbex_prefetch_done
+     * @param nuri if not NULL, will contain the length of the URI
+     * @return the NUL-terminated URI, owned by the prefetcher and valid
+     * until lcbex_prefetch_done, or NULL
+     */
+    LCBEX_API
+    const char *lcbex_prefetch_next(lcbex_prefetch_t *pf,
+                                    lcb_uint64_t *id, size_t *nuri);
+
+    /**
+     * Reports the completion of a prefetch, storing its result in the
+     * cache.
+     *
+     * @param status the status of the query. On failure, 'block' is
+     * ignored and may be NULL
+     * @param block the rows. The cache takes ownership of the block on
+     * success
+     * @return LCB_SUCCESS, LCB_KEY_ENOENT for an unknown ID, or the error
+     * from lcbex_rcache_put
+     */
+    LCBEX_API
+    lcb_error_t lcbex_prefetch_done(lcbex_prefetch_t *pf, lcb_uint64_t id,
+                                    lcbex_rcache_t *cache,
+                                    lcb_error_t status,
+                                    lcbex_rowblock_t *block,
+                                    lcb_uint64_t now);
+
+    LCBEX_API
+    void lcbex_prefetch_get_stats(const lcbex_prefetch_t *pf,
+                                  lcbex_prefetch_stats_t *stats);
+
+    /**
+     * Destroys the prefetcher. Results of outstanding prefetches should be
+     * discarded by the application.
+     */
+    LCBEX_API
+    void lcbex_prefetch_destroy(lcbex_prefetch_t *pf);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_PREFETCH_H */
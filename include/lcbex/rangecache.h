@@ -0,0 +1,183 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Cache of key ranges of view results.
+ *
+ * The result cache (rcache.h) matches queries by URI, so a query of a
+ * sub-range of a cached range, or one overlapping it, misses. The range
+ * cache keeps, for each design document, view and set of other options
+ * (the 'shape' of a query), a map of disjoint key intervals to the rows
+ * they contain. A range query (startkey, endkey, inclusive_end) is split
+ * into the parts found in the map and the gaps between them; only the
+ * gaps are queried, and the rows are stitched together in collation
+ * order. The queried range then joins the intervals it overlaps, so
+ * neighbouring scans coalesce into a single interval.
+ *
+ * Only queries whose rows depend on nothing but their own key can be
+ * split. Queries with limit, skip, key, keys, startkey_docid,
+ * endkey_docid, group_level or descending=true, or reduce=true without
+ * group=true, are refused. A view with a reduce function must be queried
+ * with reduce=false or group=true: the cache can't tell a single reduced
+ * row from a map row.
+ *
+ * Keys are compared with lcbex_vrow_collate, by code point, while the
+ * server orders strings with ICU collation (a < A < b < B, with accented
+ * letters next to their base letter). The two only agree for some keys
+ * (see lcbex_vrow_collate_class): null, booleans, numbers, strings of
+ * ASCII letters and digits, and arrays of these, provided lowercase and
+ * uppercase letters are never mixed. The cache is therefore limited to
+ * such keys: the bounds and the rows of every query of a shape must
+ * together pass LCBEX_VROW_COLLATE_EXACT, or the query is refused with
+ * LCB_EINVAL and must be run without the cache.
+ *
+ * Rows are only dropped as a whole design document (after it changes,
+ * or its documents do), when they expire, or to stay within the memory
+ * limit, least recently used intervals first.
+ *
+ * The cache is not thread safe.
+ */
+
+#ifndef LCBEX_RANGECACHE_H
+#define LCBEX_RANGECACHE_H
+
+#include <lcbex/viewopts.h>
+#include <lcbex/rowblock.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_rangecache_st lcbex_rangecache_t;
+    typedef struct lcbex_rangecache_req_st lcbex_rangecache_req_t;
+
+    typedef struct {
+        /* queries answered entirely from the cache */
+        lcb_uint64_t hits;
+        /* queries with parts cached and gaps to query */
+        lcb_uint64_t partial;
+        /* queries with nothing cached */
+        lcb_uint64_t misses;
+        /* rows returned from the cache, and from gaps */
+        lcb_uint64_t rows_cached;
+        lcb_uint64_t rows_fetched;
+        /* intervals dropped because their time to live passed */
+        lcb_uint64_t expired;
+        /* intervals dropped to stay within the memory limit */
+        lcb_uint64_t evicted;
+        size_t intervals;
+        size_t memory;
+    } lcbex_rangecache_stats_t;
+
+    /**
+     * Creates a cache
+     * @param max_memory the memory limit, in bytes
+     * @param ttl the time to live of rows, in nanoseconds; 0 to keep them
+     * until dropped or evicted. An interval expires with its oldest rows
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rangecache_create(lcbex_rangecache_t **cache,
+                                        size_t max_memory,
+                                        lcb_uint64_t ttl);
+
+    /**
+     * Starts a range query.
+     *
+     * @param options the options of the query
+     * @param now the current time, from lcbex_hrtime()
+     * @param req will contain the request. Query its gaps, then finish it
+     * @return LCB_SUCCESS, LCB_EINVAL if the query can't be split or its
+     * bounds can't be ordered together with the cached keys, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rangecache_lookup(lcbex_rangecache_t *cache,
+                                        const char *design, size_t ndesign,
+                                        const char *view, size_t nview,
+                                        const lcbex_vopt_t *const *options,
+                                        size_t noptions,
+                                        lcb_uint64_t now,
+                                        lcbex_rangecache_req_t **req);
+
+    /**
+     * Returns the number of gaps to query; 0 if the range is cached
+     */
+    LCBEX_API
+    size_t lcbex_rangecache_req_ngaps(const lcbex_rangecache_req_t *req);
+
+    /**
+     * Returns the NUL-terminated URI of a gap, owned by the request
+     */
+    LCBEX_API
+    const char *lcbex_rangecache_req_gap_uri(const lcbex_rangecache_req_t *req,
+                                             size_t index);
+
+    /**
+     * Supplies the rows of a gap, in ascending key order.
+     * @param block the rows. The request takes ownership on success
+     * @return LCB_SUCCESS, or LCB_EINVAL if the index is out of range,
+     * the gap was already filled, or the rows have keys which can't be
+     * ordered together with the others (in which case the query must be
+     * run without the cache)
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rangecache_req_fill(lcbex_rangecache_req_t *req,
+                                          size_t index,
+                                          lcbex_rowblock_t *block);
+
+    /**
+     * Stitches the rows of the range together once every gap is filled,
+     * and caches them.
+     *
+     * @param result will point to the rows of the range, owned by the
+     * request and valid until it is destroyed
+     * @return LCB_SUCCESS, LCB_EINVAL if a gap is not filled, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rangecache_req_finish(lcbex_rangecache_req_t *req,
+                                            lcb_uint64_t now,
+                                            const lcbex_rowblock_t **result);
+
+    /**
+     * Destroys a request, finished or not. Requests must be destroyed
+     * before their cache.
+     */
+    LCBEX_API
+    void lcbex_rangecache_req_destroy(lcbex_rangecache_req_t *req);
+
+    /**
+     * Drops the rows of every view of a design document. Requests in
+     * progress will not cache their rows.
+     * @return the number of intervals dropped
+     */
+    LCBEX_API
+    size_t lcbex_rangecache_invalidate(lcbex_rangecache_t *cache,
+                                       const char *design, size_t ndesign);
+
+    LCBEX_API
+    void lcbex_rangecache_get_stats(const lcbex_rangecache_t *cache,
+                                    lcbex_rangecache_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_rangecache_destroy(lcbex_rangecache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_RANGECACHE_H */
@@ -0,0 +1,133 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Cache of view results, invalidated by document mutations.
+ *
+ * Results are stored as row blocks, keyed by their query URI, with an
+ * optional time to live. As a result is cached, the IDs of the documents
+ * in its rows are added to an inverted index from document ID to the
+ * entries containing it. The application reports the IDs of documents it
+ * mutates (e.g. from its store and remove callbacks), and exactly the
+ * entries containing them are dropped. Reduced results have no document
+ * IDs, so any reported mutation drops them.
+ *
+ * The index stores a 64 bit hash of each ID rather than the ID itself; a
+ * collision only drops an extra entry. It costs about 20 bytes per
+ * distinct document in each entry.
+ *
+ * A mutation can also add a row to a cached result, if the document now
+ * emits a key within the queried range. Such rows are not detected, so
+ * results which must include new documents should still expire.
+ *
+ * When the cache exceeds its memory limit, the least recently used
+ * entries are dropped. The cache is not thread safe.
+ */
+
+#ifndef LCBEX_RCACHE_H
+#define LCBEX_RCACHE_H
+
+#include <lcbex/rowblock.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_rcache_st lcbex_rcache_t;
+
+    typedef struct {
+        lcb_uint64_t hits;
+        lcb_uint64_t misses;
+        /* entries dropped because their time to live passed */
+        lcb_uint64_t expired;
+        /* entries dropped by lcbex_rcache_invalidate */
+        lcb_uint64_t invalidated;
+        /* entries dropped to stay within the memory limit */
+        lcb_uint64_t evicted;
+        size_t entries;
+        /* bytes used by the blocks, URIs and index */
+        size_t memory;
+    } lcbex_rcache_stats_t;
+
+    /**
+     * Creates a cache
+     * @param max_memory the memory limit, in bytes
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rcache_create(lcbex_rcache_t **cache,
+                                    size_t max_memory);
+
+    /**
+     * Caches a result, replacing any cached for the same URI.
+     *
+     * @param uri the query URI, e.g. from lcbex_vqstr_make_uri. -1 if
+     * NUL-terminated
+     * @param block the rows. The cache takes ownership of the block on
+     * success
+     * @param ttl the time to live, in nanoseconds; 0 to keep the result
+     * until it is invalidated or evicted
+     * @param now the current time, from lcbex_hrtime()
+     * @return LCB_E2BIG if the result alone exceeds the memory limit
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rcache_put(lcbex_rcache_t *cache,
+                                 const char *uri, size_t nuri,
+                                 lcbex_rowblock_t *block,
+                                 lcb_uint64_t ttl,
+                                 lcb_uint64_t now);
+
+    /**
+     * Looks up a result.
+     * @return the cached rows, or NULL if absent or expired. The block is
+     * owned by the cache, and is valid until the next put, invalidate or
+     * remove, or the next get of the same URI.
+     */
+    LCBEX_API
+    const lcbex_rowblock_t *lcbex_rcache_get(lcbex_rcache_t *cache,
+                                             const char *uri, size_t nuri,
+                                             lcb_uint64_t now);
+
+    /**
+     * Drops the results containing a document, and all reduced results.
+     * @param docid the document ID, as passed to the store or remove
+     * operation (not JSON-encoded). -1 if NUL-terminated
+     * @return the number of results dropped
+     */
+    LCBEX_API
+    size_t lcbex_rcache_invalidate(lcbex_rcache_t *cache,
+                                   const char *docid, size_t ndocid);
+
+    /**
+     * Drops a result
+     * @return 1 if it was cached, 0 otherwise
+     */
+    LCBEX_API
+    int lcbex_rcache_remove(lcbex_rcache_t *cache,
+                            const char *uri, size_t nuri);
+
+    LCBEX_API
+    void lcbex_rcache_get_stats(const lcbex_rcache_t *cache,
+                                lcbex_rcache_stats_t *stats);
+
+    LCBEX_API
+    void lcbex_rcache_destroy(lcbex_rcache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_RCACHE_H */
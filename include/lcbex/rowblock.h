@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Compact storage for cached view rows.
+ *
+ * Rows arrive sorted by key, and neighbouring keys (and document IDs)
+ * tend to share long prefixes, e.g. ["United States","Nevada",...]. A row
+ * block stores each key and ID as the length of the prefix it shares with
+ * the previous row plus the remaining suffix. Every 'restart interval'
+ * rows (16-64) the full key and ID are stored instead; these restart
+ * points allow seeking with a binary search. Values and documents are
+ * stored verbatim.
+ *
+ * A block is a single immutable allocation. It can be read by any number
+ * of iterators concurrently.
+ */
+
+#ifndef LCBEX_ROWBLOCK_H
+#define LCBEX_ROWBLOCK_H
+
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum {
+        /* rows are in descending key order (descending=true) */
+        LCBEX_ROWBLOCK_F_DESCENDING = 1 << 0
+    };
+
+#define LCBEX_ROWBLOCK_RESTART_MIN 16
+#define LCBEX_ROWBLOCK_RESTART_MAX 64
+#define LCBEX_ROWBLOCK_RESTART_DEFAULT 32
+
+    typedef struct lcbex_rowblock_st lcbex_rowblock_t;
+    typedef struct lcbex_rowblock_builder_st lcbex_rowblock_builder_t;
+
+    /**
+     * Iterator over a row block. The row returned by lcbex_rowblock_iter_next
+     * points into the iterator (for the key and ID) and into the block (for
+     * the value and doc). It is valid until the next call on the iterator.
+     */
+    typedef struct {
+        const lcbex_rowblock_t *block;
+        size_t offset;
+        size_t index;
+        char *keybuf;
+        char *idbuf;
+        size_t nkeyalloc;
+        size_t nidalloc;
+        lcbex_vrow_t row;
+    } lcbex_rowblock_iter_t;
+
+    /**
+     * Creates a new builder
+     * @param builder will contain the builder
+     * @param restart_interval rows between restart points. Clamped to the
+     * LCBEX_ROWBLOCK_RESTART_MIN..MAX range; 0 uses the default
+     * @param flags LCBEX_ROWBLOCK_F_* flags
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rowblock_builder_create(lcbex_rowblock_builder_t **builder,
+                                              unsigned int restart_interval,
+                                              int flags);
+
+    /**
+     * Appends a row. Rows must be added in the order returned by the view
+     * (ascending, or descending if LCBEX_ROWBLOCK_F_DESCENDING was given),
+     * or seeking will not work.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rowblock_builder_add(lcbex_rowblock_builder_t *builder,
+                                           const lcbex_vrow_t *row);
+
+    /**
+     * Creates a block from the rows added so far and resets the builder
+     * so it can be reused.
+     *
+     * @param block will contain the block. Free with lcbex_rowblock_free
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rowblock_builder_finish(lcbex_rowblock_builder_t *builder,
+                                              lcbex_rowblock_t **block);
+
+    LCBEX_API
+    void lcbex_rowblock_builder_destroy(lcbex_rowblock_builder_t *builder);
+
+    /**
+     * Returns the number of rows in the block
+     */
+    LCBEX_API
+    size_t lcbex_rowblock_nrows(const lcbex_rowblock_t *block);
+
+    /**
+     * Returns the total memory used by the block, in bytes
+     */
+    LCBEX_API
+    size_t lcbex_rowblock_size(const lcbex_rowblock_t *block);
+
+    /**
+     * Returns the lcbex_vrow_collate_class of all keys in the block, ORed
+     * together
+     */
+    LCBEX_API
+    int lcbex_rowblock_collate_class(const lcbex_rowblock_t *block);
+
+    LCBEX_API
+    void lcbex_rowblock_free(lcbex_rowblock_t *block);
+
+    /**
+     * Initializes an iterator positioned at the first row
+     */
+    LCBEX_API
+    void lcbex_rowblock_iter_init(lcbex_rowblock_iter_t *iter,
+                                  const lcbex_rowblock_t *block);
+
+    /**
+     * Positions the iterator at the first row whose key does not sort before
+     * the given JSON key (in the block's order). Uses a binary search over
+     * the restart points followed by a scan of at most one interval.
+     *
+     * Keys are compared with lcbex_vrow_collate, which only agrees with the
+     * order the server returned the rows in for some keys. Seeking is only
+     * defined when the target and every key in the block pass
+     * LCBEX_VROW_COLLATE_EXACT together (see lcbex_vrow_collate_class).
+     *
+     * @return LCB_SUCCESS, or LCB_EINVAL (leaving the iterator where it
+     * was) if the orders may differ
+     */
+    LCBEX_API
+    lcb_error_t lcbex_rowblock_iter_seek(lcbex_rowblock_iter_t *iter,
+                                         const char *key, size_t nkey);
+
+    /**
+     * Decodes the next row
+     * @param row will point to the decoded row
+     * @return 1 if a row was returned, 0 at the end of the block
+     */
+    LCBEX_API
+    int lcbex_rowblock_iter_next(lcbex_rowblock_iter_t *iter,
+                                 const lcbex_vrow_t **row);
+
+    /**
+     * Frees the iterator's buffers. The iterator itself is not freed.
+     */
+    LCBEX_API
+    void lcbex_rowblock_iter_cleanup(lcbex_rowblock_iter_t *iter);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_ROWBLOCK_H */
@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Streaming sketches over view rows.
+ *
+ * Exact distinct counts and percentiles need every row held at once.
+ * These sketches answer the same questions approximately, in a fixed
+ * amount of memory, from rows seen once as they stream in:
+ *
+ * o HyperLogLog counts distinct keys, document IDs or values. With the
+ *   default precision (14) it uses 16KB and the standard error is about
+ *   0.8%.
+ *
+ * o t-digest estimates quantiles (median, p99...) of numeric values. It
+ *   is most accurate near the extremes; with the default compression
+ *   (100) it keeps at most a few hundred centroids.
+ *
+ * Both can be merged, so a query split into partitions (see planner.h)
+ * can be sketched per partition and combined afterwards.
+ *
+ * Sketches are not thread safe.
+ */
+
+#ifndef LCBEX_SKETCH_H
+#define LCBEX_SKETCH_H
+
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* which part of a row to count */
+    typedef enum {
+        LCBEX_SKETCH_KEY = 0,
+        LCBEX_SKETCH_ID,
+        LCBEX_SKETCH_VALUE
+    } lcbex_sketch_field_t;
+
+#define LCBEX_HLL_PRECISION_MIN 4
+#define LCBEX_HLL_PRECISION_MAX 18
+#define LCBEX_HLL_PRECISION_DEFAULT 14
+
+    typedef struct lcbex_hll_st lcbex_hll_t;
+
+    /**
+     * Creates an empty HyperLogLog sketch
+     * @param precision log2 of the number of registers, between
+     * LCBEX_HLL_PRECISION_MIN and MAX; 0 for the default
+     */
+    LCBEX_API
+    lcb_error_t lcbex_hll_create(lcbex_hll_t **hll, unsigned int precision);
+
+    /**
+     * Adds an item, given as raw bytes
+     */
+    LCBEX_API
+    void lcbex_hll_add(lcbex_hll_t *hll, const void *data, size_t ndata);
+
+    /**
+     * Adds one field of a row. The field is hashed as the JSON text returned
+     * by the view; rows without the field (e.g. no ID) are ignored.
+     */
+    LCBEX_API
+    void lcbex_hll_add_row(lcbex_hll_t *hll, const lcbex_vrow_t *row,
+                           lcbex_sketch_field_t field);
+
+    /**
+     * Returns the estimated number of distinct items added
+     */
+    LCBEX_API
+    double lcbex_hll_count(const lcbex_hll_t *hll);
+
+    /**
+     * Merges src into dst. Afterwards dst estimates the number of items
+     * distinct across both.
+     * @return LCB_SUCCESS, or LCB_EINVAL if the precisions differ
+     */
+    LCBEX_API
+    lcb_error_t lcbex_hll_merge(lcbex_hll_t *dst, const lcbex_hll_t *src);
+
+    LCBEX_API
+    void lcbex_hll_reset(lcbex_hll_t *hll);
+
+    LCBEX_API
+    void lcbex_hll_destroy(lcbex_hll_t *hll);
+
+
+#define LCBEX_TDIGEST_COMPRESSION_DEFAULT 100
+
+    typedef struct lcbex_tdigest_st lcbex_tdigest_t;
+
+    /**
+     * Creates an empty t-digest
+     * @param compression accuracy/size trade-off. The digest holds at most
+     * about this many centroids. 0 for the default
+     */
+    LCBEX_API
+    lcb_error_t lcbex_tdigest_create(lcbex_tdigest_t **digest,
+                                     double compression);
+
+    /**
+     * Adds a value with a weight (normally 1)
+     */
+    LCBEX_API
+    lcb_error_t lcbex_tdigest_add(lcbex_tdigest_t *digest, double value,
+                                  double weight);
+
+    /**
+     * Adds a row's numeric value
+     * @param path a dotted path (see lcbex_jsoncur_path) to the number
+     * within the row's value, or NULL if the value is the number
+     * @return LCB_SUCCESS, or LCB_EINVAL if there is no number there
+     */
+    LCBEX_API
+    lcb_error_t lcbex_tdigest_add_row(lcbex_tdigest_t *digest,
+                                      const lcbex_vrow_t *row,
+                                      const char *path);
+
+    /**
+     * Returns the estimated value at quantile q (0 <= q <= 1), or NaN if
+     * the digest is empty
+     */
+    LCBEX_API
+    double lcbex_tdigest_quantile(lcbex_tdigest_t *digest, double q);
+
+    /**
+     * Returns the total weight added
+     */
+    LCBEX_API
+    double lcbex_tdigest_count(const lcbex_tdigest_t *digest);
+
+    LCBEX_API
+    double lcbex_tdigest_min(const lcbex_tdigest_t *digest);
+
+    LCBEX_API
+    double lcbex_tdigest_max(const lcbex_tdigest_t *digest);
+
+    /**
+     * Adds everything in src to dst
+     */
+    LCBEX_API
+    lcb_error_t lcbex_tdigest_merge(lcbex_tdigest_t *dst,
+                                    lcbex_tdigest_t *src);
+
+    LCBEX_API
+    void lcbex_tdigest_reset(lcbex_tdigest_t *digest);
+
+    LCBEX_API
+    void lcbex_tdigest_destroy(lcbex_tdigest_t *digest);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_SKETCH_H */
@@ -0,0 +1,105 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Consistency/latency policy for the 'stale' view option.
+ *
+ * Rather than choosing stale=false|ok|update_after by hand, the caller
+ * states how stale a result it can tolerate, and the policy picks the
+ * value using the last time it forced an index update for the design
+ * document (all views of a design document share one index):
+ *
+ * o If the index was forced within the tolerance, 'ok' is used
+ * o Otherwise, if no forcing query is outstanding, 'false' is used and the
+ *   query becomes the design document's refresh. Its completion must be
+ *   reported with lcbex_stalepol_refreshed()
+ * o Otherwise a refresh is already running and 'update_after' is used, so
+ *   only a single stale=false query per window reaches the cluster
+ *
+ * The policy is not thread safe.
+ */
+
+#ifndef LCBEX_STALEPOL_H
+#define LCBEX_STALEPOL_H
+
+#include <lcbex/viewopts.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_stalepol_st lcbex_stalepol_t;
+
+    /**
+     * Creates a new policy
+     */
+    LCBEX_API
+    lcb_error_t lcbex_stalepol_create(lcbex_stalepol_t **policy);
+
+    /**
+     * Selects the stale value for a query.
+     *
+     * @param policy the policy
+     * @param design the design document name
+     * @param ndesign length of the name (-1 for nul-terminated)
+     * @param max_staleness the maximum tolerable staleness, in nanoseconds.
+     * 0 always selects stale=false
+     * @param now the current time, from lcbex_hrtime()
+     * @param optobj an uninitialized view option which will contain the
+     * 'stale' option. Clean it up with lcbex_vopt_cleanup
+     * @param is_refresh set to non-zero if this query forces the index
+     * update. If set, the caller must call lcbex_stalepol_refreshed() once
+     * the query completes.
+     *
+     * @return LCB_SUCCESS or an error
+     */
+    LCBEX_API
+    lcb_error_t lcbex_stalepol_select(lcbex_stalepol_t *policy,
+                                      const char *design, size_t ndesign,
+                                      lcb_uint64_t max_staleness,
+                                      lcb_uint64_t now,
+                                      lcbex_vopt_t *optobj,
+                                      int *is_refresh);
+
+    /**
+     * Reports the completion of a refresh (a query for which is_refresh
+     * was set).
+     *
+     * @param err the status of the query. On success the index is
+     * considered current as of the time the query was issued
+     */
+    LCBEX_API
+    void lcbex_stalepol_refreshed(lcbex_stalepol_t *policy,
+                                  const char *design, size_t ndesign,
+                                  lcb_error_t err);
+
+    /**
+     * Forgets the refresh state of a design document, e.g. after it has
+     * been redefined. The next query will force an update.
+     */
+    LCBEX_API
+    void lcbex_stalepol_reset(lcbex_stalepol_t *policy,
+                              const char *design, size_t ndesign);
+
+    LCBEX_API
+    void lcbex_stalepol_destroy(lcbex_stalepol_t *policy);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_STALEPOL_H */
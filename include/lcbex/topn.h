@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Top-N rows by a numeric field of their values.
+ *
+ * Views are sorted by key only, so finding the rows with the highest
+ * scores means reading the whole view. Here the view is read as a
+ * partitioned scan (see planner.h): each partition keeps a bounded heap
+ * of its best N rows, and the heaps are merged once every partition is
+ * done. Memory is O(N * partitions) however many rows are read, and the
+ * partitions are independent of each other: each can be fed by a
+ * different thread without locking.
+ *
+ * The field is located with a JSON cursor (see jsoncur.h) and converted
+ * in place. Only rows which enter a heap are copied. Rows whose value
+ * lacks the field, or where it is not a number, are skipped.
+ *
+ * Rows with equal values are ordered as they were returned by the view,
+ * partitions in the query's order.
+ */
+
+#ifndef LCBEX_TOPN_H
+#define LCBEX_TOPN_H
+
+#include <lcbex/planner.h>
+#include <lcbex/vrow.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum {
+        /* keep the N rows with the lowest values rather than the highest */
+        LCBEX_TOPN_F_ASCENDING = 1 << 0
+    };
+
+    typedef struct lcbex_topn_st lcbex_topn_t;
+    typedef struct lcbex_topn_part_st lcbex_topn_part_t;
+
+    typedef struct {
+        double value;
+        lcbex_vrow_t row;
+    } lcbex_topn_row_t;
+
+    /**
+     * Creates a top-N operator.
+     *
+     * @param n the number of rows to keep
+     * @param path the field of each row's value, as a dotted path (see
+     * lcbex_jsoncur_path); NULL or "" if the value is itself the number
+     * @param flags LCBEX_TOPN_F_* flags
+     * @param plan a SINGLE, RANGE_PARTITIONED or KEYS_CHUNKED plan for the
+     * query
+     * @param options the query's options; they are used to build the
+     * parts' URIs and must stay valid while the operator is used
+     * @return LCB_EINVAL if n is 0 or the plan is PAGINATED
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_create(lcbex_topn_t **topn,
+                                  size_t n,
+                                  const char *path,
+                                  int flags,
+                                  const lcbex_plan_t *plan,
+                                  const char *design, size_t ndesign,
+                                  const char *view, size_t nview,
+                                  const lcbex_vopt_t *const *options,
+                                  size_t noptions);
+
+    LCBEX_API
+    size_t lcbex_topn_nparts(const lcbex_topn_t *topn);
+
+    /**
+     * Returns a part, from 0 to lcbex_topn_nparts() - 1
+     */
+    LCBEX_API
+    lcbex_topn_part_t *lcbex_topn_get_part(lcbex_topn_t *topn, size_t index);
+
+    /**
+     * Builds the URI to query for a part
+     * @return an allocated string, or NULL on error
+     */
+    LCBEX_API
+    char *lcbex_topn_part_make_uri(const lcbex_topn_part_t *part);
+
+    /**
+     * Feeds part of the part's response body
+     * @return LCB_SUCCESS, LCB_EINVAL if the response is malformed, or
+     * LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_part_feed(lcbex_topn_part_t *part,
+                                     const void *data, size_t ndata);
+
+    /**
+     * Offers a single row to a part, for rows which were parsed elsewhere
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_part_add_row(lcbex_topn_part_t *part,
+                                        const lcbex_vrow_t *row);
+
+    /**
+     * Completes a part.
+     * @param status the status of the part's query. If it is not
+     * LCB_SUCCESS the part is failed; it may be retried after
+     * lcbex_topn_part_reset()
+     * @return the first error of the part, if any
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_part_done(lcbex_topn_part_t *part,
+                                     lcb_error_t status);
+
+    /**
+     * Discards the rows kept by a part, so its query can be retried
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_part_reset(lcbex_topn_part_t *part);
+
+    /**
+     * Returns the number of rows a part has read, and how many of them
+     * were skipped for lacking a numeric field
+     */
+    LCBEX_API
+    void lcbex_topn_part_get_counts(const lcbex_topn_part_t *part,
+                                    lcb_uint64_t *rows,
+                                    lcb_uint64_t *skipped);
+
+    /**
+     * Merges the parts' rows. Must be called after every part is done, and
+     * not concurrently with anything else on the operator.
+     *
+     * @param rows will point to the best rows, best first. They are owned
+     * by the operator and valid until it is destroyed or a part is reset
+     * @param nrows will contain the number of rows, at most N
+     * @return LCB_EINVAL if a part is not done, or the error of a failed
+     * part
+     */
+    LCBEX_API
+    lcb_error_t lcbex_topn_merge(lcbex_topn_t *topn,
+                                 const lcbex_topn_row_t **rows,
+                                 size_t *nrows);
+
+    LCBEX_API
+    void lcbex_topn_destroy(lcbex_topn_t *topn);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_TOPN_H */
@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+/**
+ * Trace spans for view queries.
+ *
+ * When a single query is slow, the question is where its time went:
+ * assigning options, building the URI, waiting to be scheduled,
+ * connecting, waiting for the first byte, parsing, or in row callbacks.
+ * lcbex instruments the phases it owns (option assignment, URI building,
+ * row parsing and row callbacks); the application records the others
+ * around its libcouchbase calls with the same functions.
+ *
+ * Each span carries the current query ID of the recording thread (see
+ * lcbex_trace_set_query()) and monotonic timestamps from lcbex_hrtime().
+ * Spans are written into a ring owned by the recording thread, so
+ * recording takes no locks and never blocks: if the ring is full the
+ * oldest spans are overwritten. lcbex_trace_flush() drains the rings of
+ * all threads into an exporter; a Chrome trace-event exporter is provided
+ * whose output can be loaded in chrome://tracing or Perfetto.
+ *
+ * Tracing is off until lcbex_trace_enable() is called, and costs one
+ * branch per instrumentation point while off. Defining
+ * LCBEX_DISABLE_TRACING when building lcbex (and the application) removes
+ * the instrumentation entirely; the functions below then do nothing.
+ */
+
+#ifndef LCBEX_TRACE_H
+#define LCBEX_TRACE_H
+
+#include <lcbex/lcbex.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Span names for the phases of a view query. Names recorded by the
+     * application need not be one of these, but must be string literals
+     * (or otherwise outlive the flush which exports them).
+     */
+#define LCBEX_TRACE_OPTIONS "vopt_assign"
+#define LCBEX_TRACE_URI "make_uri"
+#define LCBEX_TRACE_SCHEDULE "schedule"
+#define LCBEX_TRACE_CONNECT "connect"
+#define LCBEX_TRACE_FIRST_BYTE "first_byte"
+#define LCBEX_TRACE_PARSE "parse"
+#define LCBEX_TRACE_CALLBACK "row_callback"
+
+    /* default number of spans kept per thread */
+#define LCBEX_TRACE_RING_DEFAULT 4096
+
+    typedef struct {
+        /** name of the span */
+        const char *name;
+        /** query ID set by the recording thread, 0 if none */
+        lcb_uint64_t query_id;
+        /** start time, from lcbex_hrtime() */
+        lcb_uint64_t start;
+        /** duration in nanoseconds; 0 for instant events */
+        lcb_uint64_t duration;
+        /** small sequential ID of the recording thread, starting at 1 */
+        lcb_uint32_t thread_id;
+        /** 'X' for a span, 'i' for an instant event (as in Chrome's format) */
+        char phase;
+    } lcbex_trace_event_t;
+
+    /**
+     * Starts recording spans.
+     * @param ring_size the number of spans kept per thread between flushes,
+     * rounded up to a power of two; 0 for LCBEX_TRACE_RING_DEFAULT. Rings
+     * which already exist keep their size.
+     * @return LCB_NOT_SUPPORTED if tracing was compiled out
+     */
+    LCBEX_API
+    lcb_error_t lcbex_trace_enable(size_t ring_size);
+
+    /**
+     * Stops recording spans. Spans already recorded can still be flushed.
+     */
+    LCBEX_API
+    void lcbex_trace_disable(void);
+
+    /**
+     * Sets the query ID attached to spans subsequently recorded by the
+     * calling thread. Set it before working on a query, and again whenever
+     * the thread switches to another query (e.g. in each callback).
+     */
+    LCBEX_API
+    void lcbex_trace_set_query(lcb_uint64_t query_id);
+
+    LCBEX_API
+    lcb_uint64_t lcbex_trace_get_query(void);
+
+    /**
+     * Returns the start time for a span, or 0 if tracing is disabled, in
+     * which case the span should not be recorded.
+     */
+    LCBEX_API
+    lcb_uint64_t lcbex_trace_now(void);
+
+    /**
+     * Records a span which started at 'start' (from lcbex_trace_now()) and
+     * ends now
+     */
+    LCBEX_API
+    void lcbex_trace_span(const char *name, lcb_uint64_t start);
+
+    /**
+     * Records a span with explicit times, e.g. one measured elsewhere
+     */
+    LCBEX_API
+    void lcbex_trace_span_at(const char *name,
+                             lcb_uint64_t start, lcb_uint64_t end);
+
+    /**
+     * Records an instant event, such as the first byte of a response
+     */
+    LCBEX_API
+    void lcbex_trace_mark(const char *name);
+
+    /**
+     * Receives a batch of events from one thread, in recording order
+     */
+    typedef void (*lcbex_trace_exporter)(const lcbex_trace_event_t *events,
+                                         size_t nevents,
+                                         void *cookie);
+
+    /**
+     * Drains the spans recorded by all threads since the last flush into
+     * the exporter. May be called from any thread while others keep
+     * recording, but not from two threads at once.
+     *
+     * The rings of threads which have exited are freed once drained.
+     * @param dropped if not NULL, set to the number of spans overwritten
+     * before they could be flushed
+     * @return the number of events exported
+     */
+    LCBEX_API
+    size_t lcbex_trace_flush(lcbex_trace_exporter exporter, void *cookie,
+                             lcb_uint64_t *dropped);
+
+    /**
+     * Frees the rings of all threads, discarding unflushed spans. No thread
+     * may be recording while this is called; threads which record spans
+     * afterwards get new rings.
+     */
+    LCBEX_API
+    void lcbex_trace_cleanup(void);
+
+    /**
+     * Exporter writing Chrome's trace-event JSON format (an array of
+     * events with microsecond timestamps). Usage:
+     *
+     *   lcbex_trace_chrome_t ctx;
+     *   lcbex_trace_chrome_begin(&ctx, fp);
+     *   lcbex_trace_flush(lcbex_trace_chrome_export, &ctx, NULL);
+     *   ... more flushes ...
+     *   lcbex_trace_chrome_end(&ctx);
+     */
+    typedef struct {
+        FILE *fp;
+        size_t nevents;
+    } lcbex_trace_chrome_t;
+
+    LCBEX_API
+    void lcbex_trace_chrome_begin(lcbex_trace_chrome_t *ctx, FILE *fp);
+
+    LCBEX_API
+    void lcbex_trace_chrome_export(const lcbex_trace_event_t *events,
+                                   size_t nevents,
+                                   void *cookie);
+
+    LCBEX_API
+    void lcbex_trace_chrome_end(lcbex_trace_chrome_t *ctx);
+
+    /**
+     * Instrumentation macros. Declare the start time among the other
+     * declarations of the block:
+     *
+     *   lcb_uint64_t t0 = LCBEX_TRACE_START();
+     *   ...
+     *   LCBEX_TRACE_END(LCBEX_TRACE_SCHEDULE, t0);
+     */
+#ifndef LCBEX_DISABLE_TRACING
+#define LCBEX_TRACE_START() lcbex_trace_now()
+#define LCBEX_TRACE_END(name, start) \
+    do { if (start) { lcbex_trace_span(name, start); } } while (0)
+#define LCBEX_TRACE_MARK(name) lcbex_trace_mark(name)
+#else
+#define LCBEX_TRACE_START() 0
+#define LCBEX_TRACE_END(name, start) ((void)(start))
+#define LCBEX_TRACE_MARK(name) ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LCBEX_TRACE_H */
@@ -56,9 +56,41 @@ extern "C" {
         LCBEX_VOPT_F_OPTNAME_CONSTANT = 1 << 4,
 
         /* Option name is an integer constant, not a string */
-        LCBEX_VOPT_F_OPTNAME_NUMERIC = 1 << 5
+        LCBEX_VOPT_F_OPTNAME_NUMERIC = 1 << 5,
+
+        /**
+         * Percent-encode the value, leaving only RFC 3986 'unreserved'
+         * characters ([A-Za-z0-9-_.~]) as they are. Implies PCTENCODE.
+         */
+        LCBEX_VOPT_F_PCTENCODE_RFC3986 = 1 << 6,
+
+        /**
+         * Percent-encode the value, leaving unescaped everything which may
+         * appear in a query component besides the separators ('&', '=',
+         * '+', '#'). This also leaves the JSON punctuation '[', ']' and '"'
+         * as they are; these are accepted by the view engine though not
+         * strictly permitted by RFC 3986. Typical JSON keys stay close to
+         * their original size. Implies PCTENCODE.
+         */
+        LCBEX_VOPT_F_PCTENCODE_QUERYSAFE = 1 << 7,
+
+        /**
+         * Option value is a reference counted entry from the value memo
+         * (see lcbex_vopt_memo_enable). Set by the library; don't free,
+         * lcbex_vopt_cleanup drops the reference
+         */
+        LCBEX_VOPT_F_OPTVAL_SHARED = 1 << 8
     };
 
+    /**
+     * LCBEX_VOPT_F_PCTENCODE on its own uses the same logic as PHP's
+     * urlencode, escaping everything except [A-Za-z0-9-_.]
+     */
+#define LCBEX_VOPT_F_PCTENCODE_ANY \
+    (LCBEX_VOPT_F_PCTENCODE | \
+     LCBEX_VOPT_F_PCTENCODE_RFC3986 | \
+     LCBEX_VOPT_F_PCTENCODE_QUERYSAFE)
+
 
     /**
      * This x-macro accepts three arguments:
@@ -74,6 +106,13 @@ extern "C" {
      *      'onerror' - special type accepting the appropriate values (stop, continue)
      *      'stale' - special type accepting ('ok' (coerced if needed from true), 'false',
      *          and 'update_after')
+     *      'coords' - a list of coordinates for spatial views. Either a
+     *          string (a JSON array of numbers, or for bbox also a bare
+     *          comma-separated list) or, with LCBEX_VOPT_F_OPTVAL_NUMERIC,
+     *          an array of doubles with 'nvalue' being the number of
+     *          elements. 'bbox' takes exactly four numbers; the range
+     *          options also accept null (NaN in the numeric form) for an
+     *          open-ended dimension
      *
      * You may use this xmacro if developing higher level wrappers around vopts.
      * Basically, you can create your own handlers which correspond to the
@@ -96,7 +135,10 @@ extern "C" {
     XX(LCBEX_VOPT_OPT_LIMIT, "limit", num) \
     XX(LCBEX_VOPT_OPT_STARTKEY, "startkey", jval) \
     XX(LCBEX_VOPT_OPT_STARTKEY_DOCID, "startkey_docid", string) \
-    XX(LCBEX_VOPT_OPT_DEBUG, "debug", bool)
+    XX(LCBEX_VOPT_OPT_DEBUG, "debug", bool) \
+    XX(LCBEX_VOPT_OPT_BBOX, "bbox", coords) \
+    XX(LCBEX_VOPT_OPT_START_RANGE, "start_range", coords) \
+    XX(LCBEX_VOPT_OPT_END_RANGE, "end_range", coords)
 
     enum {
         LCBEX_VOPT_OPT_CLIENT_PASSTHROUGH = 0,
@@ -117,6 +159,9 @@ extern "C" {
         LCBEX_VOPT_OPT_STARTKEY,
         LCBEX_VOPT_OPT_STARTKEY_DOCID,
         LCBEX_VOPT_OPT_DEBUG,
+        LCBEX_VOPT_OPT_BBOX,
+        LCBEX_VOPT_OPT_START_RANGE,
+        LCBEX_VOPT_OPT_END_RANGE,
         _LCB_VOPT_OPT_MAX
     };
 
@@ -197,6 +242,19 @@ extern "C" {
     lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
                                  size_t *noptions, char **errstr, ...);
 
+    /**
+     * Like lcbex_vopt_createv, but passes flags to each assignment. This
+     * may be used to select a percent-encoding profile for all options, e.g.
+     *
+     *  lcbex_vopt_createv_flags(&optarray, &noptions,
+     *                           LCBEX_VOPT_F_PCTENCODE_QUERYSAFE, &errstr,
+     *                           "startkey", "[\"a\",\"b\"]", NULL);
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vopt_createv_flags(lcbex_vopt_t *optarray[],
+                                         size_t *noptions, int flags,
+                                         char **errstr, ...);
+
     /**
      * Cleans up a vopt structure. This does not free the structure, but does
      * free any allocated members in the structure's internal fields (if any).
@@ -262,6 +320,161 @@ extern "C" {
                              const lcbex_vopt_t *const *options,
                              size_t noptions);
 
+    /**
+     * Like lcbex_vqstr_make_uri, but for a spatial view
+     * (_design/<design>/_spatial/<view>)
+     */
+    LCBEX_API
+    char *lcbex_vqstr_make_spatial_uri(const char *design, size_t ndesign,
+                                     const char *view, size_t nview,
+                                     const lcbex_vopt_t *const *options,
+                                     size_t noptions);
+
+    /**
+     * Like lcbex_vqstr_make_uri, but builds the URI in a buffer owned by the
+     * calling thread, which is reused by later calls so that building a
+     * URI usually allocates nothing.
+     *
+     * The returned string is valid until the next call to one of the
+     * *_tls functions on the same thread; it must not be freed. Copy it if
+     * it is needed for longer.
+     *
+     * The buffer is freed when the thread exits (see
+     * lcbex_vqstr_tls_release).
+     *
+     * @param nuri if not NULL, set to the length of the URI
+     * @return the NUL-terminated URI, or NULL if memory could not be
+     * allocated
+     */
+    LCBEX_API
+    const char *lcbex_vqstr_make_uri_tls(const char *design, size_t ndesign,
+                                         const char *view, size_t nview,
+                                         const lcbex_vopt_t *const *options,
+                                         size_t noptions,
+                                         size_t *nuri);
+
+    /**
+     * Like lcbex_vqstr_make_uri_tls, but for a spatial view
+     */
+    LCBEX_API
+    const char *lcbex_vqstr_make_spatial_uri_tls(const char *design,
+                                                 size_t ndesign,
+                                                 const char *view,
+                                                 size_t nview,
+                                                 const lcbex_vopt_t *const *options,
+                                                 size_t noptions,
+                                                 size_t *nuri);
+
+    /**
+     * Frees the calling thread's URI buffer. The buffer is also freed when
+     * the thread exits, so this is only needed to reclaim the memory of a
+     * thread which keeps running but no longer builds URIs.
+     *
+     * If the process has run out of thread-local storage keys, buffers
+     * cannot be freed at exit and this call is required: threads which
+     * used the *_tls functions must then call it before exiting.
+     */
+    LCBEX_API
+    void lcbex_vqstr_tls_release(void);
+
+    /* default number of values kept by the value memo */
+#define LCBEX_VOPT_MEMO_DEFAULT 1024
+
+    /* longer values are encoded without the memo */
+#define LCBEX_VOPT_MEMO_MAXVALUE 256
+
+    typedef struct {
+        lcb_uint64_t hits;
+        lcb_uint64_t misses;
+        /** values dropped to make room for others */
+        lcb_uint64_t evictions;
+        size_t entries;
+        size_t capacity;
+    } lcbex_vopt_memo_stats_t;
+
+    /**
+     * Starts memoizing percent-encoded values. Once enabled, values assigned
+     * with one of the LCBEX_VOPT_F_PCTENCODE flags are looked up by their
+     * raw bytes, and a value seen before shares the encoded copy made the
+     * first time rather than being encoded again (its option is flagged
+     * LCBEX_VOPT_F_OPTVAL_SHARED). The memo is safe to use from several
+     * threads at once. When full, it evicts values not used recently
+     * (CLOCK); evicted values stay valid in the options still using them.
+     *
+     * Enabling and disabling must not race with option assignments.
+     *
+     * @param capacity the number of values kept; 0 for
+     * LCBEX_VOPT_MEMO_DEFAULT. If the memo is already enabled it is
+     * emptied and resized.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vopt_memo_enable(size_t capacity);
+
+    /**
+     * Stops memoizing values and frees the memo. Options assigned from it
+     * remain valid.
+     */
+    LCBEX_API
+    void lcbex_vopt_memo_disable(void);
+
+    /**
+     * Gets the memo's counters since it was enabled. All are zero if the
+     * memo is disabled.
+     */
+    LCBEX_API
+    void lcbex_vopt_memo_get_stats(lcbex_vopt_memo_stats_t *stats);
+
+    /**
+     * Like lcbex_vqstr_make_uri, but replaces some of the options.
+     *
+     * Any option in 'options' whose name matches one of the names in
+     * 'overrides' is left out, and all of 'overrides' are appended. This is
+     * useful for deriving sub-queries (pages, partitions, chunks) from a
+     * user's query.
+     */
+    LCBEX_API
+    char *lcbex_vqstr_make_uri_override(const char *design, size_t ndesign,
+                                      const char *view, size_t nview,
+                                      const lcbex_vopt_t *const *options,
+                                      size_t noptions,
+                                      const lcbex_vopt_t *const *overrides,
+                                      size_t noverrides);
+
+    /**
+     * Finds an option by name in a list of options
+     * @return the last matching option, or NULL
+     */
+    LCBEX_API
+    const lcbex_vopt_t *lcbex_vopt_find(const lcbex_vopt_t *const *options,
+                                      size_t noptions,
+                                      const char *name);
+
+    /**
+     * Writes an option's value to a buffer, undoing any percent-encoding
+     * applied by lcbex_vopt_assign.
+     *
+     * @param optobj an assigned option
+     * @param buf a buffer of at least optobj->noptval bytes
+     * @return the length of the decoded value
+     */
+    LCBEX_API
+    size_t lcbex_vopt_decode(const lcbex_vopt_t *optobj, char *buf);
+
+#define LCBEX_VOPT_DOUBLE_BUFSIZE 32
+
+    /**
+     * Formats a double using the fewest significant digits which read back
+     * as the same value (e.g. 0.1 rather than 0.10000000000000001). The
+     * exponent never contains a '+', which would be read as a space in a
+     * query string.
+     *
+     * @param buf a buffer of at least LCBEX_VOPT_DOUBLE_BUFSIZE bytes. The
+     * output is NUL-terminated
+     * @return the length of the output, or 0 if the value is not finite
+     */
+    LCBEX_API
+    size_t lcbex_vopt_format_double(double value, char *buf);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
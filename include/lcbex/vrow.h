@@ -0,0 +1,186 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * View rows.
+ *
+ * A view row is represented by the raw JSON text of its fields, as found
+ * in the view response. Nothing is copied or decoded up front: the row
+ * parser only locates the spans of each row, and strings are unescaped
+ * on demand (most keys and IDs contain no escapes, and are returned
+ * without copying).
+ */
+
+#ifndef LCBEX_VROW_H
+#define LCBEX_VROW_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_vrow_st {
+        /* JSON-encoded key */
+        const char *key;
+        /* JSON-encoded document ID (including the quotes). NULL for
+         * reduced rows */
+        const char *id;
+        /* JSON-encoded value */
+        const char *value;
+        /* JSON-encoded document (include_docs). NULL if not present */
+        const char *doc;
+        size_t nkey;
+        size_t nid;
+        size_t nvalue;
+        size_t ndoc;
+    } lcbex_vrow_t;
+
+    /**
+     * Compares two JSON-encoded values in view collation order:
+     * null < false < true < numbers < strings < arrays < objects.
+     *
+     * Arrays and objects are compared element by element. Strings are
+     * compared by Unicode code point; this matches the server's (ICU)
+     * ordering for ASCII data of a single case, but not in general (see
+     * lcbex_vrow_collate_class).
+     *
+     * @return less than, equal to, or greater than zero if a sorts before,
+     * together with, or after b
+     */
+    LCBEX_API
+    int lcbex_vrow_collate(const char *a, size_t na,
+                           const char *b, size_t nb);
+
+    enum {
+        /* the key contains strings with lowercase ASCII letters */
+        LCBEX_VROW_COLLATE_LOWER = 1 << 0,
+        /* the key contains strings with uppercase ASCII letters */
+        LCBEX_VROW_COLLATE_UPPER = 1 << 1,
+        /* the key contains strings (or objects) which the server may order
+         * differently from lcbex_vrow_collate */
+        LCBEX_VROW_COLLATE_ICU = 1 << 2
+    };
+
+    /**
+     * Classifies a JSON key by how far lcbex_vrow_collate can be trusted
+     * to order it the way the server does.
+     *
+     * Null, booleans, numbers, and strings made only of ASCII letters and
+     * digits (and arrays of these) are ordered identically by both, as long
+     * as lowercase and uppercase letters are not mixed: ICU sorts 'a' before
+     * 'B', while a code point comparison sorts it after.
+     *
+     * @return a mask of LCBEX_VROW_COLLATE_* flags. OR together the results
+     * for a set of keys and test the combined mask with
+     * LCBEX_VROW_COLLATE_EXACT
+     */
+    LCBEX_API
+    int lcbex_vrow_collate_class(const char *key, size_t nkey);
+
+#define LCBEX_VROW_COLLATE_EXACT(mask) \
+    (!((mask) & LCBEX_VROW_COLLATE_ICU) && \
+     ((mask) & (LCBEX_VROW_COLLATE_LOWER | LCBEX_VROW_COLLATE_UPPER)) != \
+     (LCBEX_VROW_COLLATE_LOWER | LCBEX_VROW_COLLATE_UPPER))
+
+    /**
+     * Returns the contents of a JSON string.
+     *
+     * If the string contains no escape sequences, a pointer into the input
+     * is returned and nothing is copied. Otherwise the string is unescaped
+     * (including \uXXXX sequences and surrogate pairs, which are encoded as
+     * UTF-8) into 'buf'.
+     *
+     * @param str the JSON string, including its quotes
+     * @param nstr the length of the JSON string
+     * @param buf a buffer of at least nstr bytes. An unescaped string is
+     * never longer than its escaped form
+     * @param out will point to the contents (either into str or buf)
+     * @param nout will contain the length of the contents
+     *
+     * @return LCB_SUCCESS, or LCB_EINVAL if the string is malformed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vrow_unescape(const char *str, size_t nstr, char *buf,
+                                    const char **out, size_t *nout);
+
+    /**
+     * Convenience wrapper for lcbex_vrow_unescape to get a row's document
+     * ID. 'buf' must be at least row->nid bytes.
+     * @return LCB_KEY_ENOENT if the row has no ID (e.g. a reduce row)
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vrow_get_id(const lcbex_vrow_t *row, char *buf,
+                                  const char **out, size_t *nout);
+
+    typedef struct lcbex_vrow_parser_st lcbex_vrow_parser_t;
+
+    /**
+     * Invoked for each row. The row's fields point into the parser's
+     * buffer and are only valid for the duration of the callback.
+     */
+    typedef void (*lcbex_vrow_callback)(lcbex_vrow_parser_t *parser,
+                                        const lcbex_vrow_t *row,
+                                        void *cookie);
+
+    /**
+     * Creates a streaming row parser. The parser is fed the body of a view
+     * response as it arrives (e.g. from the data callback of an
+     * LCB_HTTP_TYPE_VIEW request with chunked responses enabled), and
+     * invokes the callback for each complete row.
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vrow_parser_create(lcbex_vrow_parser_t **parser,
+                                         lcbex_vrow_callback callback,
+                                         void *cookie);
+
+    /**
+     * Feeds a chunk of the response body to the parser
+     * @return LCB_SUCCESS, LCB_CLIENT_ENOMEM, or LCB_EINVAL if the response
+     * is malformed
+     */
+    LCBEX_API
+    lcb_error_t lcbex_vrow_parser_feed(lcbex_vrow_parser_t *parser,
+                                       const void *data, size_t ndata);
+
+    /**
+     * Returns the response's 'total_rows', or SIZE_MAX if it has not been
+     * seen (yet)
+     */
+    LCBEX_API
+    size_t lcbex_vrow_parser_total_rows(const lcbex_vrow_parser_t *parser);
+
+    /**
+     * Returns the number of rows emitted so far
+     */
+    LCBEX_API
+    size_t lcbex_vrow_parser_nrows(const lcbex_vrow_parser_t *parser);
+
+    /**
+     * Resets the parser so it can parse another response
+     */
+    LCBEX_API
+    void lcbex_vrow_parser_reset(lcbex_vrow_parser_t *parser);
+
+    LCBEX_API
+    void lcbex_vrow_parser_destroy(lcbex_vrow_parser_t *parser);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_VROW_H */
@@ -0,0 +1,176 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * View index warmer.
+ *
+ * After a deploy or rebalance the first stale=false query against a design
+ * document blocks until its index is built. The warmer fires a cheap
+ * 'stale=update_after&limit=0' query against one view of each design
+ * document (with bounded concurrency) and reports when each of them has
+ * answered, so that services can gate their readiness on it.
+ *
+ * The warmer does not perform any I/O itself. It hands each URI to a
+ * submit callback; the application issues the request (typically with
+ * lcb_make_http_request and LCB_HTTP_TYPE_VIEW) and reports completion
+ * with lcbex_warmer_done().
+ */
+
+#ifndef LCBEX_WARMER_H
+#define LCBEX_WARMER_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct lcbex_warmer_st lcbex_warmer_t;
+
+    typedef enum {
+        /* waiting to be submitted (or resubmitted after a failure) */
+        LCBEX_WARMER_S_PENDING = 0,
+        /* query has been submitted and not yet completed */
+        LCBEX_WARMER_S_INFLIGHT,
+        /* the index answered */
+        LCBEX_WARMER_S_READY,
+        /* all attempts failed */
+        LCBEX_WARMER_S_FAILED
+    } lcbex_warmer_status_t;
+
+    /**
+     * Invoked when a warming query should be issued.
+     *
+     * @param warmer the warmer
+     * @param index the index of the design document (in order of
+     * lcbex_warmer_add). Pass it back to lcbex_warmer_done
+     * @param uri the NUL-terminated view path and query string. Owned by the
+     * warmer and valid until the warmer is destroyed
+     * @param cookie the cookie passed to lcbex_warmer_create
+     *
+     * It is safe to call lcbex_warmer_done from within this callback.
+     */
+    typedef void (*lcbex_warmer_submit_cb)(lcbex_warmer_t *warmer,
+                                           size_t index,
+                                           const char *uri,
+                                           void *cookie);
+
+    /**
+     * Invoked once per design document when it becomes ready, or when its
+     * last attempt has failed.
+     *
+     * @param err LCB_SUCCESS if the index is responsive, otherwise the error
+     * of the last attempt
+     * @param elapsed nanoseconds from the first submission to completion
+     */
+    typedef void (*lcbex_warmer_ready_cb)(lcbex_warmer_t *warmer,
+                                          size_t index,
+                                          lcb_error_t err,
+                                          lcb_uint64_t elapsed,
+                                          void *cookie);
+
+    /**
+     * Creates a new warmer
+     *
+     * @param warmer pointer which will contain the new warmer
+     * @param max_inflight maximum number of concurrently outstanding queries
+     * (0 means 1)
+     * @param max_attempts how many times a query is tried before its design
+     * document is reported as failed (0 means 1)
+     * @param submit callback used to issue queries
+     * @param ready callback invoked on completion. May be NULL
+     * @param cookie passed to the callbacks
+     *
+     * @return LCB_SUCCESS, or LCB_EINVAL/LCB_CLIENT_ENOMEM
+     */
+    LCBEX_API
+    lcb_error_t lcbex_warmer_create(lcbex_warmer_t **warmer,
+                                    size_t max_inflight,
+                                    unsigned int max_attempts,
+                                    lcbex_warmer_submit_cb submit,
+                                    lcbex_warmer_ready_cb ready,
+                                    void *cookie);
+
+    /**
+     * Adds a design document to warm. Any view of the design document may
+     * be used since all of its views share the same index.
+     *
+     * @param design the design document name
+     * @param ndesign length of the name (-1 for nul-terminated)
+     * @param view the view to query
+     * @param nview the length of the view name (-1 for nul-terminated)
+     *
+     * @return LCB_SUCCESS, or an error. Design documents cannot be added
+     * once the warmer has been started
+     */
+    LCBEX_API
+    lcb_error_t lcbex_warmer_add(lcbex_warmer_t *warmer,
+                                 const char *design, size_t ndesign,
+                                 const char *view, size_t nview);
+
+    /**
+     * Starts submitting queries, up to max_inflight at a time.
+     */
+    LCBEX_API
+    void lcbex_warmer_start(lcbex_warmer_t *warmer);
+
+    /**
+     * Reports the completion of a warming query.
+     *
+     * @param index the index passed to the submit callback
+     * @param err the error of the request, if any
+     * @param http_status the HTTP status code of the response. Anything
+     * but 200 is considered a failure
+     */
+    LCBEX_API
+    void lcbex_warmer_done(lcbex_warmer_t *warmer,
+                           size_t index,
+                           lcb_error_t err,
+                           short http_status);
+
+    /**
+     * Returns the status of a single design document
+     */
+    LCBEX_API
+    lcbex_warmer_status_t lcbex_warmer_get_status(const lcbex_warmer_t *warmer,
+                                                  size_t index);
+
+    /**
+     * Returns the number of design documents which have neither become
+     * ready nor failed. Readiness may be gated on this reaching zero.
+     */
+    LCBEX_API
+    size_t lcbex_warmer_remaining(const lcbex_warmer_t *warmer);
+
+    /**
+     * Returns the number of design documents which failed all attempts
+     */
+    LCBEX_API
+    size_t lcbex_warmer_failed(const lcbex_warmer_t *warmer);
+
+    /**
+     * Destroys the warmer. Any outstanding queries should be cancelled
+     * or ignored by the application.
+     */
+    LCBEX_API
+    void lcbex_warmer_destroy(lcbex_warmer_t *warmer);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* LCBEX_WARMER_H */
@@ -0,0 +1,388 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/admit.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/**
+ * Deadline-aware admission control
+ */
+
+/* weight a single sample has at least, however close to the previous */
+#define SAMPLE_MIN_WEIGHT 0.125
+
+enum {
+    TICKET_NONE = 0,
+    TICKET_QUEUED,
+    TICKET_INFLIGHT
+};
+
+typedef struct {
+    /* latency average in nanoseconds, as of 'stamp' */
+    double latency;
+    lcb_uint64_t stamp;
+    int has_sample;
+} latency_avg;
+
+typedef struct {
+    /* design name followed by view name */
+    char *name;
+    size_t ndesign;
+    size_t nview;
+    latency_avg fresh;
+    latency_avg stale;
+} view_entry;
+
+struct lcbex_admit_st {
+    /* A handful of views per application; a linear list is fine */
+    view_entry *entries;
+    size_t nentries;
+    size_t nalloc;
+
+    lcbex_admit_config_t config;
+    double decay;
+
+    /* estimates of the queries waiting for a slot */
+    unsigned int nqueued;
+    double queued_work;
+
+    /* estimates and start times of the queries in flight */
+    unsigned int ninflight;
+    double inflight_work;
+    double inflight_started;
+
+    lcbex_admit_stats_t stats;
+};
+
+static view_entry *find_entry(lcbex_admit_t *adm,
+                              const char *design, size_t ndesign,
+                              const char *view, size_t nview)
+{
+    size_t ii;
+    for (ii = 0; ii < adm->nentries; ii++) {
+        view_entry *ent = adm->entries + ii;
+        if (ent->ndesign == ndesign && ent->nview == nview &&
+                memcmp(ent->name, design, ndesign) == 0 &&
+                memcmp(ent->name + ndesign, view, nview) == 0) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+static view_entry *add_entry(lcbex_admit_t *adm,
+                             const char *design, size_t ndesign,
+                             const char *view, size_t nview)
+{
+    view_entry *ent;
+
+    if (adm->nentries == adm->nalloc) {
+        size_t n_alloc = adm->nalloc ? adm->nalloc * 2 : 8;
+        view_entry *tmp = realloc(adm->entries, n_alloc * sizeof(*tmp));
+        if (!tmp) {
+            return NULL;
+        }
+        adm->entries = tmp;
+        adm->nalloc = n_alloc;
+    }
+
+    ent = adm->entries + adm->nentries;
+    memset(ent, 0, sizeof(*ent));
+    ent->name = malloc(ndesign + nview + 1);
+    if (!ent->name) {
+        return NULL;
+    }
+    memcpy(ent->name, design, ndesign);
+    memcpy(ent->name + ndesign, view, nview);
+    ent->ndesign = ndesign;
+    ent->nview = nview;
+    adm->nentries++;
+    return ent;
+}
+
+static view_entry *lookup(lcbex_admit_t *adm,
+                          const char *design, size_t ndesign,
+                          const char *view, size_t nview, int create)
+{
+    view_entry *ent;
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+    ent = find_entry(adm, design, ndesign, view, nview);
+    if (!ent && create) {
+        ent = add_entry(adm, design, ndesign, view, nview);
+    }
+    return ent;
+}
+
+static double get_latency(const lcbex_admit_t *adm, const latency_avg *avg)
+{
+    if (!avg->has_sample) {
+        return (double)adm->config.initial_latency;
+    }
+    return avg->latency;
+}
+
+/**
+ * Unlike a node's latency, which decays towards zero so that idle nodes
+ * are retried, a view's average must hold while the view is idle: the
+ * time elapsed only decides how much weight the new sample gets.
+ */
+static void add_sample(const lcbex_admit_t *adm, latency_avg *avg,
+                       lcb_uint64_t latency, lcb_uint64_t now)
+{
+    double w;
+
+    if (!avg->has_sample) {
+        avg->latency = (double)latency;
+        avg->stamp = now;
+        avg->has_sample = 1;
+        return;
+    }
+
+    w = now > avg->stamp ? exp(-(double)(now - avg->stamp) / adm->decay) : 1;
+    if (w > 1 - SAMPLE_MIN_WEIGHT) {
+        w = 1 - SAMPLE_MIN_WEIGHT;
+    }
+    avg->latency = avg->latency * w + (double)latency * (1 - w);
+    if (now > avg->stamp) {
+        avg->stamp = now;
+    }
+}
+
+/**
+ * Time until a new query would get a slot: none if one is free, otherwise
+ * the remaining work ahead of it spread over the slots. The remaining
+ * work of a query in flight is its estimate less the time it has run,
+ * which the sums of estimates and start times give without visiting
+ * each query.
+ */
+static double queue_wait(const lcbex_admit_t *adm, lcb_uint64_t now)
+{
+    double remaining;
+
+    if (adm->nqueued + adm->ninflight < adm->config.concurrency) {
+        return 0;
+    }
+
+    remaining = adm->inflight_work -
+            ((double)now * adm->ninflight - adm->inflight_started);
+    if (remaining < 0) {
+        remaining = 0;
+    }
+    return (remaining + adm->queued_work) / adm->config.concurrency;
+}
+
+LCBEX_API
+void lcbex_admit_config_init(lcbex_admit_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->concurrency = 8;
+    config->decay = LCBEX_ADMIT_DECAY_DEFAULT;
+    config->initial_latency = LCBEX_ADMIT_LATENCY_DEFAULT;
+}
+
+LCBEX_API
+lcb_error_t lcbex_admit_create(lcbex_admit_t **adm,
+                               const lcbex_admit_config_t *config)
+{
+    lcbex_admit_t *ret;
+
+    if (!config->concurrency) {
+        return LCB_EINVAL;
+    }
+
+    ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->config = *config;
+    if (!ret->config.decay) {
+        ret->config.decay = LCBEX_ADMIT_DECAY_DEFAULT;
+    }
+    ret->decay = (double)ret->config.decay;
+    *adm = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcbex_admit_decision_t lcbex_admit_request(lcbex_admit_t *adm,
+                                           const char *design,
+                                           size_t ndesign,
+                                           const char *view,
+                                           size_t nview,
+                                           lcb_uint64_t deadline,
+                                           int flags,
+                                           lcb_uint64_t now,
+                                           lcbex_admit_ticket_t *ticket,
+                                           lcb_uint64_t *estimate)
+{
+    view_entry *ent;
+    double start, fresh, stale;
+    lcbex_admit_decision_t ret;
+
+    memset(ticket, 0, sizeof(*ticket));
+
+    ent = lookup(adm, design, ndesign, view, nview, 1);
+    if (!ent) {
+        adm->stats.rejected++;
+        return LCBEX_ADMIT_REJECT;
+    }
+
+    start = (double)now + queue_wait(adm, now);
+    fresh = get_latency(adm, &ent->fresh);
+    if (estimate) {
+        *estimate = (lcb_uint64_t)(start + fresh);
+    }
+
+    if (!deadline || start + fresh <= (double)deadline) {
+        ret = LCBEX_ADMIT_ACCEPT;
+        ticket->estimate = (lcb_uint64_t)fresh;
+        adm->stats.accepted++;
+
+    } else {
+        stale = get_latency(adm, &ent->stale);
+        if ((flags & LCBEX_ADMIT_F_CAN_DOWNGRADE) &&
+                start + stale <= (double)deadline) {
+            ret = LCBEX_ADMIT_DOWNGRADE;
+            ticket->estimate = (lcb_uint64_t)stale;
+            ticket->stale = 1;
+            adm->stats.downgraded++;
+        } else {
+            adm->stats.rejected++;
+            return LCBEX_ADMIT_REJECT;
+        }
+    }
+
+    ticket->view = ent - adm->entries;
+    ticket->deadline = deadline;
+    ticket->state = TICKET_QUEUED;
+    adm->nqueued++;
+    adm->queued_work += (double)ticket->estimate;
+    return ret;
+}
+
+static void release(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket)
+{
+    if (ticket->state == TICKET_QUEUED) {
+        adm->nqueued--;
+        adm->queued_work -= (double)ticket->estimate;
+        if (!adm->nqueued) {
+            adm->queued_work = 0;
+        }
+    } else if (ticket->state == TICKET_INFLIGHT) {
+        adm->ninflight--;
+        adm->inflight_work -= (double)ticket->estimate;
+        adm->inflight_started -= (double)ticket->started;
+        if (!adm->ninflight) {
+            adm->inflight_work = 0;
+            adm->inflight_started = 0;
+        }
+    }
+    ticket->state = TICKET_NONE;
+}
+
+LCBEX_API
+void lcbex_admit_start(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket,
+                       lcb_uint64_t now)
+{
+    if (ticket->state != TICKET_QUEUED) {
+        return;
+    }
+    release(adm, ticket);
+    ticket->started = now;
+    ticket->state = TICKET_INFLIGHT;
+    adm->ninflight++;
+    adm->inflight_work += (double)ticket->estimate;
+    adm->inflight_started += (double)now;
+}
+
+LCBEX_API
+void lcbex_admit_done(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket,
+                      lcb_error_t status, lcb_uint64_t now)
+{
+    view_entry *ent;
+    int was_inflight = ticket->state == TICKET_INFLIGHT;
+
+    if (ticket->state == TICKET_NONE) {
+        return;
+    }
+    release(adm, ticket);
+
+    adm->stats.completed++;
+    if (ticket->deadline && now > ticket->deadline) {
+        adm->stats.late++;
+    }
+
+    /**
+     * Other failures (e.g. a missing view) say nothing about how long a
+     * query takes; a timeout is a lower bound and is kept so that an
+     * overloaded view's average rises.
+     */
+    if (!was_inflight ||
+            (status != LCB_SUCCESS && status != LCB_ETIMEDOUT)) {
+        return;
+    }
+
+    ent = adm->entries + ticket->view;
+    add_sample(adm, ticket->stale ? &ent->stale : &ent->fresh,
+               now > ticket->started ? now - ticket->started : 0, now);
+}
+
+LCBEX_API
+void lcbex_admit_cancel(lcbex_admit_t *adm, lcbex_admit_ticket_t *ticket)
+{
+    release(adm, ticket);
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_admit_get_latency(lcbex_admit_t *adm,
+                                     const char *design, size_t ndesign,
+                                     const char *view, size_t nview,
+                                     int stale)
+{
+    view_entry *ent = lookup(adm, design, ndesign, view, nview, 0);
+    if (!ent) {
+        return adm->config.initial_latency;
+    }
+    return (lcb_uint64_t)get_latency(adm, stale ? &ent->stale : &ent->fresh);
+}
+
+LCBEX_API
+void lcbex_admit_get_stats(const lcbex_admit_t *adm,
+                           lcbex_admit_stats_t *stats)
+{
+    *stats = adm->stats;
+    stats->queued = adm->nqueued;
+    stats->inflight = adm->ninflight;
+}
+
+LCBEX_API
+void lcbex_admit_destroy(lcbex_admit_t *adm)
+{
+    size_t ii;
+    for (ii = 0; ii < adm->nentries; ii++) {
+        free(adm->entries[ii].name);
+    }
+    free(adm->entries);
+    free(adm);
+}
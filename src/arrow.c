@@ -0,0 +1,1020 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/arrow.h>
+#include <lcbex/jsoncur.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/**
+ * Constants from the Arrow format's Schema.fbs and Message.fbs
+ */
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_INT 2
+#define TYPE_FLOATING_POINT 3
+#define TYPE_UTF8 5
+#define TYPE_BOOL 6
+#define PRECISION_DOUBLE 2
+#define ENDIAN_LITTLE 0
+#define ENDIAN_BIG 1
+
+/* field IDs within each table */
+#define MESSAGE_VERSION 0
+#define MESSAGE_HEADER_TYPE 1
+#define MESSAGE_HEADER 2
+#define MESSAGE_BODY_LENGTH 3
+#define SCHEMA_ENDIANNESS 0
+#define SCHEMA_FIELDS 1
+#define FIELD_NAME 0
+#define FIELD_NULLABLE 1
+#define FIELD_TYPE_TYPE 2
+#define FIELD_TYPE 3
+#define FIELD_CHILDREN 5
+#define INT_BIT_WIDTH 0
+#define INT_IS_SIGNED 1
+#define FLOAT_PRECISION 0
+#define BATCH_LENGTH 0
+#define BATCH_NODES 1
+#define BATCH_BUFFERS 2
+
+#define CONTINUATION 0xFFFFFFFFU
+
+/* the largest offset in a UTF-8 column */
+#define MAX_UTF8_OFFSET 0x7FFFFFFF
+
+/**
+ * Minimal flatbuffer builder. As in the reference implementation the
+ * buffer is filled from the end towards the front, so that objects are
+ * written before the tables which refer to them; an object is identified
+ * by its distance from the end, which doesn't change as the buffer grows.
+ * Everything is little endian, as flatbuffers require.
+ */
+#define FB_MAX_FIELDS 8
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t minalign;
+    /* the table being built */
+    size_t table_start;
+    lcb_uint32_t fields[FB_MAX_FIELDS];
+    unsigned int nfields;
+    int failed;
+} fb_builder;
+
+static void fb_reset(fb_builder *fb)
+{
+    fb->len = 0;
+    fb->minalign = 8;
+    fb->failed = 0;
+}
+
+static char *fb_push(fb_builder *fb, size_t n)
+{
+    if (fb->failed) {
+        return NULL;
+    }
+    if (fb->cap - fb->len < n) {
+        size_t ncap = fb->cap ? fb->cap : 1024;
+        char *tmp;
+        while (ncap - fb->len < n) {
+            ncap *= 2;
+        }
+        if ((tmp = malloc(ncap)) == NULL) {
+            fb->failed = 1;
+            return NULL;
+        }
+        if (fb->len) {
+            memcpy(tmp + ncap - fb->len, fb->buf + fb->cap - fb->len,
+                   fb->len);
+        }
+        free(fb->buf);
+        fb->buf = tmp;
+        fb->cap = ncap;
+    }
+    fb->len += n;
+    return fb->buf + fb->cap - fb->len;
+}
+
+static void put_le(char *p, lcb_uint64_t v, size_t n)
+{
+    size_t ii;
+    for (ii = 0; ii < n; ii++) {
+        p[ii] = (char)(v >> (8 * ii));
+    }
+}
+
+/**
+ * Pads so that, once 'additional' more bytes are pushed, the front is
+ * aligned to 'align'
+ */
+static void fb_prep(fb_builder *fb, size_t align, size_t additional)
+{
+    size_t pad = (~(fb->len + additional) + 1) & (align - 1);
+    char *p;
+
+    if (align > fb->minalign) {
+        fb->minalign = align;
+    }
+    if (pad && (p = fb_push(fb, pad)) != NULL) {
+        memset(p, 0, pad);
+    }
+}
+
+static lcb_uint32_t fb_scalar(fb_builder *fb, lcb_uint64_t v, size_t size)
+{
+    char *p;
+    fb_prep(fb, size, 0);
+    if ((p = fb_push(fb, size)) != NULL) {
+        put_le(p, v, size);
+    }
+    return (lcb_uint32_t)fb->len;
+}
+
+/* an offset to an object written earlier */
+static lcb_uint32_t fb_uoffset(fb_builder *fb, lcb_uint32_t target)
+{
+    char *p;
+    fb_prep(fb, 4, 0);
+    if ((p = fb_push(fb, 4)) != NULL) {
+        put_le(p, fb->len - target, 4);
+    }
+    return (lcb_uint32_t)fb->len;
+}
+
+static lcb_uint32_t fb_string(fb_builder *fb, const char *s)
+{
+    size_t n = strlen(s);
+    char *p;
+
+    fb_prep(fb, 4, n + 1);
+    if ((p = fb_push(fb, n + 1)) != NULL) {
+        memcpy(p, s, n + 1);
+    }
+    return fb_scalar(fb, n, 4);
+}
+
+static lcb_uint32_t fb_offset_vector(fb_builder *fb,
+                                     const lcb_uint32_t *targets, size_t n)
+{
+    size_t ii;
+
+    fb_prep(fb, 4, n * 4);
+    for (ii = n; ii > 0; ii--) {
+        fb_uoffset(fb, targets[ii - 1]);
+    }
+    return fb_scalar(fb, n, 4);
+}
+
+/**
+ * Vector of structs made of two longs (FieldNode and Buffer)
+ */
+static lcb_uint32_t fb_pair_vector(fb_builder *fb,
+                                   const lcb_uint64_t *pairs, size_t n)
+{
+    size_t ii;
+    char *p;
+
+    fb_prep(fb, 4, n * 16);
+    fb_prep(fb, 8, n * 16);
+    for (ii = n; ii > 0; ii--) {
+        if ((p = fb_push(fb, 16)) != NULL) {
+            put_le(p, pairs[2 * (ii - 1)], 8);
+            put_le(p + 8, pairs[2 * (ii - 1) + 1], 8);
+        }
+    }
+    return fb_scalar(fb, n, 4);
+}
+
+static void fb_start(fb_builder *fb)
+{
+    memset(fb->fields, 0, sizeof(fb->fields));
+    fb->nfields = 0;
+    fb->table_start = fb->len;
+}
+
+static void fb_field_added(fb_builder *fb, unsigned int id, lcb_uint32_t ref)
+{
+    fb->fields[id] = ref;
+    if (id + 1 > fb->nfields) {
+        fb->nfields = id + 1;
+    }
+}
+
+static void fb_add_scalar(fb_builder *fb, unsigned int id,
+                          lcb_uint64_t v, size_t size)
+{
+    fb_field_added(fb, id, fb_scalar(fb, v, size));
+}
+
+static void fb_add_offset(fb_builder *fb, unsigned int id,
+                          lcb_uint32_t target)
+{
+    fb_field_added(fb, id, fb_uoffset(fb, target));
+}
+
+/**
+ * Writes the table's vtable just in front of it, and points the table
+ * at it
+ */
+static lcb_uint32_t fb_end(fb_builder *fb)
+{
+    lcb_uint32_t table, vtable;
+    unsigned int ii;
+    char *p;
+
+    fb_prep(fb, 4, 0);
+    fb_push(fb, 4);
+    table = (lcb_uint32_t)fb->len;
+
+    for (ii = fb->nfields; ii > 0; ii--) {
+        lcb_uint32_t ref = fb->fields[ii - 1];
+        fb_scalar(fb, ref ? table - ref : 0, 2);
+    }
+    fb_scalar(fb, table - fb->table_start, 2);
+    fb_scalar(fb, 4 + 2 * fb->nfields, 2);
+    vtable = (lcb_uint32_t)fb->len;
+
+    if (!fb->failed) {
+        p = fb->buf + fb->cap - table;
+        put_le(p, vtable - table, 4);
+    }
+    return table;
+}
+
+static void fb_finish(fb_builder *fb, lcb_uint32_t root)
+{
+    fb_prep(fb, fb->minalign, 4);
+    fb_uoffset(fb, root);
+}
+
+/**
+ * Growable byte buffer for column data
+ */
+typedef struct {
+    char *data;
+    size_t n;
+    size_t alloc;
+} abuf;
+
+static char *abuf_extend(abuf *b, size_t n)
+{
+    if (b->alloc - b->n < n) {
+        size_t nalloc = b->alloc ? b->alloc : 256;
+        char *tmp;
+        while (nalloc - b->n < n) {
+            nalloc *= 2;
+        }
+        if ((tmp = realloc(b->data, nalloc)) == NULL) {
+            return NULL;
+        }
+        b->data = tmp;
+        b->alloc = nalloc;
+    }
+    b->n += n;
+    return b->data + b->n - n;
+}
+
+static int abuf_append(abuf *b, const void *data, size_t n)
+{
+    char *p = abuf_extend(b, n);
+    if (!p) {
+        return 0;
+    }
+    memcpy(p, data, n);
+    return 1;
+}
+
+/* appends bit 'row' of a bitmap */
+static int bit_append(abuf *b, size_t row, int set)
+{
+    if (row % 8 == 0) {
+        char *p = abuf_extend(b, 1);
+        if (!p) {
+            return 0;
+        }
+        *p = 0;
+    }
+    if (set) {
+        b->data[row / 8] |= (char)(1 << (row % 8));
+    }
+    return 1;
+}
+
+typedef enum {
+    SOURCE_KEY = 0,
+    SOURCE_ID,
+    SOURCE_VALUE,
+    SOURCE_EXTRACT
+} column_source;
+
+typedef struct {
+    char *name;
+    /* path within the value, for extracted columns */
+    char *path;
+    column_source source;
+    lcbex_arrow_type_t type;
+    abuf validity;
+    /* UTF-8 columns only */
+    abuf offsets;
+    abuf data;
+    size_t nnulls;
+    /* sizes before the current row, to undo a partly appended row */
+    size_t mark_validity;
+    size_t mark_offsets;
+    size_t mark_data;
+    size_t mark_nulls;
+} arrow_column;
+
+struct lcbex_arrow_writer_st {
+    lcbex_arrow_sink sink;
+    void *cookie;
+    arrow_column *columns;
+    size_t ncolumns;
+    size_t nrows;
+    size_t batch_rows;
+    int schema_written;
+    /* first error seen by the row callback */
+    lcb_error_t err;
+    lcbex_json_index_t *index;
+    /* for unescaping strings */
+    char *scratch;
+    size_t nscratch;
+    fb_builder fb;
+    /* FieldNodes and Buffers of a record batch */
+    lcb_uint64_t *pairs;
+    size_t npairs;
+};
+
+static const char zeroes[8] = { 0 };
+
+static char *my_strdup(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *ret = malloc(n);
+    if (ret) {
+        memcpy(ret, s, n);
+    }
+    return ret;
+}
+
+static lcb_error_t append_column(lcbex_arrow_writer_t *writer,
+                                 const char *name, const char *path,
+                                 column_source source,
+                                 lcbex_arrow_type_t type)
+{
+    arrow_column *tmp, *col;
+
+    tmp = realloc(writer->columns,
+                  (writer->ncolumns + 1) * sizeof(*writer->columns));
+    if (!tmp) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    writer->columns = tmp;
+    col = tmp + writer->ncolumns;
+    memset(col, 0, sizeof(*col));
+
+    col->source = source;
+    col->type = type;
+    if ((col->name = my_strdup(name)) == NULL ||
+            (path && (col->path = my_strdup(path)) == NULL) ||
+            (type == LCBEX_ARROW_UTF8 &&
+             !abuf_append(&col->offsets, zeroes, 4))) {
+        free(col->name);
+        free(col->path);
+        free(col->offsets.data);
+        return LCB_CLIENT_ENOMEM;
+    }
+    writer->ncolumns++;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_arrow_writer_create(lcbex_arrow_writer_t **writer,
+                                      lcbex_arrow_sink sink,
+                                      void *cookie)
+{
+    lcbex_arrow_writer_t *ret;
+
+    if (!sink) {
+        return LCB_EINVAL;
+    }
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->sink = sink;
+    ret->cookie = cookie;
+    ret->batch_rows = LCBEX_ARROW_BATCH_DEFAULT;
+
+    if (lcbex_json_index_create(&ret->index) != LCB_SUCCESS ||
+            append_column(ret, "key", NULL, SOURCE_KEY,
+                          LCBEX_ARROW_UTF8) != LCB_SUCCESS ||
+            append_column(ret, "id", NULL, SOURCE_ID,
+                          LCBEX_ARROW_UTF8) != LCB_SUCCESS ||
+            append_column(ret, "value", NULL, SOURCE_VALUE,
+                          LCBEX_ARROW_UTF8) != LCB_SUCCESS) {
+        lcbex_arrow_writer_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    *writer = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_arrow_writer_add_column(lcbex_arrow_writer_t *writer,
+                                          const char *name,
+                                          const char *path,
+                                          lcbex_arrow_type_t type)
+{
+    if (writer->schema_written || !name || type > LCBEX_ARROW_BOOL) {
+        return LCB_EINVAL;
+    }
+    return append_column(writer, name, path, SOURCE_EXTRACT, type);
+}
+
+LCBEX_API
+void lcbex_arrow_writer_set_batch_rows(lcbex_arrow_writer_t *writer,
+                                       size_t nrows)
+{
+    writer->batch_rows = nrows ? nrows : LCBEX_ARROW_BATCH_DEFAULT;
+}
+
+/**
+ * Parses a JSON number as a 64 bit integer. Integers are parsed exactly;
+ * numbers with a fraction or exponent are accepted if they are integral.
+ */
+static int number_to_int64(const lcbex_jsoncur_t *cur, lcb_int64_t *out)
+{
+    const char *raw, *p, *end;
+    size_t nraw;
+    lcb_uint64_t v = 0, limit;
+    double d;
+    int neg;
+
+    if (lcbex_jsoncur_double(cur, &d) != LCB_SUCCESS) {
+        return 0;
+    }
+    lcbex_jsoncur_raw(cur, &raw, &nraw);
+    end = raw + nraw;
+    neg = *raw == '-';
+    limit = neg ? (lcb_uint64_t)1 << 63 : ((lcb_uint64_t)1 << 63) - 1;
+
+    for (p = raw + neg; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (v > (limit - (*p - '0')) / 10) {
+            return 0;
+        }
+        v = v * 10 + (*p - '0');
+    }
+    if (p == end) {
+        *out = neg ? (lcb_int64_t)(0 - v) : (lcb_int64_t)v;
+        return 1;
+    }
+
+    if (d != floor(d) || d < -9223372036854775808.0 ||
+            d >= 9223372036854775808.0) {
+        return 0;
+    }
+    *out = (lcb_int64_t)d;
+    return 1;
+}
+
+static lcb_error_t append_utf8(arrow_column *col, size_t row,
+                               const char *s, size_t n)
+{
+    lcb_uint32_t end;
+
+    if (n > MAX_UTF8_OFFSET) {
+        return LCB_E2BIG;
+    }
+    if (!bit_append(&col->validity, row, s != NULL) ||
+            (s && !abuf_append(&col->data, s, n))) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (!s) {
+        col->nnulls++;
+    }
+    end = (lcb_uint32_t)col->data.n;
+    if (!abuf_append(&col->offsets, &end, sizeof(end))) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
+
+static lcb_error_t append_extracted(lcbex_arrow_writer_t *writer,
+                                    arrow_column *col,
+                                    const lcbex_jsoncur_t *cur)
+{
+    lcbex_json_type_t type = cur ? lcbex_jsoncur_type(cur) :
+                             LCBEX_JSON_INVALID;
+    size_t row = writer->nrows;
+    int valid = 0;
+
+    switch (col->type) {
+    case LCBEX_ARROW_UTF8: {
+        const char *s = NULL;
+        size_t ns = 0;
+        if (type == LCBEX_JSON_STRING) {
+            if (lcbex_jsoncur_string(cur, writer->scratch,
+                                     &s, &ns) != LCB_SUCCESS) {
+                s = NULL;
+            }
+        } else if (type != LCBEX_JSON_INVALID) {
+            lcbex_jsoncur_raw(cur, &s, &ns);
+        }
+        return append_utf8(col, row, s, ns);
+    }
+
+    case LCBEX_ARROW_INT64: {
+        lcb_int64_t v = 0;
+        valid = type == LCBEX_JSON_NUMBER && number_to_int64(cur, &v);
+        if (!abuf_append(&col->data, &v, sizeof(v))) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        break;
+    }
+
+    case LCBEX_ARROW_DOUBLE: {
+        double v = 0;
+        valid = type == LCBEX_JSON_NUMBER &&
+                lcbex_jsoncur_double(cur, &v) == LCB_SUCCESS;
+        if (!valid) {
+            v = 0;
+        }
+        if (!abuf_append(&col->data, &v, sizeof(v))) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        break;
+    }
+
+    case LCBEX_ARROW_BOOL:
+        valid = type == LCBEX_JSON_TRUE || type == LCBEX_JSON_FALSE;
+        if (!bit_append(&col->data, row, type == LCBEX_JSON_TRUE)) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        break;
+    }
+
+    if (!bit_append(&col->validity, row, valid)) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (!valid) {
+        col->nnulls++;
+    }
+    return LCB_SUCCESS;
+}
+
+/**
+ * Checks that a row's strings fit in the current batch, and that the
+ * scratch buffer can hold its unescaped ID and value strings
+ */
+static lcb_error_t prepare_row(lcbex_arrow_writer_t *writer,
+                               const lcbex_vrow_t *row)
+{
+    size_t need = row->nid > row->nvalue ? row->nid : row->nvalue;
+    size_t total = row->nkey + row->nid + row->nvalue;
+    size_t ii;
+    lcb_error_t err;
+
+    if (total > MAX_UTF8_OFFSET) {
+        return LCB_E2BIG;
+    }
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        if (col->type == LCBEX_ARROW_UTF8 &&
+                col->data.n + total > MAX_UTF8_OFFSET) {
+            if ((err = lcbex_arrow_writer_flush(writer)) != LCB_SUCCESS) {
+                return err;
+            }
+            break;
+        }
+    }
+
+    if (need > writer->nscratch) {
+        char *tmp = realloc(writer->scratch, need);
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        writer->scratch = tmp;
+        writer->nscratch = need;
+    }
+    return LCB_SUCCESS;
+}
+
+static void mark_row(lcbex_arrow_writer_t *writer)
+{
+    size_t ii;
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        col->mark_validity = col->validity.n;
+        col->mark_offsets = col->offsets.n;
+        col->mark_data = col->data.n;
+        col->mark_nulls = col->nnulls;
+    }
+}
+
+static void clear_bit(abuf *b, size_t row)
+{
+    if (row / 8 < b->n) {
+        b->data[row / 8] &= (char)~(1 << (row % 8));
+    }
+}
+
+static void undo_row(lcbex_arrow_writer_t *writer)
+{
+    size_t ii, row = writer->nrows;
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        col->validity.n = col->mark_validity;
+        col->offsets.n = col->mark_offsets;
+        col->data.n = col->mark_data;
+        col->nnulls = col->mark_nulls;
+        clear_bit(&col->validity, row);
+        if (col->type == LCBEX_ARROW_BOOL) {
+            clear_bit(&col->data, row);
+        }
+    }
+}
+
+LCBEX_API
+lcb_error_t lcbex_arrow_writer_add_row(lcbex_arrow_writer_t *writer,
+                                       const lcbex_vrow_t *row)
+{
+    lcbex_jsoncur_t root, cur;
+    int have_root = 0;
+    size_t ii;
+    lcb_error_t err;
+
+    if ((err = prepare_row(writer, row)) != LCB_SUCCESS) {
+        return err;
+    }
+    mark_row(writer);
+
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        const char *s;
+        size_t ns;
+
+        switch (col->source) {
+        case SOURCE_KEY:
+            err = append_utf8(col, writer->nrows, row->key, row->nkey);
+            break;
+
+        case SOURCE_ID:
+            if (lcbex_vrow_get_id(row, writer->scratch,
+                                  &s, &ns) != LCB_SUCCESS) {
+                s = NULL;
+                ns = 0;
+            }
+            err = append_utf8(col, writer->nrows, s, ns);
+            break;
+
+        case SOURCE_VALUE:
+            err = append_utf8(col, writer->nrows, row->value, row->nvalue);
+            break;
+
+        case SOURCE_EXTRACT:
+            if (!have_root) {
+                /* index the value once for all extracted columns */
+                have_root = -1;
+                if (row->value &&
+                        lcbex_json_index_build(writer->index, row->value,
+                                               row->nvalue) == LCB_SUCCESS &&
+                        lcbex_jsoncur_root(writer->index,
+                                           &root) == LCB_SUCCESS) {
+                    have_root = 1;
+                }
+            }
+            if (have_root == 1 &&
+                    (col->path == NULL ||
+                     lcbex_jsoncur_path(&root, col->path,
+                                        &cur) == LCB_SUCCESS)) {
+                err = append_extracted(writer, col,
+                                       col->path ? &cur : &root);
+            } else {
+                err = append_extracted(writer, col, NULL);
+            }
+            break;
+        }
+
+        if (err != LCB_SUCCESS) {
+            undo_row(writer);
+            return err;
+        }
+    }
+
+    if (++writer->nrows >= writer->batch_rows) {
+        return lcbex_arrow_writer_flush(writer);
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_arrow_writer_row_callback(lcbex_vrow_parser_t *parser,
+                                     const lcbex_vrow_t *row,
+                                     void *cookie)
+{
+    lcbex_arrow_writer_t *writer = cookie;
+    if (writer->err == LCB_SUCCESS) {
+        writer->err = lcbex_arrow_writer_add_row(writer, row);
+    }
+    (void)parser;
+}
+
+static size_t pad8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+/**
+ * Writes an encapsulated message: a continuation marker, the length of
+ * the metadata, and the metadata (a Message table whose header has
+ * already been built), padded to 8 bytes. The body follows separately.
+ */
+static lcb_error_t write_message(lcbex_arrow_writer_t *writer,
+                                 int header_type, lcb_uint32_t header,
+                                 size_t body_len)
+{
+    fb_builder *fb = &writer->fb;
+    char prefix[8];
+    size_t nmeta;
+    lcb_uint32_t msg;
+    lcb_error_t err;
+
+    fb_start(fb);
+    fb_add_scalar(fb, MESSAGE_BODY_LENGTH, body_len, 8);
+    fb_add_offset(fb, MESSAGE_HEADER, header);
+    fb_add_scalar(fb, MESSAGE_VERSION, METADATA_V5, 2);
+    fb_add_scalar(fb, MESSAGE_HEADER_TYPE, header_type, 1);
+    msg = fb_end(fb);
+    fb_finish(fb, msg);
+    if (fb->failed) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    nmeta = pad8(fb->len);
+    put_le(prefix, CONTINUATION, 4);
+    put_le(prefix + 4, nmeta, 4);
+    if ((err = writer->sink(prefix, 8, writer->cookie)) != LCB_SUCCESS ||
+            (err = writer->sink(fb->buf + fb->cap - fb->len, fb->len,
+                                writer->cookie)) != LCB_SUCCESS) {
+        return err;
+    }
+    if (nmeta > fb->len) {
+        return writer->sink(zeroes, nmeta - fb->len, writer->cookie);
+    }
+    return LCB_SUCCESS;
+}
+
+static lcb_uint32_t build_field(fb_builder *fb, const arrow_column *col)
+{
+    lcb_uint32_t name, children, type;
+    int type_type;
+
+    name = fb_string(fb, col->name);
+    children = fb_offset_vector(fb, NULL, 0);
+
+    fb_start(fb);
+    switch (col->type) {
+    case LCBEX_ARROW_INT64:
+        fb_add_scalar(fb, INT_BIT_WIDTH, 64, 4);
+        fb_add_scalar(fb, INT_IS_SIGNED, 1, 1);
+        type_type = TYPE_INT;
+        break;
+    case LCBEX_ARROW_DOUBLE:
+        fb_add_scalar(fb, FLOAT_PRECISION, PRECISION_DOUBLE, 2);
+        type_type = TYPE_FLOATING_POINT;
+        break;
+    case LCBEX_ARROW_BOOL:
+        type_type = TYPE_BOOL;
+        break;
+    default:
+        type_type = TYPE_UTF8;
+        break;
+    }
+    type = fb_end(fb);
+
+    fb_start(fb);
+    fb_add_offset(fb, FIELD_NAME, name);
+    fb_add_offset(fb, FIELD_TYPE, type);
+    fb_add_offset(fb, FIELD_CHILDREN, children);
+    fb_add_scalar(fb, FIELD_NULLABLE, 1, 1);
+    fb_add_scalar(fb, FIELD_TYPE_TYPE, type_type, 1);
+    return fb_end(fb);
+}
+
+static int host_is_big_endian(void)
+{
+    union {
+        lcb_uint16_t u;
+        char c[2];
+    } probe;
+    probe.u = 1;
+    return probe.c[0] == 0;
+}
+
+static lcb_error_t write_schema(lcbex_arrow_writer_t *writer)
+{
+    fb_builder *fb = &writer->fb;
+    lcb_uint32_t *fields, vec, schema;
+    size_t ii;
+    lcb_error_t err;
+
+    if ((fields = malloc(writer->ncolumns * sizeof(*fields))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    fb_reset(fb);
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        fields[ii] = build_field(fb, writer->columns + ii);
+    }
+    vec = fb_offset_vector(fb, fields, writer->ncolumns);
+    free(fields);
+
+    fb_start(fb);
+    fb_add_offset(fb, SCHEMA_FIELDS, vec);
+    fb_add_scalar(fb, SCHEMA_ENDIANNESS,
+                  host_is_big_endian() ? ENDIAN_BIG : ENDIAN_LITTLE, 2);
+    schema = fb_end(fb);
+
+    if ((err = write_message(writer, HEADER_SCHEMA, schema, 0)) ==
+            LCB_SUCCESS) {
+        writer->schema_written = 1;
+    }
+    return err;
+}
+
+static void reset_batch(lcbex_arrow_writer_t *writer)
+{
+    size_t ii;
+    lcb_uint32_t zero = 0;
+
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        col->validity.n = 0;
+        col->offsets.n = 0;
+        col->data.n = 0;
+        col->nnulls = 0;
+        if (col->type == LCBEX_ARROW_UTF8) {
+            /* the buffer was allocated along with the column, so this
+             * can't fail */
+            abuf_append(&col->offsets, &zero, sizeof(zero));
+        }
+    }
+    writer->nrows = 0;
+}
+
+/**
+ * Returns the buffers of a column, in the order Arrow expects them. The
+ * validity bitmap may be omitted if there are no nulls.
+ */
+static size_t column_buffers(const arrow_column *col, const abuf **bufs)
+{
+    static const abuf empty = { NULL, 0, 0 };
+    size_t n = 0;
+
+    bufs[n++] = col->nnulls ? &col->validity : &empty;
+    if (col->type == LCBEX_ARROW_UTF8) {
+        bufs[n++] = &col->offsets;
+    }
+    bufs[n++] = &col->data;
+    return n;
+}
+
+static lcb_error_t write_batch(lcbex_arrow_writer_t *writer)
+{
+    fb_builder *fb = &writer->fb;
+    const abuf *bufs[3];
+    lcb_uint64_t *nodes, *buffers, offset = 0;
+    lcb_uint32_t nodes_vec, buffers_vec, batch;
+    size_t ii, jj, nb, nbuffers = 0, need = writer->ncolumns * 8;
+    lcb_error_t err;
+
+    if (need > writer->npairs) {
+        lcb_uint64_t *tmp = realloc(writer->pairs, need * sizeof(*tmp));
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        writer->pairs = tmp;
+        writer->npairs = need;
+    }
+    /* a node and up to three buffers per column */
+    nodes = writer->pairs;
+    buffers = writer->pairs + writer->ncolumns * 2;
+
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        const arrow_column *col = writer->columns + ii;
+        nodes[ii * 2] = writer->nrows;
+        nodes[ii * 2 + 1] = col->nnulls;
+        nb = column_buffers(col, bufs);
+        for (jj = 0; jj < nb; jj++, nbuffers++) {
+            buffers[nbuffers * 2] = offset;
+            buffers[nbuffers * 2 + 1] = bufs[jj]->n;
+            offset += pad8(bufs[jj]->n);
+        }
+    }
+
+    fb_reset(fb);
+    nodes_vec = fb_pair_vector(fb, nodes, writer->ncolumns);
+    buffers_vec = fb_pair_vector(fb, buffers, nbuffers);
+    fb_start(fb);
+    fb_add_scalar(fb, BATCH_LENGTH, writer->nrows, 8);
+    fb_add_offset(fb, BATCH_NODES, nodes_vec);
+    fb_add_offset(fb, BATCH_BUFFERS, buffers_vec);
+    batch = fb_end(fb);
+
+    if ((err = write_message(writer, HEADER_RECORD_BATCH, batch,
+                             (size_t)offset)) != LCB_SUCCESS) {
+        return err;
+    }
+
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        nb = column_buffers(writer->columns + ii, bufs);
+        for (jj = 0; jj < nb; jj++) {
+            size_t n = bufs[jj]->n;
+            if (n && (err = writer->sink(bufs[jj]->data, n,
+                                         writer->cookie)) != LCB_SUCCESS) {
+                return err;
+            }
+            if (pad8(n) > n &&
+                    (err = writer->sink(zeroes, pad8(n) - n,
+                                        writer->cookie)) != LCB_SUCCESS) {
+                return err;
+            }
+        }
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_arrow_writer_flush(lcbex_arrow_writer_t *writer)
+{
+    lcb_error_t err;
+
+    if (!writer->schema_written &&
+            (err = write_schema(writer)) != LCB_SUCCESS) {
+        return err;
+    }
+    if (writer->nrows == 0) {
+        return LCB_SUCCESS;
+    }
+    err = write_batch(writer);
+    reset_batch(writer);
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_arrow_writer_finish(lcbex_arrow_writer_t *writer)
+{
+    char eos[8];
+    lcb_error_t err = writer->err;
+
+    if (err == LCB_SUCCESS) {
+        err = lcbex_arrow_writer_flush(writer);
+    }
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+    put_le(eos, CONTINUATION, 4);
+    put_le(eos + 4, 0, 4);
+    return writer->sink(eos, sizeof(eos), writer->cookie);
+}
+
+LCBEX_API
+void lcbex_arrow_writer_destroy(lcbex_arrow_writer_t *writer)
+{
+    size_t ii;
+
+    for (ii = 0; ii < writer->ncolumns; ii++) {
+        arrow_column *col = writer->columns + ii;
+        free(col->name);
+        free(col->path);
+        free(col->validity.data);
+        free(col->offsets.data);
+        free(col->data.data);
+    }
+    free(writer->columns);
+    if (writer->index) {
+        lcbex_json_index_destroy(writer->index);
+    }
+    free(writer->scratch);
+    free(writer->fb.buf);
+    free(writer->pairs);
+    free(writer);
+}
@@ -0,0 +1,380 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/vrow.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * View key collation. Both values are walked in lockstep; we bail out
+ * as soon as they differ, so nothing is decoded past the first difference.
+ * @author Mark Nunberg
+ */
+
+typedef struct {
+    const char *p;
+    const char *end;
+} jcursor;
+
+enum {
+    RANK_END = -1,
+    RANK_NULL = 0,
+    RANK_FALSE,
+    RANK_TRUE,
+    RANK_NUMBER,
+    RANK_STRING,
+    RANK_ARRAY,
+    RANK_OBJECT,
+    RANK_INVALID
+};
+
+static void skip_ws(jcursor *c)
+{
+    while (c->p < c->end &&
+            (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+}
+
+static int type_rank(jcursor *c)
+{
+    skip_ws(c);
+    if (c->p >= c->end) {
+        return RANK_END;
+    }
+
+    switch (*c->p) {
+    case 'n':
+        return RANK_NULL;
+    case 'f':
+        return RANK_FALSE;
+    case 't':
+        return RANK_TRUE;
+    case '"':
+        return RANK_STRING;
+    case '[':
+        return RANK_ARRAY;
+    case '{':
+        return RANK_OBJECT;
+    default:
+        if (*c->p == '-' || (*c->p >= '0' && *c->p <= '9')) {
+            return RANK_NUMBER;
+        }
+        return RANK_INVALID;
+    }
+}
+
+static double read_number(jcursor *c)
+{
+    char buf[64];
+    size_t n = 0;
+
+    while (c->p < c->end && n < sizeof(buf) - 1) {
+        char ch = *c->p;
+        if ((ch >= '0' && ch <= '9') || ch == '-' || ch == '+' ||
+                ch == '.' || ch == 'e' || ch == 'E') {
+            buf[n++] = ch;
+            c->p++;
+        } else {
+            break;
+        }
+    }
+    buf[n] = '\0';
+    return strtod(buf, NULL);
+}
+
+static int hexval(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+static long read_hex4(jcursor *c)
+{
+    long ret = 0;
+    int ii;
+
+    if (c->end - c->p < 4) {
+        c->p = c->end;
+        return -1;
+    }
+    for (ii = 0; ii < 4; ii++) {
+        int v = hexval(c->p[ii]);
+        if (v < 0) {
+            return -1;
+        }
+        ret = (ret << 4) | v;
+    }
+    c->p += 4;
+    return ret;
+}
+
+/**
+ * Returns the next code point of a string whose opening quote has already
+ * been consumed, or -1 once the closing quote (or the end of the buffer)
+ * is reached.
+ */
+static long next_codepoint(jcursor *c)
+{
+    unsigned char ch;
+    long cp;
+    int nextra, ii;
+
+    if (c->p >= c->end) {
+        return -1;
+    }
+
+    ch = (unsigned char) * c->p++;
+    if (ch == '"') {
+        return -1;
+    }
+
+    if (ch == '\\') {
+        if (c->p >= c->end) {
+            return -1;
+        }
+        ch = (unsigned char) * c->p++;
+        switch (ch) {
+        case 'b':
+            return '\b';
+        case 'f':
+            return '\f';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 't':
+            return '\t';
+        case 'u':
+            cp = read_hex4(c);
+            if (cp >= 0xD800 && cp <= 0xDBFF &&
+                    c->end - c->p >= 6 && c->p[0] == '\\' && c->p[1] == 'u') {
+                long lo;
+                jcursor save = *c;
+                c->p += 2;
+                lo = read_hex4(c);
+                if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                    return 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                *c = save;
+            }
+            return cp;
+        default:
+            return ch;
+        }
+    }
+
+    if (ch < 0x80) {
+        return ch;
+    } else if ((ch & 0xE0) == 0xC0) {
+        cp = ch & 0x1F;
+        nextra = 1;
+    } else if ((ch & 0xF0) == 0xE0) {
+        cp = ch & 0x0F;
+        nextra = 2;
+    } else if ((ch & 0xF8) == 0xF0) {
+        cp = ch & 0x07;
+        nextra = 3;
+    } else {
+        return ch;
+    }
+
+    for (ii = 0; ii < nextra && c->p < c->end; ii++) {
+        cp = (cp << 6) | ((unsigned char) * c->p++ & 0x3F);
+    }
+    return cp;
+}
+
+static int collate_value(jcursor *a, jcursor *b);
+
+static int collate_string(jcursor *a, jcursor *b)
+{
+    /* skip the opening quotes */
+    a->p++;
+    b->p++;
+
+    for (;;) {
+        long ca = next_codepoint(a);
+        long cb = next_codepoint(b);
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+        if (ca == -1) {
+            return 0;
+        }
+    }
+}
+
+static int at_close(jcursor *c, char closer)
+{
+    skip_ws(c);
+    return c->p >= c->end || *c->p == closer;
+}
+
+static void skip_sep(jcursor *c, char sep)
+{
+    skip_ws(c);
+    if (c->p < c->end && *c->p == sep) {
+        c->p++;
+    }
+}
+
+static int collate_container(jcursor *a, jcursor *b, char closer)
+{
+    a->p++;
+    b->p++;
+
+    for (;;) {
+        int rv;
+        int a_done = at_close(a, closer);
+        int b_done = at_close(b, closer);
+
+        if (a_done || b_done) {
+            if (a_done && b_done) {
+                a->p++;
+                b->p++;
+                return 0;
+            }
+            return a_done ? -1 : 1;
+        }
+
+        if (closer == '}') {
+            /* member name, then value */
+            if (type_rank(a) != RANK_STRING || type_rank(b) != RANK_STRING) {
+                return collate_value(a, b);
+            }
+            if ((rv = collate_string(a, b)) != 0) {
+                return rv;
+            }
+            skip_sep(a, ':');
+            skip_sep(b, ':');
+        }
+
+        if ((rv = collate_value(a, b)) != 0) {
+            return rv;
+        }
+        skip_sep(a, ',');
+        skip_sep(b, ',');
+    }
+}
+
+static void skip_literal(jcursor *c)
+{
+    while (c->p < c->end && *c->p >= 'a' && *c->p <= 'z') {
+        c->p++;
+    }
+}
+
+static int collate_value(jcursor *a, jcursor *b)
+{
+    int ra = type_rank(a);
+    int rb = type_rank(b);
+
+    if (ra != rb) {
+        return ra < rb ? -1 : 1;
+    }
+
+    switch (ra) {
+    case RANK_END:
+        return 0;
+
+    case RANK_NULL:
+    case RANK_FALSE:
+    case RANK_TRUE:
+        skip_literal(a);
+        skip_literal(b);
+        return 0;
+
+    case RANK_NUMBER: {
+        double da = read_number(a);
+        double db = read_number(b);
+        if (da != db) {
+            return da < db ? -1 : 1;
+        }
+        return 0;
+    }
+
+    case RANK_STRING:
+        return collate_string(a, b);
+
+    case RANK_ARRAY:
+        return collate_container(a, b, ']');
+
+    case RANK_OBJECT:
+        return collate_container(a, b, '}');
+
+    default: {
+        /* not JSON; fall back to a byte comparison of what's left */
+        size_t na = a->end - a->p, nb = b->end - b->p;
+        int rv = memcmp(a->p, b->p, na < nb ? na : nb);
+        if (rv) {
+            return rv;
+        }
+        return na == nb ? 0 : (na < nb ? -1 : 1);
+    }
+    }
+}
+
+LCBEX_API
+int lcbex_vrow_collate(const char *a, size_t na, const char *b, size_t nb)
+{
+    jcursor ca, cb;
+    ca.p = a;
+    ca.end = a + na;
+    cb.p = b;
+    cb.end = b + nb;
+    return collate_value(&ca, &cb);
+}
+
+LCBEX_API
+int lcbex_vrow_collate_class(const char *key, size_t nkey)
+{
+    const char *p = key, *end = key + nkey;
+    int ret = 0;
+
+    while (p < end) {
+        char ch = *p++;
+
+        if (ch == '{') {
+            /* member names would need the same treatment, and objects are
+             * rare enough as keys that it isn't worth it */
+            return LCBEX_VROW_COLLATE_ICU;
+        }
+        if (ch != '"') {
+            continue;
+        }
+
+        while (p < end && (ch = *p++) != '"') {
+            if (ch >= 'a' && ch <= 'z') {
+                ret |= LCBEX_VROW_COLLATE_LOWER;
+            } else if (ch >= 'A' && ch <= 'Z') {
+                ret |= LCBEX_VROW_COLLATE_UPPER;
+            } else if (ch < '0' || ch > '9') {
+                /* punctuation, whitespace, escapes and non-ASCII text are
+                 * all ordered differently by ICU */
+                return LCBEX_VROW_COLLATE_ICU;
+            }
+        }
+    }
+    return ret;
+}
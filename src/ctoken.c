@@ -0,0 +1,433 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/ctoken.h>
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Continuation tokens
+ *
+ * Layout, before base64url encoding:
+ *
+ *     version (1 byte)
+ *     flags (1 byte)
+ *     varint length, startkey
+ *     varint length, startkey_docid (if FLAG_HAS_DOCID)
+ *     SipHash of the query's fingerprint and the above (8 bytes, LE)
+ */
+
+#define TOKEN_VERSION 1
+#define FLAG_HAS_DOCID 0x80
+#define MAC_SIZE 8
+#define MAX_VARINT 10
+
+static const char b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static int b64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '-') {
+        return 62;
+    } else if (c == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+/**
+ * @return the length written, excluding the NUL. 'out' must hold
+ * (n * 4 + 2) / 3 + 1 bytes
+ */
+static size_t b64_encode(const unsigned char *in, size_t n, char *out)
+{
+    char *p = out;
+    size_t ii;
+
+    for (ii = 0; ii + 3 <= n; ii += 3) {
+        lcb_uint32_t v = (in[ii] << 16) | (in[ii + 1] << 8) | in[ii + 2];
+        *p++ = b64_chars[(v >> 18) & 63];
+        *p++ = b64_chars[(v >> 12) & 63];
+        *p++ = b64_chars[(v >> 6) & 63];
+        *p++ = b64_chars[v & 63];
+    }
+    if (n - ii == 1) {
+        *p++ = b64_chars[in[ii] >> 2];
+        *p++ = b64_chars[(in[ii] & 3) << 4];
+    } else if (n - ii == 2) {
+        lcb_uint32_t v = (in[ii] << 8) | in[ii + 1];
+        *p++ = b64_chars[v >> 10];
+        *p++ = b64_chars[(v >> 4) & 63];
+        *p++ = b64_chars[(v & 15) << 2];
+    }
+    *p = '\0';
+    return p - out;
+}
+
+/**
+ * @return the length decoded, or SIZE_MAX if the input is not canonical
+ * unpadded base64url. 'out' must hold n * 3 / 4 bytes
+ */
+static size_t b64_decode(const char *in, size_t n, unsigned char *out)
+{
+    unsigned char *p = out;
+    lcb_uint32_t v = 0;
+    size_t ii;
+    int bits = 0;
+
+    if (n % 4 == 1) {
+        return SIZE_MAX;
+    }
+    for (ii = 0; ii < n; ii++) {
+        int c = b64_value(in[ii]);
+        if (c < 0) {
+            return SIZE_MAX;
+        }
+        v = (v << 6) | c;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *p++ = (unsigned char)(v >> bits);
+            v &= (1 << bits) - 1;
+        }
+    }
+    /* leftover bits must be zero, so each token has a single encoding */
+    if (v) {
+        return SIZE_MAX;
+    }
+    return p - out;
+}
+
+static size_t put_varint(unsigned char *p, size_t val)
+{
+    size_t n = 0;
+    while (val >= 0x80) {
+        p[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    p[n++] = (unsigned char)val;
+    return n;
+}
+
+/**
+ * @return 1 if a length fitting in what remains of the buffer was read
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+                      size_t *val)
+{
+    size_t ret = 0;
+    unsigned int shift = 0;
+
+    while (*p < end && shift < sizeof(size_t) * 8) {
+        unsigned char c = *(*p)++;
+        ret |= (size_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *val = ret;
+            return ret <= (size_t)(end - *p);
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static lcb_uint64_t compute_mac(const unsigned char *key,
+                                lcb_uint64_t fingerprint,
+                                unsigned char *buf, size_t n)
+{
+    /* the fingerprint is prepended to the contents in the space reserved
+     * for it, and not sent */
+    size_t ii;
+    for (ii = 0; ii < 8; ii++) {
+        buf[ii] = (unsigned char)(fingerprint >> (ii * 8));
+    }
+    return lcbex_siphash(key, buf, n + 8);
+}
+
+static int is_paging_option(const lcbex_vopt_t *opt)
+{
+    static const char *names[] = {
+        "startkey", "startkey_docid", "skip", "limit", "descending", NULL
+    };
+    size_t ii;
+
+    for (ii = 0; names[ii]; ii++) {
+        if (opt->noptname == strlen(names[ii]) &&
+                memcmp(opt->optname, names[ii], opt->noptname) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_ctoken_fingerprint(const char *design, size_t ndesign,
+                                      const char *view, size_t nview,
+                                      const lcbex_vopt_t *const *options,
+                                      size_t noptions)
+{
+    char sbuf[256];
+    lcb_uint64_t ret, sum = 0;
+    size_t ii;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    ret = lcbex_hash64(design, ndesign, 0);
+    ret = lcbex_hash64(view, nview, ret + nview);
+
+    /* hash the decoded values, so that the encoding does not matter, and
+     * add the hashes up, so that the order does not */
+    for (ii = 0; ii < noptions; ii++) {
+        const lcbex_vopt_t *opt = options[ii];
+        char *value = sbuf;
+        size_t nvalue;
+        lcb_uint64_t h;
+
+        if (is_paging_option(opt)) {
+            continue;
+        }
+        if (opt->noptval > sizeof(sbuf) &&
+                (value = malloc(opt->noptval)) == NULL) {
+            /* can't decode; the encoded form is still a fingerprint */
+            value = (char *)opt->optval;
+            nvalue = opt->noptval;
+        } else {
+            nvalue = lcbex_vopt_decode(opt, value);
+        }
+
+        h = lcbex_hash64(opt->optname, opt->noptname, 0);
+        sum += lcbex_hash64(value, nvalue, h + nvalue);
+        if (value != sbuf && value != opt->optval) {
+            free(value);
+        }
+    }
+    return ret + sum;
+}
+
+LCBEX_API
+lcb_error_t lcbex_ctoken_from_row(lcbex_ctoken_t *token,
+                                  const lcbex_vrow_t *row, int flags)
+{
+    lcb_error_t err;
+
+    lcbex_ctoken_cleanup(token);
+    token->startkey = row->key;
+    token->nstartkey = row->nkey;
+    token->flags = flags;
+    if (!row->id) {
+        return LCB_SUCCESS;
+    }
+
+    if ((token->buf = malloc(row->nid)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    err = lcbex_vrow_get_id(row, token->buf, &token->startkey_docid,
+                            &token->nstartkey_docid);
+    if (err != LCB_SUCCESS) {
+        token->startkey_docid = NULL;
+        token->nstartkey_docid = 0;
+    }
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_ctoken_encode(const lcbex_ctoken_t *token,
+                                const unsigned char *key,
+                                lcb_uint64_t fingerprint,
+                                char **out, size_t *nout)
+{
+    unsigned char *buf, *p;
+    size_t n, ntoken;
+    lcb_uint64_t mac;
+    int has_docid = token->startkey_docid != NULL;
+
+    if (!token->startkey || !token->nstartkey) {
+        return LCB_EINVAL;
+    }
+
+    n = 8 + 2 + MAX_VARINT + token->nstartkey + MAC_SIZE;
+    if (has_docid) {
+        n += MAX_VARINT + token->nstartkey_docid;
+    }
+    if ((buf = malloc(n)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    p = buf + 8;
+    *p++ = TOKEN_VERSION;
+    *p++ = (unsigned char)((token->flags & LCBEX_CTOKEN_F_DESCENDING) |
+                           (has_docid ? FLAG_HAS_DOCID : 0));
+    p += put_varint(p, token->nstartkey);
+    memcpy(p, token->startkey, token->nstartkey);
+    p += token->nstartkey;
+    if (has_docid) {
+        p += put_varint(p, token->nstartkey_docid);
+        memcpy(p, token->startkey_docid, token->nstartkey_docid);
+        p += token->nstartkey_docid;
+    }
+
+    n = p - buf - 8;
+    mac = compute_mac(key, fingerprint, buf, n);
+    for (ntoken = 0; ntoken < MAC_SIZE; ntoken++) {
+        *p++ = (unsigned char)(mac >> (ntoken * 8));
+    }
+    n += MAC_SIZE;
+
+    if ((*out = malloc((n * 4 + 2) / 3 + 1)) == NULL) {
+        free(buf);
+        return LCB_CLIENT_ENOMEM;
+    }
+    ntoken = b64_encode(buf + 8, n, *out);
+    if (nout) {
+        *nout = ntoken;
+    }
+    free(buf);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_ctoken_decode(lcbex_ctoken_t *token,
+                                const char *str, size_t nstr,
+                                const unsigned char *key,
+                                lcb_uint64_t fingerprint)
+{
+    const unsigned char *p, *end;
+    unsigned char *buf;
+    lcb_uint64_t mac = 0;
+    size_t n, ii;
+    int flags;
+
+    memset(token, 0, sizeof(*token));
+    if (nstr == SIZE_MAX) {
+        nstr = strlen(str);
+    }
+
+    /* room for the fingerprint ahead of the contents */
+    if ((buf = malloc(8 + nstr * 3 / 4 + 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    token->buf = (char *)buf;
+
+    n = b64_decode(str, nstr, buf + 8);
+    if (n == SIZE_MAX || n < 2 + MAC_SIZE) {
+        return LCB_EINVAL;
+    }
+    n -= MAC_SIZE;
+    for (ii = MAC_SIZE; ii--;) {
+        mac = (mac << 8) | buf[8 + n + ii];
+    }
+    if (mac != compute_mac(key, fingerprint, buf, n)) {
+        return LCB_EINVAL;
+    }
+
+    p = buf + 8;
+    end = p + n;
+    if (*p++ != TOKEN_VERSION) {
+        return LCB_EINVAL;
+    }
+    flags = *p++;
+
+    if (!get_varint(&p, end, &token->nstartkey) || !token->nstartkey) {
+        return LCB_EINVAL;
+    }
+    token->startkey = (const char *)p;
+    p += token->nstartkey;
+
+    if (flags & FLAG_HAS_DOCID) {
+        if (!get_varint(&p, end, &token->nstartkey_docid)) {
+            return LCB_EINVAL;
+        }
+        token->startkey_docid = (const char *)p;
+        p += token->nstartkey_docid;
+    }
+    if (p != end) {
+        return LCB_EINVAL;
+    }
+
+    token->flags = flags & LCBEX_CTOKEN_F_DESCENDING;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+char *lcbex_ctoken_make_uri(const lcbex_ctoken_t *token,
+                            const char *design, size_t ndesign,
+                            const char *view, size_t nview,
+                            const lcbex_vopt_t *const *options,
+                            size_t noptions)
+{
+    lcbex_vopt_t overrides[3];
+    const lcbex_vopt_t *override_list[3];
+    size_t noverrides = 0, ii;
+    int optid = LCBEX_VOPT_OPT_DESCENDING;
+    int descending = (token->flags & LCBEX_CTOKEN_F_DESCENDING) != 0;
+    char *errstr;
+    char *ret = NULL;
+
+    memset(overrides, 0, sizeof(overrides));
+
+    if (lcbex_vopt_assign(&overrides[noverrides++], "startkey", -1,
+                          token->startkey, token->nstartkey,
+                          LCBEX_VOPT_F_PCTENCODE, &errstr) != LCB_SUCCESS) {
+        goto GT_DONE;
+    }
+    if (token->startkey_docid &&
+            lcbex_vopt_assign(&overrides[noverrides++], "startkey_docid", -1,
+                              token->startkey_docid, token->nstartkey_docid,
+                              LCBEX_VOPT_F_PCTENCODE,
+                              &errstr) != LCB_SUCCESS) {
+        goto GT_DONE;
+    }
+    /* the token's direction wins over the options' */
+    if ((descending || lcbex_vopt_find(options, noptions, "descending")) &&
+            lcbex_vopt_assign(&overrides[noverrides++], &optid, 0,
+                              descending ? "true" : "false", -1,
+                              LCBEX_VOPT_F_OPTNAME_NUMERIC,
+                              &errstr) != LCB_SUCCESS) {
+        goto GT_DONE;
+    }
+
+    for (ii = 0; ii < noverrides; ii++) {
+        override_list[ii] = &overrides[ii];
+    }
+    ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                        options, noptions,
+                                        override_list, noverrides);
+
+GT_DONE:
+    for (ii = 0; ii < noverrides; ii++) {
+        lcbex_vopt_cleanup(&overrides[ii]);
+    }
+    return ret;
+}
+
+LCBEX_API
+void lcbex_ctoken_cleanup(lcbex_ctoken_t *token)
+{
+    free(token->buf);
+    memset(token, 0, sizeof(*token));
+}
@@ -0,0 +1,439 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/export.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* stdio buffer of each part's file */
+#define EXPORT_BUFSIZE (1 << 20)
+
+struct lcbex_export_part_st {
+    lcbex_export_t *exp;
+    size_t index;
+    char *path;
+    FILE *fp;
+    lcbex_vrow_parser_t *parser;
+    lcb_uint64_t rows;
+    char *first_key;
+    size_t nfirst_key;
+    char *last_key;
+    size_t nlast_key;
+    size_t alast_key;
+    lcb_error_t err;
+    int done;
+};
+
+struct lcbex_export_st {
+    lcbex_plan_t plan;
+    char *dir;
+    char *design;
+    char *view;
+    const lcbex_vopt_t *const *options;
+    size_t noptions;
+    lcbex_export_part_t *parts;
+    size_t nparts;
+};
+
+static char *my_strndup(const char *s, size_t n)
+{
+    char *ret = malloc(n + 1);
+    if (ret) {
+        memcpy(ret, s, n);
+        ret[n] = '\0';
+    }
+    return ret;
+}
+
+static int set_key(char **buf, size_t *nbuf, size_t *alloc,
+                   const char *key, size_t nkey)
+{
+    if (nkey > *alloc) {
+        char *tmp = realloc(*buf, nkey);
+        if (!tmp) {
+            return 0;
+        }
+        *buf = tmp;
+        *alloc = nkey;
+    }
+    if (nkey) {
+        memcpy(*buf, key, nkey);
+    }
+    *nbuf = nkey;
+    return 1;
+}
+
+static void row_callback(lcbex_vrow_parser_t *parser,
+                         const lcbex_vrow_t *row,
+                         void *cookie)
+{
+    lcbex_export_part_t *part = cookie;
+    FILE *fp = part->fp;
+
+    if (part->err != LCB_SUCCESS) {
+        return;
+    }
+
+    fputc('{', fp);
+    if (row->id) {
+        fputs("\"id\":", fp);
+        fwrite(row->id, 1, row->nid, fp);
+        fputc(',', fp);
+    }
+    fputs("\"key\":", fp);
+    if (row->key) {
+        fwrite(row->key, 1, row->nkey, fp);
+    } else {
+        fputs("null", fp);
+    }
+    fputs(",\"value\":", fp);
+    if (row->value) {
+        fwrite(row->value, 1, row->nvalue, fp);
+    } else {
+        fputs("null", fp);
+    }
+    fputs("}\n", fp);
+
+    if (part->rows++ == 0) {
+        part->first_key = my_strndup(row->key ? row->key : "null",
+                                     row->key ? row->nkey : 4);
+        if (!part->first_key) {
+            part->err = LCB_CLIENT_ENOMEM;
+            return;
+        }
+        part->nfirst_key = row->key ? row->nkey : 4;
+    }
+    if (!set_key(&part->last_key, &part->nlast_key, &part->alast_key,
+                 row->key ? row->key : "null", row->key ? row->nkey : 4)) {
+        part->err = LCB_CLIENT_ENOMEM;
+    }
+    (void)parser;
+}
+
+LCBEX_API
+lcb_error_t lcbex_export_create(lcbex_export_t **exp,
+                                const char *dir,
+                                const lcbex_plan_t *plan,
+                                const char *design, size_t ndesign,
+                                const char *view, size_t nview,
+                                const lcbex_vopt_t *const *options,
+                                size_t noptions)
+{
+    lcbex_export_t *ret;
+    size_t ii, ndir = strlen(dir);
+
+    if (plan->strategy != LCBEX_PLAN_SINGLE &&
+            plan->strategy != LCBEX_PLAN_RANGE_PARTITIONED) {
+        return LCB_EINVAL;
+    }
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->plan = *plan;
+    ret->options = options;
+    ret->noptions = noptions;
+    ret->nparts = plan->strategy == LCBEX_PLAN_SINGLE ? 1 : plan->nparts;
+    ret->dir = my_strndup(dir, ndir);
+    ret->design = my_strndup(design, ndesign);
+    ret->view = my_strndup(view, nview);
+    ret->parts = calloc(ret->nparts, sizeof(*ret->parts));
+    if (!ret->dir || !ret->design || !ret->view || !ret->parts) {
+        lcbex_export_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    for (ii = 0; ii < ret->nparts; ii++) {
+        lcbex_export_part_t *part = ret->parts + ii;
+        part->exp = ret;
+        part->index = ii;
+        /* <dir>/part-NNNNN */
+        if ((part->path = malloc(ndir + 32)) == NULL ||
+                lcbex_vrow_parser_create(&part->parser, row_callback,
+                                         part) != LCB_SUCCESS) {
+            lcbex_export_destroy(ret);
+            return LCB_CLIENT_ENOMEM;
+        }
+        sprintf(part->path, "%s/part-%05lu", ret->dir, (unsigned long)ii);
+    }
+    *exp = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+size_t lcbex_export_nparts(const lcbex_export_t *exp)
+{
+    return exp->nparts;
+}
+
+LCBEX_API
+lcbex_export_part_t *lcbex_export_get_part(lcbex_export_t *exp,
+                                           size_t index)
+{
+    return index < exp->nparts ? exp->parts + index : NULL;
+}
+
+LCBEX_API
+char *lcbex_export_part_make_uri(const lcbex_export_part_t *part)
+{
+    const lcbex_export_t *exp = part->exp;
+    return lcbex_plan_make_part_uri(&exp->plan, part->index,
+                                    exp->design, -1, exp->view, -1,
+                                    exp->options, exp->noptions);
+}
+
+static lcb_error_t open_part(lcbex_export_part_t *part)
+{
+    if ((part->fp = fopen(part->path, "wb")) == NULL) {
+        return LCB_ERROR;
+    }
+    setvbuf(part->fp, NULL, _IOFBF, EXPORT_BUFSIZE);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_export_part_feed(lcbex_export_part_t *part,
+                                   const void *data, size_t ndata)
+{
+    lcb_error_t err;
+
+    if (part->err != LCB_SUCCESS) {
+        return part->err;
+    }
+    if (part->done) {
+        return LCB_EINVAL;
+    }
+    if (!part->fp && (part->err = open_part(part)) != LCB_SUCCESS) {
+        return part->err;
+    }
+    if ((err = lcbex_vrow_parser_feed(part->parser, data, ndata)) !=
+            LCB_SUCCESS && part->err == LCB_SUCCESS) {
+        part->err = err;
+    }
+    if (part->err == LCB_SUCCESS && ferror(part->fp)) {
+        part->err = LCB_ERROR;
+    }
+    return part->err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_export_part_done(lcbex_export_part_t *part,
+                                   lcb_error_t status)
+{
+    if (part->err == LCB_SUCCESS) {
+        part->err = status;
+    }
+    /* an empty result still gets its (empty) file */
+    if (part->err == LCB_SUCCESS && !part->fp) {
+        part->err = open_part(part);
+    }
+    if (part->fp) {
+        if (fclose(part->fp) != 0 && part->err == LCB_SUCCESS) {
+            part->err = LCB_ERROR;
+        }
+        part->fp = NULL;
+    }
+    part->done = 1;
+    return part->err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_export_part_reset(lcbex_export_part_t *part)
+{
+    if (part->fp) {
+        fclose(part->fp);
+        part->fp = NULL;
+    }
+    lcbex_vrow_parser_reset(part->parser);
+    free(part->first_key);
+    part->first_key = NULL;
+    part->nfirst_key = 0;
+    part->nlast_key = 0;
+    part->rows = 0;
+    part->err = LCB_SUCCESS;
+    part->done = 0;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_export_part_rows(const lcbex_export_part_t *part)
+{
+    return part->rows;
+}
+
+static void write_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void write_bound(FILE *fp, const char *name, int have, double v)
+{
+    char buf[LCBEX_VOPT_DOUBLE_BUFSIZE];
+
+    fprintf(fp, ",\"%s\":", name);
+    if (have && lcbex_vopt_format_double(v, buf)) {
+        fputs(buf, fp);
+    } else {
+        fputs("null", fp);
+    }
+}
+
+static void write_part(FILE *fp, const lcbex_export_t *exp,
+                       const lcbex_export_part_t *part)
+{
+    const lcbex_vopt_t *incl;
+    const char *fname = strrchr(part->path, '/') + 1;
+    double start = 0, end = 0;
+    int have, inclusive_end;
+
+    have = lcbex_plan_get_part_range(&exp->plan, part->index,
+                                     &start, &end) == LCB_SUCCESS;
+
+    /* only the last partition keeps the query's inclusive_end */
+    incl = lcbex_vopt_find(exp->options, exp->noptions, "inclusive_end");
+    inclusive_end = !(incl && incl->noptval == 5 &&
+                      memcmp(incl->optval, "false", 5) == 0);
+    if (part->index + 1 < exp->nparts) {
+        inclusive_end = 0;
+    }
+
+    fputs("{\"file\":", fp);
+    write_json_string(fp, fname);
+    write_bound(fp, "start_key", have, start);
+    write_bound(fp, "end_key", have, end);
+    fprintf(fp, ",\"inclusive_end\":%s,\"rows\":%llu,\"first_key\":",
+            inclusive_end ? "true" : "false",
+            (unsigned long long)part->rows);
+    if (part->rows) {
+        fwrite(part->first_key, 1, part->nfirst_key, fp);
+        fputs(",\"last_key\":", fp);
+        fwrite(part->last_key, 1, part->nlast_key, fp);
+    } else {
+        fputs("null,\"last_key\":null", fp);
+    }
+    fputc('}', fp);
+}
+
+LCBEX_API
+lcb_error_t lcbex_export_write_manifest(lcbex_export_t *exp)
+{
+    char *path, *tmppath;
+    size_t ii, ndir = strlen(exp->dir);
+    FILE *fp;
+    lcb_error_t err = LCB_SUCCESS;
+
+    for (ii = 0; ii < exp->nparts; ii++) {
+        if (!exp->parts[ii].done) {
+            return LCB_EINVAL;
+        }
+        if (exp->parts[ii].err != LCB_SUCCESS) {
+            return exp->parts[ii].err;
+        }
+    }
+
+    path = malloc(ndir + sizeof("/manifest.json"));
+    tmppath = malloc(ndir + sizeof("/manifest.json.tmp"));
+    if (!path || !tmppath) {
+        free(path);
+        free(tmppath);
+        return LCB_CLIENT_ENOMEM;
+    }
+    sprintf(path, "%s/manifest.json", exp->dir);
+    sprintf(tmppath, "%s/manifest.json.tmp", exp->dir);
+
+    /* write it under a temporary name, so that a manifest is never seen
+     * half written */
+    if ((fp = fopen(tmppath, "wb")) == NULL) {
+        err = LCB_ERROR;
+        goto GT_DONE;
+    }
+    fputs("{\"design\":", fp);
+    write_json_string(fp, exp->design);
+    fputs(",\"view\":", fp);
+    write_json_string(fp, exp->view);
+    fputs(",\"parts\":[", fp);
+    for (ii = 0; ii < exp->nparts; ii++) {
+        fputs(ii ? ",\n" : "\n", fp);
+        write_part(fp, exp, exp->parts + ii);
+    }
+    fputs("]}\n", fp);
+
+    if (ferror(fp)) {
+        err = LCB_ERROR;
+    }
+    if (fclose(fp) != 0) {
+        err = LCB_ERROR;
+    }
+    if (err == LCB_SUCCESS) {
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (rename(tmppath, path) != 0) {
+            err = LCB_ERROR;
+        }
+    }
+    if (err != LCB_SUCCESS) {
+        remove(tmppath);
+    }
+
+GT_DONE:
+    free(path);
+    free(tmppath);
+    return err;
+}
+
+LCBEX_API
+void lcbex_export_destroy(lcbex_export_t *exp)
+{
+    size_t ii;
+
+    for (ii = 0; exp->parts && ii < exp->nparts; ii++) {
+        lcbex_export_part_t *part = exp->parts + ii;
+        if (part->fp) {
+            fclose(part->fp);
+        }
+        if (part->parser) {
+            lcbex_vrow_parser_destroy(part->parser);
+        }
+        free(part->path);
+        free(part->first_key);
+        free(part->last_key);
+    }
+    free(exp->parts);
+    free(exp->dir);
+    free(exp->design);
+    free(exp->view);
+    free(exp);
+}
@@ -0,0 +1,734 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/extsort.h>
+#include <lcbex/jsoncur.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threads.h"
+
+#define DEFAULT_FANIN 64
+/* stdio buffer of each run being written or read */
+#define RUN_BUFSIZE (64 * 1024)
+
+/* record flags */
+#define REC_HAS_FIELD 0x01
+
+typedef struct {
+    lcbex_vrow_t row;
+    /* the sort field; valid if flags & REC_HAS_FIELD */
+    double num;
+    size_t field_off;
+    size_t nfield;
+    int flags;
+    /* order of arrival, for stability within a run */
+    lcb_uint64_t seq;
+} sort_rec;
+
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t nalloc;
+    sort_rec rec;
+} run_cursor;
+
+struct lcbex_extsort_st {
+    lcbex_extsort_config_t config;
+    lcbex_json_index_t *index;
+
+    /* rows held in memory, each a single allocation */
+    sort_rec **recs;
+    size_t nrecs;
+    size_t nrecs_alloc;
+    size_t memory;
+    lcb_uint64_t seq;
+
+    /* written runs, in the order they were written */
+    FILE **runs;
+    size_t nruns;
+    size_t nruns_alloc;
+
+    int finished;
+    /* reading from memory: the next row */
+    size_t pos;
+    /* reading from runs: a heap of cursors with rows left */
+    run_cursor *cursors;
+    size_t *heap;
+    size_t nheap;
+    /* the cursor whose row was returned last, to be advanced */
+    size_t last;
+
+    lcbex_extsort_stats_t stats;
+};
+
+#define NO_CURSOR ((size_t)-1)
+
+static char *copy_str(const char *s)
+{
+    char *ret;
+    if (!s) {
+        return NULL;
+    }
+    if ((ret = malloc(strlen(s) + 1)) != NULL) {
+        strcpy(ret, s);
+    }
+    return ret;
+}
+
+static int put_varint(FILE *fp, size_t val)
+{
+    while (val >= 0x80) {
+        if (putc((int)(val & 0x7f) | 0x80, fp) == EOF) {
+            return -1;
+        }
+        val >>= 7;
+    }
+    return putc((int)val, fp) == EOF ? -1 : 0;
+}
+
+/**
+ * @return 1 on success, 0 at the end of the file, -1 on errors
+ */
+static int get_varint(FILE *fp, size_t *val)
+{
+    unsigned int shift = 0;
+    int c;
+
+    *val = 0;
+    while ((c = getc(fp)) != EOF) {
+        *val |= (size_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return 1;
+        }
+        if ((shift += 7) >= sizeof(size_t) * 8) {
+            return -1;
+        }
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/**
+ * Orders two records by their sort fields only
+ */
+static int compare_recs(const lcbex_extsort_t *sorter,
+                        const sort_rec *a, const sort_rec *b)
+{
+    int ret;
+
+    if ((a->flags & REC_HAS_FIELD) == 0 || (b->flags & REC_HAS_FIELD) == 0) {
+        /* rows without the field come last, whatever the direction */
+        return (b->flags & REC_HAS_FIELD) - (a->flags & REC_HAS_FIELD);
+    }
+
+    if (sorter->config.compare == LCBEX_EXTSORT_NUMERIC) {
+        ret = a->num < b->num ? -1 : a->num > b->num;
+    } else {
+        ret = lcbex_vrow_collate(a->row.value + a->field_off, a->nfield,
+                                 b->row.value + b->field_off, b->nfield);
+    }
+    return sorter->config.descending ? -ret : ret;
+}
+
+/* qsort has no context argument */
+static LCBEX_TLS const lcbex_extsort_t *qsort_sorter;
+
+static int qsort_compare(const void *a, const void *b)
+{
+    const sort_rec *x = *(const sort_rec *const *)a;
+    const sort_rec *y = *(const sort_rec *const *)b;
+    int ret = compare_recs(qsort_sorter, x, y);
+
+    if (ret == 0) {
+        ret = x->seq < y->seq ? -1 : x->seq > y->seq;
+    }
+    return ret;
+}
+
+static void sort_memory(lcbex_extsort_t *sorter)
+{
+    qsort_sorter = sorter;
+    qsort(sorter->recs, sorter->nrecs, sizeof(*sorter->recs), qsort_compare);
+    qsort_sorter = NULL;
+}
+
+static void clear_memory(lcbex_extsort_t *sorter)
+{
+    size_t ii;
+    for (ii = 0; ii < sorter->nrecs; ii++) {
+        free(sorter->recs[ii]);
+    }
+    sorter->nrecs = 0;
+    sorter->memory = 0;
+}
+
+static lcb_error_t write_rec(lcbex_extsort_t *sorter, FILE *fp,
+                             const sort_rec *rec)
+{
+    const lcbex_vrow_t *row = &rec->row;
+    const char *fields[4];
+    size_t lens[4], ii;
+    long start = ftell(fp);
+
+    fields[0] = row->key;
+    lens[0] = row->nkey;
+    fields[1] = row->id;
+    lens[1] = row->nid;
+    fields[2] = row->value;
+    lens[2] = row->nvalue;
+    fields[3] = row->doc;
+    lens[3] = row->ndoc;
+
+    if (putc(rec->flags, fp) == EOF) {
+        return LCB_ERROR;
+    }
+    for (ii = 0; ii < 4; ii++) {
+        if (put_varint(fp, fields[ii] ? lens[ii] + 1 : 0) != 0) {
+            return LCB_ERROR;
+        }
+    }
+    if (rec->flags & REC_HAS_FIELD) {
+        if (sorter->config.compare == LCBEX_EXTSORT_NUMERIC) {
+            if (fwrite(&rec->num, sizeof(rec->num), 1, fp) != 1) {
+                return LCB_ERROR;
+            }
+        } else if (put_varint(fp, rec->field_off) != 0 ||
+                   put_varint(fp, rec->nfield) != 0) {
+            return LCB_ERROR;
+        }
+    }
+    for (ii = 0; ii < 4; ii++) {
+        if (fields[ii] && lens[ii] &&
+                fwrite(fields[ii], 1, lens[ii], fp) != lens[ii]) {
+            return LCB_ERROR;
+        }
+    }
+    if (start >= 0) {
+        sorter->stats.spilled_bytes += ftell(fp) - start;
+    }
+    return LCB_SUCCESS;
+}
+
+/**
+ * Reads the cursor's next record
+ * @return 1 if a record was read, 0 at the end of the run, -1 on errors
+ */
+static int read_rec(lcbex_extsort_t *sorter, run_cursor *cur)
+{
+    sort_rec *rec = &cur->rec;
+    size_t lens[4], total = 0, ii;
+    const char **fields[4];
+    size_t *nfields[4];
+    char *p;
+    int c, rv;
+
+    if ((c = getc(cur->fp)) == EOF) {
+        return ferror(cur->fp) ? -1 : 0;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->flags = c;
+    for (ii = 0; ii < 4; ii++) {
+        if ((rv = get_varint(cur->fp, &lens[ii])) != 1) {
+            return -1;
+        }
+        total += lens[ii] ? lens[ii] - 1 : 0;
+    }
+    if (rec->flags & REC_HAS_FIELD) {
+        if (sorter->config.compare == LCBEX_EXTSORT_NUMERIC) {
+            if (fread(&rec->num, sizeof(rec->num), 1, cur->fp) != 1) {
+                return -1;
+            }
+        } else if (get_varint(cur->fp, &rec->field_off) != 1 ||
+                   get_varint(cur->fp, &rec->nfield) != 1) {
+            return -1;
+        }
+    }
+
+    if (total > cur->nalloc || !cur->buf) {
+        char *tmp = realloc(cur->buf, total ? total : 1);
+        if (!tmp) {
+            return -1;
+        }
+        cur->buf = tmp;
+        cur->nalloc = total;
+    }
+    if (total && fread(cur->buf, 1, total, cur->fp) != total) {
+        return -1;
+    }
+
+    fields[0] = &rec->row.key;
+    nfields[0] = &rec->row.nkey;
+    fields[1] = &rec->row.id;
+    nfields[1] = &rec->row.nid;
+    fields[2] = &rec->row.value;
+    nfields[2] = &rec->row.nvalue;
+    fields[3] = &rec->row.doc;
+    nfields[3] = &rec->row.ndoc;
+    for (ii = 0, p = cur->buf; ii < 4; ii++) {
+        if (lens[ii]) {
+            *fields[ii] = p;
+            *nfields[ii] = lens[ii] - 1;
+            p += lens[ii] - 1;
+        }
+    }
+    return 1;
+}
+
+static lcb_error_t new_run(lcbex_extsort_t *sorter, FILE **fp)
+{
+    if (sorter->nruns == sorter->nruns_alloc) {
+        size_t nalloc = sorter->nruns_alloc ? sorter->nruns_alloc * 2 : 16;
+        FILE **tmp = realloc(sorter->runs, nalloc * sizeof(*tmp));
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        sorter->runs = tmp;
+        sorter->nruns_alloc = nalloc;
+    }
+    if ((*fp = tmpfile()) == NULL) {
+        return LCB_ERROR;
+    }
+    setvbuf(*fp, NULL, _IOFBF, RUN_BUFSIZE);
+    sorter->runs[sorter->nruns++] = *fp;
+    sorter->stats.runs++;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Sorts the rows held in memory and writes them out as a run
+ */
+static lcb_error_t spill_memory(lcbex_extsort_t *sorter)
+{
+    lcb_error_t err;
+    FILE *fp;
+    size_t ii;
+
+    sort_memory(sorter);
+    if ((err = new_run(sorter, &fp)) != LCB_SUCCESS) {
+        return err;
+    }
+    for (ii = 0; ii < sorter->nrecs && err == LCB_SUCCESS; ii++) {
+        err = write_rec(sorter, fp, sorter->recs[ii]);
+    }
+    if (err == LCB_SUCCESS && fflush(fp) != 0) {
+        err = LCB_ERROR;
+    }
+    clear_memory(sorter);
+    return err;
+}
+
+static lcb_error_t add_row(lcbex_extsort_t *sorter, const lcbex_vrow_t *row)
+{
+    size_t needed = row->nkey + row->nid + row->nvalue + row->ndoc;
+    size_t memory = sizeof(sort_rec) + needed + sizeof(sort_rec *);
+    lcbex_jsoncur_t root, cur, *field = NULL;
+    sort_rec *rec;
+    char *p;
+
+    if (sorter->config.memory_limit && sorter->nrecs &&
+            sorter->memory + memory > sorter->config.memory_limit) {
+        lcb_error_t err = spill_memory(sorter);
+        if (err != LCB_SUCCESS) {
+            return err;
+        }
+    }
+
+    if (sorter->nrecs == sorter->nrecs_alloc) {
+        size_t nalloc = sorter->nrecs_alloc ? sorter->nrecs_alloc * 2 : 256;
+        sort_rec **tmp = realloc(sorter->recs, nalloc * sizeof(*tmp));
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        sorter->recs = tmp;
+        sorter->nrecs_alloc = nalloc;
+    }
+    if ((rec = malloc(sizeof(*rec) + needed)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+    p = (char *)(rec + 1);
+#define COPY_FIELD(f, nf) \
+    if (row->f) { \
+        memcpy(p, row->f, row->nf); \
+        rec->row.f = p; \
+        rec->row.nf = row->nf; \
+        p += row->nf; \
+    }
+    COPY_FIELD(key, nkey)
+    COPY_FIELD(id, nid)
+    COPY_FIELD(value, nvalue)
+    COPY_FIELD(doc, ndoc)
+#undef COPY_FIELD
+
+    if (rec->row.value &&
+            lcbex_json_index_build(sorter->index, rec->row.value,
+                                   rec->row.nvalue) == LCB_SUCCESS &&
+            lcbex_jsoncur_root(sorter->index, &root) == LCB_SUCCESS) {
+        if (!sorter->config.path) {
+            field = &root;
+        } else if (lcbex_jsoncur_path(&root, sorter->config.path,
+                                      &cur) == LCB_SUCCESS) {
+            field = &cur;
+        }
+    }
+    if (field) {
+        if (sorter->config.compare == LCBEX_EXTSORT_NUMERIC) {
+            if (lcbex_jsoncur_double(field, &rec->num) == LCB_SUCCESS) {
+                rec->flags |= REC_HAS_FIELD;
+            }
+        } else {
+            const char *raw;
+            lcbex_jsoncur_raw(field, &raw, &rec->nfield);
+            rec->field_off = raw - rec->row.value;
+            rec->flags |= REC_HAS_FIELD;
+        }
+    }
+    if ((rec->flags & REC_HAS_FIELD) == 0) {
+        sorter->stats.unsorted++;
+    }
+
+    rec->seq = sorter->seq++;
+    sorter->recs[sorter->nrecs++] = rec;
+    sorter->memory += memory;
+    sorter->stats.rows++;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_extsort_config_init(lcbex_extsort_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->compare = LCBEX_EXTSORT_NUMERIC;
+    config->max_fanin = DEFAULT_FANIN;
+}
+
+LCBEX_API
+lcb_error_t lcbex_extsort_create(lcbex_extsort_t **sorter,
+                                 const lcbex_extsort_config_t *config)
+{
+    lcbex_extsort_t *ret;
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->config = *config;
+    ret->config.path = NULL;
+    if (ret->config.max_fanin == 0) {
+        ret->config.max_fanin = DEFAULT_FANIN;
+    } else if (ret->config.max_fanin < 2) {
+        ret->config.max_fanin = 2;
+    }
+    ret->last = NO_CURSOR;
+
+    if ((config->path && *config->path &&
+            (ret->config.path = copy_str(config->path)) == NULL) ||
+            lcbex_json_index_create(&ret->index) != LCB_SUCCESS) {
+        lcbex_extsort_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    *sorter = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_extsort_add_rows(lcbex_extsort_t *sorter,
+                                   const lcbex_vrow_t *rows,
+                                   size_t nrows)
+{
+    lcb_error_t err = LCB_SUCCESS;
+    size_t ii;
+
+    if (sorter->finished) {
+        return LCB_EINVAL;
+    }
+    for (ii = 0; ii < nrows && err == LCB_SUCCESS; ii++) {
+        err = add_row(sorter, rows + ii);
+    }
+    return err;
+}
+
+/**
+ * Returns whether cursor 'a' should be read before cursor 'b'. Runs
+ * written earlier hold earlier rows, so ties go to the lower index.
+ */
+static int cursor_before(const lcbex_extsort_t *sorter, size_t a, size_t b)
+{
+    int ret = compare_recs(sorter, &sorter->cursors[a].rec,
+                           &sorter->cursors[b].rec);
+    return ret < 0 || (ret == 0 && a < b);
+}
+
+static void heap_sift_down(lcbex_extsort_t *sorter, size_t ii)
+{
+    size_t *heap = sorter->heap;
+
+    for (;;) {
+        size_t first = ii, child = ii * 2 + 1, tmp;
+
+        if (child < sorter->nheap &&
+                cursor_before(sorter, heap[child], heap[first])) {
+            first = child;
+        }
+        if (child + 1 < sorter->nheap &&
+                cursor_before(sorter, heap[child + 1], heap[first])) {
+            first = child + 1;
+        }
+        if (first == ii) {
+            return;
+        }
+        tmp = heap[ii];
+        heap[ii] = heap[first];
+        heap[first] = tmp;
+        ii = first;
+    }
+}
+
+static void close_cursors(lcbex_extsort_t *sorter, size_t ncursors)
+{
+    size_t ii;
+
+    if (!sorter->cursors) {
+        return;
+    }
+    for (ii = 0; ii < ncursors; ii++) {
+        free(sorter->cursors[ii].buf);
+    }
+    free(sorter->cursors);
+    free(sorter->heap);
+    sorter->cursors = NULL;
+    sorter->heap = NULL;
+    sorter->nheap = 0;
+    sorter->last = NO_CURSOR;
+}
+
+/**
+ * Starts merging 'n' runs
+ */
+static lcb_error_t open_cursors(lcbex_extsort_t *sorter,
+                                FILE **runs, size_t n)
+{
+    size_t ii;
+
+    sorter->cursors = calloc(n, sizeof(*sorter->cursors));
+    sorter->heap = malloc(n * sizeof(*sorter->heap));
+    if (!sorter->cursors || !sorter->heap) {
+        close_cursors(sorter, n);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    sorter->nheap = 0;
+    for (ii = 0; ii < n; ii++) {
+        run_cursor *cur = sorter->cursors + ii;
+        int rv;
+
+        cur->fp = runs[ii];
+        rewind(cur->fp);
+        if ((rv = read_rec(sorter, cur)) < 0) {
+            close_cursors(sorter, n);
+            return LCB_ERROR;
+        }
+        if (rv) {
+            sorter->heap[sorter->nheap++] = ii;
+        }
+    }
+    for (ii = sorter->nheap / 2; ii > 0; ii--) {
+        heap_sift_down(sorter, ii - 1);
+    }
+    return LCB_SUCCESS;
+}
+
+/**
+ * Returns the next record of the merge, advancing the cursor of the
+ * previous one
+ * @return 1 if a record was returned, 0 at the end, -1 on errors
+ */
+static int merge_next(lcbex_extsort_t *sorter, const sort_rec **rec)
+{
+    if (sorter->last != NO_CURSOR) {
+        int rv = read_rec(sorter, sorter->cursors + sorter->last);
+        if (rv < 0) {
+            return -1;
+        }
+        if (rv == 0) {
+            sorter->heap[0] = sorter->heap[--sorter->nheap];
+        }
+        sorter->last = NO_CURSOR;
+        heap_sift_down(sorter, 0);
+    }
+    if (!sorter->nheap) {
+        return 0;
+    }
+    sorter->last = sorter->heap[0];
+    *rec = &sorter->cursors[sorter->last].rec;
+    return 1;
+}
+
+/**
+ * Merges runs in groups of max_fanin, in order, until no more than
+ * max_fanin are left
+ */
+static lcb_error_t merge_pass(lcbex_extsort_t *sorter)
+{
+    size_t nold = sorter->nruns, ii, jj;
+    FILE **old = sorter->runs;
+    lcb_error_t err = LCB_SUCCESS;
+
+    sorter->runs = NULL;
+    sorter->nruns = sorter->nruns_alloc = 0;
+
+    for (ii = 0; ii < nold && err == LCB_SUCCESS;
+            ii += sorter->config.max_fanin) {
+        size_t n = nold - ii;
+        const sort_rec *rec;
+        FILE *out;
+        int rv = 0;
+
+        if (n > sorter->config.max_fanin) {
+            n = sorter->config.max_fanin;
+        }
+        if ((err = new_run(sorter, &out)) != LCB_SUCCESS) {
+            break;
+        }
+
+        if ((err = open_cursors(sorter, old + ii, n)) != LCB_SUCCESS) {
+            break;
+        }
+        while ((rv = merge_next(sorter, &rec)) > 0) {
+            if ((err = write_rec(sorter, out, rec)) != LCB_SUCCESS) {
+                break;
+            }
+        }
+        if (rv < 0) {
+            err = LCB_ERROR;
+        }
+        if (err == LCB_SUCCESS && fflush(out) != 0) {
+            err = LCB_ERROR;
+        }
+        close_cursors(sorter, n);
+    }
+
+    for (jj = 0; jj < nold; jj++) {
+        fclose(old[jj]);
+    }
+    free(old);
+    sorter->stats.merge_passes++;
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_extsort_finish(lcbex_extsort_t *sorter)
+{
+    lcb_error_t err = LCB_SUCCESS;
+
+    if (sorter->finished) {
+        return LCB_EINVAL;
+    }
+    sorter->finished = 1;
+    sorter->pos = 0;
+
+    if (!sorter->nruns) {
+        sort_memory(sorter);
+        return LCB_SUCCESS;
+    }
+
+    if (sorter->nrecs) {
+        err = spill_memory(sorter);
+    }
+    while (err == LCB_SUCCESS && sorter->nruns > sorter->config.max_fanin) {
+        err = merge_pass(sorter);
+    }
+    if (err == LCB_SUCCESS) {
+        err = open_cursors(sorter, sorter->runs, sorter->nruns);
+    }
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_extsort_next(lcbex_extsort_t *sorter,
+                               const lcbex_vrow_t **row)
+{
+    const sort_rec *rec;
+    int rv;
+
+    *row = NULL;
+    if (!sorter->finished) {
+        return LCB_EINVAL;
+    }
+    if (!sorter->nruns) {
+        if (sorter->pos < sorter->nrecs) {
+            *row = &sorter->recs[sorter->pos++]->row;
+        }
+        return LCB_SUCCESS;
+    }
+    if (!sorter->cursors) {
+        /* finishing failed */
+        return LCB_ERROR;
+    }
+    if ((rv = merge_next(sorter, &rec)) < 0) {
+        return LCB_ERROR;
+    }
+    if (rv) {
+        *row = &rec->row;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_extsort_reset(lcbex_extsort_t *sorter)
+{
+    size_t ii;
+
+    close_cursors(sorter, sorter->nruns);
+    for (ii = 0; ii < sorter->nruns; ii++) {
+        fclose(sorter->runs[ii]);
+    }
+    sorter->nruns = 0;
+    clear_memory(sorter);
+    sorter->finished = 0;
+    sorter->pos = 0;
+    sorter->seq = 0;
+}
+
+LCBEX_API
+size_t lcbex_extsort_memory(const lcbex_extsort_t *sorter)
+{
+    return sorter->memory;
+}
+
+LCBEX_API
+void lcbex_extsort_get_stats(const lcbex_extsort_t *sorter,
+                             lcbex_extsort_stats_t *stats)
+{
+    *stats = sorter->stats;
+}
+
+LCBEX_API
+void lcbex_extsort_destroy(lcbex_extsort_t *sorter)
+{
+    if (!sorter) {
+        return;
+    }
+    lcbex_extsort_reset(sorter);
+    free(sorter->recs);
+    free(sorter->runs);
+    if (sorter->index) {
+        lcbex_json_index_destroy(sorter->index);
+    }
+    free((void *)sorter->config.path);
+    free(sorter);
+}
@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include "hash.h"
+#include <string.h>
+
+/**
+ * MurmurHash64A, by Austin Appleby (public domain). Reads are done through
+ * memcpy so unaligned buffers are fine.
+ */
+lcb_uint64_t lcbex_hash64(const void *buf, size_t nbuf, lcb_uint64_t seed)
+{
+    const lcb_uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = (const unsigned char *)buf;
+    const unsigned char *end = data + (nbuf & ~(size_t)7);
+    lcb_uint64_t h = seed ^ (nbuf * m);
+
+    while (data != end) {
+        lcb_uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        data += 8;
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (nbuf & 7) {
+    case 7:
+        h ^= (lcb_uint64_t)data[6] << 48;
+        /* fall through */
+    case 6:
+        h ^= (lcb_uint64_t)data[5] << 40;
+        /* fall through */
+    case 5:
+        h ^= (lcb_uint64_t)data[4] << 32;
+        /* fall through */
+    case 4:
+        h ^= (lcb_uint64_t)data[3] << 24;
+        /* fall through */
+    case 3:
+        h ^= (lcb_uint64_t)data[2] << 16;
+        /* fall through */
+    case 2:
+        h ^= (lcb_uint64_t)data[1] << 8;
+        /* fall through */
+    case 1:
+        h ^= (lcb_uint64_t)data[0];
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+/* little-endian load, whatever the host */
+static lcb_uint64_t load_le64(const unsigned char *p, size_t n)
+{
+    lcb_uint64_t ret = 0;
+    while (n--) {
+        ret = (ret << 8) | p[n];
+    }
+    return ret;
+}
+
+/**
+ * SipHash-2-4, by Jean-Philippe Aumasson and Daniel J. Bernstein
+ */
+lcb_uint64_t lcbex_siphash(const unsigned char *key,
+                           const void *buf, size_t nbuf)
+{
+    const unsigned char *data = (const unsigned char *)buf;
+    const unsigned char *end = data + (nbuf & ~(size_t)7);
+    lcb_uint64_t k0 = load_le64(key, 8);
+    lcb_uint64_t k1 = load_le64(key + 8, 8);
+    lcb_uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    lcb_uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    lcb_uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    lcb_uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    lcb_uint64_t m;
+
+    for (; data != end; data += 8) {
+        m = load_le64(data, 8);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    m = ((lcb_uint64_t)nbuf << 56) | load_le64(data, nbuf & 7);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Internal hashing helpers. Not part of the public API.
+ */
+
+#ifndef LCBEX_HASH_H
+#define LCBEX_HASH_H
+
+#include <lcbex/lcbex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * 64 bit hash of a byte string (MurmurHash64A)
+     */
+    lcb_uint64_t lcbex_hash64(const void *buf, size_t nbuf, lcb_uint64_t seed);
+
+    /**
+     * SipHash-2-4 of a byte string, keyed with 16 bytes. Unlike
+     * lcbex_hash64 it is a MAC: without the key, hashes can't be forged
+     */
+    lcb_uint64_t lcbex_siphash(const unsigned char *key,
+                               const void *buf, size_t nbuf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LCBEX_HASH_H */
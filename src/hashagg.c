@@ -0,0 +1,700 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/hashagg.h>
+#include <lcbex/jsoncur.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+/**
+ * Streaming hash aggregation with spilling
+ * @author Mark Nunberg
+ */
+
+#define MIN_CAPACITY 64
+#define MAX_PARTITIONS 256
+/* partitions are not split any further past this depth */
+#define MAX_SPILL_DEPTH 4
+
+typedef struct {
+    lcb_uint64_t count;
+    lcb_uint64_t nvalues;
+    double sum;
+    double min;
+    double max;
+} agg_acc;
+
+typedef struct {
+    /* 0 marks an empty slot */
+    lcb_uint64_t hash;
+    lcb_uint32_t nkey;
+    union {
+        char inl[LCBEX_HASHAGG_INLINE_KEY];
+        char *ext;
+    } key;
+    agg_acc acc;
+} agg_entry;
+
+/* a row of the current batch, once its group and measure are known */
+typedef struct {
+    size_t keyoff;
+    size_t nkey;
+    lcb_uint64_t hash;
+    double measure;
+    int has_measure;
+} batch_item;
+
+/* one set of partition files */
+typedef struct {
+    FILE *files[MAX_PARTITIONS];
+    unsigned int depth;
+} spill_set;
+
+struct lcbex_hashagg_st {
+    lcbex_hashagg_config_t config;
+
+    agg_entry *entries;
+    size_t capacity;
+    size_t nentries;
+    /* bytes of keys stored outside the table */
+    size_t ext_bytes;
+
+    /* per-batch state */
+    batch_item *items;
+    size_t nitems_alloc;
+    char *scratch;
+    size_t nscratch;
+    size_t nscratch_alloc;
+    lcbex_json_index_t *index;
+
+    /* where the table goes when it is full. NULL until the first spill */
+    spill_set *spill;
+    /* whether the table may currently be spilled */
+    int can_spill;
+
+    lcbex_hashagg_stats_t stats;
+};
+
+LCBEX_API
+void lcbex_hashagg_config_init(lcbex_hashagg_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->group_by = LCBEX_HASHAGG_GROUP_KEY_PREFIX;
+    config->npartitions = 16;
+}
+
+static char *copy_str(const char *s)
+{
+    char *ret;
+    if (!s) {
+        return NULL;
+    }
+    if ((ret = malloc(strlen(s) + 1)) != NULL) {
+        strcpy(ret, s);
+    }
+    return ret;
+}
+
+LCBEX_API
+void lcbex_hashagg_destroy(lcbex_hashagg_t *agg);
+
+LCBEX_API
+lcb_error_t lcbex_hashagg_create(lcbex_hashagg_t **agg,
+                                 const lcbex_hashagg_config_t *config)
+{
+    lcbex_hashagg_t *ret;
+
+    if (config->group_by == LCBEX_HASHAGG_GROUP_VALUE_FIELD &&
+            !config->group_path) {
+        return LCB_EINVAL;
+    }
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->config = *config;
+    ret->config.group_path = NULL;
+    ret->config.measure_path = NULL;
+    if (ret->config.npartitions < 2) {
+        ret->config.npartitions = 2;
+    } else if (ret->config.npartitions > MAX_PARTITIONS) {
+        ret->config.npartitions = MAX_PARTITIONS;
+    }
+    ret->can_spill = 1;
+
+    if ((config->group_path &&
+            (ret->config.group_path = copy_str(config->group_path)) == NULL) ||
+            (config->measure_path &&
+             (ret->config.measure_path =
+                  copy_str(config->measure_path)) == NULL) ||
+            lcbex_json_index_create(&ret->index) != LCB_SUCCESS ||
+            (ret->entries = calloc(MIN_CAPACITY,
+                                   sizeof(*ret->entries))) == NULL) {
+        lcbex_hashagg_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->capacity = MIN_CAPACITY;
+    *agg = ret;
+    return LCB_SUCCESS;
+}
+
+static const char *entry_key(const agg_entry *ent)
+{
+    return ent->nkey > LCBEX_HASHAGG_INLINE_KEY ? ent->key.ext : ent->key.inl;
+}
+
+static lcb_uint64_t hash_key(const char *key, size_t nkey)
+{
+    lcb_uint64_t hash = lcbex_hash64(key, nkey, 0);
+    return hash ? hash : 1;
+}
+
+static void clear_table(lcbex_hashagg_t *agg)
+{
+    size_t ii;
+    for (ii = 0; ii < agg->capacity; ii++) {
+        if (agg->entries[ii].hash &&
+                agg->entries[ii].nkey > LCBEX_HASHAGG_INLINE_KEY) {
+            free(agg->entries[ii].key.ext);
+        }
+    }
+    memset(agg->entries, 0, agg->capacity * sizeof(*agg->entries));
+    agg->nentries = 0;
+    agg->ext_bytes = 0;
+}
+
+LCBEX_API
+size_t lcbex_hashagg_memory(const lcbex_hashagg_t *agg)
+{
+    return agg->capacity * sizeof(*agg->entries) + agg->ext_bytes;
+}
+
+static void acc_merge(agg_acc *dst, const agg_acc *src)
+{
+    if (src->nvalues) {
+        if (!dst->nvalues || src->min < dst->min) {
+            dst->min = src->min;
+        }
+        if (!dst->nvalues || src->max > dst->max) {
+            dst->max = src->max;
+        }
+    }
+    dst->count += src->count;
+    dst->nvalues += src->nvalues;
+    dst->sum += src->sum;
+}
+
+/**
+ * Finds the slot for a key: either the entry holding it, or the empty
+ * slot where it belongs
+ */
+static agg_entry *find_slot(agg_entry *entries, size_t capacity,
+                            const char *key, size_t nkey, lcb_uint64_t hash)
+{
+    size_t mask = capacity - 1;
+    size_t ii = (size_t)hash & mask;
+
+    for (;; ii = (ii + 1) & mask) {
+        agg_entry *ent = entries + ii;
+        if (!ent->hash) {
+            return ent;
+        }
+        if (ent->hash == hash && ent->nkey == nkey &&
+                memcmp(entry_key(ent), key, nkey) == 0) {
+            return ent;
+        }
+    }
+}
+
+static int grow_table(lcbex_hashagg_t *agg)
+{
+    size_t n_capacity = agg->capacity * 2;
+    agg_entry *n_entries = calloc(n_capacity, sizeof(*n_entries));
+    size_t ii;
+
+    if (!n_entries) {
+        return -1;
+    }
+    for (ii = 0; ii < agg->capacity; ii++) {
+        agg_entry *ent = agg->entries + ii;
+        if (ent->hash) {
+            *find_slot(n_entries, n_capacity, entry_key(ent), ent->nkey,
+                       ent->hash) = *ent;
+        }
+    }
+    free(agg->entries);
+    agg->entries = n_entries;
+    agg->capacity = n_capacity;
+    return 0;
+}
+
+static lcb_error_t spill_table(lcbex_hashagg_t *agg, spill_set *set);
+
+/**
+ * Merges a partial aggregate for a key into the table, spilling or
+ * growing the table first if the key is new and there is no room.
+ */
+static lcb_error_t table_merge(lcbex_hashagg_t *agg,
+                               const char *key, size_t nkey,
+                               lcb_uint64_t hash, const agg_acc *acc)
+{
+    agg_entry *ent = find_slot(agg->entries, agg->capacity, key, nkey, hash);
+
+    if (ent->hash) {
+        acc_merge(&ent->acc, acc);
+        return LCB_SUCCESS;
+    }
+
+    {
+        int needs_growth = (agg->nentries + 1) * 4 > agg->capacity * 3;
+        size_t ext = nkey > LCBEX_HASHAGG_INLINE_KEY ? nkey : 0;
+        size_t needed = lcbex_hashagg_memory(agg) + ext;
+
+        if (needs_growth) {
+            needed += agg->capacity * sizeof(*agg->entries);
+        }
+
+        if (agg->config.memory_limit && needed > agg->config.memory_limit &&
+                agg->can_spill && agg->nentries) {
+            lcb_error_t err = spill_table(agg, agg->spill);
+            if (err != LCB_SUCCESS) {
+                return err;
+            }
+            needs_growth = 0;
+
+        } else if (needs_growth && grow_table(agg) != 0) {
+            return LCB_CLIENT_ENOMEM;
+        }
+
+        if (needs_growth || !agg->nentries) {
+            ent = find_slot(agg->entries, agg->capacity, key, nkey, hash);
+        }
+
+        if (ext) {
+            if ((ent->key.ext = malloc(nkey)) == NULL) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            memcpy(ent->key.ext, key, nkey);
+            agg->ext_bytes += nkey;
+        } else {
+            memcpy(ent->key.inl, key, nkey);
+        }
+        ent->hash = hash;
+        ent->nkey = (lcb_uint32_t)nkey;
+        ent->acc = *acc;
+        agg->nentries++;
+    }
+    return LCB_SUCCESS;
+}
+
+static spill_set *spill_set_create(unsigned int depth)
+{
+    spill_set *set = calloc(1, sizeof(*set));
+    if (set) {
+        set->depth = depth;
+    }
+    return set;
+}
+
+static void spill_set_destroy(spill_set *set)
+{
+    unsigned int ii;
+    if (!set) {
+        return;
+    }
+    for (ii = 0; ii < MAX_PARTITIONS; ii++) {
+        if (set->files[ii]) {
+            fclose(set->files[ii]);
+        }
+    }
+    free(set);
+}
+
+static int spill_set_used(const lcbex_hashagg_t *agg, const spill_set *set)
+{
+    unsigned int ii;
+    for (ii = 0; ii < agg->config.npartitions; ii++) {
+        if (set->files[ii]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the table's partial aggregates to the partitions of 'set' (the
+ * aggregator's current spill set if NULL, created if needed), and clears
+ * the table.
+ */
+static lcb_error_t spill_table(lcbex_hashagg_t *agg, spill_set *set)
+{
+    size_t ii;
+
+    if (!set) {
+        if ((set = agg->spill = spill_set_create(0)) == NULL) {
+            return LCB_CLIENT_ENOMEM;
+        }
+    }
+
+    for (ii = 0; ii < agg->capacity; ii++) {
+        const agg_entry *ent = agg->entries + ii;
+        const char *key;
+        lcb_uint32_t part;
+        FILE *fp;
+
+        if (!ent->hash) {
+            continue;
+        }
+        key = entry_key(ent);
+        /* a different seed at each depth, so a partition can be split */
+        part = (lcb_uint32_t)(lcbex_hash64(key, ent->nkey, set->depth + 1)
+                              >> 32) % agg->config.npartitions;
+
+        if ((fp = set->files[part]) == NULL) {
+            if ((fp = set->files[part] = tmpfile()) == NULL) {
+                return LCB_ERROR;
+            }
+        }
+        if (fwrite(&ent->nkey, sizeof(ent->nkey), 1, fp) != 1 ||
+                fwrite(key, 1, ent->nkey, fp) != ent->nkey ||
+                fwrite(&ent->acc, sizeof(ent->acc), 1, fp) != 1) {
+            return LCB_ERROR;
+        }
+        agg->stats.spilled_bytes += sizeof(ent->nkey) + ent->nkey +
+                                    sizeof(ent->acc);
+    }
+
+    agg->stats.spills++;
+    clear_table(agg);
+    return LCB_SUCCESS;
+}
+
+/**
+ * Appends the group key of a row to the scratch buffer
+ * @return 1 if the row has a group key, 0 if it should be skipped, -1 on
+ * allocation failure
+ */
+static int extract_group(lcbex_hashagg_t *agg, const lcbex_vrow_t *row,
+                         size_t *keyoff, size_t *nkey)
+{
+    const char *src = row->key;
+    size_t nsrc = row->nkey;
+    int close_array = 0;
+    lcbex_jsoncur_t cur;
+
+    if (agg->config.group_by == LCBEX_HASHAGG_GROUP_VALUE_FIELD) {
+        if (!row->value ||
+                lcbex_json_index_build(agg->index, row->value,
+                                       row->nvalue) != LCB_SUCCESS ||
+                lcbex_jsoncur_root(agg->index, &cur) != LCB_SUCCESS ||
+                lcbex_jsoncur_path(&cur, agg->config.group_path,
+                                   &cur) != LCB_SUCCESS) {
+            return 0;
+        }
+        lcbex_jsoncur_raw(&cur, &src, &nsrc);
+
+    } else if (agg->config.group_level && nsrc && *src == '[' &&
+               lcbex_json_index_build(agg->index, src, nsrc) == LCB_SUCCESS &&
+               lcbex_jsoncur_root(agg->index, &cur) == LCB_SUCCESS &&
+               lcbex_jsoncur_at(&cur, agg->config.group_level - 1,
+                                &cur) == LCB_SUCCESS &&
+               lcbex_jsoncur_next(&cur, &cur) == LCB_SUCCESS) {
+        /* there are more elements than the group level: truncate */
+        const char *elem;
+        size_t nelem;
+        lcbex_jsoncur_raw(&cur, &elem, &nelem);
+        nsrc = elem - src;
+        /* drop the comma (and any whitespace) after the last element */
+        while (nsrc && src[nsrc - 1] != ',') {
+            nsrc--;
+        }
+        nsrc--;
+        close_array = 1;
+    }
+
+    if (agg->nscratch + nsrc + 1 > agg->nscratch_alloc) {
+        size_t n_alloc = agg->nscratch_alloc ? agg->nscratch_alloc : 1024;
+        char *tmp;
+        while (n_alloc < agg->nscratch + nsrc + 1) {
+            n_alloc *= 2;
+        }
+        if ((tmp = realloc(agg->scratch, n_alloc)) == NULL) {
+            return -1;
+        }
+        agg->scratch = tmp;
+        agg->nscratch_alloc = n_alloc;
+    }
+
+    *keyoff = agg->nscratch;
+    memcpy(agg->scratch + agg->nscratch, src, nsrc);
+    agg->nscratch += nsrc;
+    if (close_array) {
+        agg->scratch[agg->nscratch++] = ']';
+    }
+    *nkey = agg->nscratch - *keyoff;
+    return 1;
+}
+
+static int extract_measure(lcbex_hashagg_t *agg, const lcbex_vrow_t *row,
+                           double *out)
+{
+    lcbex_jsoncur_t cur;
+
+    if (!row->value ||
+            lcbex_json_index_build(agg->index, row->value,
+                                   row->nvalue) != LCB_SUCCESS ||
+            lcbex_jsoncur_root(agg->index, &cur) != LCB_SUCCESS) {
+        return 0;
+    }
+    if (agg->config.measure_path &&
+            lcbex_jsoncur_path(&cur, agg->config.measure_path,
+                               &cur) != LCB_SUCCESS) {
+        return 0;
+    }
+    return lcbex_jsoncur_double(&cur, out) == LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_hashagg_add_rows(lcbex_hashagg_t *agg,
+                                   const lcbex_vrow_t *rows,
+                                   size_t nrows)
+{
+    size_t ii, nitems = 0;
+
+    if (nrows > agg->nitems_alloc) {
+        batch_item *tmp = realloc(agg->items, nrows * sizeof(*tmp));
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        agg->items = tmp;
+        agg->nitems_alloc = nrows;
+    }
+    agg->nscratch = 0;
+
+    /* first pass: work out each row's group and measure */
+    for (ii = 0; ii < nrows; ii++) {
+        batch_item *item = agg->items + nitems;
+        int rv = extract_group(agg, rows + ii, &item->keyoff, &item->nkey);
+
+        agg->stats.rows++;
+        if (rv < 0) {
+            return LCB_CLIENT_ENOMEM;
+        } else if (rv == 0) {
+            agg->stats.skipped++;
+            continue;
+        }
+        item->has_measure = extract_measure(agg, rows + ii, &item->measure);
+        nitems++;
+    }
+
+    /* hash them all, and get their slots on the way into the cache */
+    for (ii = 0; ii < nitems; ii++) {
+        batch_item *item = agg->items + ii;
+        item->hash = hash_key(agg->scratch + item->keyoff, item->nkey);
+#ifdef __GNUC__
+        __builtin_prefetch(agg->entries +
+                           ((size_t)item->hash & (agg->capacity - 1)));
+#endif
+    }
+
+    /* second pass: update the table */
+    for (ii = 0; ii < nitems; ii++) {
+        const batch_item *item = agg->items + ii;
+        agg_acc acc;
+        lcb_error_t err;
+
+        acc.count = 1;
+        acc.nvalues = item->has_measure ? 1 : 0;
+        acc.sum = acc.min = acc.max = item->has_measure ? item->measure : 0;
+
+        err = table_merge(agg, agg->scratch + item->keyoff, item->nkey,
+                          item->hash, &acc);
+        if (err != LCB_SUCCESS) {
+            return err;
+        }
+    }
+    return LCB_SUCCESS;
+}
+
+static void emit_table(lcbex_hashagg_t *agg, lcbex_hashagg_callback callback,
+                       void *cookie)
+{
+    size_t ii;
+
+    for (ii = 0; ii < agg->capacity; ii++) {
+        const agg_entry *ent = agg->entries + ii;
+        lcbex_hashagg_result_t res;
+
+        if (!ent->hash) {
+            continue;
+        }
+        res.count = ent->acc.count;
+        res.nvalues = ent->acc.nvalues;
+        res.sum = ent->acc.sum;
+        res.min = ent->acc.min;
+        res.max = ent->acc.max;
+        res.mean = res.nvalues ? res.sum / res.nvalues : 0;
+        agg->stats.groups++;
+        callback(agg, entry_key(ent), ent->nkey, &res, cookie);
+    }
+    clear_table(agg);
+}
+
+static lcb_error_t process_set(lcbex_hashagg_t *agg, spill_set *set,
+                               lcbex_hashagg_callback callback, void *cookie);
+
+/**
+ * Aggregates one spilled partition. If it does not fit in memory it is
+ * split into a further set of partitions, up to MAX_SPILL_DEPTH.
+ */
+static lcb_error_t process_partition(lcbex_hashagg_t *agg, FILE *fp,
+                                     unsigned int depth,
+                                     lcbex_hashagg_callback callback,
+                                     void *cookie)
+{
+    spill_set *children = NULL;
+    char *key = NULL;
+    size_t nkey_alloc = 0;
+    lcb_error_t err = LCB_SUCCESS;
+    lcb_uint32_t nkey;
+    agg_acc acc;
+
+    rewind(fp);
+    agg->can_spill = depth < MAX_SPILL_DEPTH;
+    if (agg->can_spill && (children = spill_set_create(depth + 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    agg->spill = children;
+
+    while (err == LCB_SUCCESS && fread(&nkey, sizeof(nkey), 1, fp) == 1) {
+        if (nkey > nkey_alloc) {
+            char *tmp = realloc(key, nkey);
+            if (!tmp) {
+                err = LCB_CLIENT_ENOMEM;
+                break;
+            }
+            key = tmp;
+            nkey_alloc = nkey;
+        }
+        if (fread(key, 1, nkey, fp) != nkey ||
+                fread(&acc, sizeof(acc), 1, fp) != 1) {
+            err = LCB_ERROR;
+            break;
+        }
+        err = table_merge(agg, key, nkey, hash_key(key, nkey), &acc);
+    }
+    free(key);
+
+    if (err == LCB_SUCCESS && ferror(fp)) {
+        err = LCB_ERROR;
+    }
+
+    if (err == LCB_SUCCESS) {
+        if (children && !spill_set_used(agg, children)) {
+            spill_set_destroy(children);
+            children = NULL;
+        }
+
+        if (children) {
+            /* this partition was split: the rest of it goes the same way */
+            err = spill_table(agg, children);
+            if (err == LCB_SUCCESS) {
+                err = process_set(agg, children, callback, cookie);
+            }
+        } else {
+            emit_table(agg, callback, cookie);
+        }
+    }
+
+    agg->spill = NULL;
+    spill_set_destroy(children);
+    return err;
+}
+
+static lcb_error_t process_set(lcbex_hashagg_t *agg, spill_set *set,
+                               lcbex_hashagg_callback callback, void *cookie)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < agg->config.npartitions; ii++) {
+        lcb_error_t err;
+        if (!set->files[ii]) {
+            continue;
+        }
+        err = process_partition(agg, set->files[ii], set->depth,
+                                callback, cookie);
+        fclose(set->files[ii]);
+        set->files[ii] = NULL;
+        if (err != LCB_SUCCESS) {
+            return err;
+        }
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_hashagg_finish(lcbex_hashagg_t *agg,
+                                 lcbex_hashagg_callback callback,
+                                 void *cookie)
+{
+    spill_set *set = agg->spill;
+    lcb_error_t err = LCB_SUCCESS;
+
+    if (!set) {
+        emit_table(agg, callback, cookie);
+        return LCB_SUCCESS;
+    }
+
+    err = spill_table(agg, set);
+    if (err == LCB_SUCCESS) {
+        err = process_set(agg, set, callback, cookie);
+    }
+
+    spill_set_destroy(set);
+    agg->spill = NULL;
+    agg->can_spill = 1;
+    clear_table(agg);
+    return err;
+}
+
+LCBEX_API
+void lcbex_hashagg_get_stats(const lcbex_hashagg_t *agg,
+                             lcbex_hashagg_stats_t *stats)
+{
+    *stats = agg->stats;
+}
+
+LCBEX_API
+void lcbex_hashagg_destroy(lcbex_hashagg_t *agg)
+{
+    if (!agg) {
+        return;
+    }
+    if (agg->entries) {
+        clear_table(agg);
+    }
+    free(agg->entries);
+    spill_set_destroy(agg->spill);
+    lcbex_json_index_destroy(agg->index);
+    free(agg->items);
+    free(agg->scratch);
+    free((void *)agg->config.group_path);
+    free((void *)agg->config.measure_path);
+    free(agg);
+}
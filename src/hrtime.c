@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/lcbex.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/**
+ * Monotonic clock. We can't use libcouchbase's gethrtime() since we don't
+ * link against it.
+ */
+
+#ifdef _WIN32
+LCBEX_API
+lcb_uint64_t lcbex_hrtime(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (lcb_uint64_t)((double)now.QuadPart * 1000000000.0 /
+                          (double)freq.QuadPart);
+}
+
+#else
+LCBEX_API
+lcb_uint64_t lcbex_hrtime(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000;
+#endif
+    return (lcb_uint64_t)ts.tv_sec * 1000000000 + (lcb_uint64_t)ts.tv_nsec;
+}
+#endif
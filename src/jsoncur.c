@@ -0,0 +1,616 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/jsoncur.h>
+#include <lcbex/vrow.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Structural index and cursor for on-demand JSON navigation
+ * @author Mark Nunberg
+ */
+
+struct lcbex_json_index_st {
+    const char *json;
+    size_t njson;
+    /* offsets of the structural characters, in order */
+    lcb_uint32_t *pos;
+    /* for each opening bracket or quote, the index of its closing one */
+    lcb_uint32_t *match;
+    size_t npos;
+    size_t nalloc;
+    /* indexes of the currently open brackets, while building */
+    lcb_uint32_t *stack;
+    size_t nstack;
+};
+
+LCBEX_API
+lcb_error_t lcbex_json_index_create(lcbex_json_index_t **index)
+{
+    if ((*index = calloc(1, sizeof(**index))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_json_index_destroy(lcbex_json_index_t *index)
+{
+    if (!index) {
+        return;
+    }
+    free(index->pos);
+    free(index->match);
+    free(index->stack);
+    free(index);
+}
+
+static int push_structural(lcbex_json_index_t *index, size_t offset)
+{
+    if (index->npos == index->nalloc) {
+        size_t n_alloc = index->nalloc ? index->nalloc * 2 : 64;
+        lcb_uint32_t *pos, *match, *stack;
+
+        if ((pos = realloc(index->pos, n_alloc * sizeof(*pos))) == NULL) {
+            return -1;
+        }
+        index->pos = pos;
+        if ((match = realloc(index->match, n_alloc * sizeof(*match))) == NULL) {
+            return -1;
+        }
+        index->match = match;
+        /* there can never be more open brackets than structurals */
+        if ((stack = realloc(index->stack, n_alloc * sizeof(*stack))) == NULL) {
+            return -1;
+        }
+        index->stack = stack;
+        index->nalloc = n_alloc;
+    }
+    index->pos[index->npos] = (lcb_uint32_t)offset;
+    index->match[index->npos] = 0;
+    index->npos++;
+    return 0;
+}
+
+LCBEX_API
+lcb_error_t lcbex_json_index_build(lcbex_json_index_t *index,
+                                   const char *json, size_t njson)
+{
+    size_t ii;
+
+    if (njson >= 0xffffffffUL) {
+        return LCB_E2BIG;
+    }
+
+    index->json = json;
+    index->njson = njson;
+    index->npos = 0;
+    index->nstack = 0;
+
+    for (ii = 0; ii < njson; ii++) {
+        size_t open;
+
+        switch (json[ii]) {
+        case '"':
+            open = index->npos;
+            if (push_structural(index, ii) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            for (ii++; ii < njson && json[ii] != '"'; ii++) {
+                if (json[ii] == '\\') {
+                    ii++;
+                }
+            }
+            if (ii >= njson) {
+                return LCB_EINVAL;
+            }
+            if (push_structural(index, ii) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            index->match[open] = (lcb_uint32_t)(index->npos - 1);
+            break;
+
+        case '{':
+        case '[':
+            if (push_structural(index, ii) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            index->stack[index->nstack++] = (lcb_uint32_t)(index->npos - 1);
+            break;
+
+        case '}':
+        case ']':
+            if (index->nstack == 0) {
+                return LCB_EINVAL;
+            }
+            open = index->stack[--index->nstack];
+            if (json[index->pos[open]] != (json[ii] == '}' ? '{' : '[')) {
+                return LCB_EINVAL;
+            }
+            index->match[open] = (lcb_uint32_t)index->npos;
+            if (push_structural(index, ii) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            break;
+
+        case ':':
+        case ',':
+            if (push_structural(index, ii) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (index->nstack) {
+        return LCB_EINVAL;
+    }
+    return LCB_SUCCESS;
+}
+
+static int is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static size_t skip_ws(const lcbex_json_index_t *index, size_t offset)
+{
+    while (offset < index->njson && is_ws(index->json[offset])) {
+        offset++;
+    }
+    return offset;
+}
+
+/**
+ * Offset of the given structural character, or the end of the text
+ */
+static size_t structural_offset(const lcbex_json_index_t *index, size_t si)
+{
+    return si < index->npos ? index->pos[si] : index->njson;
+}
+
+static char structural_char(const lcbex_json_index_t *index, size_t si)
+{
+    return si < index->npos ? index->json[index->pos[si]] : '\0';
+}
+
+static int is_compound(const lcbex_jsoncur_t *cur)
+{
+    char c = cur->index->json[cur->offset];
+    return c == '{' || c == '[' || c == '"';
+}
+
+/**
+ * Returns the index of the first structural character after the value
+ */
+static size_t after_value(const lcbex_jsoncur_t *cur)
+{
+    if (is_compound(cur)) {
+        return cur->index->match[cur->si] + 1;
+    }
+    /* a scalar contains no structurals */
+    return cur->si;
+}
+
+/**
+ * Positions a cursor at the value following the structural character
+ * 'si' (a colon, comma or opening bracket)
+ */
+static lcb_error_t value_after(const lcbex_json_index_t *index, size_t si,
+                               size_t name_si, lcbex_jsoncur_t *cur)
+{
+    size_t offset = skip_ws(index, index->pos[si] + 1);
+    char c;
+
+    if (offset >= index->njson) {
+        return LCB_EINVAL;
+    }
+    c = index->json[offset];
+    if (c == ',' || c == ':' || c == '}' || c == ']') {
+        return LCB_EINVAL;
+    }
+    cur->index = index;
+    cur->offset = offset;
+    cur->si = si + 1;
+    cur->name_si = name_si;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Positions a cursor at the object member whose name starts at the
+ * structural 'si'
+ */
+static lcb_error_t member_at(const lcbex_json_index_t *index, size_t si,
+                             lcbex_jsoncur_t *cur)
+{
+    if (structural_char(index, si) != '"' ||
+            structural_char(index, si + 2) != ':') {
+        return LCB_EINVAL;
+    }
+    return value_after(index, si + 2, si, cur);
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_root(const lcbex_json_index_t *index,
+                               lcbex_jsoncur_t *cur)
+{
+    size_t offset = skip_ws(index, 0);
+    if (offset >= index->njson) {
+        return LCB_EINVAL;
+    }
+    cur->index = index;
+    cur->offset = offset;
+    cur->si = 0;
+    cur->name_si = SIZE_MAX;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcbex_json_type_t lcbex_jsoncur_type(const lcbex_jsoncur_t *cur)
+{
+    char c = cur->index->json[cur->offset];
+
+    switch (c) {
+    case '{':
+        return LCBEX_JSON_OBJECT;
+    case '[':
+        return LCBEX_JSON_ARRAY;
+    case '"':
+        return LCBEX_JSON_STRING;
+    case 'n':
+        return LCBEX_JSON_NULL;
+    case 't':
+        return LCBEX_JSON_TRUE;
+    case 'f':
+        return LCBEX_JSON_FALSE;
+    default:
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            return LCBEX_JSON_NUMBER;
+        }
+        return LCBEX_JSON_INVALID;
+    }
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_first(const lcbex_jsoncur_t *cur,
+                                lcbex_jsoncur_t *child)
+{
+    const lcbex_json_index_t *index = cur->index;
+
+    switch (lcbex_jsoncur_type(cur)) {
+    case LCBEX_JSON_OBJECT:
+        if (structural_char(index, cur->si + 1) == '}') {
+            return LCB_KEY_ENOENT;
+        }
+        return member_at(index, cur->si + 1, child);
+
+    case LCBEX_JSON_ARRAY:
+        if (index->json[skip_ws(index, cur->offset + 1)] == ']') {
+            return LCB_KEY_ENOENT;
+        }
+        return value_after(index, cur->si, SIZE_MAX, child);
+
+    default:
+        return LCB_EINVAL;
+    }
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_next(const lcbex_jsoncur_t *cur,
+                               lcbex_jsoncur_t *sibling)
+{
+    size_t si = after_value(cur);
+
+    if (structural_char(cur->index, si) != ',') {
+        return LCB_KEY_ENOENT;
+    }
+    if (cur->name_si != SIZE_MAX) {
+        return member_at(cur->index, si + 1, sibling);
+    }
+    return value_after(cur->index, si, SIZE_MAX, sibling);
+}
+
+static int name_equals(const lcbex_jsoncur_t *cur,
+                       const char *name, size_t nname)
+{
+    const lcbex_json_index_t *index = cur->index;
+    const char *raw = index->json + index->pos[cur->name_si];
+    size_t nraw = index->pos[cur->name_si + 1] - index->pos[cur->name_si] + 1;
+    char stackbuf[256], *buf = stackbuf;
+    const char *unescaped;
+    size_t nunescaped;
+    int ret = 0;
+
+    if (!memchr(raw, '\\', nraw)) {
+        return nraw - 2 == nname && memcmp(raw + 1, name, nname) == 0;
+    }
+
+    /* an escaped name is never shorter than its contents */
+    if (nraw - 2 < nname) {
+        return 0;
+    }
+    if (nraw > sizeof(stackbuf) && (buf = malloc(nraw)) == NULL) {
+        return 0;
+    }
+    if (lcbex_vrow_unescape(raw, nraw, buf,
+                            &unescaped, &nunescaped) == LCB_SUCCESS) {
+        ret = nunescaped == nname && memcmp(unescaped, name, nname) == 0;
+    }
+    if (buf != stackbuf) {
+        free(buf);
+    }
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_get(const lcbex_jsoncur_t *cur,
+                              const char *name, size_t nname,
+                              lcbex_jsoncur_t *child)
+{
+    lcbex_jsoncur_t pos;
+    lcb_error_t err;
+
+    if (lcbex_jsoncur_type(cur) != LCBEX_JSON_OBJECT) {
+        return LCB_EINVAL;
+    }
+    if (nname == SIZE_MAX) {
+        nname = strlen(name);
+    }
+
+    for (err = lcbex_jsoncur_first(cur, &pos); err == LCB_SUCCESS;
+            err = lcbex_jsoncur_next(&pos, &pos)) {
+        if (name_equals(&pos, name, nname)) {
+            *child = pos;
+            return LCB_SUCCESS;
+        }
+    }
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_at(const lcbex_jsoncur_t *cur, size_t ii,
+                             lcbex_jsoncur_t *child)
+{
+    lcbex_jsoncur_t pos;
+    lcb_error_t err;
+
+    if (lcbex_jsoncur_type(cur) != LCBEX_JSON_ARRAY) {
+        return LCB_EINVAL;
+    }
+    for (err = lcbex_jsoncur_first(cur, &pos); err == LCB_SUCCESS && ii;
+            ii--) {
+        err = lcbex_jsoncur_next(&pos, &pos);
+    }
+    if (err == LCB_SUCCESS) {
+        *child = pos;
+    }
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_path(const lcbex_jsoncur_t *cur,
+                               const char *path, lcbex_jsoncur_t *child)
+{
+    lcbex_jsoncur_t pos = *cur;
+
+    while (*path) {
+        const char *end = strchr(path, '.');
+        size_t ncomp = end ? (size_t)(end - path) : strlen(path);
+        size_t ii, num = 0;
+        lcb_error_t err;
+
+        for (ii = 0; ii < ncomp && path[ii] >= '0' && path[ii] <= '9'; ii++) {
+            num = num * 10 + (path[ii] - '0');
+        }
+
+        if (ncomp && ii == ncomp &&
+                lcbex_jsoncur_type(&pos) == LCBEX_JSON_ARRAY) {
+            err = lcbex_jsoncur_at(&pos, num, &pos);
+        } else {
+            err = lcbex_jsoncur_get(&pos, path, ncomp, &pos);
+        }
+        if (err != LCB_SUCCESS) {
+            return err;
+        }
+
+        path += ncomp;
+        if (*path == '.') {
+            path++;
+        }
+    }
+
+    *child = pos;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_jsoncur_raw(const lcbex_jsoncur_t *cur,
+                       const char **out, size_t *nout)
+{
+    const lcbex_json_index_t *index = cur->index;
+    size_t end;
+
+    if (is_compound(cur)) {
+        end = index->pos[index->match[cur->si]] + 1;
+    } else {
+        end = structural_offset(index, cur->si);
+        while (end > cur->offset && is_ws(index->json[end - 1])) {
+            end--;
+        }
+    }
+    *out = index->json + cur->offset;
+    *nout = end - cur->offset;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_name(const lcbex_jsoncur_t *cur,
+                               const char **out, size_t *nout)
+{
+    const lcbex_json_index_t *index = cur->index;
+
+    if (cur->name_si == SIZE_MAX) {
+        return LCB_EINVAL;
+    }
+    *out = index->json + index->pos[cur->name_si];
+    *nout = index->pos[cur->name_si + 1] - index->pos[cur->name_si] + 1;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_string(const lcbex_jsoncur_t *cur, char *buf,
+                                 const char **out, size_t *nout)
+{
+    const char *raw;
+    size_t nraw;
+
+    if (lcbex_jsoncur_type(cur) != LCBEX_JSON_STRING) {
+        return LCB_EINVAL;
+    }
+    lcbex_jsoncur_raw(cur, &raw, &nraw);
+    return lcbex_vrow_unescape(raw, nraw, buf, out, nout);
+}
+
+/**
+ * Checks the JSON number grammar, which is stricter than strtod's
+ */
+static int is_json_number(const char *p, size_t n)
+{
+    size_t ii = 0, ndigits;
+
+    if (ii < n && p[ii] == '-') {
+        ii++;
+    }
+    for (ndigits = 0; ii < n && p[ii] >= '0' && p[ii] <= '9'; ii++) {
+        ndigits++;
+    }
+    if (!ndigits || (ndigits > 1 && p[ii - ndigits] == '0')) {
+        return 0;
+    }
+    if (ii < n && p[ii] == '.') {
+        for (ii++, ndigits = 0; ii < n && p[ii] >= '0' && p[ii] <= '9'; ii++) {
+            ndigits++;
+        }
+        if (!ndigits) {
+            return 0;
+        }
+    }
+    if (ii < n && (p[ii] == 'e' || p[ii] == 'E')) {
+        ii++;
+        if (ii < n && (p[ii] == '+' || p[ii] == '-')) {
+            ii++;
+        }
+        for (ndigits = 0; ii < n && p[ii] >= '0' && p[ii] <= '9'; ii++) {
+            ndigits++;
+        }
+        if (!ndigits) {
+            return 0;
+        }
+    }
+    return ii == n;
+}
+
+/**
+ * Converts a valid JSON number without copying it, when this is exact:
+ * if the digits fit in 53 bits and the power of ten is at most 22, both
+ * are exact doubles and a single multiplication or division rounds
+ * correctly. This covers integers and most decimals found in values.
+ * @return 0 if strtod is needed
+ */
+static int fast_number(const char *p, size_t n, double *out)
+{
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    lcb_uint64_t mantissa = 0;
+    int ndigits = 0, exp10 = 0, neg = 0, exp = 0, expneg = 0;
+    size_t ii = 0;
+    double d;
+
+    if (p[ii] == '-') {
+        neg = 1;
+        ii++;
+    }
+    for (; ii < n && p[ii] >= '0' && p[ii] <= '9'; ii++) {
+        if (mantissa && ++ndigits > 18) {
+            return 0;
+        }
+        mantissa = mantissa * 10 + (p[ii] - '0');
+    }
+    if (ii < n && p[ii] == '.') {
+        for (ii++; ii < n && p[ii] >= '0' && p[ii] <= '9'; ii++) {
+            if (mantissa && ++ndigits > 18) {
+                return 0;
+            }
+            mantissa = mantissa * 10 + (p[ii] - '0');
+            exp10--;
+        }
+    }
+    if (ii < n) {
+        /* 'e' or 'E' */
+        ii++;
+        if (p[ii] == '+' || p[ii] == '-') {
+            expneg = p[ii++] == '-';
+        }
+        for (; ii < n; ii++) {
+            if (exp > 1000) {
+                return 0;
+            }
+            exp = exp * 10 + (p[ii] - '0');
+        }
+        exp10 += expneg ? -exp : exp;
+    }
+
+    if (mantissa == 0) {
+        *out = neg ? -0.0 : 0.0;
+        return 1;
+    }
+    if (mantissa > ((lcb_uint64_t)1 << 53) || exp10 < -22 || exp10 > 22) {
+        return 0;
+    }
+    d = (double)mantissa;
+    d = exp10 < 0 ? d / pow10[-exp10] : d * pow10[exp10];
+    *out = neg ? -d : d;
+    return 1;
+}
+
+LCBEX_API
+lcb_error_t lcbex_jsoncur_double(const lcbex_jsoncur_t *cur, double *out)
+{
+    const char *raw;
+    size_t nraw;
+    char buf[64];
+
+    if (lcbex_jsoncur_type(cur) != LCBEX_JSON_NUMBER) {
+        return LCB_EINVAL;
+    }
+    lcbex_jsoncur_raw(cur, &raw, &nraw);
+    if (nraw >= sizeof(buf) || !is_json_number(raw, nraw)) {
+        return LCB_EINVAL;
+    }
+    if (fast_number(raw, nraw, out)) {
+        return LCB_SUCCESS;
+    }
+    memcpy(buf, raw, nraw);
+    buf[nraw] = '\0';
+    *out = strtod(buf, NULL);
+    return LCB_SUCCESS;
+}
@@ -0,0 +1,425 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/keyfilter.h>
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Blocked Bloom filter of view keys.
+ *
+ * Each key maps to a single 512 bit (cache line sized) block, and all of
+ * its bits are set within that block, so a lookup touches one cache line.
+ *
+ * @author Mark Nunberg
+ */
+
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 64)
+#define DEFAULT_BITS_PER_KEY 10
+#define KEY_SEED 0x6c636265784b4559ULL
+/* longer integers may not survive a round trip through a double */
+#define MAX_EXACT_DIGITS 15
+
+typedef struct {
+    lcb_uint64_t *words;
+    size_t nblocks;
+    unsigned int nprobes;
+    size_t nkeys;
+} bloom;
+
+struct lcbex_keyfilter_st {
+    bloom current;
+    bloom building;
+    int has_current;
+    int is_building;
+    lcb_uint64_t built_at;
+    lcb_uint64_t refresh_interval;
+    lcbex_keyfilter_stats_t stats;
+};
+
+static int bloom_init(bloom *b, size_t expected_keys, unsigned int bits_per_key)
+{
+    size_t nbits;
+
+    memset(b, 0, sizeof(*b));
+    if (!expected_keys) {
+        expected_keys = 1;
+    }
+
+    nbits = expected_keys * bits_per_key;
+    b->nblocks = (nbits + BLOCK_BITS - 1) / BLOCK_BITS;
+
+    /* k = ln(2) * bits per key minimizes the false positive rate */
+    b->nprobes = (bits_per_key * 69 + 50) / 100;
+    if (b->nprobes < 1) {
+        b->nprobes = 1;
+    } else if (b->nprobes > 16) {
+        b->nprobes = 16;
+    }
+
+    b->words = calloc(b->nblocks * BLOCK_WORDS, sizeof(lcb_uint64_t));
+    return b->words ? 0 : -1;
+}
+
+static void bloom_cleanup(bloom *b)
+{
+    free(b->words);
+    memset(b, 0, sizeof(*b));
+}
+
+static lcb_uint64_t *bloom_block(const bloom *b, lcb_uint64_t hash)
+{
+    /* multiply-shift reduction of the upper half onto [0, nblocks) */
+    size_t index = (size_t)(((hash >> 32) * (lcb_uint64_t)b->nblocks) >> 32);
+    return b->words + index * BLOCK_WORDS;
+}
+
+static void bloom_add(bloom *b, lcb_uint64_t hash)
+{
+    lcb_uint64_t *block = bloom_block(b, hash);
+    lcb_uint32_t h1 = (lcb_uint32_t)hash;
+    lcb_uint32_t h2 = (lcb_uint32_t)(hash >> 17) | 1;
+    unsigned int ii;
+
+    for (ii = 0; ii < b->nprobes; ii++) {
+        lcb_uint32_t bit = (h1 + ii * h2) % BLOCK_BITS;
+        block[bit / 64] |= (lcb_uint64_t)1 << (bit % 64);
+    }
+    b->nkeys++;
+}
+
+static int bloom_test(const bloom *b, lcb_uint64_t hash)
+{
+    const lcb_uint64_t *block = bloom_block(b, hash);
+    lcb_uint32_t h1 = (lcb_uint32_t)hash;
+    lcb_uint32_t h2 = (lcb_uint32_t)(hash >> 17) | 1;
+    unsigned int ii;
+
+    for (ii = 0; ii < b->nprobes; ii++) {
+        lcb_uint32_t bit = (h1 + ii * h2) % BLOCK_BITS;
+        if ((block[bit / 64] & ((lcb_uint64_t)1 << (bit % 64))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Copies a key into 'out', dropping whitespace outside of strings.
+ * Returns the new length, or -1 if the key has more than one possible
+ * encoding (string escapes, non-ASCII text, non-integer numbers, or
+ * integers too long to survive the server's conversion to a double), in
+ * which case it must not be reported as absent.
+ */
+static long canonicalize_key(const char *key, size_t nkey, char *out)
+{
+    size_t ii, nout = 0;
+    int in_str = 0, in_num = 0, ndigits = 0;
+
+    for (ii = 0; ii < nkey; ii++) {
+        unsigned char c = (unsigned char)key[ii];
+
+        if (c == '\\' || c >= 0x80) {
+            return -1;
+        }
+
+        if (in_str) {
+            if (c == '"') {
+                in_str = 0;
+            }
+        } else if (in_num && (c == '.' || c == 'e' || c == 'E')) {
+            return -1;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            if (c == '-' && ii + 1 < nkey && key[ii + 1] == '0') {
+                /* -0 == 0 */
+                return -1;
+            }
+            if (!in_num) {
+                ndigits = 0;
+            }
+            if (c != '-' && ++ndigits > MAX_EXACT_DIGITS) {
+                /* 9007199254740993 == 9007199254740992 */
+                return -1;
+            }
+            in_num = 1;
+        } else {
+            in_num = 0;
+            if (c == '"') {
+                in_str = 1;
+            } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                continue;
+            }
+        }
+
+        out[nout++] = (char)c;
+    }
+    return (long)nout;
+}
+
+static lcb_uint64_t hash_key(const char *key, size_t nkey, int *ok)
+{
+    char sbuf[256];
+    char *buf = sbuf;
+    long ncanon;
+    lcb_uint64_t ret = 0;
+
+    if (nkey > sizeof(sbuf) && (buf = malloc(nkey)) == NULL) {
+        *ok = 0;
+        return 0;
+    }
+
+    ncanon = canonicalize_key(key, nkey, buf);
+    *ok = ncanon >= 0;
+    if (*ok) {
+        ret = lcbex_hash64(buf, (size_t)ncanon, KEY_SEED);
+    }
+
+    if (buf != sbuf) {
+        free(buf);
+    }
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_keyfilter_create(lcbex_keyfilter_t **filter,
+                                   lcb_uint64_t refresh_interval)
+{
+    *filter = calloc(1, sizeof(**filter));
+    if (!*filter) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    (*filter)->refresh_interval = refresh_interval;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_keyfilter_rebuild_begin(lcbex_keyfilter_t *filter,
+                                          size_t expected_keys,
+                                          unsigned int bits_per_key)
+{
+    lcbex_keyfilter_rebuild_abort(filter);
+
+    if (!bits_per_key) {
+        bits_per_key = DEFAULT_BITS_PER_KEY;
+    }
+    if (bloom_init(&filter->building, expected_keys, bits_per_key) != 0) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    filter->is_building = 1;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_keyfilter_rebuild_add(lcbex_keyfilter_t *filter,
+                                        const char *key, size_t nkey)
+{
+    int ok;
+    lcb_uint64_t hash;
+
+    if (!filter->is_building) {
+        return LCB_EINVAL;
+    }
+
+    /* keys which can't be canonicalized are never looked up */
+    hash = hash_key(key, nkey, &ok);
+    if (ok) {
+        bloom_add(&filter->building, hash);
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_keyfilter_rebuild_commit(lcbex_keyfilter_t *filter,
+                                           lcb_uint64_t now)
+{
+    if (!filter->is_building) {
+        return LCB_EINVAL;
+    }
+
+    bloom_cleanup(&filter->current);
+    filter->current = filter->building;
+    memset(&filter->building, 0, sizeof(filter->building));
+    filter->is_building = 0;
+    filter->has_current = 1;
+    filter->built_at = now;
+    filter->stats.rebuilds++;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_keyfilter_rebuild_abort(lcbex_keyfilter_t *filter)
+{
+    if (filter->is_building) {
+        bloom_cleanup(&filter->building);
+        filter->is_building = 0;
+    }
+}
+
+LCBEX_API
+int lcbex_keyfilter_needs_rebuild(const lcbex_keyfilter_t *filter,
+                                  lcb_uint64_t now)
+{
+    if (filter->is_building) {
+        return 0;
+    }
+    if (!filter->has_current) {
+        return 1;
+    }
+    return filter->refresh_interval &&
+           now - filter->built_at >= filter->refresh_interval;
+}
+
+LCBEX_API
+void lcbex_keyfilter_add(lcbex_keyfilter_t *filter,
+                         const char *key, size_t nkey)
+{
+    int ok;
+    lcb_uint64_t hash = hash_key(key, nkey, &ok);
+
+    if (!ok) {
+        return;
+    }
+    if (filter->has_current) {
+        bloom_add(&filter->current, hash);
+    }
+    if (filter->is_building) {
+        bloom_add(&filter->building, hash);
+    }
+}
+
+LCBEX_API
+int lcbex_keyfilter_may_contain(lcbex_keyfilter_t *filter,
+                                const char *key, size_t nkey)
+{
+    int ok;
+    lcb_uint64_t hash;
+
+    filter->stats.lookups++;
+    if (!filter->has_current) {
+        return 1;
+    }
+
+    hash = hash_key(key, nkey, &ok);
+    if (!ok || bloom_test(&filter->current, hash)) {
+        return 1;
+    }
+
+    filter->stats.negatives++;
+    return 0;
+}
+
+/**
+ * Options which widen the query beyond the single key, or whose result is
+ * not simply the rows for that key
+ */
+static int is_excluded_option(const lcbex_vopt_t *opt)
+{
+    static const char *names[] = {
+        "keys", "startkey", "endkey", "startkey_docid", "endkey_docid",
+        "inclusive_end", "reduce", "group", "group_level",
+        "bbox", "start_range", "end_range", NULL
+    };
+    size_t ii;
+
+    for (ii = 0; names[ii]; ii++) {
+        if (opt->noptname == strlen(names[ii]) &&
+                memcmp(opt->optname, names[ii], opt->noptname) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+LCBEX_API
+int lcbex_keyfilter_check_vopts(lcbex_keyfilter_t *filter,
+                                const lcbex_vopt_t *const *options,
+                                size_t noptions)
+{
+    const lcbex_vopt_t *keyopt = NULL;
+    size_t ii;
+    char sbuf[256];
+    char *buf;
+    size_t nkey;
+    int rv;
+
+    for (ii = 0; ii < noptions; ii++) {
+        const lcbex_vopt_t *opt = options[ii];
+
+        if (opt->flags & LCBEX_VOPT_F_PASSTHROUGH) {
+            return 1;
+        }
+        if (opt->noptname == 3 && memcmp(opt->optname, "key", 3) == 0) {
+            if (keyopt) {
+                return 1;
+            }
+            keyopt = opt;
+        } else if (is_excluded_option(opt)) {
+            return 1;
+        }
+    }
+
+    if (!keyopt) {
+        return 1;
+    }
+
+    if ((keyopt->flags & LCBEX_VOPT_F_PCTENCODE_ANY) == 0) {
+        return lcbex_keyfilter_may_contain(filter, keyopt->optval,
+                                           keyopt->noptval);
+    }
+
+    buf = sbuf;
+    if (keyopt->noptval > sizeof(sbuf) &&
+            (buf = malloc(keyopt->noptval)) == NULL) {
+        return 1;
+    }
+
+    nkey = lcbex_vopt_decode(keyopt, buf);
+    rv = lcbex_keyfilter_may_contain(filter, buf, nkey);
+
+    if (buf != sbuf) {
+        free(buf);
+    }
+    return rv;
+}
+
+LCBEX_API
+void lcbex_keyfilter_report_empty(lcbex_keyfilter_t *filter)
+{
+    filter->stats.false_positives++;
+}
+
+LCBEX_API
+void lcbex_keyfilter_get_stats(const lcbex_keyfilter_t *filter,
+                               lcbex_keyfilter_stats_t *stats)
+{
+    *stats = filter->stats;
+    stats->nkeys = filter->current.nkeys;
+    stats->nbits = (lcb_uint64_t)filter->current.nblocks * BLOCK_BITS;
+}
+
+LCBEX_API
+void lcbex_keyfilter_destroy(lcbex_keyfilter_t *filter)
+{
+    if (!filter) {
+        return;
+    }
+    bloom_cleanup(&filter->current);
+    bloom_cleanup(&filter->building);
+    free(filter);
+}
@@ -0,0 +1,409 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/mergejoin.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Merge-join of two sorted row streams
+ * @author Mark Nunberg
+ */
+
+typedef struct {
+    /**
+     * Buffered rows, oldest first, starting at 'head'. Each row's fields
+     * live in a single allocation starting at row.key.
+     */
+    lcbex_vrow_t *rows;
+    size_t head;
+    size_t nrows;
+    size_t nalloc;
+
+    /* how many rows from 'head' are known to share the head's key */
+    size_t group_len;
+    /* whether a row with a different key follows the head group */
+    int group_complete;
+    int done;
+
+    /* the key of the last row added, for order checking */
+    char *lastkey;
+    size_t nlastkey;
+    size_t nlastkey_alloc;
+} join_side;
+
+struct lcbex_mergejoin_st {
+    join_side sides[2];
+    int flags;
+    lcbex_mergejoin_callback callback;
+    void *cookie;
+    lcbex_mergejoin_stats_t stats;
+    /* lcbex_vrow_collate_class of every key fed to either side */
+    int collate_mask;
+    /* set once a key may order differently on the server */
+    int failed;
+};
+
+LCBEX_API
+lcb_error_t lcbex_mergejoin_create(lcbex_mergejoin_t **join, int flags,
+                                   lcbex_mergejoin_callback callback,
+                                   void *cookie)
+{
+    lcbex_mergejoin_t *ret;
+
+    if (!callback) {
+        return LCB_EINVAL;
+    }
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->flags = flags;
+    ret->callback = callback;
+    ret->cookie = cookie;
+    *join = ret;
+    return LCB_SUCCESS;
+}
+
+static int opt_is_true(const lcbex_vopt_t *opt)
+{
+    return opt && opt->noptval == 4 && memcmp(opt->optval, "true", 4) == 0;
+}
+
+LCBEX_API
+lcb_error_t lcbex_mergejoin_make_uri(const lcbex_mergejoin_t *join,
+                                     const char *design, size_t ndesign,
+                                     const char *view, size_t nview,
+                                     const lcbex_vopt_t *const *options,
+                                     size_t noptions,
+                                     char **uri)
+{
+    int descending = opt_is_true(lcbex_vopt_find(options, noptions,
+                                                 "descending"));
+
+    if (lcbex_vopt_find(options, noptions, "skip") ||
+            lcbex_vopt_find(options, noptions, "limit") ||
+            lcbex_vopt_find(options, noptions, "keys")) {
+        return LCB_EINVAL;
+    }
+    if (descending != ((join->flags & LCBEX_MERGEJOIN_F_DESCENDING) != 0)) {
+        return LCB_EINVAL;
+    }
+
+    *uri = lcbex_vqstr_make_uri(design, ndesign, view, nview,
+                                options, noptions);
+    return *uri ? LCB_SUCCESS : LCB_CLIENT_ENOMEM;
+}
+
+/**
+ * Compares two keys in the join's order
+ */
+static int compare_keys(const lcbex_mergejoin_t *join,
+                        const char *a, size_t na,
+                        const char *b, size_t nb)
+{
+    int rv = lcbex_vrow_collate(a, na, b, nb);
+    return (join->flags & LCBEX_MERGEJOIN_F_DESCENDING) ? -rv : rv;
+}
+
+static lcbex_vrow_t *head_row(join_side *side)
+{
+    return side->rows + side->head;
+}
+
+static int group_ready(const join_side *side)
+{
+    return side->group_complete || side->done;
+}
+
+/**
+ * Removes the head group, and works out the extent of the next one
+ */
+static void pop_group(const lcbex_mergejoin_t *join, join_side *side)
+{
+    size_t ii;
+    const lcbex_vrow_t *head;
+
+    for (ii = 0; ii < side->group_len; ii++) {
+        free((void *)side->rows[side->head + ii].key);
+    }
+    side->head += side->group_len;
+    side->nrows -= side->group_len;
+    side->group_len = 0;
+    side->group_complete = 0;
+
+    if (!side->nrows) {
+        side->head = 0;
+        return;
+    }
+
+    head = head_row(side);
+    for (side->group_len = 1; side->group_len < side->nrows;
+            side->group_len++) {
+        const lcbex_vrow_t *cur = head + side->group_len;
+        if (compare_keys(join, head->key, head->nkey,
+                         cur->key, cur->nkey) != 0) {
+            side->group_complete = 1;
+            break;
+        }
+    }
+}
+
+/**
+ * Emits every group which can no longer change
+ */
+static void process(lcbex_mergejoin_t *join)
+{
+    join_side *left = join->sides + LCBEX_MERGEJOIN_LEFT;
+    join_side *right = join->sides + LCBEX_MERGEJOIN_RIGHT;
+
+    for (;;) {
+        join_side *unmatched;
+        int emit;
+
+        if (left->nrows && right->nrows) {
+            const lcbex_vrow_t *lhead = head_row(left);
+            const lcbex_vrow_t *rhead = head_row(right);
+            int cmp = compare_keys(join, lhead->key, lhead->nkey,
+                                   rhead->key, rhead->nkey);
+
+            if (cmp == 0) {
+                if (!group_ready(left) || !group_ready(right)) {
+                    return;
+                }
+                join->stats.groups++;
+                join->callback(join, lhead->key, lhead->nkey,
+                               lhead, left->group_len,
+                               rhead, right->group_len,
+                               join->cookie);
+                pop_group(join, left);
+                pop_group(join, right);
+                continue;
+            }
+
+            /* the side which is behind cannot match anything more */
+            unmatched = cmp < 0 ? left : right;
+
+        } else if (left->nrows && right->done) {
+            unmatched = left;
+        } else if (right->nrows && left->done) {
+            unmatched = right;
+        } else {
+            return;
+        }
+
+        if (unmatched == left) {
+            emit = join->flags & LCBEX_MERGEJOIN_F_LEFT_OUTER;
+        } else {
+            emit = join->flags & LCBEX_MERGEJOIN_F_RIGHT_OUTER;
+        }
+
+        /**
+         * Rows which will not be emitted can be dropped straight away; an
+         * outer group must be complete first.
+         */
+        if (emit) {
+            const lcbex_vrow_t *head = head_row(unmatched);
+
+            if (!group_ready(unmatched)) {
+                return;
+            }
+            join->stats.groups++;
+            if (unmatched == left) {
+                join->callback(join, head->key, head->nkey,
+                               head, left->group_len, NULL, 0, join->cookie);
+            } else {
+                join->callback(join, head->key, head->nkey,
+                               NULL, 0, head, right->group_len, join->cookie);
+            }
+        }
+        pop_group(join, unmatched);
+    }
+}
+
+static lcb_error_t copy_row(const lcbex_vrow_t *src, lcbex_vrow_t *dst)
+{
+    size_t ntotal = src->nkey + src->nid + src->nvalue + src->ndoc;
+    char *buf, *p;
+
+    /* the key is always allocated, since it is what gets freed */
+    if ((buf = malloc(ntotal + 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    p = buf;
+
+    memset(dst, 0, sizeof(*dst));
+    memcpy(p, src->key, src->nkey);
+    dst->key = p;
+    dst->nkey = src->nkey;
+    p += src->nkey;
+
+    if (src->id) {
+        memcpy(p, src->id, src->nid);
+        dst->id = p;
+        dst->nid = src->nid;
+        p += src->nid;
+    }
+    if (src->value) {
+        memcpy(p, src->value, src->nvalue);
+        dst->value = p;
+        dst->nvalue = src->nvalue;
+        p += src->nvalue;
+    }
+    if (src->doc) {
+        memcpy(p, src->doc, src->ndoc);
+        dst->doc = p;
+        dst->ndoc = src->ndoc;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_mergejoin_add_row(lcbex_mergejoin_t *join, int side_ix,
+                                    const lcbex_vrow_t *row)
+{
+    join_side *side;
+    size_t nbuffered;
+    lcb_error_t err;
+
+    if (side_ix != LCBEX_MERGEJOIN_LEFT && side_ix != LCBEX_MERGEJOIN_RIGHT) {
+        return LCB_EINVAL;
+    }
+    side = join->sides + side_ix;
+    if (join->failed || side->done || !row->key || !row->nkey) {
+        return LCB_EINVAL;
+    }
+
+    /**
+     * Keys are compared by code point. If the server may order them
+     * differently, rows could be skipped as unmatched, so the join stops.
+     */
+    join->collate_mask |= lcbex_vrow_collate_class(row->key, row->nkey);
+    if (!LCBEX_VROW_COLLATE_EXACT(join->collate_mask)) {
+        join->failed = 1;
+        return LCB_EINVAL;
+    }
+
+    if (side->lastkey) {
+        int cmp = compare_keys(join, side->lastkey, side->nlastkey,
+                               row->key, row->nkey);
+        if (cmp > 0) {
+            return LCB_EINVAL;
+        }
+        if (side->nrows && !side->group_complete) {
+            /* the last row is part of the head group */
+            if (cmp == 0) {
+                side->group_len++;
+            } else {
+                side->group_complete = 1;
+            }
+        }
+    }
+    if (!side->nrows) {
+        side->group_len = 1;
+        side->group_complete = 0;
+    }
+
+    if (side->nlastkey_alloc < row->nkey) {
+        char *tmp = realloc(side->lastkey, row->nkey);
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        side->lastkey = tmp;
+        side->nlastkey_alloc = row->nkey;
+    }
+
+    /* make room, first by discarding consumed slots at the front */
+    if (side->head + side->nrows == side->nalloc) {
+        if (side->head) {
+            memmove(side->rows, side->rows + side->head,
+                    side->nrows * sizeof(*side->rows));
+            side->head = 0;
+        } else {
+            size_t n_alloc = side->nalloc ? side->nalloc * 2 : 16;
+            lcbex_vrow_t *tmp = realloc(side->rows,
+                                        n_alloc * sizeof(*side->rows));
+            if (!tmp) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            side->rows = tmp;
+            side->nalloc = n_alloc;
+        }
+    }
+
+    err = copy_row(row, side->rows + side->head + side->nrows);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+    side->nrows++;
+    memcpy(side->lastkey, row->key, row->nkey);
+    side->nlastkey = row->nkey;
+    join->stats.rows[side_ix]++;
+
+    nbuffered = join->sides[0].nrows + join->sides[1].nrows;
+    if (nbuffered > join->stats.max_buffered) {
+        join->stats.max_buffered = nbuffered;
+    }
+
+    process(join);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_mergejoin_side_done(lcbex_mergejoin_t *join, int side_ix)
+{
+    if (join->failed ||
+            (side_ix != LCBEX_MERGEJOIN_LEFT &&
+             side_ix != LCBEX_MERGEJOIN_RIGHT)) {
+        return LCB_EINVAL;
+    }
+    join->sides[side_ix].done = 1;
+    process(join);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+size_t lcbex_mergejoin_buffered(const lcbex_mergejoin_t *join, int side_ix)
+{
+    return join->sides[side_ix].nrows;
+}
+
+LCBEX_API
+void lcbex_mergejoin_get_stats(const lcbex_mergejoin_t *join,
+                               lcbex_mergejoin_stats_t *stats)
+{
+    *stats = join->stats;
+}
+
+LCBEX_API
+void lcbex_mergejoin_destroy(lcbex_mergejoin_t *join)
+{
+    int ii;
+    size_t jj;
+
+    if (!join) {
+        return;
+    }
+    for (ii = 0; ii < 2; ii++) {
+        join_side *side = join->sides + ii;
+        for (jj = 0; jj < side->nrows; jj++) {
+            free((void *)side->rows[side->head + jj].key);
+        }
+        free(side->rows);
+        free(side->lastkey);
+    }
+    free(join);
+}
@@ -0,0 +1,240 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/nodesel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct {
+    lcb_uint64_t selected;
+    lcb_uint64_t completed;
+    lcb_uint64_t errors;
+    unsigned int inflight;
+    /* latency average in nanoseconds, as of 'stamp' */
+    double latency;
+    lcb_uint64_t stamp;
+} node_state;
+
+struct lcbex_nodesel_st {
+    node_state *nodes;
+    size_t nnodes;
+    double decay;
+    lcb_uint64_t rand;
+    lcb_uint64_t total_selected;
+};
+
+/* xorshift64* */
+static lcb_uint64_t next_rand(lcbex_nodesel_t *sel)
+{
+    sel->rand ^= sel->rand >> 12;
+    sel->rand ^= sel->rand << 25;
+    sel->rand ^= sel->rand >> 27;
+    return sel->rand * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * The weight kept by the current average after 'elapsed' nanoseconds
+ */
+static double keep_weight(const lcbex_nodesel_t *sel, const node_state *node,
+                          lcb_uint64_t now)
+{
+    if (now <= node->stamp) {
+        return 1;
+    }
+    return exp(-(double)(now - node->stamp) / sel->decay);
+}
+
+static double node_cost(const lcbex_nodesel_t *sel, const node_state *node,
+                        lcb_uint64_t now)
+{
+    double latency = node->latency * keep_weight(sel, node, now);
+    /* a node without samples competes on requests in flight alone */
+    if (latency < 1) {
+        latency = 1;
+    }
+    return latency * (node->inflight + 1);
+}
+
+/**
+ * Starts a new node with the average latency of the nodes which have one,
+ * as of the most recent of their samples
+ */
+static void init_node(const lcbex_nodesel_t *sel, size_t nnodes,
+                      node_state *node)
+{
+    double sum = 0;
+    size_t ii, n = 0;
+
+    memset(node, 0, sizeof(*node));
+    for (ii = 0; ii < nnodes; ii++) {
+        if (sel->nodes[ii].completed) {
+            sum += sel->nodes[ii].latency;
+            n++;
+        }
+        if (sel->nodes[ii].stamp > node->stamp) {
+            node->stamp = sel->nodes[ii].stamp;
+        }
+    }
+    node->latency = n ? sum / n : 0;
+}
+
+LCBEX_API
+lcb_error_t lcbex_nodesel_create(lcbex_nodesel_t **sel,
+                                 size_t nnodes,
+                                 lcb_uint64_t decay,
+                                 lcb_uint64_t seed)
+{
+    lcbex_nodesel_t *ret;
+    lcb_error_t err;
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->decay = (double)(decay ? decay : LCBEX_NODESEL_DECAY_DEFAULT);
+    /* xorshift must not start at zero */
+    ret->rand = seed ? seed : 0x9E3779B97F4A7C15ULL;
+
+    if ((err = lcbex_nodesel_resize(ret, nnodes)) != LCB_SUCCESS) {
+        free(ret);
+        return err;
+    }
+    *sel = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_nodesel_resize(lcbex_nodesel_t *sel, size_t nnodes)
+{
+    node_state *tmp;
+    size_t old = sel->nnodes < nnodes ? sel->nnodes : nnodes;
+    size_t ii;
+
+    if (nnodes == 0) {
+        free(sel->nodes);
+        sel->nodes = NULL;
+        sel->nnodes = 0;
+        return LCB_SUCCESS;
+    }
+    if ((tmp = realloc(sel->nodes, nnodes * sizeof(*tmp))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    sel->nodes = tmp;
+    for (ii = old; ii < nnodes; ii++) {
+        init_node(sel, old, tmp + ii);
+    }
+    sel->nnodes = nnodes;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+size_t lcbex_nodesel_pick(lcbex_nodesel_t *sel, lcb_uint64_t now)
+{
+    size_t a, b;
+    node_state *node;
+
+    if (sel->nnodes == 0) {
+        return SIZE_MAX;
+    }
+
+    a = (size_t)(next_rand(sel) % sel->nnodes);
+    if (sel->nnodes > 1) {
+        /* a second node, distinct from the first */
+        b = (size_t)(next_rand(sel) % (sel->nnodes - 1));
+        if (b >= a) {
+            b++;
+        }
+        if (node_cost(sel, sel->nodes + b, now) <
+                node_cost(sel, sel->nodes + a, now)) {
+            a = b;
+        }
+    }
+
+    node = sel->nodes + a;
+    node->selected++;
+    node->inflight++;
+    sel->total_selected++;
+    return a;
+}
+
+LCBEX_API
+void lcbex_nodesel_done(lcbex_nodesel_t *sel, size_t node_index,
+                        lcb_uint64_t latency, int failed,
+                        lcb_uint64_t now)
+{
+    node_state *node;
+    double sample, current, w;
+
+    if (node_index >= sel->nnodes) {
+        /* the node went away in a resize */
+        return;
+    }
+    node = sel->nodes + node_index;
+
+    if (node->inflight) {
+        node->inflight--;
+    }
+    node->completed++;
+    if (failed) {
+        node->errors++;
+        if (latency < LCBEX_NODESEL_ERROR_PENALTY) {
+            latency = LCBEX_NODESEL_ERROR_PENALTY;
+        }
+    }
+
+    sample = (double)latency;
+    w = keep_weight(sel, node, now);
+    current = node->latency * w;
+    if (sample > current) {
+        /* react to a slowdown at once */
+        current = sample;
+    } else {
+        current += sample * (1 - w);
+    }
+    node->latency = current;
+    if (now > node->stamp) {
+        node->stamp = now;
+    }
+}
+
+LCBEX_API
+void lcbex_nodesel_get_stats(const lcbex_nodesel_t *sel, size_t node_index,
+                             lcbex_nodesel_stats_t *stats)
+{
+    const node_state *node;
+
+    memset(stats, 0, sizeof(*stats));
+    if (node_index >= sel->nnodes) {
+        return;
+    }
+    node = sel->nodes + node_index;
+    stats->selected = node->selected;
+    stats->completed = node->completed;
+    stats->errors = node->errors;
+    stats->inflight = node->inflight;
+    stats->latency = (lcb_uint64_t)node->latency;
+    if (sel->total_selected) {
+        stats->share = (double)node->selected / (double)sel->total_selected;
+    }
+}
+
+LCBEX_API
+void lcbex_nodesel_destroy(lcbex_nodesel_t *sel)
+{
+    free(sel->nodes);
+    free(sel);
+}
@@ -0,0 +1,643 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/planner.h>
+#include <lcbex/vrow.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * View query planner
+ * @author Mark Nunberg
+ */
+
+static const char *strategy_names[] = {
+    "single", "paginated", "range_partitioned", "keys_chunked"
+};
+
+/* extra cluster load of each additional request, as a fraction of a
+ * request's cost */
+#define EXTRA_REQUEST_FACTOR 0.25
+
+LCBEX_API
+void lcbex_plan_config_init(lcbex_plan_config_t *config)
+{
+    config->page_size = 1000;
+    config->max_request_rows = 10000;
+    config->keys_chunk_size = 256;
+    config->max_uri_length = 8192;
+    config->max_parallelism = 4;
+    config->request_cost = 200;
+}
+
+/**
+ * Returns a decoded copy of an option's value, or NULL. Free with free()
+ */
+static char *decode_value(const lcbex_vopt_t *opt, size_t *nout)
+{
+    char *buf = malloc(opt->noptval + 1);
+    if (!buf) {
+        return NULL;
+    }
+    *nout = lcbex_vopt_decode(opt, buf);
+    buf[*nout] = '\0';
+    return buf;
+}
+
+static int get_number(const lcbex_vopt_t *opt, double *out)
+{
+    size_t n;
+    char *end;
+    char *buf;
+    int ok;
+
+    if (!opt || (buf = decode_value(opt, &n)) == NULL) {
+        return 0;
+    }
+    *out = strtod(buf, &end);
+    ok = n && end == buf + n;
+    free(buf);
+    return ok;
+}
+
+static int opt_is_true(const lcbex_vopt_t *opt)
+{
+    return opt && opt->noptval == 4 && memcmp(opt->optval, "true", 4) == 0;
+}
+
+static int opt_is_false(const lcbex_vopt_t *opt)
+{
+    return opt && opt->noptval == 5 && memcmp(opt->optval, "false", 5) == 0;
+}
+
+static int is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Finds the top-level elements of a JSON array.
+ * If 'starts' and 'ends' are non-NULL, the offsets of each element are
+ * stored in them. Returns the number of elements.
+ */
+static size_t split_array(const char *s, size_t n, size_t *starts, size_t *ends)
+{
+    size_t ii, nelem = 0, elem_start = 0;
+    int depth = 0, in_str = 0, have_elem = 0, end_elem;
+
+    for (ii = 0; ii < n; ii++) {
+        char c = s[ii];
+
+        if (in_str) {
+            if (c == '\\') {
+                ii++;
+            } else if (c == '"') {
+                in_str = 0;
+            }
+            continue;
+        }
+
+        if (depth == 1 && !have_elem && c != ',' && c != ']' && !is_ws(c)) {
+            have_elem = 1;
+            elem_start = ii;
+        }
+
+        end_elem = 0;
+        if (c == '"') {
+            in_str = 1;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            end_elem = --depth == 0;
+        } else if (c == ',' && depth == 1) {
+            end_elem = 1;
+        }
+
+        if (end_elem && have_elem) {
+            if (starts) {
+                size_t end = ii;
+                while (end > elem_start && is_ws(s[end - 1])) {
+                    end--;
+                }
+                starts[nelem] = elem_start;
+                ends[nelem] = end;
+            }
+            nelem++;
+            have_elem = 0;
+        }
+        if (depth == 0 && end_elem) {
+            break;
+        }
+    }
+    return nelem;
+}
+
+static size_t div_ceil(size_t a, size_t b)
+{
+    return (a + b - 1) / b;
+}
+
+/**
+ * Wall-clock cost of running 'nparts' requests with the given parallelism.
+ * Each request beyond the first also adds a fraction of a request's cost,
+ * for the extra load it puts on the cluster.
+ */
+static double parallel_cost(const lcbex_plan_config_t *config, size_t nrows,
+                            size_t nparts, unsigned int parallelism)
+{
+    return div_ceil(nparts, parallelism) * config->request_cost +
+           (double)nrows / parallelism +
+           (nparts - 1) * config->request_cost * EXTRA_REQUEST_FACTOR;
+}
+
+LCBEX_API
+char *lcbex_plan_make_probe_uri(const char *design, size_t ndesign,
+                                const char *view, size_t nview,
+                                const lcbex_vopt_t *const *options,
+                                size_t noptions)
+{
+    lcbex_vopt_t overrides[2];
+    const lcbex_vopt_t *override_list[2];
+    int optid, zero = 0;
+    char *errstr;
+    char *ret;
+
+    optid = LCBEX_VOPT_OPT_LIMIT;
+    lcbex_vopt_assign(&overrides[0], &optid, 0, &zero, 0,
+                      LCBEX_VOPT_F_OPTNAME_NUMERIC | LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                      &errstr);
+    optid = LCBEX_VOPT_OPT_SKIP;
+    lcbex_vopt_assign(&overrides[1], &optid, 0, &zero, 0,
+                      LCBEX_VOPT_F_OPTNAME_NUMERIC | LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                      &errstr);
+    override_list[0] = &overrides[0];
+    override_list[1] = &overrides[1];
+
+    ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                        options, noptions, override_list, 2);
+    lcbex_vopt_cleanup(&overrides[0]);
+    lcbex_vopt_cleanup(&overrides[1]);
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_plan_create(lcbex_plan_t *plan,
+                              const lcbex_plan_config_t *config,
+                              const lcbex_vopt_t *const *options,
+                              size_t noptions,
+                              size_t total_rows)
+{
+    const lcbex_vopt_t *keys, *reduce, *group, *group_level, *limit, *skip;
+    const lcbex_vopt_t *descending;
+    double dlimit = 0, dskip = 0;
+    size_t nrows;
+    int splittable, has_range, known;
+    int ii, best;
+
+    memset(plan, 0, sizeof(*plan));
+    if (config) {
+        plan->config = *config;
+    } else {
+        lcbex_plan_config_init(&plan->config);
+    }
+    config = &plan->config;
+    if (!config->page_size || !config->max_request_rows ||
+            !config->keys_chunk_size || !config->max_parallelism) {
+        return LCB_EINVAL;
+    }
+
+    keys = lcbex_vopt_find(options, noptions, "keys");
+    reduce = lcbex_vopt_find(options, noptions, "reduce");
+    group = lcbex_vopt_find(options, noptions, "group");
+    group_level = lcbex_vopt_find(options, noptions, "group_level");
+    limit = lcbex_vopt_find(options, noptions, "limit");
+    skip = lcbex_vopt_find(options, noptions, "skip");
+    descending = lcbex_vopt_find(options, noptions, "descending");
+
+    plan->descending = opt_is_true(descending);
+
+    if (keys) {
+        size_t n;
+        char *buf = decode_value(keys, &n);
+        if (!buf) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        plan->nkeys = split_array(buf, n, NULL, NULL);
+        free(buf);
+    }
+
+    /**
+     * Splitting must not change the result. A query which may reduce
+     * without grouping returns a single row for all its input, and limit
+     * and skip apply to the whole result.
+     */
+    splittable = (opt_is_false(reduce) || opt_is_true(group) ||
+                  group_level != NULL) && limit == NULL;
+    if (skip && (get_number(skip, &dskip) == 0 || dskip != 0)) {
+        splittable = 0;
+    }
+
+    has_range = !keys &&
+                get_number(lcbex_vopt_find(options, noptions, "startkey"),
+                           &plan->range_start) &&
+                get_number(lcbex_vopt_find(options, noptions, "endkey"),
+                           &plan->range_end) &&
+                lcbex_vopt_find(options, noptions, "startkey_docid") == NULL &&
+                lcbex_vopt_find(options, noptions, "endkey_docid") == NULL;
+
+    /* estimate the number of rows */
+    known = 1;
+    if (opt_is_true(reduce) && !opt_is_true(group) && !group_level) {
+        nrows = 1;
+    } else if (keys) {
+        nrows = plan->nkeys;
+    } else if (total_rows != SIZE_MAX) {
+        nrows = total_rows;
+    } else {
+        known = 0;
+        nrows = config->page_size;
+    }
+
+    if (limit && get_number(limit, &dlimit) && dlimit >= 0) {
+        if (!known || dlimit < (double)nrows) {
+            nrows = (size_t)dlimit;
+        }
+        known = 1;
+    }
+    plan->estimated_rows = known ? nrows : SIZE_MAX;
+
+    for (ii = 0; ii < 4; ii++) {
+        plan->costs[ii] = -1;
+    }
+
+    /* single */
+    if (nrows <= config->max_request_rows &&
+            (!keys || keys->noptval < config->max_uri_length)) {
+        plan->costs[LCBEX_PLAN_SINGLE] = config->request_cost + nrows;
+    }
+
+    /* paginated (keyset). Pages replace the limit with the page size */
+    if (!keys && limit == NULL) {
+        size_t npages = div_ceil(nrows ? nrows : 1, config->page_size);
+        plan->costs[LCBEX_PLAN_PAGINATED] =
+            npages * config->request_cost + nrows;
+    }
+
+    /* range partitioned. Only when the size is known; splitting an
+     * unknown range speculatively costs more than it saves */
+    if (has_range && splittable && known && total_rows != SIZE_MAX &&
+            plan->range_start != plan->range_end) {
+        size_t nparts = div_ceil(nrows, config->max_request_rows);
+        if (nparts < config->max_parallelism) {
+            nparts = config->max_parallelism;
+        }
+        plan->costs[LCBEX_PLAN_RANGE_PARTITIONED] =
+            parallel_cost(config, nrows, nparts, config->max_parallelism);
+    }
+
+    /* chunked keys */
+    if (keys && splittable && plan->nkeys > config->keys_chunk_size) {
+        size_t nchunks = div_ceil(plan->nkeys, config->keys_chunk_size);
+        unsigned int par = nchunks < config->max_parallelism ?
+                           (unsigned int)nchunks : config->max_parallelism;
+        plan->costs[LCBEX_PLAN_KEYS_CHUNKED] =
+            parallel_cost(config, nrows, nchunks, par);
+    }
+
+    best = -1;
+    for (ii = 0; ii < 4; ii++) {
+        if (plan->costs[ii] >= 0 &&
+                (best < 0 || plan->costs[ii] < plan->costs[best])) {
+            best = ii;
+        }
+    }
+    if (best < 0) {
+        /* nothing fits the limits; do it in one go */
+        best = LCBEX_PLAN_SINGLE;
+    }
+
+    plan->strategy = (lcbex_plan_strategy_t)best;
+    switch (plan->strategy) {
+    case LCBEX_PLAN_PAGINATED:
+        plan->nparts = div_ceil(nrows ? nrows : 1, config->page_size);
+        plan->parallelism = 1;
+        break;
+
+    case LCBEX_PLAN_RANGE_PARTITIONED:
+        plan->nparts = div_ceil(nrows, config->max_request_rows);
+        if (plan->nparts < config->max_parallelism) {
+            plan->nparts = config->max_parallelism;
+        }
+        plan->parallelism = config->max_parallelism;
+        break;
+
+    case LCBEX_PLAN_KEYS_CHUNKED:
+        plan->nparts = div_ceil(plan->nkeys, config->keys_chunk_size);
+        plan->parallelism = plan->nparts < config->max_parallelism ?
+                            (unsigned int)plan->nparts : config->max_parallelism;
+        break;
+
+    default:
+        plan->nparts = 1;
+        plan->parallelism = 1;
+        break;
+    }
+
+    return LCB_SUCCESS;
+}
+
+static void append_fmt(char *buf, size_t nbuf, size_t *nw,
+                       const char *fmt, ...)
+{
+    va_list ap;
+    int rv;
+
+    va_start(ap, fmt);
+    rv = vsnprintf(*nw < nbuf ? buf + *nw : NULL,
+                   *nw < nbuf ? nbuf - *nw : 0, fmt, ap);
+    va_end(ap);
+    if (rv > 0) {
+        *nw += rv;
+    }
+}
+
+LCBEX_API
+size_t lcbex_plan_explain(const lcbex_plan_t *plan, char *buf, size_t nbuf)
+{
+    size_t nw = 0;
+    int ii;
+
+    append_fmt(buf, nbuf, &nw, "strategy: %s\n",
+               strategy_names[plan->strategy]);
+    append_fmt(buf, nbuf, &nw, "parallelism: %u\n", plan->parallelism);
+    append_fmt(buf, nbuf, &nw, "requests: %lu\n", (unsigned long)plan->nparts);
+    if (plan->estimated_rows == SIZE_MAX) {
+        append_fmt(buf, nbuf, &nw, "estimated rows: unknown\n");
+    } else {
+        append_fmt(buf, nbuf, &nw, "estimated rows: %lu\n",
+                   (unsigned long)plan->estimated_rows);
+    }
+    if (plan->nkeys) {
+        append_fmt(buf, nbuf, &nw, "keys: %lu\n", (unsigned long)plan->nkeys);
+    }
+    append_fmt(buf, nbuf, &nw, "costs:");
+    for (ii = 0; ii < 4; ii++) {
+        if (plan->costs[ii] < 0) {
+            append_fmt(buf, nbuf, &nw, " %s=n/a", strategy_names[ii]);
+        } else {
+            append_fmt(buf, nbuf, &nw, " %s=%.0f", strategy_names[ii],
+                       plan->costs[ii]);
+        }
+    }
+    append_fmt(buf, nbuf, &nw, "\n");
+    return nw;
+}
+
+static char *make_keys_chunk_uri(const lcbex_plan_t *plan, size_t index,
+                                 const char *design, size_t ndesign,
+                                 const char *view, size_t nview,
+                                 const lcbex_vopt_t *const *options,
+                                 size_t noptions)
+{
+    const lcbex_vopt_t *keys = lcbex_vopt_find(options, noptions, "keys");
+    size_t *starts = NULL, *ends = NULL;
+    size_t nbuf, nelem, first, last, ii, nchunk = 0;
+    char *buf = NULL, *chunk = NULL, *ret = NULL;
+    lcbex_vopt_t override;
+    const lcbex_vopt_t *override_list[1];
+    char *errstr;
+
+    if (!keys || (buf = decode_value(keys, &nbuf)) == NULL) {
+        return NULL;
+    }
+
+    nelem = plan->nkeys;
+    starts = malloc(sizeof(*starts) * (nelem + 1));
+    ends = malloc(sizeof(*ends) * (nelem + 1));
+    chunk = malloc(nbuf + 3);
+    if (!starts || !ends || !chunk) {
+        goto GT_DONE;
+    }
+
+    split_array(buf, nbuf, starts, ends);
+    first = index * plan->config.keys_chunk_size;
+    last = first + plan->config.keys_chunk_size;
+    if (last > nelem) {
+        last = nelem;
+    }
+    if (first >= last) {
+        goto GT_DONE;
+    }
+
+    chunk[nchunk++] = '[';
+    for (ii = first; ii < last; ii++) {
+        if (ii != first) {
+            chunk[nchunk++] = ',';
+        }
+        memcpy(chunk + nchunk, buf + starts[ii], ends[ii] - starts[ii]);
+        nchunk += ends[ii] - starts[ii];
+    }
+    chunk[nchunk++] = ']';
+
+    if (lcbex_vopt_assign(&override, "keys", 4, chunk, nchunk,
+                          keys->flags & LCBEX_VOPT_F_PCTENCODE_ANY,
+                          &errstr) == LCB_SUCCESS) {
+        override_list[0] = &override;
+        ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                            options, noptions,
+                                            override_list, 1);
+    }
+    lcbex_vopt_cleanup(&override);
+
+GT_DONE:
+    free(buf);
+    free(starts);
+    free(ends);
+    free(chunk);
+    return ret;
+}
+
+static char *make_range_part_uri(const lcbex_plan_t *plan, size_t index,
+                                 const char *design, size_t ndesign,
+                                 const char *view, size_t nview,
+                                 const lcbex_vopt_t *const *options,
+                                 size_t noptions)
+{
+    const lcbex_vopt_t *skey = lcbex_vopt_find(options, noptions, "startkey");
+    lcbex_vopt_t overrides[3];
+    const lcbex_vopt_t *override_list[3];
+    size_t noverrides = 0, ii;
+    double start, end;
+    char numbuf[2][LCBEX_VOPT_DOUBLE_BUFSIZE];
+    int flags = skey->flags & LCBEX_VOPT_F_PCTENCODE_ANY;
+    char *errstr;
+    char *ret = NULL;
+
+    memset(overrides, 0, sizeof(overrides));
+    lcbex_plan_get_part_range(plan, index, &start, &end);
+
+    /* the first and last partitions keep the user's bounds */
+    if (index > 0) {
+        if (!lcbex_vopt_format_double(start, numbuf[0]) ||
+                lcbex_vopt_assign(&overrides[noverrides++], "startkey", -1,
+                                  numbuf[0], -1, flags, &errstr) != LCB_SUCCESS) {
+            goto GT_DONE;
+        }
+    }
+    if (index + 1 < plan->nparts) {
+        if (!lcbex_vopt_format_double(end, numbuf[1]) ||
+                lcbex_vopt_assign(&overrides[noverrides++], "endkey", -1,
+                                  numbuf[1], -1, flags, &errstr) != LCB_SUCCESS ||
+                lcbex_vopt_assign(&overrides[noverrides++], "inclusive_end", -1,
+                                  "false", -1, 0, &errstr) != LCB_SUCCESS) {
+            goto GT_DONE;
+        }
+    }
+
+    for (ii = 0; ii < noverrides; ii++) {
+        override_list[ii] = &overrides[ii];
+    }
+    ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                        options, noptions,
+                                        override_list, noverrides);
+
+GT_DONE:
+    for (ii = 0; ii < noverrides; ii++) {
+        lcbex_vopt_cleanup(&overrides[ii]);
+    }
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_plan_get_part_range(const lcbex_plan_t *plan, size_t index,
+                                      double *start, double *end)
+{
+    double width;
+
+    if (plan->strategy != LCBEX_PLAN_RANGE_PARTITIONED ||
+            index >= plan->nparts) {
+        return LCB_EINVAL;
+    }
+    width = (plan->range_end - plan->range_start) / plan->nparts;
+    *start = plan->range_start + width * index;
+    /* avoid rounding away from the user's bound */
+    *end = index + 1 == plan->nparts ? plan->range_end :
+           plan->range_start + width * (index + 1);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+char *lcbex_plan_make_part_uri(const lcbex_plan_t *plan, size_t index,
+                               const char *design, size_t ndesign,
+                               const char *view, size_t nview,
+                               const lcbex_vopt_t *const *options,
+                               size_t noptions)
+{
+    if (index >= plan->nparts) {
+        return NULL;
+    }
+
+    switch (plan->strategy) {
+    case LCBEX_PLAN_SINGLE:
+        return lcbex_vqstr_make_uri(design, ndesign, view, nview,
+                                    options, noptions);
+    case LCBEX_PLAN_KEYS_CHUNKED:
+        return make_keys_chunk_uri(plan, index, design, ndesign, view, nview,
+                                   options, noptions);
+    case LCBEX_PLAN_RANGE_PARTITIONED:
+        return make_range_part_uri(plan, index, design, ndesign, view, nview,
+                                   options, noptions);
+    default:
+        return NULL;
+    }
+}
+
+LCBEX_API
+char *lcbex_plan_make_page_uri(const lcbex_plan_t *plan,
+                               const char *design, size_t ndesign,
+                               const char *view, size_t nview,
+                               const lcbex_vopt_t *const *options,
+                               size_t noptions,
+                               const char *last_key, size_t nlast_key,
+                               const char *last_id, size_t nlast_id)
+{
+    lcbex_vopt_t overrides[4];
+    const lcbex_vopt_t *override_list[4];
+    size_t noverrides = 0, ii;
+    int optid, ival;
+    char *errstr;
+    char *idbuf = NULL;
+    char *ret = NULL;
+
+    memset(overrides, 0, sizeof(overrides));
+
+    optid = LCBEX_VOPT_OPT_LIMIT;
+    ival = (int)plan->config.page_size;
+    if (lcbex_vopt_assign(&overrides[noverrides++], &optid, 0, &ival, 0,
+                          LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                          LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                          &errstr) != LCB_SUCCESS) {
+        goto GT_DONE;
+    }
+
+    if (last_key) {
+        /* resume at the last row, and skip over it */
+        optid = LCBEX_VOPT_OPT_SKIP;
+        ival = 1;
+        if (lcbex_vopt_assign(&overrides[noverrides++], &optid, 0, &ival, 0,
+                              LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                              LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                              &errstr) != LCB_SUCCESS ||
+                lcbex_vopt_assign(&overrides[noverrides++], "startkey", -1,
+                                  last_key, nlast_key,
+                                  LCBEX_VOPT_F_PCTENCODE, &errstr) != LCB_SUCCESS) {
+            goto GT_DONE;
+        }
+
+        /* the docid is a raw string, not JSON */
+        if (last_id) {
+            const char *id;
+            size_t nid;
+
+            if ((idbuf = malloc(nlast_id)) == NULL ||
+                    lcbex_vrow_unescape(last_id, nlast_id, idbuf,
+                                        &id, &nid) != LCB_SUCCESS ||
+                    lcbex_vopt_assign(&overrides[noverrides++],
+                                      "startkey_docid", -1, id, nid,
+                                      LCBEX_VOPT_F_PCTENCODE,
+                                      &errstr) != LCB_SUCCESS) {
+                goto GT_DONE;
+            }
+        }
+    }
+
+    for (ii = 0; ii < noverrides; ii++) {
+        override_list[ii] = &overrides[ii];
+    }
+    ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                        options, noptions,
+                                        override_list, noverrides);
+
+GT_DONE:
+    for (ii = 0; ii < noverrides; ii++) {
+        lcbex_vopt_cleanup(&overrides[ii]);
+    }
+    free(idbuf);
+    return ret;
+}
@@ -0,0 +1,665 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/prefetch.h>
+#include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Prefetching of predictable follow-up view queries
+ */
+
+/* options whose integers may step: skip, startkey, endkey */
+#define MAX_COORDS 3
+/* longest decoded value searched for an integer */
+#define MAX_COORD_VALUE 128
+/* integers are kept in doubles, exactly up to 2^53 */
+#define MAX_DIGITS 15
+/* equal steps in a row after which the next is predicted */
+#define STEPS_TO_PREDICT 2
+/* predictions waiting for lcbex_prefetch_next */
+#define MAX_PENDING 16
+
+/**
+ * An integer in an option's value: the whole value, or the last element
+ * of an array
+ */
+typedef struct {
+    const lcbex_vopt_t *opt;
+    size_t index;
+    char text[MAX_COORD_VALUE + 1];
+    size_t ntext;
+    /* the integer is text[nprefix..ntext - nsuffix) */
+    size_t nprefix;
+    size_t nsuffix;
+    double value;
+} coord;
+
+/**
+ * What must match for two queries to be steps of one stream: the design,
+ * view and options, less the integers. Each piece is stored after its
+ * length so that adjacent pieces can't run together.
+ */
+typedef struct {
+    char *data;
+    size_t ndata;
+    size_t nalloc;
+    lcb_uint64_t hash;
+} shape_key;
+
+typedef struct {
+    /* shape_key hash and bytes */
+    lcb_uint64_t shape;
+    char *key;
+    size_t nkey;
+    lcb_uint64_t last_seen;
+    double values[MAX_COORDS];
+    double step[MAX_COORDS];
+    unsigned int nsteps;
+    int has_values;
+} stream;
+
+typedef struct {
+    char *uri;
+    size_t nuri;
+    lcb_uint64_t hash;
+    lcb_uint64_t id;
+    int inflight;
+} candidate;
+
+typedef struct {
+    lcb_uint64_t hash;
+    int valid;
+    int used;
+} tracked;
+
+struct lcbex_prefetch_st {
+    lcbex_prefetch_config_t config;
+
+    stream *streams;
+    size_t nstreams;
+    /* scratch key of the query being observed */
+    shape_key key;
+
+    /* pending predictions in order of arrival, and prefetches in flight */
+    candidate *candidates;
+    size_t ncandidates;
+    size_t maxcandidates;
+    unsigned int ninflight;
+
+    /* ring of the most recent prefetched results */
+    tracked *tracked;
+    size_t tracked_pos;
+
+    double tokens;
+    lcb_uint64_t next_id;
+    lcbex_prefetch_stats_t stats;
+};
+
+static int add_piece(shape_key *key, const void *buf, size_t n)
+{
+    size_t needed = key->ndata + sizeof(n) + n;
+
+    if (needed > key->nalloc) {
+        size_t nalloc = key->nalloc ? key->nalloc : 256;
+        char *tmp;
+        while (nalloc < needed) {
+            nalloc *= 2;
+        }
+        if ((tmp = realloc(key->data, nalloc)) == NULL) {
+            return -1;
+        }
+        key->data = tmp;
+        key->nalloc = nalloc;
+    }
+
+    memcpy(key->data + key->ndata, &n, sizeof(n));
+    if (n) {
+        memcpy(key->data + key->ndata + sizeof(n), buf, n);
+    }
+    key->ndata = needed;
+    key->hash = lcbex_hash64(buf, n, key->hash + n);
+    return 0;
+}
+
+static int name_is(const lcbex_vopt_t *opt, const char *name)
+{
+    size_t n = strlen(name);
+    return opt->noptname == n && memcmp(opt->optname, name, n) == 0;
+}
+
+static int is_coord_option(const lcbex_vopt_t *opt)
+{
+    return name_is(opt, "skip") || name_is(opt, "startkey") ||
+           name_is(opt, "endkey");
+}
+
+/**
+ * Finds the integer in a decoded value
+ * @return 1 if found
+ */
+static int parse_coord(coord *c)
+{
+    size_t end = c->ntext, begin, ndigits;
+    const char *p = c->text;
+
+    c->nsuffix = 0;
+    if (end && p[end - 1] == ']') {
+        c->nsuffix = 1;
+        end--;
+    }
+
+    begin = end;
+    while (begin && p[begin - 1] >= '0' && p[begin - 1] <= '9') {
+        begin--;
+    }
+    ndigits = end - begin;
+    if (!ndigits || ndigits > MAX_DIGITS ||
+            (ndigits > 1 && p[begin] == '0')) {
+        return 0;
+    }
+    if (begin && p[begin - 1] == '-') {
+        begin--;
+    }
+
+    if (c->nsuffix) {
+        if (!begin || (p[begin - 1] != '[' && p[begin - 1] != ',')) {
+            return 0;
+        }
+    } else if (begin) {
+        return 0;
+    }
+
+    c->nprefix = begin;
+    c->value = strtod(p + begin, NULL);
+    return 1;
+}
+
+/**
+ * Finds the integers in the options, and builds the key of the rest
+ * @return LCB_CLIENT_ENOMEM if the key could not be grown
+ */
+static lcb_error_t get_coords(const char *design, size_t ndesign,
+                              const char *view, size_t nview,
+                              const lcbex_vopt_t *const *options,
+                              size_t noptions,
+                              coord *coords, size_t *ncoords_out,
+                              shape_key *key)
+{
+    size_t ii, ncoords = 0;
+    int rv;
+
+    key->ndata = 0;
+    key->hash = 0;
+    rv = add_piece(key, design, ndesign);
+    rv |= add_piece(key, view, nview);
+
+    for (ii = 0; ii < noptions; ii++) {
+        const lcbex_vopt_t *opt = options[ii];
+        coord *c = coords + ncoords;
+
+        rv |= add_piece(key, opt->optname, opt->noptname);
+        if (ncoords < MAX_COORDS && is_coord_option(opt) &&
+                opt->noptval <= MAX_COORD_VALUE) {
+            c->ntext = lcbex_vopt_decode(opt, c->text);
+            c->text[c->ntext] = '\0';
+            if (parse_coord(c)) {
+                c->opt = opt;
+                c->index = ii;
+                rv |= add_piece(key, c->text, c->nprefix);
+                rv |= add_piece(key, c->text + c->ntext - c->nsuffix,
+                                c->nsuffix);
+                ncoords++;
+                continue;
+            }
+        }
+        rv |= add_piece(key, opt->optval, opt->noptval);
+    }
+
+    /* streams of different numbers of integers must not meet */
+    rv |= add_piece(key, &ncoords, sizeof(ncoords));
+    *ncoords_out = ncoords;
+    return rv ? LCB_CLIENT_ENOMEM : LCB_SUCCESS;
+}
+
+/**
+ * Finds the stream of a shape, replacing the least recently seen stream if
+ * there is none
+ * @return the stream, or NULL if memory could not be allocated
+ */
+static stream *get_stream(lcbex_prefetch_t *pf, const shape_key *key,
+                          lcb_uint64_t now)
+{
+    size_t ii;
+    stream *st, *oldest = NULL;
+    char *copy;
+
+    for (ii = 0; ii < pf->nstreams; ii++) {
+        st = pf->streams + ii;
+        if (st->shape == key->hash && st->nkey == key->ndata &&
+                memcmp(st->key, key->data, key->ndata) == 0) {
+            st->last_seen = now;
+            return st;
+        }
+        if (!oldest || st->last_seen < oldest->last_seen) {
+            oldest = st;
+        }
+    }
+
+    if ((copy = malloc(key->ndata)) == NULL) {
+        return NULL;
+    }
+    memcpy(copy, key->data, key->ndata);
+
+    if (pf->nstreams < pf->config.max_streams) {
+        st = pf->streams + pf->nstreams++;
+    } else {
+        st = oldest;
+        free(st->key);
+    }
+    memset(st, 0, sizeof(*st));
+    st->shape = key->hash;
+    st->key = copy;
+    st->nkey = key->ndata;
+    st->last_seen = now;
+    return st;
+}
+
+/**
+ * Records the new position of a stream
+ * @return 1 if the stream has stepped evenly often enough to predict
+ */
+static int advance_stream(stream *st, const coord *coords, size_t ncoords)
+{
+    size_t ii;
+    int same = 1, moved = 0;
+    double steps[MAX_COORDS];
+
+    for (ii = 0; ii < ncoords; ii++) {
+        steps[ii] = coords[ii].value - st->values[ii];
+        if (steps[ii] != 0) {
+            moved = 1;
+        }
+        if (steps[ii] != st->step[ii]) {
+            same = 0;
+        }
+    }
+
+    if (st->has_values && !moved) {
+        /* the same query again (e.g. a refresh) */
+        return 0;
+    }
+
+    for (ii = 0; ii < ncoords; ii++) {
+        st->step[ii] = steps[ii];
+        st->values[ii] = coords[ii].value;
+    }
+
+    if (!st->has_values) {
+        st->nsteps = 0;
+    } else if (same) {
+        st->nsteps++;
+    } else {
+        st->nsteps = 1;
+    }
+    st->has_values = 1;
+    return st->nsteps >= STEPS_TO_PREDICT;
+}
+
+static candidate *find_candidate(lcbex_prefetch_t *pf, lcb_uint64_t hash)
+{
+    size_t ii;
+    for (ii = 0; ii < pf->ncandidates; ii++) {
+        if (pf->candidates[ii].hash == hash) {
+            return pf->candidates + ii;
+        }
+    }
+    return NULL;
+}
+
+static void remove_candidate(lcbex_prefetch_t *pf, candidate *cand)
+{
+    size_t index = cand - pf->candidates;
+    if (cand->inflight) {
+        pf->ninflight--;
+    }
+    free(cand->uri);
+    memmove(cand, cand + 1,
+            (pf->ncandidates - index - 1) * sizeof(*cand));
+    pf->ncandidates--;
+}
+
+static tracked *find_tracked(lcbex_prefetch_t *pf, lcb_uint64_t hash)
+{
+    size_t ii;
+    for (ii = 0; ii < pf->config.max_tracked; ii++) {
+        if (pf->tracked[ii].valid && pf->tracked[ii].hash == hash) {
+            return pf->tracked + ii;
+        }
+    }
+    return NULL;
+}
+
+static void add_tracked(lcbex_prefetch_t *pf, lcb_uint64_t hash)
+{
+    tracked *tr = find_tracked(pf, hash);
+
+    if (!tr) {
+        tr = pf->tracked + pf->tracked_pos;
+        pf->tracked_pos = (pf->tracked_pos + 1) % pf->config.max_tracked;
+        if (tr->valid && !tr->used) {
+            pf->stats.wasted++;
+        }
+    }
+    tr->hash = hash;
+    tr->valid = 1;
+    tr->used = 0;
+}
+
+/**
+ * Builds the query one step further along the stream, and queues it
+ */
+static lcb_error_t predict(lcbex_prefetch_t *pf,
+                           const char *design, size_t ndesign,
+                           const char *view, size_t nview,
+                           const lcbex_vopt_t *const *options,
+                           size_t noptions,
+                           const stream *st,
+                           const coord *coords, size_t ncoords)
+{
+    const lcbex_vopt_t *sbuf[32];
+    const lcbex_vopt_t **next = sbuf;
+    lcbex_vopt_t stepped[MAX_COORDS];
+    char text[MAX_COORD_VALUE + 32];
+    lcb_error_t err = LCB_SUCCESS;
+    candidate *cand;
+    size_t ii, nassigned = 0, nuri;
+    lcb_uint64_t hash;
+    char *uri = NULL;
+    char *errstr;
+
+    if (noptions > sizeof(sbuf) / sizeof(sbuf[0])) {
+        next = malloc(noptions * sizeof(*next));
+        if (!next) {
+            return LCB_CLIENT_ENOMEM;
+        }
+    }
+    memcpy(next, options, noptions * sizeof(*next));
+    memset(stepped, 0, sizeof(stepped));
+
+    for (ii = 0; ii < ncoords; ii++) {
+        const coord *c = coords + ii;
+        double value = c->value + st->step[ii];
+        size_t n;
+
+        if (value < 0 && name_is(c->opt, "skip")) {
+            /* paged back past the first row */
+            goto GT_DONE;
+        }
+
+        memcpy(text, c->text, c->nprefix);
+        n = c->nprefix;
+        n += sprintf(text + n, "%.0f", value);
+        memcpy(text + n, c->text + c->ntext - c->nsuffix, c->nsuffix);
+        n += c->nsuffix;
+
+        /* encode the value as the application did */
+        if (lcbex_vopt_assign(&stepped[nassigned], c->opt->optname,
+                              c->opt->noptname, text, n,
+                              c->opt->flags & (LCBEX_VOPT_F_PCTENCODE_ANY |
+                                               LCBEX_VOPT_F_PASSTHROUGH),
+                              &errstr) != LCB_SUCCESS) {
+            goto GT_DONE;
+        }
+        next[c->index] = &stepped[nassigned++];
+    }
+
+    uri = lcbex_vqstr_make_uri(design, ndesign, view, nview, next, noptions);
+    if (!uri) {
+        err = LCB_CLIENT_ENOMEM;
+        goto GT_DONE;
+    }
+    nuri = strlen(uri);
+    hash = lcbex_hash64(uri, nuri, 0);
+    if (find_candidate(pf, hash) || find_tracked(pf, hash)) {
+        goto GT_DONE;
+    }
+
+    if (pf->ncandidates == pf->maxcandidates) {
+        /* forget the oldest prediction not yet in flight */
+        for (ii = 0; pf->candidates[ii].inflight; ii++) {
+        }
+        remove_candidate(pf, pf->candidates + ii);
+    }
+    cand = pf->candidates + pf->ncandidates++;
+    memset(cand, 0, sizeof(*cand));
+    cand->uri = uri;
+    cand->nuri = nuri;
+    cand->hash = hash;
+    uri = NULL;
+    pf->stats.predicted++;
+
+GT_DONE:
+    free(uri);
+    for (ii = 0; ii < nassigned; ii++) {
+        lcbex_vopt_cleanup(&stepped[ii]);
+    }
+    if (next != sbuf) {
+        free(next);
+    }
+    return err;
+}
+
+LCBEX_API
+void lcbex_prefetch_config_init(lcbex_prefetch_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->budget = 0.5;
+    config->burst = 4;
+    config->max_inflight = 2;
+    config->max_streams = 64;
+    config->max_tracked = 256;
+}
+
+LCBEX_API
+lcb_error_t lcbex_prefetch_create(lcbex_prefetch_t **pf,
+                                  const lcbex_prefetch_config_t *config)
+{
+    lcbex_prefetch_t *ret;
+
+    if (config->budget < 0 || !config->max_inflight ||
+            !config->max_streams || !config->max_tracked) {
+        return LCB_EINVAL;
+    }
+
+    ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->config = *config;
+    ret->maxcandidates = config->max_inflight + MAX_PENDING;
+    ret->streams = calloc(config->max_streams, sizeof(*ret->streams));
+    ret->candidates = calloc(ret->maxcandidates, sizeof(*ret->candidates));
+    ret->tracked = calloc(config->max_tracked, sizeof(*ret->tracked));
+    if (!ret->streams || !ret->candidates || !ret->tracked) {
+        lcbex_prefetch_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    *pf = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_prefetch_observe(lcbex_prefetch_t *pf,
+                                   const char *design, size_t ndesign,
+                                   const char *view, size_t nview,
+                                   const lcbex_vopt_t *const *options,
+                                   size_t noptions,
+                                   lcb_uint64_t now)
+{
+    coord coords[MAX_COORDS];
+    size_t ncoords;
+    lcb_uint64_t hash;
+    lcb_error_t err;
+    candidate *cand;
+    tracked *tr;
+    stream *st;
+    char *uri;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    uri = lcbex_vqstr_make_uri(design, ndesign, view, nview,
+                               options, noptions);
+    if (!uri) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    hash = lcbex_hash64(uri, strlen(uri), 0);
+    free(uri);
+
+    pf->stats.observed++;
+    if ((tr = find_tracked(pf, hash)) != NULL && !tr->used) {
+        tr->used = 1;
+        pf->stats.hits++;
+    }
+    if ((cand = find_candidate(pf, hash)) != NULL) {
+        if (cand->inflight) {
+            pf->stats.late++;
+        } else {
+            /* the application is fetching it itself */
+            remove_candidate(pf, cand);
+        }
+    }
+
+    pf->tokens += pf->config.budget;
+    if (pf->tokens > pf->config.burst) {
+        pf->tokens = pf->config.burst;
+    }
+
+    err = get_coords(design, ndesign, view, nview, options, noptions,
+                     coords, &ncoords, &pf->key);
+    if (err != LCB_SUCCESS || !ncoords) {
+        return err;
+    }
+
+    if ((st = get_stream(pf, &pf->key, now)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (!advance_stream(st, coords, ncoords)) {
+        return LCB_SUCCESS;
+    }
+    return predict(pf, design, ndesign, view, nview, options, noptions,
+                   st, coords, ncoords);
+}
+
+LCBEX_API
+const char *lcbex_prefetch_next(lcbex_prefetch_t *pf,
+                                lcb_uint64_t *id, size_t *nuri)
+{
+    size_t ii = pf->ncandidates;
+    candidate *cand;
+
+    if (pf->ninflight >= pf->config.max_inflight || pf->tokens < 1) {
+        return NULL;
+    }
+
+    while (ii--) {
+        cand = pf->candidates + ii;
+        if (cand->inflight) {
+            continue;
+        }
+        cand->inflight = 1;
+        cand->id = ++pf->next_id;
+        pf->ninflight++;
+        pf->tokens -= 1;
+        pf->stats.issued++;
+        *id = cand->id;
+        if (nuri) {
+            *nuri = cand->nuri;
+        }
+        return cand->uri;
+    }
+    return NULL;
+}
+
+LCBEX_API
+lcb_error_t lcbex_prefetch_done(lcbex_prefetch_t *pf, lcb_uint64_t id,
+                                lcbex_rcache_t *cache,
+                                lcb_error_t status,
+                                lcbex_rowblock_t *block,
+                                lcb_uint64_t now)
+{
+    candidate *cand = NULL;
+    lcb_error_t err = LCB_SUCCESS;
+    size_t ii;
+
+    for (ii = 0; ii < pf->ncandidates && !cand; ii++) {
+        if (pf->candidates[ii].inflight && pf->candidates[ii].id == id) {
+            cand = pf->candidates + ii;
+        }
+    }
+    if (!cand) {
+        return LCB_KEY_ENOENT;
+    }
+
+    if (status == LCB_SUCCESS) {
+        err = lcbex_rcache_put(cache, cand->uri, cand->nuri, block,
+                               pf->config.ttl, now);
+    }
+    if (status == LCB_SUCCESS && err == LCB_SUCCESS) {
+        add_tracked(pf, cand->hash);
+        pf->stats.completed++;
+    } else {
+        pf->stats.failed++;
+    }
+    remove_candidate(pf, cand);
+    return err;
+}
+
+LCBEX_API
+void lcbex_prefetch_get_stats(const lcbex_prefetch_t *pf,
+                              lcbex_prefetch_stats_t *stats)
+{
+    *stats = pf->stats;
+    stats->hit_rate = stats->completed ?
+            (double)stats->hits / stats->completed : 0;
+    stats->inflight = pf->ninflight;
+    stats->pending = (unsigned int)pf->ncandidates - pf->ninflight;
+}
+
+LCBEX_API
+void lcbex_prefetch_destroy(lcbex_prefetch_t *pf)
+{
+    size_t ii;
+    for (ii = 0; ii < pf->ncandidates; ii++) {
+        free(pf->candidates[ii].uri);
+    }
+    for (ii = 0; ii < pf->nstreams; ii++) {
+        free(pf->streams[ii].key);
+    }
+    free(pf->candidates);
+    free(pf->streams);
+    free(pf->key.data);
+    free(pf->tracked);
+    free(pf);
+}
@@ -0,0 +1,1067 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/rangecache.h>
+#include "hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Cache of key ranges of view results
+ */
+
+typedef struct {
+    /* JSON-encoded key; NULL if unbounded */
+    char *key;
+    size_t nkey;
+    int inclusive;
+} bound;
+
+/* row blocks are shared by the intervals and requests using them */
+typedef struct {
+    unsigned int refcount;
+    lcbex_rowblock_t *block;
+} shared_block;
+
+/**
+ * An interval holding every row whose key is within its bounds. The
+ * lower bound is inclusive or unbounded, since startkey is inclusive.
+ */
+typedef struct {
+    bound lo;
+    bound hi;
+    shared_block *rows;
+    lcb_uint64_t last_used;
+    /* 0 if the interval does not expire */
+    lcb_uint64_t expires;
+    size_t memory;
+    /* not to be evicted while it is being added */
+    int pinned;
+} interval;
+
+typedef struct {
+    char *design;
+    size_t ndesign;
+    char *view;
+    size_t nview;
+    /* the options besides the range, sorted, each name and value stored
+     * after its length; and their hash */
+    char *options;
+    size_t noptions;
+    lcb_uint64_t options_hash;
+    /* sorted and disjoint */
+    interval *intervals;
+    size_t nintervals;
+    size_t nalloc;
+    /* lcbex_vrow_collate_class of the keys in the intervals */
+    int collate_mask;
+} shape;
+
+struct lcbex_rangecache_st {
+    /* A handful of views per application; a linear list is fine */
+    shape *shapes;
+    size_t nshapes;
+    size_t nalloc;
+    size_t max_memory;
+    lcb_uint64_t ttl;
+    /* bumped by invalidation, so that requests started before it don't
+     * cache their rows */
+    lcb_uint64_t generation;
+    lcbex_rangecache_stats_t stats;
+};
+
+typedef struct {
+    bound lo;
+    bound hi;
+    /* NULL for a gap not yet filled */
+    shared_block *rows;
+    /* NULL for a cached part */
+    char *uri;
+} segment;
+
+struct lcbex_rangecache_req_st {
+    lcbex_rangecache_t *cache;
+    size_t shape_index;
+    lcb_uint64_t generation;
+    bound lo;
+    bound hi;
+    segment *segments;
+    size_t nsegments;
+    /* indexes of the gaps in the segments */
+    size_t *gaps;
+    size_t ngaps;
+    shared_block *result;
+    /* lcbex_vrow_collate_class of the bounds and the rows of the gaps */
+    int collate_mask;
+    /* earliest expiry of the cached segments, or 0 */
+    lcb_uint64_t expires;
+};
+
+static int collate(const bound *b, const char *key, size_t nkey)
+{
+    return lcbex_vrow_collate(b->key, b->nkey, key, nkey);
+}
+
+static int bound_class(const bound *b)
+{
+    return b->key ? lcbex_vrow_collate_class(b->key, b->nkey) : 0;
+}
+
+static int key_above_lo(const bound *lo, const char *key, size_t nkey)
+{
+    int rv;
+    if (!lo->key) {
+        return 1;
+    }
+    rv = collate(lo, key, nkey);
+    return rv < 0 || (rv == 0 && lo->inclusive);
+}
+
+static int key_below_hi(const bound *hi, const char *key, size_t nkey)
+{
+    int rv;
+    if (!hi->key) {
+        return 1;
+    }
+    rv = collate(hi, key, nkey);
+    return rv > 0 || (rv == 0 && hi->inclusive);
+}
+
+/**
+ * Whether no key is within lo..hi
+ */
+static int range_empty(const bound *lo, const bound *hi)
+{
+    int rv;
+    if (!lo->key || !hi->key) {
+        return 0;
+    }
+    rv = collate(lo, hi->key, hi->nkey);
+    return rv > 0 || (rv == 0 && !(lo->inclusive && hi->inclusive));
+}
+
+/* the higher of two lower bounds; of equal keys, the exclusive one */
+static const bound *lo_max(const bound *a, const bound *b)
+{
+    int rv;
+    if (!a->key) {
+        return b;
+    } else if (!b->key) {
+        return a;
+    }
+    rv = collate(a, b->key, b->nkey);
+    if (rv == 0) {
+        return a->inclusive ? b : a;
+    }
+    return rv > 0 ? a : b;
+}
+
+/* the lower of two upper bounds; of equal keys, the exclusive one */
+static const bound *hi_min(const bound *a, const bound *b)
+{
+    int rv;
+    if (!a->key) {
+        return b;
+    } else if (!b->key) {
+        return a;
+    }
+    rv = collate(a, b->key, b->nkey);
+    if (rv == 0) {
+        return a->inclusive ? b : a;
+    }
+    return rv < 0 ? a : b;
+}
+
+/**
+ * The bound just past another: the lower bound after an upper bound, or
+ * the upper bound before a lower one. The key is borrowed.
+ */
+static bound flip(const bound *b)
+{
+    bound ret = *b;
+    ret.inclusive = !b->inclusive;
+    return ret;
+}
+
+static lcb_error_t bound_dup(bound *dst, const bound *src)
+{
+    *dst = *src;
+    if (!src->key) {
+        return LCB_SUCCESS;
+    }
+    if ((dst->key = malloc(src->nkey ? src->nkey : 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    memcpy(dst->key, src->key, src->nkey);
+    return LCB_SUCCESS;
+}
+
+static void bound_free(bound *b)
+{
+    free(b->key);
+    b->key = NULL;
+}
+
+static shared_block *share_block(lcbex_rowblock_t *block)
+{
+    shared_block *ret = malloc(sizeof(*ret));
+    if (ret) {
+        ret->refcount = 1;
+        ret->block = block;
+    }
+    return ret;
+}
+
+static void release_block(shared_block *sb)
+{
+    if (sb && --sb->refcount == 0) {
+        lcbex_rowblock_free(sb->block);
+        free(sb);
+    }
+}
+
+static int name_is(const lcbex_vopt_t *opt, const char *name)
+{
+    size_t n = strlen(name);
+    return opt->noptname == n && memcmp(opt->optname, name, n) == 0;
+}
+
+static int value_is(const lcbex_vopt_t *opt, const char *value)
+{
+    size_t n = strlen(value);
+    return opt->noptval == n && memcmp(opt->optval, value, n) == 0;
+}
+
+static lcb_error_t decode_key(const lcbex_vopt_t *opt, bound *b)
+{
+    if ((b->key = malloc(opt->noptval + 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    b->nkey = lcbex_vopt_decode(opt, b->key);
+    return LCB_SUCCESS;
+}
+
+static int compare_bytes(const char *a, size_t na, const char *b, size_t nb)
+{
+    int rv = memcmp(a, b, na < nb ? na : nb);
+    if (rv) {
+        return rv;
+    }
+    return na == nb ? 0 : (na < nb ? -1 : 1);
+}
+
+static int compare_options(const void *a, const void *b)
+{
+    const lcbex_vopt_t *oa = *(const lcbex_vopt_t * const *)a;
+    const lcbex_vopt_t *ob = *(const lcbex_vopt_t * const *)b;
+    int rv = compare_bytes(oa->optname, oa->noptname,
+                           ob->optname, ob->noptname);
+    if (rv) {
+        return rv;
+    }
+    return compare_bytes(oa->optval, oa->noptval, ob->optval, ob->noptval);
+}
+
+static char *put_piece(char *p, const char *buf, size_t n)
+{
+    memcpy(p, &n, sizeof(n));
+    if (n) {
+        memcpy(p + sizeof(n), buf, n);
+    }
+    return p + sizeof(n) + n;
+}
+
+/**
+ * Writes the options besides the range in a canonical form, so that the
+ * order they were given in does not matter
+ */
+static lcb_error_t canonicalize(const lcbex_vopt_t **others, size_t nothers,
+                                char **out, size_t *nout)
+{
+    size_t ii, n = 0;
+    char *p;
+
+    qsort(others, nothers, sizeof(*others), compare_options);
+    for (ii = 0; ii < nothers; ii++) {
+        n += 2 * sizeof(size_t) + others[ii]->noptname + others[ii]->noptval;
+    }
+    if ((*out = p = malloc(n ? n : 1)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    for (ii = 0; ii < nothers; ii++) {
+        p = put_piece(p, others[ii]->optname, others[ii]->noptname);
+        p = put_piece(p, others[ii]->optval, others[ii]->noptval);
+    }
+    *nout = n;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Reads the range of a query, and the canonical form of its other options
+ * @param canon will contain the other options. Free with free()
+ */
+static lcb_error_t parse_options(const lcbex_vopt_t *const *options,
+                                 size_t noptions,
+                                 bound *lo, bound *hi,
+                                 char **canon, size_t *ncanon)
+{
+    static const char *refused[] = {
+        "limit", "skip", "key", "keys", "startkey_docid", "endkey_docid",
+        "group_level", NULL
+    };
+    const lcbex_vopt_t *startkey = NULL, *endkey = NULL;
+    const lcbex_vopt_t *sbuf[16];
+    const lcbex_vopt_t **others = sbuf;
+    size_t nothers = 0;
+    int reduce = 0, group = 0;
+    lcb_error_t err = LCB_SUCCESS;
+    size_t ii, jj;
+
+    memset(lo, 0, sizeof(*lo));
+    memset(hi, 0, sizeof(*hi));
+    lo->inclusive = 1;
+    hi->inclusive = 1;
+    *canon = NULL;
+
+    if (noptions > sizeof(sbuf) / sizeof(sbuf[0]) &&
+            (others = malloc(noptions * sizeof(*others))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    for (ii = 0; ii < noptions; ii++) {
+        const lcbex_vopt_t *opt = options[ii];
+
+        for (jj = 0; refused[jj]; jj++) {
+            if (name_is(opt, refused[jj])) {
+                err = LCB_EINVAL;
+                goto GT_DONE;
+            }
+        }
+        if (name_is(opt, "startkey")) {
+            startkey = opt;
+            continue;
+        } else if (name_is(opt, "endkey")) {
+            endkey = opt;
+            continue;
+        } else if (name_is(opt, "inclusive_end")) {
+            hi->inclusive = !value_is(opt, "false");
+            continue;
+        } else if (name_is(opt, "descending") && value_is(opt, "true")) {
+            err = LCB_EINVAL;
+            goto GT_DONE;
+        } else if (name_is(opt, "reduce")) {
+            reduce = value_is(opt, "true");
+        } else if (name_is(opt, "group")) {
+            group = value_is(opt, "true");
+        }
+
+        others[nothers++] = opt;
+    }
+    if (reduce && !group) {
+        err = LCB_EINVAL;
+        goto GT_DONE;
+    }
+
+    err = canonicalize(others, nothers, canon, ncanon);
+    if (err == LCB_SUCCESS && startkey) {
+        err = decode_key(startkey, lo);
+    }
+    if (err == LCB_SUCCESS && endkey) {
+        err = decode_key(endkey, hi);
+    }
+
+GT_DONE:
+    if (err != LCB_SUCCESS) {
+        bound_free(lo);
+        bound_free(hi);
+        free(*canon);
+        *canon = NULL;
+    }
+    if (others != sbuf) {
+        free(others);
+    }
+    return err;
+}
+
+/**
+ * Finds or adds the shape of a query. The shape takes ownership of the
+ * canonical options if it is added; otherwise they are freed
+ */
+static shape *get_shape(lcbex_rangecache_t *cache,
+                        const char *design, size_t ndesign,
+                        const char *view, size_t nview,
+                        char *options, size_t noptions)
+{
+    lcb_uint64_t options_hash = lcbex_hash64(options, noptions, 0);
+    size_t ii;
+    shape *sh;
+
+    for (ii = 0; ii < cache->nshapes; ii++) {
+        sh = cache->shapes + ii;
+        if (sh->options_hash == options_hash &&
+                sh->noptions == noptions &&
+                sh->ndesign == ndesign && sh->nview == nview &&
+                memcmp(sh->options, options, noptions) == 0 &&
+                memcmp(sh->design, design, ndesign) == 0 &&
+                memcmp(sh->view, view, nview) == 0) {
+            free(options);
+            return sh;
+        }
+    }
+
+    if (cache->nshapes == cache->nalloc) {
+        size_t n_alloc = cache->nalloc ? cache->nalloc * 2 : 8;
+        shape *tmp = realloc(cache->shapes, n_alloc * sizeof(*tmp));
+        if (!tmp) {
+            free(options);
+            return NULL;
+        }
+        cache->shapes = tmp;
+        cache->nalloc = n_alloc;
+    }
+
+    sh = cache->shapes + cache->nshapes;
+    memset(sh, 0, sizeof(*sh));
+    sh->design = malloc(ndesign + 1);
+    sh->view = malloc(nview + 1);
+    if (!sh->design || !sh->view) {
+        free(sh->design);
+        free(sh->view);
+        free(options);
+        return NULL;
+    }
+    memcpy(sh->design, design, ndesign);
+    memcpy(sh->view, view, nview);
+    sh->ndesign = ndesign;
+    sh->nview = nview;
+    sh->options = options;
+    sh->noptions = noptions;
+    sh->options_hash = options_hash;
+    cache->nshapes++;
+    return sh;
+}
+
+static void remove_intervals(lcbex_rangecache_t *cache, shape *sh,
+                             size_t begin, size_t end)
+{
+    size_t ii;
+
+    if (begin == end) {
+        return;
+    }
+    for (ii = begin; ii < end; ii++) {
+        interval *iv = sh->intervals + ii;
+        cache->stats.memory -= iv->memory;
+        bound_free(&iv->lo);
+        bound_free(&iv->hi);
+        release_block(iv->rows);
+    }
+    memmove(sh->intervals + begin, sh->intervals + end,
+            (sh->nintervals - end) * sizeof(interval));
+    sh->nintervals -= end - begin;
+    cache->stats.intervals -= end - begin;
+    if (!sh->nintervals) {
+        sh->collate_mask = 0;
+    }
+}
+
+static void expire_intervals(lcbex_rangecache_t *cache, shape *sh,
+                             lcb_uint64_t now)
+{
+    size_t ii = sh->nintervals;
+    while (ii--) {
+        if (sh->intervals[ii].expires && now >= sh->intervals[ii].expires) {
+            remove_intervals(cache, sh, ii, ii + 1);
+            cache->stats.expired++;
+        }
+    }
+}
+
+static void evict_lru(lcbex_rangecache_t *cache)
+{
+    shape *victim_shape = NULL;
+    size_t ii, jj, victim = 0;
+    lcb_uint64_t oldest = 0;
+
+    for (ii = 0; ii < cache->nshapes; ii++) {
+        shape *sh = cache->shapes + ii;
+        for (jj = 0; jj < sh->nintervals; jj++) {
+            interval *iv = sh->intervals + jj;
+            if (!iv->pinned && (!victim_shape || iv->last_used < oldest)) {
+                victim_shape = sh;
+                victim = jj;
+                oldest = iv->last_used;
+            }
+        }
+    }
+    if (victim_shape) {
+        remove_intervals(cache, victim_shape, victim, victim + 1);
+        cache->stats.evicted++;
+    }
+}
+
+/**
+ * Adds the rows of a block within lo..hi to a builder
+ */
+static lcb_error_t add_rows(lcbex_rowblock_builder_t *builder,
+                            const lcbex_rowblock_t *block,
+                            const bound *lo, const bound *hi,
+                            lcb_uint64_t *count)
+{
+    lcbex_rowblock_iter_t iter;
+    const lcbex_vrow_t *row;
+    lcb_error_t err = LCB_SUCCESS;
+
+    lcbex_rowblock_iter_init(&iter, block);
+    if (lo->key) {
+        lcbex_rowblock_iter_seek(&iter, lo->key, lo->nkey);
+    }
+    while (err == LCB_SUCCESS && lcbex_rowblock_iter_next(&iter, &row)) {
+        if (!key_above_lo(lo, row->key, row->nkey)) {
+            continue;
+        }
+        if (!key_below_hi(hi, row->key, row->nkey)) {
+            break;
+        }
+        err = lcbex_rowblock_builder_add(builder, row);
+        (*count)++;
+    }
+    lcbex_rowblock_iter_cleanup(&iter);
+    return err;
+}
+
+static lcb_error_t add_segment(lcbex_rangecache_req_t *req,
+                               const bound *lo, const bound *hi,
+                               shared_block *rows)
+{
+    segment *seg = req->segments + req->nsegments;
+    lcb_error_t err;
+
+    memset(seg, 0, sizeof(*seg));
+    req->nsegments++;
+    if ((err = bound_dup(&seg->lo, lo)) != LCB_SUCCESS ||
+            (err = bound_dup(&seg->hi, hi)) != LCB_SUCCESS) {
+        return err;
+    }
+    if (rows) {
+        seg->rows = rows;
+        rows->refcount++;
+    } else {
+        req->gaps[req->ngaps++] = req->nsegments - 1;
+    }
+    return LCB_SUCCESS;
+}
+
+/**
+ * Splits the requested range into the cached parts and the gaps
+ */
+static lcb_error_t split_range(lcbex_rangecache_req_t *req, shape *sh,
+                               lcb_uint64_t now)
+{
+    bound cursor = req->lo, gap_hi;
+    lcb_error_t err = LCB_SUCCESS;
+    size_t ii;
+    int done = 0;
+
+    /* each interval adds at most a gap and a part, plus a final gap */
+    req->segments = calloc(sh->nintervals * 2 + 1, sizeof(*req->segments));
+    req->gaps = calloc(sh->nintervals + 1, sizeof(*req->gaps));
+    if (!req->segments || !req->gaps) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (range_empty(&req->lo, &req->hi)) {
+        return LCB_SUCCESS;
+    }
+
+    for (ii = 0; ii < sh->nintervals && !done && err == LCB_SUCCESS; ii++) {
+        interval *iv = sh->intervals + ii;
+        const bound *lo = lo_max(&cursor, &iv->lo);
+        const bound *hi = hi_min(&req->hi, &iv->hi);
+
+        if (range_empty(lo, hi)) {
+            if (range_empty(&iv->lo, &req->hi)) {
+                /* this and the following intervals are past the range */
+                break;
+            }
+            continue;
+        }
+
+        if (iv->lo.key) {
+            gap_hi = flip(&iv->lo);
+            if (!range_empty(&cursor, &gap_hi)) {
+                err = add_segment(req, &cursor, &gap_hi, NULL);
+            }
+        }
+        if (err == LCB_SUCCESS) {
+            err = add_segment(req, lo, hi, iv->rows);
+            iv->last_used = now;
+            if (iv->expires && (!req->expires || iv->expires < req->expires)) {
+                req->expires = iv->expires;
+            }
+        }
+
+        if (iv->hi.key) {
+            cursor = flip(&iv->hi);
+        } else {
+            done = 1;
+        }
+    }
+
+    if (err == LCB_SUCCESS && !done && !range_empty(&cursor, &req->hi)) {
+        err = add_segment(req, &cursor, &req->hi, NULL);
+    }
+    return err;
+}
+
+static char *make_gap_uri(const segment *seg,
+                          const char *design, size_t ndesign,
+                          const char *view, size_t nview,
+                          const lcbex_vopt_t *const *options,
+                          size_t noptions)
+{
+    lcbex_vopt_t overrides[3];
+    const lcbex_vopt_t *override_list[3];
+    size_t noverrides = 0, ii;
+    char *errstr;
+    char *ret = NULL;
+
+    memset(overrides, 0, sizeof(overrides));
+
+    /* an exclusive lower bound is queried inclusively, and the rows at
+     * its key are dropped when stitching */
+    if (seg->lo.key &&
+            lcbex_vopt_assign(&overrides[noverrides++], "startkey", -1,
+                              seg->lo.key, seg->lo.nkey,
+                              LCBEX_VOPT_F_PCTENCODE, &errstr) != LCB_SUCCESS) {
+        goto GT_DONE;
+    }
+    if (seg->hi.key &&
+            (lcbex_vopt_assign(&overrides[noverrides++], "endkey", -1,
+                               seg->hi.key, seg->hi.nkey,
+                               LCBEX_VOPT_F_PCTENCODE,
+                               &errstr) != LCB_SUCCESS ||
+             lcbex_vopt_assign(&overrides[noverrides++], "inclusive_end", -1,
+                               seg->hi.inclusive ? "true" : "false", -1,
+                               0, &errstr) != LCB_SUCCESS)) {
+        goto GT_DONE;
+    }
+
+    for (ii = 0; ii < noverrides; ii++) {
+        override_list[ii] = &overrides[ii];
+    }
+    ret = lcbex_vqstr_make_uri_override(design, ndesign, view, nview,
+                                        options, noptions,
+                                        override_list, noverrides);
+
+GT_DONE:
+    for (ii = 0; ii < noverrides; ii++) {
+        lcbex_vopt_cleanup(&overrides[ii]);
+    }
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rangecache_create(lcbex_rangecache_t **cache,
+                                    size_t max_memory,
+                                    lcb_uint64_t ttl)
+{
+    lcbex_rangecache_t *ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->max_memory = max_memory;
+    ret->ttl = ttl;
+    *cache = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rangecache_lookup(lcbex_rangecache_t *cache,
+                                    const char *design, size_t ndesign,
+                                    const char *view, size_t nview,
+                                    const lcbex_vopt_t *const *options,
+                                    size_t noptions,
+                                    lcb_uint64_t now,
+                                    lcbex_rangecache_req_t **req)
+{
+    lcbex_rangecache_req_t *ret;
+    char *canon;
+    size_t ncanon;
+    lcb_error_t err;
+    shape *sh;
+    size_t ii;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    err = parse_options(options, noptions, &ret->lo, &ret->hi,
+                        &canon, &ncanon);
+    if (err != LCB_SUCCESS) {
+        free(ret);
+        return err;
+    }
+
+    ret->cache = cache;
+    ret->generation = cache->generation;
+    sh = get_shape(cache, design, ndesign, view, nview, canon, ncanon);
+    if (!sh) {
+        lcbex_rangecache_req_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->shape_index = sh - cache->shapes;
+    expire_intervals(cache, sh, now);
+
+    /* the bounds must order the same way as the cached keys, and the same
+     * way as the server orders them */
+    ret->collate_mask = bound_class(&ret->lo) | bound_class(&ret->hi);
+    if (!LCBEX_VROW_COLLATE_EXACT(ret->collate_mask | sh->collate_mask)) {
+        lcbex_rangecache_req_destroy(ret);
+        return LCB_EINVAL;
+    }
+
+    err = split_range(ret, sh, now);
+    for (ii = 0; err == LCB_SUCCESS && ii < ret->ngaps; ii++) {
+        segment *seg = ret->segments + ret->gaps[ii];
+        seg->uri = make_gap_uri(seg, design, ndesign, view, nview,
+                                options, noptions);
+        if (!seg->uri) {
+            err = LCB_CLIENT_ENOMEM;
+        }
+    }
+    if (err != LCB_SUCCESS) {
+        lcbex_rangecache_req_destroy(ret);
+        return err;
+    }
+
+    if (!ret->ngaps) {
+        cache->stats.hits++;
+    } else if (ret->ngaps < ret->nsegments) {
+        cache->stats.partial++;
+    } else {
+        cache->stats.misses++;
+    }
+    *req = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+size_t lcbex_rangecache_req_ngaps(const lcbex_rangecache_req_t *req)
+{
+    return req->ngaps;
+}
+
+LCBEX_API
+const char *lcbex_rangecache_req_gap_uri(const lcbex_rangecache_req_t *req,
+                                         size_t index)
+{
+    if (index >= req->ngaps) {
+        return NULL;
+    }
+    return req->segments[req->gaps[index]].uri;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rangecache_req_fill(lcbex_rangecache_req_t *req,
+                                      size_t index,
+                                      lcbex_rowblock_t *block)
+{
+    const shape *sh = req->cache->shapes + req->shape_index;
+    segment *seg;
+    int mask;
+
+    if (index >= req->ngaps) {
+        return LCB_EINVAL;
+    }
+    seg = req->segments + req->gaps[index];
+    if (seg->rows) {
+        return LCB_EINVAL;
+    }
+    /* rows we can't order can't be stitched to the others */
+    mask = req->collate_mask | lcbex_rowblock_collate_class(block);
+    if (!LCBEX_VROW_COLLATE_EXACT(mask | sh->collate_mask)) {
+        return LCB_EINVAL;
+    }
+    if ((seg->rows = share_block(block)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    req->collate_mask = mask;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Adds the rows of a finished request to the cache, joined with the
+ * intervals they overlap
+ */
+static lcb_error_t add_interval(lcbex_rangecache_t *cache, shape *sh,
+                                const lcbex_rangecache_req_t *req,
+                                lcb_uint64_t now)
+{
+    lcbex_rowblock_builder_t *builder = NULL;
+    lcbex_rowblock_t *block;
+    interval joined, *first = NULL, *last = NULL, *iv;
+    bound qlo_flip = flip(&req->lo), qhi_flip = flip(&req->hi);
+    lcb_error_t err = LCB_SUCCESS;
+    size_t begin, end, ii;
+    lcb_uint64_t count = 0;
+    int pre = 0, post = 0;
+
+    if (range_empty(&req->lo, &req->hi)) {
+        return LCB_SUCCESS;
+    }
+    expire_intervals(cache, sh, now);
+
+    for (begin = 0; begin < sh->nintervals; begin++) {
+        if (!range_empty(&req->lo, &sh->intervals[begin].hi)) {
+            break;
+        }
+    }
+    for (end = begin; end < sh->nintervals; end++) {
+        iv = sh->intervals + end;
+        if (range_empty(lo_max(&req->lo, &iv->lo), hi_min(&req->hi, &iv->hi))) {
+            break;
+        }
+    }
+
+    memset(&joined, 0, sizeof(joined));
+    joined.expires = cache->ttl ? now + cache->ttl : 0;
+    /* the rows reused from the cache may since have been dropped */
+    if (req->expires && (!joined.expires || req->expires < joined.expires)) {
+        joined.expires = req->expires;
+    }
+    if (end > begin) {
+        first = sh->intervals + begin;
+        last = sh->intervals + end - 1;
+        pre = req->lo.key && !range_empty(&first->lo, &qlo_flip);
+        post = req->hi.key && !range_empty(&qhi_flip, &last->hi);
+        for (ii = begin; ii < end; ii++) {
+            iv = sh->intervals + ii;
+            if (iv->expires && (!joined.expires ||
+                                iv->expires < joined.expires)) {
+                joined.expires = iv->expires;
+            }
+        }
+    }
+
+    if (pre || post) {
+        err = lcbex_rowblock_builder_create(&builder, 0, 0);
+        if (err == LCB_SUCCESS && pre) {
+            err = add_rows(builder, first->rows->block, &first->lo,
+                           &qlo_flip, &count);
+        }
+        if (err == LCB_SUCCESS) {
+            err = add_rows(builder, req->result->block, &req->lo, &req->hi,
+                           &count);
+        }
+        if (err == LCB_SUCCESS && post) {
+            err = add_rows(builder, last->rows->block, &qhi_flip, &last->hi,
+                           &count);
+        }
+        if (err == LCB_SUCCESS) {
+            err = lcbex_rowblock_builder_finish(builder, &block);
+        }
+        if (builder) {
+            lcbex_rowblock_builder_destroy(builder);
+        }
+        if (err == LCB_SUCCESS && (joined.rows = share_block(block)) == NULL) {
+            lcbex_rowblock_free(block);
+            err = LCB_CLIENT_ENOMEM;
+        }
+    } else {
+        joined.rows = req->result;
+        joined.rows->refcount++;
+    }
+
+    if (err == LCB_SUCCESS) {
+        err = bound_dup(&joined.lo, pre ? &first->lo : &req->lo);
+    }
+    if (err == LCB_SUCCESS) {
+        err = bound_dup(&joined.hi, post ? &last->hi : &req->hi);
+    }
+    if (err == LCB_SUCCESS && sh->nintervals - (end - begin) == sh->nalloc) {
+        size_t n_alloc = sh->nalloc ? sh->nalloc * 2 : 8;
+        interval *tmp = realloc(sh->intervals, n_alloc * sizeof(*tmp));
+        if (tmp) {
+            sh->intervals = tmp;
+            sh->nalloc = n_alloc;
+        } else {
+            err = LCB_CLIENT_ENOMEM;
+        }
+    }
+
+    joined.memory = sizeof(joined) + joined.lo.nkey + joined.hi.nkey;
+    if (joined.rows) {
+        joined.memory += lcbex_rowblock_size(joined.rows->block);
+    }
+    if (err != LCB_SUCCESS || joined.memory > cache->max_memory) {
+        bound_free(&joined.lo);
+        bound_free(&joined.hi);
+        release_block(joined.rows);
+        return err;
+    }
+
+    remove_intervals(cache, sh, begin, end);
+    memmove(sh->intervals + begin + 1, sh->intervals + begin,
+            (sh->nintervals - begin) * sizeof(interval));
+    sh->collate_mask |= bound_class(&joined.lo) | bound_class(&joined.hi) |
+                        lcbex_rowblock_collate_class(joined.rows->block);
+    joined.last_used = now;
+    joined.pinned = 1;
+    sh->intervals[begin] = joined;
+    sh->nintervals++;
+    cache->stats.intervals++;
+    cache->stats.memory += joined.memory;
+
+    while (cache->stats.memory > cache->max_memory) {
+        evict_lru(cache);
+    }
+    /* unpin it, wherever eviction moved it */
+    for (ii = 0; ii < sh->nintervals; ii++) {
+        sh->intervals[ii].pinned = 0;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rangecache_req_finish(lcbex_rangecache_req_t *req,
+                                        lcb_uint64_t now,
+                                        const lcbex_rowblock_t **result)
+{
+    lcbex_rangecache_t *cache = req->cache;
+    lcbex_rowblock_builder_t *builder;
+    lcbex_rowblock_t *block;
+    lcb_uint64_t count;
+    lcb_error_t err;
+    shape *sh;
+    size_t ii;
+
+    if (req->result) {
+        *result = req->result->block;
+        return LCB_SUCCESS;
+    }
+    for (ii = 0; ii < req->nsegments; ii++) {
+        if (!req->segments[ii].rows) {
+            return LCB_EINVAL;
+        }
+    }
+
+    if ((err = lcbex_rowblock_builder_create(&builder, 0, 0)) != LCB_SUCCESS) {
+        return err;
+    }
+    for (ii = 0; err == LCB_SUCCESS && ii < req->nsegments; ii++) {
+        segment *seg = req->segments + ii;
+        count = 0;
+        err = add_rows(builder, seg->rows->block, &seg->lo, &seg->hi, &count);
+        if (seg->uri) {
+            cache->stats.rows_fetched += count;
+        } else {
+            cache->stats.rows_cached += count;
+        }
+    }
+    if (err == LCB_SUCCESS) {
+        err = lcbex_rowblock_builder_finish(builder, &block);
+    }
+    lcbex_rowblock_builder_destroy(builder);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+    if ((req->result = share_block(block)) == NULL) {
+        lcbex_rowblock_free(block);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    /* failing to cache the rows does not fail the query. A query
+     * answered from the cache adds nothing to it, and one whose keys
+     * don't order consistently with rows cached since it started is not
+     * cached */
+    sh = cache->shapes + req->shape_index;
+    if (req->ngaps && req->generation == cache->generation &&
+            LCBEX_VROW_COLLATE_EXACT(req->collate_mask | sh->collate_mask)) {
+        add_interval(cache, sh, req, now);
+    }
+    *result = req->result->block;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_rangecache_req_destroy(lcbex_rangecache_req_t *req)
+{
+    size_t ii;
+    for (ii = 0; ii < req->nsegments; ii++) {
+        segment *seg = req->segments + ii;
+        bound_free(&seg->lo);
+        bound_free(&seg->hi);
+        release_block(seg->rows);
+        free(seg->uri);
+    }
+    free(req->segments);
+    free(req->gaps);
+    bound_free(&req->lo);
+    bound_free(&req->hi);
+    release_block(req->result);
+    free(req);
+}
+
+LCBEX_API
+size_t lcbex_rangecache_invalidate(lcbex_rangecache_t *cache,
+                                   const char *design, size_t ndesign)
+{
+    size_t ii, ret = 0;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    cache->generation++;
+    for (ii = 0; ii < cache->nshapes; ii++) {
+        shape *sh = cache->shapes + ii;
+        if (sh->ndesign == ndesign &&
+                memcmp(sh->design, design, ndesign) == 0) {
+            ret += sh->nintervals;
+            remove_intervals(cache, sh, 0, sh->nintervals);
+        }
+    }
+    return ret;
+}
+
+LCBEX_API
+void lcbex_rangecache_get_stats(const lcbex_rangecache_t *cache,
+                                lcbex_rangecache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+LCBEX_API
+void lcbex_rangecache_destroy(lcbex_rangecache_t *cache)
+{
+    size_t ii;
+    for (ii = 0; ii < cache->nshapes; ii++) {
+        shape *sh = cache->shapes + ii;
+        remove_intervals(cache, sh, 0, sh->nintervals);
+        free(sh->intervals);
+        free(sh->design);
+        free(sh->view);
+        free(sh->options);
+    }
+    free(cache->shapes);
+    free(cache);
+}
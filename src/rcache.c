@@ -0,0 +1,600 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/rcache.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+#define NIL ((lcb_uint32_t)-1)
+
+/* stands for every document, in the index; reduced results are filed
+ * under it */
+#define ANY_DOC 0
+
+typedef struct {
+    /* hash of the document ID, never ANY_DOC for a real document */
+    lcb_uint64_t hash;
+    lcb_uint32_t entry;
+    /* next posting in the bucket, or in the free list */
+    lcb_uint32_t next;
+} posting;
+
+typedef struct {
+    /* NULL if the entry is free */
+    lcbex_rowblock_t *block;
+    char *uri;
+    size_t nuri;
+    lcb_uint64_t urihash;
+    /* 0 if the entry does not expire */
+    lcb_uint64_t expires;
+    size_t memory;
+    /* the entry's postings, one per distinct document */
+    lcb_uint32_t *postings;
+    size_t npostings;
+    /* next entry in the URI bucket */
+    lcb_uint32_t uri_next;
+    /* LRU list; lru_next also links free entries */
+    lcb_uint32_t lru_prev;
+    lcb_uint32_t lru_next;
+} cache_entry;
+
+struct lcbex_rcache_st {
+    cache_entry *entries;
+    lcb_uint32_t nentries_alloc;
+    lcb_uint32_t free_entries;
+
+    lcb_uint32_t *uri_buckets;
+    size_t nuri_buckets;
+
+    posting *postings;
+    lcb_uint32_t npostings_alloc;
+    lcb_uint32_t free_postings;
+    size_t npostings;
+    lcb_uint32_t *doc_buckets;
+    size_t ndoc_buckets;
+
+    /* most recently used first */
+    lcb_uint32_t lru_head;
+    lcb_uint32_t lru_tail;
+
+    size_t max_memory;
+    lcbex_rcache_stats_t stats;
+};
+
+static lcb_uint64_t doc_hash(const char *docid, size_t ndocid)
+{
+    lcb_uint64_t hash = lcbex_hash64(docid, ndocid, 0);
+    return hash == ANY_DOC ? ANY_DOC + 1 : hash;
+}
+
+static lcb_uint32_t *alloc_buckets(size_t nbuckets)
+{
+    lcb_uint32_t *buckets = malloc(nbuckets * sizeof(*buckets));
+    size_t ii;
+
+    if (buckets) {
+        for (ii = 0; ii < nbuckets; ii++) {
+            buckets[ii] = NIL;
+        }
+    }
+    return buckets;
+}
+
+static void lru_unlink(lcbex_rcache_t *cache, lcb_uint32_t ii)
+{
+    cache_entry *entry = cache->entries + ii;
+
+    if (entry->lru_prev != NIL) {
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NIL) {
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push(lcbex_rcache_t *cache, lcb_uint32_t ii)
+{
+    cache_entry *entry = cache->entries + ii;
+
+    entry->lru_prev = NIL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NIL) {
+        cache->entries[cache->lru_head].lru_prev = ii;
+    } else {
+        cache->lru_tail = ii;
+    }
+    cache->lru_head = ii;
+}
+
+static lcb_uint32_t find_entry(const lcbex_rcache_t *cache,
+                               const char *uri, size_t nuri,
+                               lcb_uint64_t urihash)
+{
+    lcb_uint32_t ii = cache->uri_buckets[urihash & (cache->nuri_buckets - 1)];
+
+    for (; ii != NIL; ii = cache->entries[ii].uri_next) {
+        const cache_entry *entry = cache->entries + ii;
+        if (entry->urihash == urihash && entry->nuri == nuri &&
+                memcmp(entry->uri, uri, nuri) == 0) {
+            return ii;
+        }
+    }
+    return NIL;
+}
+
+static void remove_entry(lcbex_rcache_t *cache, lcb_uint32_t ii)
+{
+    cache_entry *entry = cache->entries + ii;
+    lcb_uint32_t *pp;
+    size_t jj;
+
+    pp = cache->uri_buckets + (entry->urihash & (cache->nuri_buckets - 1));
+    while (*pp != ii) {
+        pp = &cache->entries[*pp].uri_next;
+    }
+    *pp = entry->uri_next;
+
+    for (jj = 0; jj < entry->npostings; jj++) {
+        lcb_uint32_t pi = entry->postings[jj];
+        posting *post = cache->postings + pi;
+
+        pp = cache->doc_buckets + (post->hash & (cache->ndoc_buckets - 1));
+        while (*pp != pi) {
+            pp = &cache->postings[*pp].next;
+        }
+        *pp = post->next;
+        post->next = cache->free_postings;
+        cache->free_postings = pi;
+    }
+    cache->npostings -= entry->npostings;
+
+    lru_unlink(cache, ii);
+    cache->stats.entries--;
+    cache->stats.memory -= entry->memory;
+
+    lcbex_rowblock_free(entry->block);
+    free(entry->uri);
+    free(entry->postings);
+    memset(entry, 0, sizeof(*entry));
+    entry->lru_next = cache->free_entries;
+    cache->free_entries = ii;
+}
+
+/**
+ * Doubles the number of buckets, relinking the entries (or postings)
+ */
+static lcb_error_t grow_uri_buckets(lcbex_rcache_t *cache)
+{
+    size_t nbuckets = cache->nuri_buckets * 2;
+    lcb_uint32_t *buckets = alloc_buckets(nbuckets);
+    lcb_uint32_t ii;
+
+    if (!buckets) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    for (ii = 0; ii < cache->nentries_alloc; ii++) {
+        cache_entry *entry = cache->entries + ii;
+        if (entry->block) {
+            size_t bucket = entry->urihash & (nbuckets - 1);
+            entry->uri_next = buckets[bucket];
+            buckets[bucket] = ii;
+        }
+    }
+    free(cache->uri_buckets);
+    cache->uri_buckets = buckets;
+    cache->nuri_buckets = nbuckets;
+    return LCB_SUCCESS;
+}
+
+static lcb_error_t grow_doc_buckets(lcbex_rcache_t *cache)
+{
+    size_t nbuckets = cache->ndoc_buckets * 2;
+    lcb_uint32_t *buckets = alloc_buckets(nbuckets);
+    lcb_uint32_t ii;
+    size_t jj;
+
+    if (!buckets) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    for (ii = 0; ii < cache->nentries_alloc; ii++) {
+        const cache_entry *entry = cache->entries + ii;
+        for (jj = 0; jj < entry->npostings; jj++) {
+            posting *post = cache->postings + entry->postings[jj];
+            size_t bucket = post->hash & (nbuckets - 1);
+            post->next = buckets[bucket];
+            buckets[bucket] = entry->postings[jj];
+        }
+    }
+    free(cache->doc_buckets);
+    cache->doc_buckets = buckets;
+    cache->ndoc_buckets = nbuckets;
+    return LCB_SUCCESS;
+}
+
+static lcb_error_t alloc_entry(lcbex_rcache_t *cache, lcb_uint32_t *ii)
+{
+    if (cache->free_entries == NIL) {
+        lcb_uint32_t nalloc = cache->nentries_alloc * 2;
+        cache_entry *tmp = realloc(cache->entries, nalloc * sizeof(*tmp));
+        lcb_uint32_t jj;
+
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        memset(tmp + cache->nentries_alloc, 0,
+               (nalloc - cache->nentries_alloc) * sizeof(*tmp));
+        for (jj = nalloc; jj > cache->nentries_alloc; jj--) {
+            tmp[jj - 1].lru_next = cache->free_entries;
+            cache->free_entries = jj - 1;
+        }
+        cache->entries = tmp;
+        cache->nentries_alloc = nalloc;
+    }
+    *ii = cache->free_entries;
+    cache->free_entries = cache->entries[*ii].lru_next;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Ensures 'n' postings are free
+ */
+static lcb_error_t reserve_postings(lcbex_rcache_t *cache, size_t n)
+{
+    size_t nfree = cache->npostings_alloc - cache->npostings;
+    size_t nalloc = cache->npostings_alloc;
+    lcb_uint32_t ii;
+    posting *tmp;
+
+    if (nfree >= n) {
+        return LCB_SUCCESS;
+    }
+    while (nalloc - cache->npostings < n) {
+        nalloc *= 2;
+    }
+    if (nalloc >= NIL) {
+        return LCB_E2BIG;
+    }
+    if ((tmp = realloc(cache->postings, nalloc * sizeof(*tmp))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    for (ii = (lcb_uint32_t)nalloc; ii > cache->npostings_alloc; ii--) {
+        tmp[ii - 1].next = cache->free_postings;
+        cache->free_postings = ii - 1;
+    }
+    cache->postings = tmp;
+    cache->npostings_alloc = (lcb_uint32_t)nalloc;
+    return LCB_SUCCESS;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+    lcb_uint64_t x = *(const lcb_uint64_t *)a, y = *(const lcb_uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Collects the distinct document hashes of a block's rows, or ANY_DOC for
+ * reduced rows
+ */
+static lcb_error_t collect_docs(const lcbex_rowblock_t *block,
+                                lcb_uint64_t **hashes, size_t *nhashes)
+{
+    lcbex_rowblock_iter_t iter;
+    const lcbex_vrow_t *row;
+    lcb_uint64_t *out;
+    char *buf = NULL;
+    size_t nbuf = 0, n = 0, ii;
+    lcb_error_t err = LCB_SUCCESS;
+
+    out = malloc((lcbex_rowblock_nrows(block) + 1) * sizeof(*out));
+    if (!out) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    lcbex_rowblock_iter_init(&iter, block);
+    while (err == LCB_SUCCESS && lcbex_rowblock_iter_next(&iter, &row)) {
+        const char *id;
+        size_t nid;
+
+        if (!row->id) {
+            out[n++] = ANY_DOC;
+            continue;
+        }
+        if (row->nid > nbuf) {
+            char *tmp = realloc(buf, row->nid);
+            if (!tmp) {
+                err = LCB_CLIENT_ENOMEM;
+                break;
+            }
+            buf = tmp;
+            nbuf = row->nid;
+        }
+        if ((err = lcbex_vrow_get_id(row, buf, &id, &nid)) == LCB_SUCCESS) {
+            out[n++] = doc_hash(id, nid);
+        }
+    }
+    lcbex_rowblock_iter_cleanup(&iter);
+    free(buf);
+
+    if (err != LCB_SUCCESS) {
+        free(out);
+        return err;
+    }
+
+    qsort(out, n, sizeof(*out), cmp_hash);
+    for (ii = 0, *nhashes = 0; ii < n; ii++) {
+        if (ii == 0 || out[ii] != out[ii - 1]) {
+            out[(*nhashes)++] = out[ii];
+        }
+    }
+    *hashes = out;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rcache_create(lcbex_rcache_t **cache, size_t max_memory)
+{
+    lcbex_rcache_t *ret;
+    lcb_uint32_t ii;
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->max_memory = max_memory;
+    ret->lru_head = ret->lru_tail = NIL;
+    ret->free_entries = ret->free_postings = NIL;
+    ret->nentries_alloc = 16;
+    ret->nuri_buckets = 16;
+    ret->npostings_alloc = 256;
+    ret->ndoc_buckets = 256;
+
+    ret->entries = calloc(ret->nentries_alloc, sizeof(*ret->entries));
+    ret->postings = malloc(ret->npostings_alloc * sizeof(*ret->postings));
+    ret->uri_buckets = alloc_buckets(ret->nuri_buckets);
+    ret->doc_buckets = alloc_buckets(ret->ndoc_buckets);
+    if (!ret->entries || !ret->postings ||
+            !ret->uri_buckets || !ret->doc_buckets) {
+        lcbex_rcache_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    for (ii = ret->nentries_alloc; ii > 0; ii--) {
+        ret->entries[ii - 1].lru_next = ret->free_entries;
+        ret->free_entries = ii - 1;
+    }
+    for (ii = ret->npostings_alloc; ii > 0; ii--) {
+        ret->postings[ii - 1].next = ret->free_postings;
+        ret->free_postings = ii - 1;
+    }
+
+    *cache = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rcache_put(lcbex_rcache_t *cache,
+                             const char *uri, size_t nuri,
+                             lcbex_rowblock_t *block,
+                             lcb_uint64_t ttl,
+                             lcb_uint64_t now)
+{
+    lcb_uint64_t urihash, *hashes;
+    size_t nhashes, memory, jj;
+    cache_entry *entry;
+    lcb_uint32_t ii;
+    lcb_error_t err;
+
+    if (nuri == (size_t)-1) {
+        nuri = strlen(uri);
+    }
+    urihash = lcbex_hash64(uri, nuri, 0);
+
+    if ((err = collect_docs(block, &hashes, &nhashes)) != LCB_SUCCESS) {
+        return err;
+    }
+    memory = sizeof(cache_entry) + lcbex_rowblock_size(block) + nuri +
+            nhashes * (sizeof(posting) + sizeof(lcb_uint32_t));
+    if (memory > cache->max_memory) {
+        free(hashes);
+        return LCB_E2BIG;
+    }
+
+    if ((ii = find_entry(cache, uri, nuri, urihash)) != NIL) {
+        remove_entry(cache, ii);
+    }
+    while (cache->stats.memory + memory > cache->max_memory) {
+        remove_entry(cache, cache->lru_tail);
+        cache->stats.evicted++;
+    }
+
+    if (cache->stats.entries >= cache->nuri_buckets) {
+        err = grow_uri_buckets(cache);
+    }
+    while (err == LCB_SUCCESS &&
+            cache->npostings + nhashes > cache->ndoc_buckets) {
+        err = grow_doc_buckets(cache);
+    }
+    if (err == LCB_SUCCESS) {
+        err = reserve_postings(cache, nhashes);
+    }
+    if (err == LCB_SUCCESS) {
+        err = alloc_entry(cache, &ii);
+    }
+    if (err != LCB_SUCCESS) {
+        free(hashes);
+        return err;
+    }
+
+    entry = cache->entries + ii;
+    entry->uri = malloc(nuri ? nuri : 1);
+    entry->postings = malloc((nhashes ? nhashes : 1) *
+                             sizeof(*entry->postings));
+    if (!entry->uri || !entry->postings) {
+        free(entry->uri);
+        free(entry->postings);
+        memset(entry, 0, sizeof(*entry));
+        entry->lru_next = cache->free_entries;
+        cache->free_entries = ii;
+        free(hashes);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    memcpy(entry->uri, uri, nuri);
+    entry->nuri = nuri;
+    entry->urihash = urihash;
+    entry->block = block;
+    entry->expires = ttl ? now + ttl : 0;
+    entry->memory = memory;
+
+    for (jj = 0; jj < nhashes; jj++) {
+        lcb_uint32_t pi = cache->free_postings;
+        posting *post = cache->postings + pi;
+        size_t bucket = hashes[jj] & (cache->ndoc_buckets - 1);
+
+        cache->free_postings = post->next;
+        post->hash = hashes[jj];
+        post->entry = ii;
+        post->next = cache->doc_buckets[bucket];
+        cache->doc_buckets[bucket] = pi;
+        entry->postings[jj] = pi;
+    }
+    entry->npostings = nhashes;
+    cache->npostings += nhashes;
+    free(hashes);
+
+    entry->uri_next = cache->uri_buckets[urihash & (cache->nuri_buckets - 1)];
+    cache->uri_buckets[urihash & (cache->nuri_buckets - 1)] = ii;
+    lru_push(cache, ii);
+    cache->stats.entries++;
+    cache->stats.memory += memory;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+const lcbex_rowblock_t *lcbex_rcache_get(lcbex_rcache_t *cache,
+                                         const char *uri, size_t nuri,
+                                         lcb_uint64_t now)
+{
+    lcb_uint32_t ii;
+
+    if (nuri == (size_t)-1) {
+        nuri = strlen(uri);
+    }
+    ii = find_entry(cache, uri, nuri, lcbex_hash64(uri, nuri, 0));
+    if (ii == NIL) {
+        cache->stats.misses++;
+        return NULL;
+    }
+    if (cache->entries[ii].expires && now >= cache->entries[ii].expires) {
+        remove_entry(cache, ii);
+        cache->stats.expired++;
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    lru_unlink(cache, ii);
+    lru_push(cache, ii);
+    cache->stats.hits++;
+    return cache->entries[ii].block;
+}
+
+/**
+ * Drops every entry with a posting for the hash
+ */
+static size_t drop_postings(lcbex_rcache_t *cache, lcb_uint64_t hash)
+{
+    size_t ndropped = 0;
+    lcb_uint32_t pi;
+
+    /* removing an entry unlinks its posting, so restart after each */
+    do {
+        pi = cache->doc_buckets[hash & (cache->ndoc_buckets - 1)];
+        while (pi != NIL && cache->postings[pi].hash != hash) {
+            pi = cache->postings[pi].next;
+        }
+        if (pi != NIL) {
+            remove_entry(cache, cache->postings[pi].entry);
+            ndropped++;
+        }
+    } while (pi != NIL);
+
+    return ndropped;
+}
+
+LCBEX_API
+size_t lcbex_rcache_invalidate(lcbex_rcache_t *cache,
+                               const char *docid, size_t ndocid)
+{
+    size_t ndropped;
+
+    if (ndocid == (size_t)-1) {
+        ndocid = strlen(docid);
+    }
+    ndropped = drop_postings(cache, doc_hash(docid, ndocid)) +
+            drop_postings(cache, ANY_DOC);
+    cache->stats.invalidated += ndropped;
+    return ndropped;
+}
+
+LCBEX_API
+int lcbex_rcache_remove(lcbex_rcache_t *cache, const char *uri, size_t nuri)
+{
+    lcb_uint32_t ii;
+
+    if (nuri == (size_t)-1) {
+        nuri = strlen(uri);
+    }
+    ii = find_entry(cache, uri, nuri, lcbex_hash64(uri, nuri, 0));
+    if (ii == NIL) {
+        return 0;
+    }
+    remove_entry(cache, ii);
+    return 1;
+}
+
+LCBEX_API
+void lcbex_rcache_get_stats(const lcbex_rcache_t *cache,
+                            lcbex_rcache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+LCBEX_API
+void lcbex_rcache_destroy(lcbex_rcache_t *cache)
+{
+    lcb_uint32_t ii;
+
+    if (cache->entries) {
+        for (ii = 0; ii < cache->nentries_alloc; ii++) {
+            if (cache->entries[ii].block) {
+                lcbex_rowblock_free(cache->entries[ii].block);
+                free(cache->entries[ii].uri);
+                free(cache->entries[ii].postings);
+            }
+        }
+    }
+    free(cache->entries);
+    free(cache->postings);
+    free(cache->uri_buckets);
+    free(cache->doc_buckets);
+    free(cache);
+}
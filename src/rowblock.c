@@ -0,0 +1,472 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/rowblock.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Front-coded row blocks.
+ *
+ * Each row is encoded as:
+ *
+ *  varint shared key prefix length
+ *  varint key suffix length
+ *  varint shared id prefix length
+ *  varint id suffix length + 1 (0 if the row has no id)
+ *  varint value length
+ *  varint doc length + 1 (0 if the row has no doc)
+ *  key suffix, id suffix, value, doc
+ *
+ * Rows at a restart point have both shared lengths set to 0, so their key
+ * can be read in place during the binary search.
+ *
+ * @author Mark Nunberg
+ */
+
+struct lcbex_rowblock_st {
+    size_t nrows;
+    size_t nrestarts;
+    size_t ndata;
+    unsigned int interval;
+    int flags;
+    /* lcbex_vrow_collate_class of all keys */
+    int collate_mask;
+    const lcb_uint32_t *restarts;
+    const unsigned char *data;
+};
+
+struct lcbex_rowblock_builder_st {
+    unsigned char *data;
+    size_t ndata;
+    size_t nalloc;
+
+    lcb_uint32_t *restarts;
+    size_t nrestarts;
+    size_t nrestarts_alloc;
+
+    char *lastkey;
+    size_t nlastkey;
+    size_t nlastkey_alloc;
+
+    char *lastid;
+    size_t nlastid;
+    size_t nlastid_alloc;
+
+    size_t nrows;
+    unsigned int interval;
+    int flags;
+    int collate_mask;
+};
+
+static size_t put_varint(unsigned char *buf, size_t val)
+{
+    size_t n = 0;
+    while (val >= 0x80) {
+        buf[n++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    buf[n++] = (unsigned char)val;
+    return n;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, size_t *val)
+{
+    size_t ret = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        ret |= (size_t)(*p & 0x7F) << shift;
+        shift += 7;
+        p++;
+    }
+    ret |= (size_t)(*p) << shift;
+    *val = ret;
+    return p + 1;
+}
+
+static size_t common_prefix(const char *a, size_t na, const char *b, size_t nb)
+{
+    size_t ii, n = na < nb ? na : nb;
+    for (ii = 0; ii < n && a[ii] == b[ii]; ii++) {
+        /* nothing */
+    }
+    return ii;
+}
+
+static int ensure_space(char **buf, size_t *nalloc, size_t needed)
+{
+    char *tmp;
+    size_t n_alloc = *nalloc ? *nalloc : 64;
+
+    if (needed <= *nalloc) {
+        return 0;
+    }
+    while (n_alloc < needed) {
+        n_alloc *= 2;
+    }
+    tmp = realloc(*buf, n_alloc);
+    if (!tmp) {
+        return -1;
+    }
+    *buf = tmp;
+    *nalloc = n_alloc;
+    return 0;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rowblock_builder_create(lcbex_rowblock_builder_t **builder,
+                                          unsigned int restart_interval,
+                                          int flags)
+{
+    lcbex_rowblock_builder_t *ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    if (restart_interval == 0) {
+        restart_interval = LCBEX_ROWBLOCK_RESTART_DEFAULT;
+    } else if (restart_interval < LCBEX_ROWBLOCK_RESTART_MIN) {
+        restart_interval = LCBEX_ROWBLOCK_RESTART_MIN;
+    } else if (restart_interval > LCBEX_ROWBLOCK_RESTART_MAX) {
+        restart_interval = LCBEX_ROWBLOCK_RESTART_MAX;
+    }
+
+    ret->interval = restart_interval;
+    ret->flags = flags;
+    *builder = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rowblock_builder_add(lcbex_rowblock_builder_t *builder,
+                                       const lcbex_vrow_t *row)
+{
+    unsigned char hdr[60];
+    size_t nhdr = 0;
+    size_t shared_key = 0, shared_id = 0;
+    size_t nid = row->id ? row->nid : 0;
+    size_t ndoc = row->doc ? row->ndoc : 0;
+    size_t needed;
+    unsigned char *p;
+
+    if (builder->nrows % builder->interval == 0) {
+        if (builder->ndata > (lcb_uint32_t) - 1) {
+            return LCB_E2BIG;
+        }
+        if (builder->nrestarts == builder->nrestarts_alloc) {
+            size_t n_alloc = builder->nrestarts_alloc ?
+                             builder->nrestarts_alloc * 2 : 16;
+            lcb_uint32_t *tmp = realloc(builder->restarts,
+                                        n_alloc * sizeof(*tmp));
+            if (!tmp) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            builder->restarts = tmp;
+            builder->nrestarts_alloc = n_alloc;
+        }
+        builder->restarts[builder->nrestarts++] = (lcb_uint32_t)builder->ndata;
+
+    } else {
+        shared_key = common_prefix(builder->lastkey, builder->nlastkey,
+                                   row->key, row->nkey);
+        if (row->id) {
+            shared_id = common_prefix(builder->lastid, builder->nlastid,
+                                      row->id, nid);
+        }
+    }
+
+    nhdr += put_varint(hdr + nhdr, shared_key);
+    nhdr += put_varint(hdr + nhdr, row->nkey - shared_key);
+    nhdr += put_varint(hdr + nhdr, shared_id);
+    nhdr += put_varint(hdr + nhdr, row->id ? nid - shared_id + 1 : 0);
+    nhdr += put_varint(hdr + nhdr, row->nvalue);
+    nhdr += put_varint(hdr + nhdr, row->doc ? ndoc + 1 : 0);
+
+    needed = nhdr + (row->nkey - shared_key) + (nid - shared_id) +
+             row->nvalue + ndoc;
+
+    if (ensure_space((char **)&builder->data, &builder->nalloc,
+                     builder->ndata + needed) != 0 ||
+            ensure_space(&builder->lastkey, &builder->nlastkey_alloc,
+                         row->nkey) != 0 ||
+            ensure_space(&builder->lastid, &builder->nlastid_alloc, nid) != 0) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    p = builder->data + builder->ndata;
+    memcpy(p, hdr, nhdr);
+    p += nhdr;
+    memcpy(p, row->key + shared_key, row->nkey - shared_key);
+    p += row->nkey - shared_key;
+    if (nid) {
+        memcpy(p, row->id + shared_id, nid - shared_id);
+        p += nid - shared_id;
+    }
+    if (row->nvalue) {
+        memcpy(p, row->value, row->nvalue);
+        p += row->nvalue;
+    }
+    if (ndoc) {
+        memcpy(p, row->doc, ndoc);
+        p += ndoc;
+    }
+    builder->ndata += needed;
+
+    if (row->nkey) {
+        memcpy(builder->lastkey, row->key, row->nkey);
+    }
+    builder->nlastkey = row->nkey;
+    if (nid) {
+        memcpy(builder->lastid, row->id, nid);
+    }
+    builder->nlastid = nid;
+    builder->collate_mask |= lcbex_vrow_collate_class(row->key, row->nkey);
+    builder->nrows++;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rowblock_builder_finish(lcbex_rowblock_builder_t *builder,
+                                          lcbex_rowblock_t **block)
+{
+    lcbex_rowblock_t *ret;
+    size_t nrestart_bytes = builder->nrestarts * sizeof(lcb_uint32_t);
+    char *p;
+
+    ret = malloc(sizeof(*ret) + nrestart_bytes + builder->ndata);
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    p = (char *)(ret + 1);
+    if (nrestart_bytes) {
+        memcpy(p, builder->restarts, nrestart_bytes);
+    }
+    if (builder->ndata) {
+        memcpy(p + nrestart_bytes, builder->data, builder->ndata);
+    }
+
+    ret->nrows = builder->nrows;
+    ret->nrestarts = builder->nrestarts;
+    ret->ndata = builder->ndata;
+    ret->interval = builder->interval;
+    ret->flags = builder->flags;
+    ret->collate_mask = builder->collate_mask;
+    ret->restarts = (const lcb_uint32_t *)p;
+    ret->data = (const unsigned char *)p + nrestart_bytes;
+
+    builder->ndata = 0;
+    builder->nrestarts = 0;
+    builder->nrows = 0;
+    builder->nlastkey = 0;
+    builder->nlastid = 0;
+    builder->collate_mask = 0;
+
+    *block = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_rowblock_builder_destroy(lcbex_rowblock_builder_t *builder)
+{
+    if (!builder) {
+        return;
+    }
+    free(builder->data);
+    free(builder->restarts);
+    free(builder->lastkey);
+    free(builder->lastid);
+    free(builder);
+}
+
+LCBEX_API
+size_t lcbex_rowblock_nrows(const lcbex_rowblock_t *block)
+{
+    return block->nrows;
+}
+
+LCBEX_API
+size_t lcbex_rowblock_size(const lcbex_rowblock_t *block)
+{
+    return sizeof(*block) + block->nrestarts * sizeof(lcb_uint32_t) +
+           block->ndata;
+}
+
+LCBEX_API
+int lcbex_rowblock_collate_class(const lcbex_rowblock_t *block)
+{
+    return block->collate_mask;
+}
+
+LCBEX_API
+void lcbex_rowblock_free(lcbex_rowblock_t *block)
+{
+    free(block);
+}
+
+LCBEX_API
+void lcbex_rowblock_iter_init(lcbex_rowblock_iter_t *iter,
+                              const lcbex_rowblock_t *block)
+{
+    memset(iter, 0, sizeof(*iter));
+    iter->block = block;
+}
+
+LCBEX_API
+int lcbex_rowblock_iter_next(lcbex_rowblock_iter_t *iter,
+                             const lcbex_vrow_t **row)
+{
+    const lcbex_rowblock_t *block = iter->block;
+    const unsigned char *p;
+    size_t shared_key, nkey, shared_id, nid, nvalue, ndoc;
+
+    if (iter->index >= block->nrows) {
+        return 0;
+    }
+
+    p = block->data + iter->offset;
+    p = get_varint(p, &shared_key);
+    p = get_varint(p, &nkey);
+    p = get_varint(p, &shared_id);
+    p = get_varint(p, &nid);
+    p = get_varint(p, &nvalue);
+    p = get_varint(p, &ndoc);
+
+    if (ensure_space(&iter->keybuf, &iter->nkeyalloc, shared_key + nkey) != 0) {
+        return 0;
+    }
+    memcpy(iter->keybuf + shared_key, p, nkey);
+    p += nkey;
+    iter->row.key = iter->keybuf;
+    iter->row.nkey = shared_key + nkey;
+
+    if (nid) {
+        nid--;
+        if (ensure_space(&iter->idbuf, &iter->nidalloc, shared_id + nid) != 0) {
+            return 0;
+        }
+        memcpy(iter->idbuf + shared_id, p, nid);
+        p += nid;
+        iter->row.id = iter->idbuf;
+        iter->row.nid = shared_id + nid;
+    } else {
+        iter->row.id = NULL;
+        iter->row.nid = 0;
+    }
+
+    iter->row.value = (const char *)p;
+    iter->row.nvalue = nvalue;
+    p += nvalue;
+
+    if (ndoc) {
+        iter->row.doc = (const char *)p;
+        iter->row.ndoc = ndoc - 1;
+        p += ndoc - 1;
+    } else {
+        iter->row.doc = NULL;
+        iter->row.ndoc = 0;
+    }
+
+    iter->offset = p - block->data;
+    iter->index++;
+    *row = &iter->row;
+    return 1;
+}
+
+static int block_compare(const lcbex_rowblock_t *block,
+                         const char *a, size_t na,
+                         const char *b, size_t nb)
+{
+    int rv = lcbex_vrow_collate(a, na, b, nb);
+    return (block->flags & LCBEX_ROWBLOCK_F_DESCENDING) ? -rv : rv;
+}
+
+LCBEX_API
+lcb_error_t lcbex_rowblock_iter_seek(lcbex_rowblock_iter_t *iter,
+                                     const char *key, size_t nkey)
+{
+    const lcbex_rowblock_t *block = iter->block;
+    size_t lo = 0, hi = block->nrestarts;
+
+    /* a binary search using a different order than the one the rows were
+     * sorted in would land anywhere */
+    if (!LCBEX_VROW_COLLATE_EXACT(block->collate_mask |
+                                  lcbex_vrow_collate_class(key, nkey))) {
+        return LCB_EINVAL;
+    }
+
+    /* find the first restart point whose key is not before the target */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const unsigned char *p = block->data + block->restarts[mid];
+        size_t shared, nrkey, dummy;
+
+        p = get_varint(p, &shared);
+        p = get_varint(p, &nrkey);
+        p = get_varint(p, &dummy);
+        p = get_varint(p, &dummy);
+        p = get_varint(p, &dummy);
+        p = get_varint(p, &dummy);
+
+        if (block_compare(block, (const char *)p, nrkey, key, nkey) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* the target is somewhere in the interval preceding that point */
+    if (lo > 0) {
+        lo--;
+    }
+    if (lo >= block->nrestarts) {
+        iter->index = block->nrows;
+        return LCB_SUCCESS;
+    }
+
+    iter->offset = block->restarts[lo];
+    iter->index = lo * block->interval;
+
+    for (;;) {
+        const lcbex_vrow_t *row;
+        size_t offset = iter->offset;
+        size_t index = iter->index;
+
+        if (!lcbex_rowblock_iter_next(iter, &row)) {
+            return LCB_SUCCESS;
+        }
+        if (block_compare(block, row->key, row->nkey, key, nkey) >= 0) {
+            /* rewind, so the next call returns this row. The key buffers
+             * already contain this row's prefix */
+            iter->offset = offset;
+            iter->index = index;
+            return LCB_SUCCESS;
+        }
+    }
+}
+
+LCBEX_API
+void lcbex_rowblock_iter_cleanup(lcbex_rowblock_iter_t *iter)
+{
+    free(iter->keybuf);
+    free(iter->idbuf);
+    iter->keybuf = NULL;
+    iter->idbuf = NULL;
+    iter->nkeyalloc = 0;
+    iter->nidalloc = 0;
+}
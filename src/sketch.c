@@ -0,0 +1,482 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/sketch.h>
+#include <lcbex/jsoncur.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+/**
+ * HyperLogLog and t-digest sketches
+ * @author Mark Nunberg
+ */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#ifndef NAN
+#define NAN (0.0 / 0.0)
+#endif
+
+struct lcbex_hll_st {
+    unsigned int precision;
+    size_t nregisters;
+    unsigned char *registers;
+};
+
+LCBEX_API
+lcb_error_t lcbex_hll_create(lcbex_hll_t **hll, unsigned int precision)
+{
+    lcbex_hll_t *ret;
+
+    if (!precision) {
+        precision = LCBEX_HLL_PRECISION_DEFAULT;
+    }
+    if (precision < LCBEX_HLL_PRECISION_MIN ||
+            precision > LCBEX_HLL_PRECISION_MAX) {
+        return LCB_EINVAL;
+    }
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->precision = precision;
+    ret->nregisters = (size_t)1 << precision;
+    if ((ret->registers = calloc(ret->nregisters, 1)) == NULL) {
+        free(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    *hll = ret;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Number of leading zero bits. x is never 0 here
+ */
+static unsigned int clz64(lcb_uint64_t x)
+{
+#ifdef __GNUC__
+    return (unsigned int)__builtin_clzll(x);
+#else
+    unsigned int n = 0;
+    while (!(x & ((lcb_uint64_t)1 << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static void hll_add_hash(lcbex_hll_t *hll, lcb_uint64_t hash)
+{
+    size_t ix = (size_t)(hash >> (64 - hll->precision));
+    /* the remaining bits, with a sentinel so the rank is bounded */
+    lcb_uint64_t rest = (hash << hll->precision) |
+                        ((lcb_uint64_t)1 << (hll->precision - 1));
+    unsigned char rank = (unsigned char)(clz64(rest) + 1);
+
+    if (rank > hll->registers[ix]) {
+        hll->registers[ix] = rank;
+    }
+}
+
+LCBEX_API
+void lcbex_hll_add(lcbex_hll_t *hll, const void *data, size_t ndata)
+{
+    hll_add_hash(hll, lcbex_hash64(data, ndata, 0));
+}
+
+LCBEX_API
+void lcbex_hll_add_row(lcbex_hll_t *hll, const lcbex_vrow_t *row,
+                       lcbex_sketch_field_t field)
+{
+    switch (field) {
+    case LCBEX_SKETCH_KEY:
+        if (row->key) {
+            lcbex_hll_add(hll, row->key, row->nkey);
+        }
+        break;
+    case LCBEX_SKETCH_ID:
+        if (row->id) {
+            lcbex_hll_add(hll, row->id, row->nid);
+        }
+        break;
+    case LCBEX_SKETCH_VALUE:
+        if (row->value) {
+            lcbex_hll_add(hll, row->value, row->nvalue);
+        }
+        break;
+    }
+}
+
+LCBEX_API
+double lcbex_hll_count(const lcbex_hll_t *hll)
+{
+    double m = (double)hll->nregisters;
+    double sum = 0, alpha, estimate;
+    size_t ii, nzero = 0;
+
+    for (ii = 0; ii < hll->nregisters; ii++) {
+        sum += 1.0 / (double)((lcb_uint64_t)1 << hll->registers[ii]);
+        if (!hll->registers[ii]) {
+            nzero++;
+        }
+    }
+
+    switch (hll->nregisters) {
+    case 16:
+        alpha = 0.673;
+        break;
+    case 32:
+        alpha = 0.697;
+        break;
+    case 64:
+        alpha = 0.709;
+        break;
+    default:
+        alpha = 0.7213 / (1 + 1.079 / m);
+        break;
+    }
+
+    estimate = alpha * m * m / sum;
+
+    /* small cardinalities: linear counting of the empty registers */
+    if (estimate <= 2.5 * m && nzero) {
+        estimate = m * log(m / (double)nzero);
+    }
+    return estimate;
+}
+
+LCBEX_API
+lcb_error_t lcbex_hll_merge(lcbex_hll_t *dst, const lcbex_hll_t *src)
+{
+    size_t ii;
+
+    if (dst->precision != src->precision) {
+        return LCB_EINVAL;
+    }
+    for (ii = 0; ii < dst->nregisters; ii++) {
+        if (src->registers[ii] > dst->registers[ii]) {
+            dst->registers[ii] = src->registers[ii];
+        }
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_hll_reset(lcbex_hll_t *hll)
+{
+    memset(hll->registers, 0, hll->nregisters);
+}
+
+LCBEX_API
+void lcbex_hll_destroy(lcbex_hll_t *hll)
+{
+    if (!hll) {
+        return;
+    }
+    free(hll->registers);
+    free(hll);
+}
+
+
+typedef struct {
+    double mean;
+    double weight;
+} centroid;
+
+struct lcbex_tdigest_st {
+    double compression;
+    /**
+     * Merged centroids first, followed by values added since the last
+     * merge (as centroids of their own)
+     */
+    centroid *points;
+    size_t ncentroids;
+    size_t npoints;
+    size_t capacity;
+
+    double total;
+    double min;
+    double max;
+    lcbex_json_index_t *index;
+};
+
+LCBEX_API
+lcb_error_t lcbex_tdigest_create(lcbex_tdigest_t **digest, double compression)
+{
+    lcbex_tdigest_t *ret;
+
+    if (compression <= 0) {
+        compression = LCBEX_TDIGEST_COMPRESSION_DEFAULT;
+    } else if (compression < 10) {
+        compression = 10;
+    }
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->compression = compression;
+    /* room for the merged centroids plus a buffer of new values */
+    ret->capacity = (size_t)(compression * 2) + (size_t)(compression * 5);
+    if ((ret->points = malloc(ret->capacity * sizeof(*ret->points))) == NULL) {
+        free(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+    *digest = ret;
+    return LCB_SUCCESS;
+}
+
+static int compare_centroids(const void *a, const void *b)
+{
+    double ma = ((const centroid *)a)->mean;
+    double mb = ((const centroid *)b)->mean;
+    return ma < mb ? -1 : (ma > mb ? 1 : 0);
+}
+
+/**
+ * The k1 scale function, mapping a quantile to a 'centroid index'. It is
+ * steep near 0 and 1, so centroids there are kept small.
+ */
+static double scale_k(double compression, double q)
+{
+    return compression / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double scale_q(double compression, double k)
+{
+    return (sin(k * 2 * M_PI / compression) + 1) / 2;
+}
+
+/**
+ * Sorts the buffered values into the centroids, merging neighbours for as
+ * long as the merged centroid stays within one unit of k
+ */
+static void compress(lcbex_tdigest_t *digest)
+{
+    centroid *pts = digest->points;
+    size_t ii, nout = 0;
+    double wsofar = 0, limit;
+
+    if (digest->npoints == digest->ncentroids) {
+        return;
+    }
+
+    qsort(pts, digest->npoints, sizeof(*pts), compare_centroids);
+
+    limit = digest->total *
+            scale_q(digest->compression,
+                    scale_k(digest->compression, 0) + 1);
+
+    for (ii = 1; ii < digest->npoints; ii++) {
+        centroid *cur = pts + nout;
+        const centroid *next = pts + ii;
+
+        if (wsofar + cur->weight + next->weight <= limit) {
+            cur->mean += (next->mean - cur->mean) * next->weight /
+                         (cur->weight + next->weight);
+            cur->weight += next->weight;
+        } else {
+            wsofar += cur->weight;
+            limit = digest->total *
+                    scale_q(digest->compression,
+                            scale_k(digest->compression,
+                                    wsofar / digest->total) + 1);
+            pts[++nout] = *next;
+        }
+    }
+
+    digest->ncentroids = digest->npoints = nout + 1;
+}
+
+static lcb_error_t add_centroid(lcbex_tdigest_t *digest, double mean,
+                                double weight)
+{
+    if (weight <= 0 || mean != mean) {
+        return LCB_EINVAL;
+    }
+
+    if (digest->npoints == digest->capacity) {
+        compress(digest);
+        if (digest->npoints == digest->capacity) {
+            /* should not happen: compression bounds the centroids */
+            size_t n_capacity = digest->capacity * 2;
+            centroid *tmp = realloc(digest->points,
+                                    n_capacity * sizeof(*tmp));
+            if (!tmp) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            digest->points = tmp;
+            digest->capacity = n_capacity;
+        }
+    }
+
+    if (digest->total == 0 || mean < digest->min) {
+        digest->min = mean;
+    }
+    if (digest->total == 0 || mean > digest->max) {
+        digest->max = mean;
+    }
+    digest->points[digest->npoints].mean = mean;
+    digest->points[digest->npoints].weight = weight;
+    digest->npoints++;
+    digest->total += weight;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_tdigest_add(lcbex_tdigest_t *digest, double value,
+                              double weight)
+{
+    return add_centroid(digest, value, weight);
+}
+
+LCBEX_API
+lcb_error_t lcbex_tdigest_add_row(lcbex_tdigest_t *digest,
+                                  const lcbex_vrow_t *row,
+                                  const char *path)
+{
+    lcbex_jsoncur_t cur;
+    double value;
+
+    if (!row->value) {
+        return LCB_EINVAL;
+    }
+    if (!digest->index &&
+            lcbex_json_index_create(&digest->index) != LCB_SUCCESS) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (lcbex_json_index_build(digest->index, row->value,
+                               row->nvalue) != LCB_SUCCESS ||
+            lcbex_jsoncur_root(digest->index, &cur) != LCB_SUCCESS ||
+            (path && lcbex_jsoncur_path(&cur, path, &cur) != LCB_SUCCESS) ||
+            lcbex_jsoncur_double(&cur, &value) != LCB_SUCCESS) {
+        return LCB_EINVAL;
+    }
+    return add_centroid(digest, value, 1);
+}
+
+LCBEX_API
+double lcbex_tdigest_quantile(lcbex_tdigest_t *digest, double q)
+{
+    const centroid *c;
+    size_t ii, n;
+    double index, wsofar;
+
+    if (digest->total == 0) {
+        return NAN;
+    }
+    if (q <= 0) {
+        return digest->min;
+    }
+    if (q >= 1) {
+        return digest->max;
+    }
+
+    compress(digest);
+    c = digest->points;
+    n = digest->ncentroids;
+    index = q * digest->total;
+
+    if (n == 1) {
+        return c[0].mean;
+    }
+
+    /* the first half of the first centroid lies between it and the min */
+    if (index < c[0].weight / 2) {
+        return digest->min + (c[0].mean - digest->min) *
+               index / (c[0].weight / 2);
+    }
+
+    wsofar = c[0].weight / 2;
+    for (ii = 0; ii + 1 < n; ii++) {
+        double dw = (c[ii].weight + c[ii + 1].weight) / 2;
+        if (wsofar + dw > index) {
+            return c[ii].mean + (c[ii + 1].mean - c[ii].mean) *
+                   (index - wsofar) / dw;
+        }
+        wsofar += dw;
+    }
+
+    /* and the second half of the last one between it and the max */
+    return c[n - 1].mean + (digest->max - c[n - 1].mean) *
+           (index - wsofar) / (c[n - 1].weight / 2);
+}
+
+LCBEX_API
+double lcbex_tdigest_count(const lcbex_tdigest_t *digest)
+{
+    return digest->total;
+}
+
+LCBEX_API
+double lcbex_tdigest_min(const lcbex_tdigest_t *digest)
+{
+    return digest->total ? digest->min : NAN;
+}
+
+LCBEX_API
+double lcbex_tdigest_max(const lcbex_tdigest_t *digest)
+{
+    return digest->total ? digest->max : NAN;
+}
+
+LCBEX_API
+lcb_error_t lcbex_tdigest_merge(lcbex_tdigest_t *dst, lcbex_tdigest_t *src)
+{
+    size_t ii;
+    double min, max;
+
+    if (src->total == 0) {
+        return LCB_SUCCESS;
+    }
+
+    compress(src);
+    min = dst->total && dst->min < src->min ? dst->min : src->min;
+    max = dst->total && dst->max > src->max ? dst->max : src->max;
+
+    for (ii = 0; ii < src->ncentroids; ii++) {
+        lcb_error_t err = add_centroid(dst, src->points[ii].mean,
+                                       src->points[ii].weight);
+        if (err != LCB_SUCCESS) {
+            return err;
+        }
+    }
+
+    /* a centroid's mean is not the extreme of the values it holds */
+    dst->min = min;
+    dst->max = max;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_tdigest_reset(lcbex_tdigest_t *digest)
+{
+    digest->ncentroids = digest->npoints = 0;
+    digest->total = 0;
+}
+
+LCBEX_API
+void lcbex_tdigest_destroy(lcbex_tdigest_t *digest)
+{
+    if (!digest) {
+        return;
+    }
+    lcbex_json_index_destroy(digest->index);
+    free(digest->points);
+    free(digest);
+}
@@ -0,0 +1,210 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/stalepol.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Automatic 'stale' selection
+ * @author Mark Nunberg
+ */
+
+typedef struct {
+    char *design;
+    size_t ndesign;
+
+    /* time at which the last successful refresh was issued */
+    lcb_uint64_t last_refresh;
+    /* time at which the outstanding refresh was issued */
+    lcb_uint64_t refresh_started;
+
+    int has_refreshed;
+    int refreshing;
+} stale_entry;
+
+struct lcbex_stalepol_st {
+    /* There are typically only a handful of design documents per bucket,
+     * so a linear list is fine */
+    stale_entry *entries;
+    size_t nentries;
+    size_t nalloc;
+};
+
+static stale_entry *find_entry(lcbex_stalepol_t *policy,
+                               const char *design, size_t ndesign)
+{
+    size_t ii;
+    for (ii = 0; ii < policy->nentries; ii++) {
+        stale_entry *ent = policy->entries + ii;
+        if (ent->ndesign == ndesign &&
+                memcmp(ent->design, design, ndesign) == 0) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+static stale_entry *add_entry(lcbex_stalepol_t *policy,
+                              const char *design, size_t ndesign)
+{
+    stale_entry *ent;
+
+    if (policy->nentries == policy->nalloc) {
+        size_t n_alloc = policy->nalloc ? policy->nalloc * 2 : 8;
+        stale_entry *tmp = realloc(policy->entries, n_alloc * sizeof(*tmp));
+        if (!tmp) {
+            return NULL;
+        }
+        policy->entries = tmp;
+        policy->nalloc = n_alloc;
+    }
+
+    ent = policy->entries + policy->nentries;
+    memset(ent, 0, sizeof(*ent));
+    ent->design = malloc(ndesign);
+    if (!ent->design) {
+        return NULL;
+    }
+    memcpy(ent->design, design, ndesign);
+    ent->ndesign = ndesign;
+    policy->nentries++;
+    return ent;
+}
+
+LCBEX_API
+lcb_error_t lcbex_stalepol_create(lcbex_stalepol_t **policy)
+{
+    *policy = calloc(1, sizeof(**policy));
+    if (!*policy) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_stalepol_select(lcbex_stalepol_t *policy,
+                                  const char *design, size_t ndesign,
+                                  lcb_uint64_t max_staleness,
+                                  lcb_uint64_t now,
+                                  lcbex_vopt_t *optobj,
+                                  int *is_refresh)
+{
+    stale_entry *ent;
+    const char *value;
+    int optid = LCBEX_VOPT_OPT_STALE;
+    char *errstr;
+
+    *is_refresh = 0;
+    memset(optobj, 0, sizeof(*optobj));
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (!ndesign) {
+        return LCB_EINVAL;
+    }
+
+    ent = find_entry(policy, design, ndesign);
+    if (!ent && (ent = add_entry(policy, design, ndesign)) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    /**
+     * A refresh which has been outstanding for longer than the window is
+     * assumed lost (the application never reported it); let another
+     * query take over.
+     */
+    if (ent->refreshing && now - ent->refresh_started > max_staleness) {
+        ent->refreshing = 0;
+    }
+
+    if (max_staleness && ent->has_refreshed &&
+            now - ent->last_refresh <= max_staleness) {
+        value = "ok";
+
+    } else if (ent->refreshing) {
+        /* callers which can't tolerate any staleness always pay for it */
+        value = max_staleness ? "update_after" : "false";
+
+    } else {
+        value = "false";
+        ent->refreshing = 1;
+        ent->refresh_started = now;
+        *is_refresh = 1;
+    }
+
+    return lcbex_vopt_assign(optobj, &optid, 0, value, -1,
+                             LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                             LCBEX_VOPT_F_OPTVAL_CONSTANT,
+                             &errstr);
+}
+
+LCBEX_API
+void lcbex_stalepol_refreshed(lcbex_stalepol_t *policy,
+                              const char *design, size_t ndesign,
+                              lcb_error_t err)
+{
+    stale_entry *ent;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+
+    ent = find_entry(policy, design, ndesign);
+    if (!ent || !ent->refreshing) {
+        return;
+    }
+
+    ent->refreshing = 0;
+    if (err == LCB_SUCCESS) {
+        ent->last_refresh = ent->refresh_started;
+        ent->has_refreshed = 1;
+    }
+}
+
+LCBEX_API
+void lcbex_stalepol_reset(lcbex_stalepol_t *policy,
+                          const char *design, size_t ndesign)
+{
+    stale_entry *ent;
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+
+    ent = find_entry(policy, design, ndesign);
+    if (ent) {
+        ent->has_refreshed = 0;
+        ent->refreshing = 0;
+    }
+}
+
+LCBEX_API
+void lcbex_stalepol_destroy(lcbex_stalepol_t *policy)
+{
+    size_t ii;
+
+    if (!policy) {
+        return;
+    }
+    for (ii = 0; ii < policy->nentries; ii++) {
+        free(policy->entries[ii].design);
+    }
+    free(policy->entries);
+    free(policy);
+}
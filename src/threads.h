@@ -0,0 +1,125 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Internal threading helpers: thread-local storage, the few atomic
+ * operations needed by per-thread structures, a plain mutex, thread exit
+ * hooks and one-time initialization. Not part of the public API.
+ */
+
+#ifndef LCBEX_THREADS_H
+#define LCBEX_THREADS_H
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <intrin.h>
+#define LCBEX_TLS __declspec(thread)
+#else
+#define LCBEX_TLS __thread
+#endif
+
+#if defined(__GNUC__)
+/* acquire/release loads and stores of 64 bit counters */
+#define LCBEX_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define LCBEX_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+/* increment/decrement of 32 bit counters, returning the new value */
+#define LCBEX_ATOMIC_INCR(p) __atomic_add_fetch(p, 1, __ATOMIC_ACQ_REL)
+#define LCBEX_ATOMIC_DECR(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+/* full barrier */
+#define LCBEX_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+/* returns nonzero if *p was 'expected' and has been replaced by 'desired' */
+#define LCBEX_ATOMIC_CAS_PTR(p, expected, desired) \
+    __sync_bool_compare_and_swap(p, expected, desired)
+
+#elif defined(_MSC_VER)
+/* x86/x64: aligned loads and stores are atomic; the barrier stops the
+ * compiler from reordering around them */
+#define LCBEX_ATOMIC_LOAD(p) (_ReadWriteBarrier(), *(volatile long long *)(p))
+#define LCBEX_ATOMIC_STORE(p, v) \
+    do { _ReadWriteBarrier(); *(volatile long long *)(p) = (v); } while (0)
+#define LCBEX_ATOMIC_INCR(p) InterlockedIncrement((volatile LONG *)(p))
+#define LCBEX_ATOMIC_DECR(p) InterlockedDecrement((volatile LONG *)(p))
+#define LCBEX_FENCE() MemoryBarrier()
+#define LCBEX_ATOMIC_CAS_PTR(p, expected, desired) \
+    (InterlockedCompareExchangePointer((volatile PVOID *)(p), \
+                                       desired, expected) == (expected))
+#else
+#error "No atomic operations for this compiler"
+#endif
+
+#if defined(_WIN32)
+#ifndef _MSC_VER
+#include <windows.h>
+#endif
+typedef CRITICAL_SECTION lcbex_mutex_t;
+#define LCBEX_MUTEX_INIT(m) InitializeCriticalSection(m)
+#define LCBEX_MUTEX_DESTROY(m) DeleteCriticalSection(m)
+#define LCBEX_MUTEX_LOCK(m) EnterCriticalSection(m)
+#define LCBEX_MUTEX_UNLOCK(m) LeaveCriticalSection(m)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t lcbex_mutex_t;
+#define LCBEX_MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define LCBEX_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define LCBEX_MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define LCBEX_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#endif
+
+/**
+ * Thread exit hooks. A hook is a key whose destructor is called with the
+ * value the exiting thread last set for it, if that isn't NULL. Declare
+ * destructors as 'static void LCBEX_THREAD_DTOR fn(void *value)'.
+ *
+ * LCBEX_THREAD_HOOK_CREATE returns 0 on success.
+ */
+#if defined(_WIN32)
+typedef DWORD lcbex_thread_hook_t;
+#define LCBEX_THREAD_DTOR WINAPI
+#define LCBEX_THREAD_HOOK_CREATE(k, dtor) \
+    ((*(k) = FlsAlloc(dtor)) == FLS_OUT_OF_INDEXES ? -1 : 0)
+#define LCBEX_THREAD_HOOK_SET(k, v) FlsSetValue(k, v)
+#else
+typedef pthread_key_t lcbex_thread_hook_t;
+#define LCBEX_THREAD_DTOR
+#define LCBEX_THREAD_HOOK_CREATE(k, dtor) pthread_key_create(k, dtor)
+#define LCBEX_THREAD_HOOK_SET(k, v) pthread_setspecific(k, v)
+#endif
+
+/**
+ * One-time initialization: LCBEX_ONCE(&once, fn) calls 'void fn(void)'
+ * exactly once per 'static lcbex_once_t once = LCBEX_ONCE_INIT', however
+ * many threads race on it.
+ */
+#if defined(_WIN32)
+typedef INIT_ONCE lcbex_once_t;
+#define LCBEX_ONCE_INIT INIT_ONCE_STATIC_INIT
+static BOOL CALLBACK lcbex_once_thunk(PINIT_ONCE once, PVOID fn, PVOID *ctx)
+{
+    (void)once;
+    (void)ctx;
+    ((void (*)(void))fn)();
+    return TRUE;
+}
+#define LCBEX_ONCE(o, fn) \
+    InitOnceExecuteOnce(o, lcbex_once_thunk, (PVOID)(fn), NULL)
+#else
+typedef pthread_once_t lcbex_once_t;
+#define LCBEX_ONCE_INIT PTHREAD_ONCE_INIT
+#define LCBEX_ONCE(o, fn) pthread_once(o, fn)
+#endif
+
+#endif /* LCBEX_THREADS_H */
@@ -0,0 +1,487 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/topn.h>
+#include <lcbex/jsoncur.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    double value;
+    /* position in the view's order, for ties */
+    size_t part;
+    lcb_uint64_t seq;
+    /* copies of the row's fields */
+    char *buf;
+    size_t nalloc;
+    lcbex_vrow_t row;
+} topn_entry;
+
+struct lcbex_topn_part_st {
+    lcbex_topn_t *topn;
+    size_t index;
+    lcbex_vrow_parser_t *parser;
+    lcbex_json_index_t *jindex;
+    /* heap of the best rows so far, the worst at the top */
+    topn_entry *heap;
+    size_t nheap;
+    lcb_uint64_t rows;
+    lcb_uint64_t skipped;
+    lcb_error_t err;
+    int done;
+};
+
+struct lcbex_topn_st {
+    lcbex_plan_t plan;
+    size_t n;
+    char *path;
+    int ascending;
+    char *design;
+    char *view;
+    const lcbex_vopt_t *const *options;
+    size_t noptions;
+    lcbex_topn_part_t *parts;
+    size_t nparts;
+    lcbex_topn_row_t *results;
+};
+
+static char *my_strndup(const char *s, size_t n)
+{
+    char *ret = malloc(n + 1);
+    if (ret) {
+        memcpy(ret, s, n);
+        ret[n] = '\0';
+    }
+    return ret;
+}
+
+/**
+ * Returns whether 'a' ranks before 'b'
+ */
+static int is_better(int ascending, double va, size_t pa, lcb_uint64_t sa,
+                     double vb, size_t pb, lcb_uint64_t sb)
+{
+    if (va != vb) {
+        return ascending ? va < vb : va > vb;
+    }
+    if (pa != pb) {
+        return pa < pb;
+    }
+    return sa < sb;
+}
+
+static int entry_better(int ascending, const topn_entry *a,
+                        const topn_entry *b)
+{
+    return is_better(ascending, a->value, a->part, a->seq,
+                     b->value, b->part, b->seq);
+}
+
+static void sift_down(lcbex_topn_part_t *part, size_t ii)
+{
+    int ascending = part->topn->ascending;
+    topn_entry *heap = part->heap, tmp;
+
+    for (;;) {
+        size_t worst = ii, child = ii * 2 + 1;
+
+        if (child < part->nheap &&
+                entry_better(ascending, heap + worst, heap + child)) {
+            worst = child;
+        }
+        if (child + 1 < part->nheap &&
+                entry_better(ascending, heap + worst, heap + child + 1)) {
+            worst = child + 1;
+        }
+        if (worst == ii) {
+            return;
+        }
+        tmp = heap[ii];
+        heap[ii] = heap[worst];
+        heap[worst] = tmp;
+        ii = worst;
+    }
+}
+
+static void sift_up(lcbex_topn_part_t *part, size_t ii)
+{
+    int ascending = part->topn->ascending;
+    topn_entry *heap = part->heap, tmp;
+
+    while (ii) {
+        size_t parent = (ii - 1) / 2;
+        if (!entry_better(ascending, heap + parent, heap + ii)) {
+            return;
+        }
+        tmp = heap[ii];
+        heap[ii] = heap[parent];
+        heap[parent] = tmp;
+        ii = parent;
+    }
+}
+
+/**
+ * Copies a row's fields into an entry, reusing its buffer if it is large
+ * enough
+ */
+static lcb_error_t copy_row(topn_entry *entry, const lcbex_vrow_t *row)
+{
+    size_t needed = row->nkey + row->nid + row->nvalue + row->ndoc;
+    char *p;
+
+    if (needed > entry->nalloc || !entry->buf) {
+        char *tmp = realloc(entry->buf, needed ? needed : 1);
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        entry->buf = tmp;
+        entry->nalloc = needed;
+    }
+
+    p = entry->buf;
+    memset(&entry->row, 0, sizeof(entry->row));
+#define COPY_FIELD(f, nf) \
+    if (row->f) { \
+        memcpy(p, row->f, row->nf); \
+        entry->row.f = p; \
+        entry->row.nf = row->nf; \
+        p += row->nf; \
+    }
+    COPY_FIELD(key, nkey)
+    COPY_FIELD(id, nid)
+    COPY_FIELD(value, nvalue)
+    COPY_FIELD(doc, ndoc)
+#undef COPY_FIELD
+    return LCB_SUCCESS;
+}
+
+/**
+ * Gets the field's value
+ * @return 0 if the row is to be skipped
+ */
+static int get_value(lcbex_topn_part_t *part, const lcbex_vrow_t *row,
+                     double *value)
+{
+    const char *path = part->topn->path;
+    lcbex_jsoncur_t root, cur;
+
+    if (!row->value ||
+            lcbex_json_index_build(part->jindex, row->value,
+                                   row->nvalue) != LCB_SUCCESS ||
+            lcbex_jsoncur_root(part->jindex, &root) != LCB_SUCCESS) {
+        return 0;
+    }
+    if (*path && lcbex_jsoncur_path(&root, path, &cur) != LCB_SUCCESS) {
+        return 0;
+    }
+    return lcbex_jsoncur_double(*path ? &cur : &root, value) == LCB_SUCCESS;
+}
+
+static lcb_error_t add_row(lcbex_topn_part_t *part, const lcbex_vrow_t *row)
+{
+    const lcbex_topn_t *topn = part->topn;
+    lcb_uint64_t seq = part->rows++;
+    topn_entry *entry;
+    lcb_error_t err;
+    double value;
+
+    if (!get_value(part, row, &value)) {
+        part->skipped++;
+        return LCB_SUCCESS;
+    }
+
+    if (part->nheap < topn->n) {
+        entry = part->heap + part->nheap;
+        if ((err = copy_row(entry, row)) != LCB_SUCCESS) {
+            return err;
+        }
+        entry->value = value;
+        entry->part = part->index;
+        entry->seq = seq;
+        sift_up(part, part->nheap++);
+
+    } else if (is_better(topn->ascending, value, part->index, seq,
+                         part->heap->value, part->heap->part,
+                         part->heap->seq)) {
+        /* replaces the worst row kept */
+        entry = part->heap;
+        if ((err = copy_row(entry, row)) != LCB_SUCCESS) {
+            return err;
+        }
+        entry->value = value;
+        entry->seq = seq;
+        sift_down(part, 0);
+    }
+    return LCB_SUCCESS;
+}
+
+static void row_callback(lcbex_vrow_parser_t *parser,
+                         const lcbex_vrow_t *row,
+                         void *cookie)
+{
+    lcbex_topn_part_t *part = cookie;
+
+    (void)parser;
+    if (part->err == LCB_SUCCESS) {
+        part->err = add_row(part, row);
+    }
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_create(lcbex_topn_t **topn,
+                              size_t n,
+                              const char *path,
+                              int flags,
+                              const lcbex_plan_t *plan,
+                              const char *design, size_t ndesign,
+                              const char *view, size_t nview,
+                              const lcbex_vopt_t *const *options,
+                              size_t noptions)
+{
+    lcbex_topn_t *ret;
+    size_t ii;
+
+    if (n == 0 || plan->strategy == LCBEX_PLAN_PAGINATED) {
+        return LCB_EINVAL;
+    }
+    if (ndesign == (size_t)-1) {
+        ndesign = strlen(design);
+    }
+    if (nview == (size_t)-1) {
+        nview = strlen(view);
+    }
+    if (!path) {
+        path = "";
+    }
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->plan = *plan;
+    ret->n = n;
+    ret->ascending = (flags & LCBEX_TOPN_F_ASCENDING) != 0;
+    ret->options = options;
+    ret->noptions = noptions;
+    ret->nparts = plan->strategy == LCBEX_PLAN_SINGLE ? 1 : plan->nparts;
+    ret->path = my_strndup(path, strlen(path));
+    ret->design = my_strndup(design, ndesign);
+    ret->view = my_strndup(view, nview);
+    ret->parts = calloc(ret->nparts, sizeof(*ret->parts));
+    if (!ret->path || !ret->design || !ret->view || !ret->parts) {
+        lcbex_topn_destroy(ret);
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    for (ii = 0; ii < ret->nparts; ii++) {
+        lcbex_topn_part_t *part = ret->parts + ii;
+        part->topn = ret;
+        part->index = ii;
+        if ((part->heap = calloc(n, sizeof(*part->heap))) == NULL ||
+                lcbex_json_index_create(&part->jindex) != LCB_SUCCESS ||
+                lcbex_vrow_parser_create(&part->parser, row_callback,
+                                         part) != LCB_SUCCESS) {
+            lcbex_topn_destroy(ret);
+            return LCB_CLIENT_ENOMEM;
+        }
+    }
+    *topn = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+size_t lcbex_topn_nparts(const lcbex_topn_t *topn)
+{
+    return topn->nparts;
+}
+
+LCBEX_API
+lcbex_topn_part_t *lcbex_topn_get_part(lcbex_topn_t *topn, size_t index)
+{
+    return index < topn->nparts ? topn->parts + index : NULL;
+}
+
+LCBEX_API
+char *lcbex_topn_part_make_uri(const lcbex_topn_part_t *part)
+{
+    const lcbex_topn_t *topn = part->topn;
+    return lcbex_plan_make_part_uri(&topn->plan, part->index,
+                                    topn->design, -1, topn->view, -1,
+                                    topn->options, topn->noptions);
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_part_feed(lcbex_topn_part_t *part,
+                                 const void *data, size_t ndata)
+{
+    lcb_error_t err;
+
+    if (part->err != LCB_SUCCESS) {
+        return part->err;
+    }
+    if (part->done) {
+        return LCB_EINVAL;
+    }
+    if ((err = lcbex_vrow_parser_feed(part->parser, data, ndata)) !=
+            LCB_SUCCESS && part->err == LCB_SUCCESS) {
+        part->err = err;
+    }
+    return part->err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_part_add_row(lcbex_topn_part_t *part,
+                                    const lcbex_vrow_t *row)
+{
+    if (part->err != LCB_SUCCESS) {
+        return part->err;
+    }
+    if (part->done) {
+        return LCB_EINVAL;
+    }
+    return part->err = add_row(part, row);
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_part_done(lcbex_topn_part_t *part,
+                                 lcb_error_t status)
+{
+    if (part->err == LCB_SUCCESS) {
+        part->err = status;
+    }
+    part->done = 1;
+    return part->err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_part_reset(lcbex_topn_part_t *part)
+{
+    lcbex_vrow_parser_reset(part->parser);
+    /* the entries keep their buffers for reuse */
+    part->nheap = 0;
+    part->rows = 0;
+    part->skipped = 0;
+    part->err = LCB_SUCCESS;
+    part->done = 0;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_topn_part_get_counts(const lcbex_topn_part_t *part,
+                                lcb_uint64_t *rows,
+                                lcb_uint64_t *skipped)
+{
+    *rows = part->rows;
+    *skipped = part->skipped;
+}
+
+static int cmp_desc(const void *a, const void *b)
+{
+    return entry_better(0, b, a) - entry_better(0, a, b);
+}
+
+static int cmp_asc(const void *a, const void *b)
+{
+    return entry_better(1, b, a) - entry_better(1, a, b);
+}
+
+LCBEX_API
+lcb_error_t lcbex_topn_merge(lcbex_topn_t *topn,
+                             const lcbex_topn_row_t **rows,
+                             size_t *nrows)
+{
+    size_t *pos, ii, nout = 0;
+
+    for (ii = 0; ii < topn->nparts; ii++) {
+        if (!topn->parts[ii].done) {
+            return LCB_EINVAL;
+        }
+        if (topn->parts[ii].err != LCB_SUCCESS) {
+            return topn->parts[ii].err;
+        }
+    }
+
+    if (!topn->results &&
+            (topn->results = malloc(topn->n * sizeof(*topn->results))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    if ((pos = calloc(topn->nparts, sizeof(*pos))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    /* each heap in order, best first; merged by picking the best head */
+    for (ii = 0; ii < topn->nparts; ii++) {
+        lcbex_topn_part_t *part = topn->parts + ii;
+        qsort(part->heap, part->nheap, sizeof(*part->heap),
+              topn->ascending ? cmp_asc : cmp_desc);
+    }
+    while (nout < topn->n) {
+        const topn_entry *best = NULL;
+        size_t best_part = 0;
+
+        for (ii = 0; ii < topn->nparts; ii++) {
+            const lcbex_topn_part_t *part = topn->parts + ii;
+            if (pos[ii] < part->nheap &&
+                    (!best || entry_better(topn->ascending,
+                                           part->heap + pos[ii], best))) {
+                best = part->heap + pos[ii];
+                best_part = ii;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        pos[best_part]++;
+        topn->results[nout].value = best->value;
+        topn->results[nout].row = best->row;
+        nout++;
+    }
+    free(pos);
+
+    *rows = topn->results;
+    *nrows = nout;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_topn_destroy(lcbex_topn_t *topn)
+{
+    size_t ii, jj;
+
+    if (topn->parts) {
+        for (ii = 0; ii < topn->nparts; ii++) {
+            lcbex_topn_part_t *part = topn->parts + ii;
+            if (part->heap) {
+                for (jj = 0; jj < topn->n; jj++) {
+                    free(part->heap[jj].buf);
+                }
+                free(part->heap);
+            }
+            if (part->jindex) {
+                lcbex_json_index_destroy(part->jindex);
+            }
+            if (part->parser) {
+                lcbex_vrow_parser_destroy(part->parser);
+            }
+        }
+    }
+    free(topn->parts);
+    free(topn->results);
+    free(topn->path);
+    free(topn->design);
+    free(topn->view);
+    free(topn);
+}
@@ -0,0 +1,456 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include "threads.h"
+
+#ifndef LCBEX_DISABLE_TRACING
+
+/**
+ * Each thread owns a ring which only it writes to. The flushing thread
+ * reads other threads' rings without stopping them, so a slot can be
+ * overwritten while it is being copied out. To detect this the owner
+ * publishes two counters:
+ *
+ * 'claimed' is bumped before a slot is written and 'written' after. The
+ * flusher copies slots below 'written', then re-reads 'claimed': any slot
+ * more than one ring size behind it may have been (partly) rewritten
+ * during the copy, and is counted as dropped rather than exported.
+ *
+ * When a thread exits its ring is marked orphaned. The next flush drains
+ * it and then unlinks and frees it. Only the flusher unlinks rings, while
+ * new rings are only ever pushed at the head, so the list needs no lock.
+ */
+typedef struct trace_ring_st {
+    lcbex_trace_event_t *events;
+    lcb_uint64_t mask;
+    lcb_uint64_t claimed;
+    lcb_uint64_t written;
+    /* consumed by flushes; only touched by the flushing thread */
+    lcb_uint64_t read;
+    /* set once the owning thread has exited */
+    lcb_uint64_t orphaned;
+    lcb_uint32_t thread_id;
+    struct trace_ring_st *next;
+} trace_ring;
+
+/* events copied out of a ring at a time */
+#define FLUSH_BATCH 128
+
+static trace_ring *rings;
+static volatile int trace_enabled;
+static size_t trace_ring_size = LCBEX_TRACE_RING_DEFAULT;
+static lcb_uint32_t next_thread_id;
+/* bumped by cleanup, so threads know their ring is gone */
+static lcb_uint32_t generation;
+static lcbex_thread_hook_t exit_hook;
+static int have_exit_hook;
+
+static LCBEX_TLS trace_ring *my_ring;
+static LCBEX_TLS lcb_uint32_t my_generation;
+static LCBEX_TLS lcb_uint64_t my_query;
+
+static void LCBEX_THREAD_DTOR thread_exited(void *arg)
+{
+    trace_ring *ring = arg;
+
+    /* cleanup may have freed it already */
+    if (ring == my_ring && my_generation == generation) {
+        LCBEX_ATOMIC_STORE(&ring->orphaned, 1);
+    }
+    /* spans recorded by later destructors go to a new ring */
+    my_ring = NULL;
+}
+
+static trace_ring *get_ring(void)
+{
+    trace_ring *ring;
+    size_t size;
+
+    if (my_ring && my_generation == generation) {
+        return my_ring;
+    }
+
+    for (size = 1; size < trace_ring_size; size <<= 1) {
+        ;
+    }
+    if ((ring = calloc(1, sizeof(*ring))) == NULL) {
+        return NULL;
+    }
+    if ((ring->events = malloc(size * sizeof(*ring->events))) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    ring->thread_id = LCBEX_ATOMIC_INCR(&next_thread_id);
+
+    do {
+        ring->next = rings;
+    } while (!LCBEX_ATOMIC_CAS_PTR(&rings, ring->next, ring));
+
+    my_ring = ring;
+    my_generation = generation;
+    if (have_exit_hook) {
+        LCBEX_THREAD_HOOK_SET(exit_hook, ring);
+    }
+    return ring;
+}
+
+static void record(const char *name, lcb_uint64_t start,
+                   lcb_uint64_t duration, char phase)
+{
+    trace_ring *ring = get_ring();
+    lcbex_trace_event_t *ev;
+    lcb_uint64_t n;
+
+    if (!ring) {
+        return;
+    }
+
+    n = ring->claimed;
+    LCBEX_ATOMIC_STORE(&ring->claimed, n + 1);
+    LCBEX_FENCE();
+
+    ev = ring->events + (n & ring->mask);
+    ev->name = name;
+    ev->query_id = my_query;
+    ev->start = start;
+    ev->duration = duration;
+    ev->thread_id = ring->thread_id;
+    ev->phase = phase;
+
+    LCBEX_ATOMIC_STORE(&ring->written, n + 1);
+}
+
+LCBEX_API
+lcb_error_t lcbex_trace_enable(size_t ring_size)
+{
+    trace_ring_size = ring_size ? ring_size : LCBEX_TRACE_RING_DEFAULT;
+    if (!have_exit_hook) {
+        /* without it, rings of exited threads are only freed by cleanup */
+        have_exit_hook = LCBEX_THREAD_HOOK_CREATE(&exit_hook,
+                                                  thread_exited) == 0;
+    }
+    trace_enabled = 1;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_trace_disable(void)
+{
+    trace_enabled = 0;
+}
+
+LCBEX_API
+void lcbex_trace_set_query(lcb_uint64_t query_id)
+{
+    my_query = query_id;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_trace_get_query(void)
+{
+    return my_query;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_trace_now(void)
+{
+    if (!trace_enabled) {
+        return 0;
+    }
+    return lcbex_hrtime();
+}
+
+LCBEX_API
+void lcbex_trace_span(const char *name, lcb_uint64_t start)
+{
+    if (trace_enabled && start) {
+        lcb_uint64_t now = lcbex_hrtime();
+        record(name, start, now > start ? now - start : 0, 'X');
+    }
+}
+
+LCBEX_API
+void lcbex_trace_span_at(const char *name,
+                         lcb_uint64_t start, lcb_uint64_t end)
+{
+    if (trace_enabled) {
+        record(name, start, end > start ? end - start : 0, 'X');
+    }
+}
+
+LCBEX_API
+void lcbex_trace_mark(const char *name)
+{
+    if (trace_enabled) {
+        record(name, lcbex_hrtime(), 0, 'i');
+    }
+}
+
+static size_t flush_ring(trace_ring *ring,
+                         lcbex_trace_exporter exporter, void *cookie,
+                         lcb_uint64_t *dropped)
+{
+    lcbex_trace_event_t batch[FLUSH_BATCH];
+    lcb_uint64_t size = ring->mask + 1;
+    lcb_uint64_t written = LCBEX_ATOMIC_LOAD(&ring->written);
+    size_t nexported = 0;
+
+    while (ring->read < written) {
+        lcb_uint64_t begin = ring->read, end, valid, claimed, ii;
+
+        if (written - begin > size) {
+            /* overwritten before we got to them */
+            *dropped += written - size - begin;
+            begin = written - size;
+        }
+        end = written - begin > FLUSH_BATCH ? begin + FLUSH_BATCH : written;
+
+        for (ii = begin; ii < end; ii++) {
+            batch[ii - begin] = ring->events[ii & ring->mask];
+        }
+        LCBEX_FENCE();
+        claimed = LCBEX_ATOMIC_LOAD(&ring->claimed);
+
+        /* slots the owner may have been rewriting while we copied */
+        valid = begin;
+        if (claimed > size && claimed - size > begin) {
+            valid = claimed - size < end ? claimed - size : end;
+        }
+        *dropped += valid - begin;
+
+        if (end > valid) {
+            exporter(batch + (valid - begin), (size_t)(end - valid), cookie);
+            nexported += (size_t)(end - valid);
+        }
+        ring->read = end;
+    }
+    return nexported;
+}
+
+static void unlink_ring(trace_ring *ring, trace_ring *prev)
+{
+    if (!prev) {
+        if (LCBEX_ATOMIC_CAS_PTR(&rings, ring, ring->next)) {
+            return;
+        }
+        /* other threads pushed new rings in front of it */
+        for (prev = rings; prev->next != ring; prev = prev->next) {
+            ;
+        }
+    }
+    prev->next = ring->next;
+}
+
+LCBEX_API
+size_t lcbex_trace_flush(lcbex_trace_exporter exporter, void *cookie,
+                         lcb_uint64_t *dropped)
+{
+    trace_ring *ring, *prev = NULL;
+    lcb_uint64_t ndropped = 0;
+    size_t nexported = 0;
+
+    for (ring = rings; ring; ) {
+        trace_ring *next = ring->next;
+        /* read first, so the owner's last writes are visible to the flush */
+        int orphaned = LCBEX_ATOMIC_LOAD(&ring->orphaned) != 0;
+
+        nexported += flush_ring(ring, exporter, cookie, &ndropped);
+        if (orphaned) {
+            unlink_ring(ring, prev);
+            free(ring->events);
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+    if (dropped) {
+        *dropped = ndropped;
+    }
+    return nexported;
+}
+
+LCBEX_API
+void lcbex_trace_cleanup(void)
+{
+    trace_ring *ring = rings;
+
+    rings = NULL;
+    generation++;
+    while (ring) {
+        trace_ring *next = ring->next;
+        free(ring->events);
+        free(ring);
+        ring = next;
+    }
+}
+
+#else /* LCBEX_DISABLE_TRACING */
+
+LCBEX_API
+lcb_error_t lcbex_trace_enable(size_t ring_size)
+{
+    (void)ring_size;
+    return LCB_NOT_SUPPORTED;
+}
+
+LCBEX_API
+void lcbex_trace_disable(void)
+{
+}
+
+LCBEX_API
+void lcbex_trace_set_query(lcb_uint64_t query_id)
+{
+    (void)query_id;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_trace_get_query(void)
+{
+    return 0;
+}
+
+LCBEX_API
+lcb_uint64_t lcbex_trace_now(void)
+{
+    return 0;
+}
+
+LCBEX_API
+void lcbex_trace_span(const char *name, lcb_uint64_t start)
+{
+    (void)name;
+    (void)start;
+}
+
+LCBEX_API
+void lcbex_trace_span_at(const char *name,
+                         lcb_uint64_t start, lcb_uint64_t end)
+{
+    (void)name;
+    (void)start;
+    (void)end;
+}
+
+LCBEX_API
+void lcbex_trace_mark(const char *name)
+{
+    (void)name;
+}
+
+LCBEX_API
+size_t lcbex_trace_flush(lcbex_trace_exporter exporter, void *cookie,
+                         lcb_uint64_t *dropped)
+{
+    (void)exporter;
+    (void)cookie;
+    if (dropped) {
+        *dropped = 0;
+    }
+    return 0;
+}
+
+LCBEX_API
+void lcbex_trace_cleanup(void)
+{
+}
+
+#endif /* LCBEX_DISABLE_TRACING */
+
+/**
+ * Chrome trace-event exporter. Timestamps are in microseconds; we keep the
+ * nanoseconds as three decimals.
+ */
+static void write_usec(FILE *fp, lcb_uint64_t ns)
+{
+    fprintf(fp, "%llu.%03u",
+            (unsigned long long)(ns / 1000), (unsigned int)(ns % 1000));
+}
+
+static void write_name(FILE *fp, const char *name)
+{
+    const char *p;
+
+    fputc('"', fp);
+    for (p = name ? name : ""; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if ((unsigned char)*p < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+LCBEX_API
+void lcbex_trace_chrome_begin(lcbex_trace_chrome_t *ctx, FILE *fp)
+{
+    ctx->fp = fp;
+    ctx->nevents = 0;
+    fputs("[\n", fp);
+}
+
+LCBEX_API
+void lcbex_trace_chrome_export(const lcbex_trace_event_t *events,
+                               size_t nevents,
+                               void *cookie)
+{
+    lcbex_trace_chrome_t *ctx = cookie;
+    FILE *fp = ctx->fp;
+    size_t ii;
+
+    for (ii = 0; ii < nevents; ii++) {
+        const lcbex_trace_event_t *ev = events + ii;
+
+        if (ctx->nevents++) {
+            fputs(",\n", fp);
+        }
+        fputs("{\"name\":", fp);
+        write_name(fp, ev->name);
+        fprintf(fp, ",\"cat\":\"lcbex\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":", ev->phase, (unsigned int)ev->thread_id);
+        write_usec(fp, ev->start);
+
+        if (ev->phase == 'X') {
+            fputs(",\"dur\":", fp);
+            write_usec(fp, ev->duration);
+        } else {
+            /* instant events are scoped to their thread */
+            fputs(",\"s\":\"t\"", fp);
+        }
+        if (ev->query_id) {
+            fprintf(fp, ",\"args\":{\"query\":%llu}",
+                    (unsigned long long)ev->query_id);
+        }
+        fputc('}', fp);
+    }
+}
+
+LCBEX_API
+void lcbex_trace_chrome_end(lcbex_trace_chrome_t *ctx)
+{
+    fputs("\n]\n", ctx->fp);
+    fflush(ctx->fp);
+}
@@ -16,12 +16,17 @@
  */
 #include "config_static.h"
 #include <lcbex/viewopts.h>
+#include <lcbex/trace.h>
 #include <ctype.h>
+#include <float.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+#include "threads.h"
+#include "hash.h"
 
 /**
  * View option string manipulation and construction library
@@ -58,6 +63,7 @@ DECLARE_HANDLER(num_param_handler)
 DECLARE_HANDLER(string_param_handler)
 DECLARE_HANDLER(stale_param_handler)
 DECLARE_HANDLER(onerror_param_handler)
+DECLARE_HANDLER(coords_param_handler)
 
 #define jval_param_handler string_param_handler
 #define jarry_param_handler string_param_handler
@@ -205,10 +211,32 @@ static lcb_error_t num_param_handler(view_param *param,
 }
 
 
+enum {
+    PCT_PROFILE_NONE = 0,
+    /* PHP's urlencode: [A-Za-z0-9-_.] */
+    PCT_PROFILE_PHP,
+    /* RFC 3986 unreserved: [A-Za-z0-9-_.~] */
+    PCT_PROFILE_RFC3986,
+    /* anything legal in a query value, plus JSON punctuation */
+    PCT_PROFILE_QUERYSAFE
+};
+
+static int pct_profile(int flags)
+{
+    if (flags & LCBEX_VOPT_F_PCTENCODE_QUERYSAFE) {
+        return PCT_PROFILE_QUERYSAFE;
+    } else if (flags & LCBEX_VOPT_F_PCTENCODE_RFC3986) {
+        return PCT_PROFILE_RFC3986;
+    } else if (flags & LCBEX_VOPT_F_PCTENCODE) {
+        return PCT_PROFILE_PHP;
+    }
+    return PCT_PROFILE_NONE;
+}
+
 /**
- * This is the logic used in PHP's urlencode
+ * Returns whether a character must be escaped under the given profile
  */
-static int needs_pct_encoding(char c)
+static int needs_pct_encoding(int profile, char c)
 {
     if (c >= 'a' && c <= 'z') {
         return 0;
@@ -223,7 +251,42 @@ static int needs_pct_encoding(char c)
     if (c == '-' || c == '_' || c == '.') {
         return 0;
     }
-    return 1;
+
+    if (profile == PCT_PROFILE_PHP) {
+        return 1;
+    }
+
+    if (c == '~') {
+        return 0;
+    }
+
+    if (profile == PCT_PROFILE_RFC3986) {
+        return 1;
+    }
+
+    switch (c) {
+    /* sub-delims other than '&', '=' and '+', which have meaning in a query */
+    case '!':
+    case '$':
+    case '\'':
+    case '(':
+    case ')':
+    case '*':
+    case ',':
+    case ';':
+    /* the rest of 'pchar', plus '/' and '?' */
+    case ':':
+    case '@':
+    case '/':
+    case '?':
+    /* JSON punctuation, accepted by the view engine */
+    case '[':
+    case ']':
+    case '"':
+        return 0;
+    default:
+        return 1;
+    }
 }
 
 /**
@@ -232,14 +295,19 @@ static int needs_pct_encoding(char c)
  *
  * Returns the effective length of the string.
  */
-static size_t do_pct_encode(char *dest, const char *src, size_t nsrc)
+static size_t do_pct_encode(int profile, char *dest,
+                            const char *src, size_t nsrc)
 {
+    static const char hexchars[] = "0123456789ABCDEF";
     size_t d_len = 0;
     size_t ii;
     for (ii = 0; ii < nsrc; ii++) {
-        if (needs_pct_encoding(src[ii])) {
+        if (needs_pct_encoding(profile, src[ii])) {
             if (dest) {
-                sprintf(dest + d_len, "%%%02X", (unsigned char)src[ii]);
+                unsigned char c = (unsigned char)src[ii];
+                dest[d_len] = '%';
+                dest[d_len + 1] = hexchars[c >> 4];
+                dest[d_len + 2] = hexchars[c & 0x0F];
             }
             d_len += 3;
         } else {
@@ -253,6 +321,281 @@ static size_t do_pct_encode(char *dest, const char *src, size_t nsrc)
     return d_len;
 }
 
+/**
+ * Value memo. An encoded value lives in a memo_value, referenced by the
+ * table and by each option using it, and is freed with its last
+ * reference. The table is split into shards, each with its own lock,
+ * hash chains and CLOCK hand, so threads assigning different values
+ * rarely contend.
+ */
+#define MEMO_NSHARDS 16
+#define MEMO_NIL ((size_t)-1)
+
+typedef struct {
+    lcb_uint32_t refcount;
+    int profile;
+    size_t nraw;
+    size_t nencoded;
+    /* the encoded value, its NUL, then the raw value */
+    char data[1];
+} memo_value;
+
+typedef struct {
+    memo_value *value;
+    lcb_uint64_t hash;
+    /* next slot in the same bucket, or MEMO_NIL */
+    size_t next;
+    /* set on each hit, cleared as the CLOCK hand passes */
+    int referenced;
+} memo_slot;
+
+typedef struct {
+    lcbex_mutex_t lock;
+    memo_slot *slots;
+    size_t *buckets;
+    size_t nslots;
+    /* power of two */
+    size_t nbuckets;
+    size_t nused;
+    size_t hand;
+    lcb_uint64_t hits;
+    lcb_uint64_t misses;
+    lcb_uint64_t evictions;
+} memo_shard;
+
+static memo_shard *memo_shards;
+
+static memo_shard *memo_get_shard(lcb_uint64_t hash)
+{
+    return memo_shards + ((hash >> 32) & (MEMO_NSHARDS - 1));
+}
+
+static void memo_release(memo_value *value)
+{
+    if (LCBEX_ATOMIC_DECR(&value->refcount) == 0) {
+        free(value);
+    }
+}
+
+static size_t memo_find(memo_shard *shard, lcb_uint64_t hash, int profile,
+                        const char *raw, size_t nraw)
+{
+    size_t ii = shard->buckets[hash & (shard->nbuckets - 1)];
+
+    for (; ii != MEMO_NIL; ii = shard->slots[ii].next) {
+        const memo_slot *slot = shard->slots + ii;
+        const memo_value *value = slot->value;
+
+        if (slot->hash == hash && value->profile == profile &&
+                value->nraw == nraw &&
+                memcmp(value->data + value->nencoded + 1, raw, nraw) == 0) {
+            return ii;
+        }
+    }
+    return MEMO_NIL;
+}
+
+/**
+ * Returns the memoized value with a reference for the caller, or NULL
+ */
+static memo_value *memo_lookup(lcb_uint64_t hash, int profile,
+                               const char *raw, size_t nraw)
+{
+    memo_shard *shard = memo_get_shard(hash);
+    memo_value *value = NULL;
+    size_t ii;
+
+    LCBEX_MUTEX_LOCK(&shard->lock);
+    ii = memo_find(shard, hash, profile, raw, nraw);
+    if (ii != MEMO_NIL) {
+        shard->slots[ii].referenced = 1;
+        value = shard->slots[ii].value;
+        LCBEX_ATOMIC_INCR(&value->refcount);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    LCBEX_MUTEX_UNLOCK(&shard->lock);
+    return value;
+}
+
+/**
+ * Picks a slot to reuse, unlinking and releasing its value
+ */
+static size_t memo_evict(memo_shard *shard)
+{
+    memo_slot *slot;
+    size_t victim, *pp;
+
+    for (;;) {
+        victim = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->nslots;
+        slot = shard->slots + victim;
+        if (!slot->referenced) {
+            break;
+        }
+        slot->referenced = 0;
+    }
+
+    pp = shard->buckets + (slot->hash & (shard->nbuckets - 1));
+    while (*pp != victim) {
+        pp = &shard->slots[*pp].next;
+    }
+    *pp = slot->next;
+    memo_release(slot->value);
+    shard->evictions++;
+    return victim;
+}
+
+/**
+ * Adds a value to the table, which takes its own reference. If another
+ * thread added the same value meanwhile, the table keeps that one.
+ */
+static void memo_insert(lcb_uint64_t hash, memo_value *value)
+{
+    memo_shard *shard = memo_get_shard(hash);
+    memo_slot *slot;
+    size_t ii, bucket;
+
+    LCBEX_MUTEX_LOCK(&shard->lock);
+    if (memo_find(shard, hash, value->profile,
+                  value->data + value->nencoded + 1,
+                  value->nraw) == MEMO_NIL) {
+        if (shard->nused < shard->nslots) {
+            ii = shard->nused++;
+        } else {
+            ii = memo_evict(shard);
+        }
+
+        bucket = hash & (shard->nbuckets - 1);
+        slot = shard->slots + ii;
+        slot->value = value;
+        slot->hash = hash;
+        slot->referenced = 0;
+        slot->next = shard->buckets[bucket];
+        shard->buckets[bucket] = ii;
+        LCBEX_ATOMIC_INCR(&value->refcount);
+    }
+    LCBEX_MUTEX_UNLOCK(&shard->lock);
+}
+
+static memo_value *memo_create(int profile, const char *raw, size_t nraw,
+                               size_t nencoded)
+{
+    memo_value *value = malloc(offsetof(memo_value, data) +
+                               nencoded + 1 + nraw);
+    if (!value) {
+        return NULL;
+    }
+
+    value->refcount = 1;
+    value->profile = profile;
+    value->nraw = nraw;
+    value->nencoded = do_pct_encode(profile, value->data, raw, nraw);
+    value->data[nencoded] = '\0';
+    memcpy(value->data + nencoded + 1, raw, nraw);
+    return value;
+}
+
+static void set_shared_value(struct lcbex_vopt_st *optobj, memo_value *value)
+{
+    optobj->optval = value->data;
+    optobj->noptval = value->nencoded;
+    optobj->flags &= ~LCBEX_VOPT_F_OPTVAL_CONSTANT;
+    optobj->flags |= LCBEX_VOPT_F_OPTVAL_SHARED;
+}
+
+static void memo_free(memo_shard *shards, size_t nshards)
+{
+    size_t ii, jj;
+
+    for (ii = 0; ii < nshards; ii++) {
+        memo_shard *shard = shards + ii;
+
+        for (jj = 0; jj < shard->nused; jj++) {
+            memo_release(shard->slots[jj].value);
+        }
+        free(shard->slots);
+        free(shard->buckets);
+        LCBEX_MUTEX_DESTROY(&shard->lock);
+    }
+    free(shards);
+}
+
+LCBEX_API
+lcb_error_t lcbex_vopt_memo_enable(size_t capacity)
+{
+    memo_shard *shards;
+    size_t nslots, nbuckets, ii, jj;
+
+    lcbex_vopt_memo_disable();
+
+    if (capacity == 0) {
+        capacity = LCBEX_VOPT_MEMO_DEFAULT;
+    }
+    nslots = (capacity + MEMO_NSHARDS - 1) / MEMO_NSHARDS;
+    for (nbuckets = 1; nbuckets < nslots; nbuckets <<= 1) {
+        ;
+    }
+
+    shards = calloc(MEMO_NSHARDS, sizeof(*shards));
+    if (!shards) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    for (ii = 0; ii < MEMO_NSHARDS; ii++) {
+        memo_shard *shard = shards + ii;
+
+        LCBEX_MUTEX_INIT(&shard->lock);
+        shard->nslots = nslots;
+        shard->nbuckets = nbuckets;
+        shard->slots = calloc(nslots, sizeof(*shard->slots));
+        shard->buckets = malloc(nbuckets * sizeof(*shard->buckets));
+        if (!shard->slots || !shard->buckets) {
+            memo_free(shards, ii + 1);
+            return LCB_CLIENT_ENOMEM;
+        }
+        for (jj = 0; jj < nbuckets; jj++) {
+            shard->buckets[jj] = MEMO_NIL;
+        }
+    }
+
+    memo_shards = shards;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+void lcbex_vopt_memo_disable(void)
+{
+    if (memo_shards) {
+        memo_free(memo_shards, MEMO_NSHARDS);
+        memo_shards = NULL;
+    }
+}
+
+LCBEX_API
+void lcbex_vopt_memo_get_stats(lcbex_vopt_memo_stats_t *stats)
+{
+    size_t ii;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!memo_shards) {
+        return;
+    }
+
+    for (ii = 0; ii < MEMO_NSHARDS; ii++) {
+        memo_shard *shard = memo_shards + ii;
+
+        LCBEX_MUTEX_LOCK(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->nused;
+        stats->capacity += shard->nslots;
+        LCBEX_MUTEX_UNLOCK(&shard->lock);
+    }
+}
+
 static lcb_error_t string_param_handler(view_param *param,
                                         struct lcbex_vopt_st *optobj,
                                         const void *value,
@@ -267,32 +610,61 @@ static lcb_error_t string_param_handler(view_param *param,
         return LCB_EINVAL;
     }
 
-    if ((flags & LCBEX_VOPT_F_PCTENCODE) == 0) {
+    if (pct_profile(flags) == PCT_PROFILE_NONE) {
         /* determine if we need to encode anything as a percent */
         set_user_string(optobj, value, nvalue, flags);
         return LCB_SUCCESS;
 
     } else {
+        int profile = pct_profile(flags);
         size_t needed_size = 0;
         const char *str = (const char *)value;
         size_t ii;
+        int use_memo = memo_shards != NULL &&
+                nvalue <= LCBEX_VOPT_MEMO_MAXVALUE;
+        lcb_uint64_t hash = 0;
+        memo_value *shared;
+
+        if (use_memo) {
+            hash = lcbex_hash64(str, nvalue, profile);
+            shared = memo_lookup(hash, profile, str, nvalue);
+            if (shared) {
+                set_shared_value(optobj, shared);
+                return LCB_SUCCESS;
+            }
+        }
 
         for (ii = 0; ii < nvalue; ii++) {
-            if (needs_pct_encoding(str[ii])) {
+            if (needs_pct_encoding(profile, str[ii])) {
                 needed_size += 3;
             } else {
                 needed_size++;
             }
         }
 
+        if (use_memo) {
+            /* values needing no escapes are shared too, saving the copy */
+            shared = memo_create(profile, str, nvalue, needed_size);
+            if (!shared) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            memo_insert(hash, shared);
+            set_shared_value(optobj, shared);
+            return LCB_SUCCESS;
+        }
+
         if (needed_size == nvalue) {
             set_user_string(optobj, value, nvalue, flags);
             return LCB_SUCCESS;
         }
 
         optobj->optval = malloc(needed_size + 1);
+        if (!optobj->optval) {
+            return LCB_CLIENT_ENOMEM;
+        }
         ((char *)(optobj->optval))[needed_size] = '\0';
-        optobj->noptval = do_pct_encode((char *)optobj->optval, str, nvalue);
+        optobj->noptval = do_pct_encode(profile, (char *)optobj->optval,
+                                        str, nvalue);
     }
     return LCB_SUCCESS;
 }
@@ -362,6 +734,242 @@ static lcb_error_t onerror_param_handler(view_param *param,
 }
 
 
+/**
+ * Returns the length of the JSON number at the start of the string, or 0
+ */
+static size_t scan_number(const char *s, size_t n)
+{
+    size_t ii = 0, ndigits;
+
+    if (ii < n && s[ii] == '-') {
+        ii++;
+    }
+    for (ndigits = 0; ii < n && isdigit(s[ii]); ii++) {
+        ndigits++;
+    }
+    if (!ndigits) {
+        return 0;
+    }
+    if (ii < n && s[ii] == '.') {
+        for (ii++, ndigits = 0; ii < n && isdigit(s[ii]); ii++) {
+            ndigits++;
+        }
+        if (!ndigits) {
+            return 0;
+        }
+    }
+    if (ii < n && (s[ii] == 'e' || s[ii] == 'E')) {
+        ii++;
+        if (ii < n && (s[ii] == '+' || s[ii] == '-')) {
+            ii++;
+        }
+        for (ndigits = 0; ii < n && isdigit(s[ii]); ii++) {
+            ndigits++;
+        }
+        if (!ndigits) {
+            return 0;
+        }
+    }
+    return ii;
+}
+
+/**
+ * Parses a list of coordinates given as a string into 'buf', which must
+ * have at least nvalue + 3 bytes. Whitespace is removed, and so is the '+'
+ * of an exponent (it would be read as a space).
+ */
+static lcb_error_t parse_coords(const char *str, size_t nvalue, int allow_null,
+                                char *buf, size_t *nbuf, size_t *ncoords,
+                                char **error)
+{
+    size_t ii = 0;
+    int bracketed = 0;
+
+    while (ii < nvalue && isspace(str[ii])) {
+        ii++;
+    }
+    if (ii < nvalue && str[ii] == '[') {
+        bracketed = 1;
+        ii++;
+    }
+
+    for (;;) {
+        size_t ntok;
+
+        while (ii < nvalue && isspace(str[ii])) {
+            ii++;
+        }
+
+        if (nvalue - ii >= 4 && memcmp(str + ii, "null", 4) == 0) {
+            if (!allow_null) {
+                *error = "bbox coordinates cannot be null";
+                return LCB_EINVAL;
+            }
+            memcpy(buf + *nbuf, "null", 4);
+            *nbuf += 4;
+            ii += 4;
+
+        } else if ((ntok = scan_number(str + ii, nvalue - ii)) != 0) {
+            for (; ntok; ntok--, ii++) {
+                if (str[ii] != '+') {
+                    buf[(*nbuf)++] = str[ii];
+                }
+            }
+
+        } else {
+            *error = "Coordinates must be numbers";
+            return LCB_EINVAL;
+        }
+        (*ncoords)++;
+
+        while (ii < nvalue && isspace(str[ii])) {
+            ii++;
+        }
+        if (ii < nvalue && str[ii] == ',') {
+            buf[(*nbuf)++] = ',';
+            ii++;
+        } else {
+            break;
+        }
+    }
+
+    if (bracketed) {
+        if (ii == nvalue || str[ii] != ']') {
+            *error = "Unterminated coordinate array";
+            return LCB_EINVAL;
+        }
+        ii++;
+    }
+    while (ii < nvalue && isspace(str[ii])) {
+        ii++;
+    }
+    if (ii != nvalue) {
+        *error = "Trailing characters after coordinates";
+        return LCB_EINVAL;
+    }
+    return LCB_SUCCESS;
+}
+
+/**
+ * Spatial coordinates. bbox is written as a bare list (bbox=x1,y1,x2,y2);
+ * the ranges as JSON arrays. The result is then percent-encoded like any
+ * other string.
+ */
+static lcb_error_t coords_param_handler(view_param *param,
+                                        struct lcbex_vopt_st *optobj,
+                                        const void *value,
+                                        size_t nvalue,
+                                        int flags,
+                                        char **error)
+{
+    int is_bbox = param->itype == LCBEX_VOPT_OPT_BBOX;
+    size_t nbuf = 0, ncoords = 0, ii;
+    lcb_error_t err = LCB_SUCCESS;
+    char *buf;
+
+    if (flags & LCBEX_VOPT_F_OPTVAL_NUMERIC) {
+        buf = malloc(nvalue * (LCBEX_VOPT_DOUBLE_BUFSIZE + 1) + 3);
+    } else {
+        buf = malloc(nvalue + 3);
+    }
+    if (!buf) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    if (!is_bbox) {
+        buf[nbuf++] = '[';
+    }
+
+    if (flags & LCBEX_VOPT_F_OPTVAL_NUMERIC) {
+        const double *coords = (const double *)value;
+
+        for (ii = 0; ii < nvalue && err == LCB_SUCCESS; ii++) {
+            size_t n;
+
+            if (ii) {
+                buf[nbuf++] = ',';
+            }
+            if (coords[ii] != coords[ii] && !is_bbox) {
+                memcpy(buf + nbuf, "null", 4);
+                nbuf += 4;
+            } else if ((n = lcbex_vopt_format_double(coords[ii],
+                                                     buf + nbuf)) != 0) {
+                nbuf += n;
+            } else {
+                *error = "Coordinates must be finite numbers";
+                err = LCB_EINVAL;
+            }
+        }
+        ncoords = nvalue;
+
+    } else {
+        err = parse_coords((const char *)value, nvalue, !is_bbox,
+                           buf, &nbuf, &ncoords, error);
+    }
+
+    if (err == LCB_SUCCESS) {
+        if (is_bbox && ncoords != 4) {
+            *error = "bbox requires exactly four coordinates";
+            err = LCB_EINVAL;
+        } else if (ncoords == 0) {
+            *error = "At least one coordinate is required";
+            err = LCB_EINVAL;
+        }
+    }
+
+    if (err == LCB_SUCCESS) {
+        if (!is_bbox) {
+            buf[nbuf++] = ']';
+        }
+        buf[nbuf] = '\0';
+        optobj->flags &= ~(LCBEX_VOPT_F_OPTVAL_CONSTANT |
+                           LCBEX_VOPT_F_OPTVAL_NUMERIC);
+        err = string_param_handler(param, optobj, buf, nbuf,
+                                   flags & ~(LCBEX_VOPT_F_OPTVAL_CONSTANT |
+                                             LCBEX_VOPT_F_OPTVAL_NUMERIC),
+                                   error);
+    }
+
+    free(buf);
+    return err;
+}
+
+LCBEX_API
+size_t lcbex_vopt_format_double(double value, char *buf)
+{
+    int prec;
+    char *src, *dst;
+
+    /* NaN, or infinity (for which value - value is NaN) */
+    if (value != value || value - value != 0) {
+        *buf = '\0';
+        return 0;
+    }
+
+    /**
+     * Any decimal of up to DBL_DIG (15) digits survives a round trip through
+     * a normal double, so if %.15g reads back it is already the shortest
+     * form (%g drops the trailing zeros). Subnormals carry fewer digits, and
+     * may need as few as one; 17 digits always round-trip.
+     */
+    prec = value != 0 && value < DBL_MIN && value > -DBL_MIN ? 1 : DBL_DIG;
+    for (; prec <= 17; prec++) {
+        snprintf(buf, LCBEX_VOPT_DOUBLE_BUFSIZE, "%.*g", prec, value);
+        if (strtod(buf, NULL) == value) {
+            break;
+        }
+    }
+
+    for (src = dst = buf; *src; src++) {
+        if (*src != '+') {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+    return dst - buf;
+}
+
+
 static view_param *find_view_param(const void *option, size_t noption, int flags)
 {
     view_param *ret;
@@ -379,17 +987,19 @@ static view_param *find_view_param(const void *option, size_t noption, int flags
     return NULL;
 }
 
-LCBEX_API
-lcb_error_t lcbex_vopt_assign(struct lcbex_vopt_st *optobj,
-                            const void *option,
-                            size_t noption,
-                            const void *value,
-                            size_t nvalue,
-                            int flags,
-                            char **error_string)
+static lcb_error_t vopt_assign(struct lcbex_vopt_st *optobj,
+                               const void *option,
+                               size_t noption,
+                               const void *value,
+                               size_t nvalue,
+                               int flags,
+                               char **error_string)
 {
     view_param *vparam;
+    lcb_error_t err;
     memset(optobj, 0, sizeof(*optobj));
+    /* only the memo may hand out shared values */
+    flags &= ~LCBEX_VOPT_F_OPTVAL_SHARED;
 
     if (nvalue == SIZE_MAX) {
         nvalue = strlen((char *)value);
@@ -408,27 +1018,34 @@ lcb_error_t lcbex_vopt_assign(struct lcbex_vopt_st *optobj,
         return LCB_EINVAL;
     }
 
+    /* set before the handlers run, as they adjust it. Passthrough options
+     * need it too: consumers check it for the encoding of the value */
+    optobj->flags = flags;
+
     if (flags & LCBEX_VOPT_F_PASSTHROUGH) {
         if (flags & LCBEX_VOPT_F_OPTNAME_NUMERIC) {
             *error_string = "Can't use passthrough with option constants";
             return LCB_EINVAL;
         }
 
+        /* the name is always copied */
+        optobj->flags &= ~LCBEX_VOPT_F_OPTNAME_CONSTANT;
         optobj->optname = my_strndup((const char *)option, noption);
         optobj->noptname = noption;
 
         if (flags & LCBEX_VOPT_F_OPTVAL_NUMERIC) {
-            return num_param_handler(NULL, optobj, value, nvalue, flags,
-                                     error_string);
+            err = num_param_handler(NULL, optobj, value, nvalue, flags,
+                                    error_string);
         } else {
-            return string_param_handler(NULL, optobj, value, nvalue, flags,
-                                        error_string);
+            err = string_param_handler(NULL, optobj, value, nvalue, flags,
+                                       error_string);
+        }
+        if (err != LCB_SUCCESS) {
+            lcbex_vopt_cleanup(optobj);
         }
-        /* not reached */
+        return err;
     }
 
-    optobj->flags = flags;
-
     vparam = find_view_param(option, noption, flags);
     if (!vparam) {
         *error_string = "Unrecognized option";
@@ -451,7 +1068,28 @@ lcb_error_t lcbex_vopt_assign(struct lcbex_vopt_st *optobj,
         }
     }
 
-    return vparam->handler(vparam, optobj, value, nvalue, flags, error_string);
+    err = vparam->handler(vparam, optobj, value, nvalue, flags, error_string);
+    if (err != LCB_SUCCESS) {
+        /* don't leak the option name */
+        lcbex_vopt_cleanup(optobj);
+    }
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vopt_assign(struct lcbex_vopt_st *optobj,
+                            const void *option,
+                            size_t noption,
+                            const void *value,
+                            size_t nvalue,
+                            int flags,
+                            char **error_string)
+{
+    lcb_uint64_t t0 = LCBEX_TRACE_START();
+    lcb_error_t err = vopt_assign(optobj, option, noption, value, nvalue,
+                                  flags, error_string);
+    LCBEX_TRACE_END(LCBEX_TRACE_OPTIONS, t0);
+    return err;
 }
 
 LCBEX_API
@@ -463,7 +1101,10 @@ void lcbex_vopt_cleanup(lcbex_vopt_t *optobj)
         }
     }
     if (optobj->optval) {
-        if ((optobj->flags & LCBEX_VOPT_F_OPTVAL_CONSTANT) == 0) {
+        if (optobj->flags & LCBEX_VOPT_F_OPTVAL_SHARED) {
+            memo_release((memo_value *)(optobj->optval -
+                                        offsetof(memo_value, data)));
+        } else if ((optobj->flags & LCBEX_VOPT_F_OPTVAL_CONSTANT) == 0) {
             free((void *)optobj->optval);
         }
     }
@@ -532,6 +1173,144 @@ size_t lcbex_vqstr_write(const lcbex_vopt_t *const *options,
     return bufp - buf;
 }
 
+/**
+ * Length of _design/<design>/<kind>/<view>?<options>, including the
+ * terminating NUL
+ */
+static size_t uri_len(const char *kind, size_t ndesign, size_t nview,
+                      const lcbex_vopt_t *const *options,
+                      size_t noptions)
+{
+    return sizeof("_design/") - 1 + ndesign + 1 + strlen(kind) + 1 + nview +
+           lcbex_vqstr_calc_len(options, noptions);
+}
+
+/**
+ * Writes the URI; returns its length, excluding the NUL
+ */
+static size_t write_uri(const char *kind,
+                        const char *design, size_t ndesign,
+                        const char *view, size_t nview,
+                        const lcbex_vopt_t *const *options,
+                        size_t noptions,
+                        char *buf)
+{
+    char *p = buf;
+    size_t nkind = strlen(kind);
+
+    memcpy(p, "_design/", sizeof("_design/") - 1);
+    p += sizeof("_design/") - 1;
+    memcpy(p, design, ndesign);
+    p += ndesign;
+    *p++ = '/';
+    memcpy(p, kind, nkind);
+    p += nkind;
+    *p++ = '/';
+    memcpy(p, view, nview);
+    p += nview;
+
+    return (p - buf) + lcbex_vqstr_write(options, noptions, p);
+}
+
+/**
+ * Builds _design/<design>/<kind>/<view>?<options>
+ */
+static char *make_uri_common(const char *kind,
+                             const char *design, size_t ndesign,
+                             const char *view, size_t nview,
+                             const lcbex_vopt_t *const *options,
+                             size_t noptions)
+{
+    char *buf;
+    lcb_uint64_t t0 = LCBEX_TRACE_START();
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    buf = malloc(uri_len(kind, ndesign, nview, options, noptions));
+    if (buf) {
+        write_uri(kind, design, ndesign, view, nview, options, noptions, buf);
+    }
+    LCBEX_TRACE_END(LCBEX_TRACE_URI, t0);
+    return buf;
+}
+
+/**
+ * Per-thread scratch buffer for the _tls variants. It only grows, until
+ * lcbex_vqstr_tls_release() is called or the thread exits.
+ */
+static LCBEX_TLS char *tls_buf;
+static LCBEX_TLS size_t tls_nbuf;
+
+static lcbex_thread_hook_t tls_hook;
+static int have_tls_hook;
+static lcbex_once_t tls_hook_once = LCBEX_ONCE_INIT;
+
+static void LCBEX_THREAD_DTOR tls_exited(void *arg)
+{
+    free(arg);
+    tls_buf = NULL;
+    tls_nbuf = 0;
+}
+
+static void create_tls_hook(void)
+{
+    have_tls_hook = LCBEX_THREAD_HOOK_CREATE(&tls_hook, tls_exited) == 0;
+}
+
+static const char *make_uri_tls(const char *kind,
+                                const char *design, size_t ndesign,
+                                const char *view, size_t nview,
+                                const lcbex_vopt_t *const *options,
+                                size_t noptions,
+                                size_t *nuri)
+{
+    size_t needed, n;
+    lcb_uint64_t t0 = LCBEX_TRACE_START();
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+
+    needed = uri_len(kind, ndesign, nview, options, noptions);
+    if (needed > tls_nbuf) {
+        size_t nalloc = tls_nbuf ? tls_nbuf : 256;
+        char *tmp;
+        while (nalloc < needed) {
+            nalloc *= 2;
+        }
+        /* the old contents are not needed, so don't let realloc copy them */
+        if ((tmp = malloc(nalloc)) == NULL) {
+            return NULL;
+        }
+        free(tls_buf);
+        tls_buf = tmp;
+        tls_nbuf = nalloc;
+
+        LCBEX_ONCE(&tls_hook_once, create_tls_hook);
+        if (have_tls_hook) {
+            LCBEX_THREAD_HOOK_SET(tls_hook, tls_buf);
+        }
+    }
+
+    n = write_uri(kind, design, ndesign, view, nview, options, noptions,
+                  tls_buf);
+    if (nuri) {
+        *nuri = n;
+    }
+    LCBEX_TRACE_END(LCBEX_TRACE_URI, t0);
+    return tls_buf;
+}
+
 /**
  * Convenience function to make a view URI.
  */
@@ -541,43 +1320,161 @@ char *lcbex_vqstr_make_uri(const char *design, size_t ndesign,
                          const lcbex_vopt_t *const *options,
                          size_t noptions)
 {
-    size_t needed_len, path_len;
-    char *buf;
+    return make_uri_common("_view", design, ndesign, view, nview,
+                           options, noptions);
+}
 
-    if (ndesign == SIZE_MAX) {
-        ndesign = strlen(design);
+LCBEX_API
+char *lcbex_vqstr_make_spatial_uri(const char *design, size_t ndesign,
+                                 const char *view, size_t nview,
+                                 const lcbex_vopt_t *const *options,
+                                 size_t noptions)
+{
+    return make_uri_common("_spatial", design, ndesign, view, nview,
+                           options, noptions);
+}
+
+LCBEX_API
+const char *lcbex_vqstr_make_uri_tls(const char *design, size_t ndesign,
+                                     const char *view, size_t nview,
+                                     const lcbex_vopt_t *const *options,
+                                     size_t noptions,
+                                     size_t *nuri)
+{
+    return make_uri_tls("_view", design, ndesign, view, nview,
+                        options, noptions, nuri);
+}
+
+LCBEX_API
+const char *lcbex_vqstr_make_spatial_uri_tls(const char *design,
+                                             size_t ndesign,
+                                             const char *view, size_t nview,
+                                             const lcbex_vopt_t *const *options,
+                                             size_t noptions,
+                                             size_t *nuri)
+{
+    return make_uri_tls("_spatial", design, ndesign, view, nview,
+                        options, noptions, nuri);
+}
+
+LCBEX_API
+void lcbex_vqstr_tls_release(void)
+{
+    if (tls_buf && have_tls_hook) {
+        LCBEX_THREAD_HOOK_SET(tls_hook, NULL);
     }
+    free(tls_buf);
+    tls_buf = NULL;
+    tls_nbuf = 0;
+}
 
-    if (nview == SIZE_MAX) {
-        nview = strlen(view);
+LCBEX_API
+char *lcbex_vqstr_make_uri_override(const char *design, size_t ndesign,
+                                  const char *view, size_t nview,
+                                  const lcbex_vopt_t *const *options,
+                                  size_t noptions,
+                                  const lcbex_vopt_t *const *overrides,
+                                  size_t noverrides)
+{
+    const lcbex_vopt_t *sbuf[32];
+    const lcbex_vopt_t **merged = sbuf;
+    size_t nmerged = 0;
+    size_t ii, jj;
+    char *ret;
+
+    if (noptions + noverrides > sizeof(sbuf) / sizeof(sbuf[0])) {
+        merged = malloc((noptions + noverrides) * sizeof(*merged));
+        if (!merged) {
+            return NULL;
+        }
     }
 
-    /* I'm lazy */
-    path_len = snprintf(NULL, 0,
-                        "_design/%.*s/_view/%.*s",
-                        (int)ndesign, design,
-                        (int)nview, view);
+    for (ii = 0; ii < noptions; ii++) {
+        const lcbex_vopt_t *cur = options[ii];
+        int overridden = 0;
 
-    needed_len = lcbex_vqstr_calc_len(options, noptions);
-    needed_len += path_len + 1;
+        for (jj = 0; jj < noverrides && !overridden; jj++) {
+            overridden = cur->noptname == overrides[jj]->noptname &&
+                         memcmp(cur->optname, overrides[jj]->optname,
+                                cur->noptname) == 0;
+        }
+        if (!overridden) {
+            merged[nmerged++] = cur;
+        }
+    }
 
-    buf = malloc(needed_len);
-    snprintf(buf, path_len + 1,
-             "_design/%.*s/_view/%.*s",
-             (int)ndesign, design,
-             (int)nview, view);
+    for (ii = 0; ii < noverrides; ii++) {
+        merged[nmerged++] = overrides[ii];
+    }
 
-    lcbex_vqstr_write(options, noptions, buf + path_len);
-    return buf;
+    ret = lcbex_vqstr_make_uri(design, ndesign, view, nview, merged, nmerged);
+    if (merged != sbuf) {
+        free(merged);
+    }
+    return ret;
 }
 
 LCBEX_API
-lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
-                             size_t *noptions,
-                             char **errstr, ...)
+const lcbex_vopt_t *lcbex_vopt_find(const lcbex_vopt_t *const *options,
+                                  size_t noptions,
+                                  const char *name)
+{
+    size_t nname = strlen(name);
+    size_t ii = noptions;
+
+    while (ii--) {
+        if (options[ii]->noptname == nname &&
+                memcmp(options[ii]->optname, name, nname) == 0) {
+            return options[ii];
+        }
+    }
+    return NULL;
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+LCBEX_API
+size_t lcbex_vopt_decode(const lcbex_vopt_t *optobj, char *buf)
+{
+    const char *src = optobj->optval;
+    size_t nsrc = optobj->noptval;
+    size_t ii, nout = 0;
+
+    if ((optobj->flags & LCBEX_VOPT_F_PCTENCODE_ANY) == 0) {
+        memcpy(buf, src, nsrc);
+        return nsrc;
+    }
+
+    for (ii = 0; ii < nsrc; ii++) {
+        int hi, lo;
+        if (src[ii] == '%' && ii + 2 < nsrc &&
+                (hi = hexval(src[ii + 1])) >= 0 &&
+                (lo = hexval(src[ii + 2])) >= 0) {
+            buf[nout++] = (char)((hi << 4) | lo);
+            ii += 2;
+        } else {
+            buf[nout++] = src[ii];
+        }
+    }
+    return nout;
+}
+
+static lcb_error_t vopt_createv_common(lcbex_vopt_t *optarray[],
+                                       size_t *noptions,
+                                       int flags,
+                                       char **errstr,
+                                       va_list ap)
 {
-    /* two lists, first to determine how much to allocated */
-    va_list ap;
     char *strp;
     lcb_error_t err = LCB_SUCCESS;
     size_t n_alloc = 8;
@@ -589,7 +1486,6 @@ lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
         return LCB_CLIENT_ENOMEM;
     }
 
-    va_start(ap, errstr);
     *noptions = 0;
 
     while ((strp = va_arg(ap, char *))) {
@@ -618,14 +1514,13 @@ lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
         err = lcbex_vopt_assign((*optarray) + *noptions - 1,
                               strp, -1,
                               value, -1,
-                              0,
+                              flags,
                               errstr);
 
         if (err != LCB_SUCCESS) {
             break;
         }
     }
-    va_end(ap);
 
     if (*noptions == 0) {
         err = LCB_EINVAL;
@@ -639,3 +1534,32 @@ lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
     }
     return err;
 }
+
+LCBEX_API
+lcb_error_t lcbex_vopt_createv(lcbex_vopt_t *optarray[],
+                             size_t *noptions,
+                             char **errstr, ...)
+{
+    va_list ap;
+    lcb_error_t err;
+
+    va_start(ap, errstr);
+    err = vopt_createv_common(optarray, noptions, 0, errstr, ap);
+    va_end(ap);
+    return err;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vopt_createv_flags(lcbex_vopt_t *optarray[],
+                                   size_t *noptions,
+                                   int flags,
+                                   char **errstr, ...)
+{
+    va_list ap;
+    lcb_error_t err;
+
+    va_start(ap, errstr);
+    err = vopt_createv_common(optarray, noptions, flags, errstr, ap);
+    va_end(ap);
+    return err;
+}
@@ -0,0 +1,541 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/vrow.h>
+#include <lcbex/trace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define LCBEX_HAVE_SSE2_SCAN
+#endif
+
+/**
+ * Streaming view row parser and lazy string decoding
+ * @author Mark Nunberg
+ */
+
+/**
+ * Returns the offset of the first backslash in the buffer, or n if there
+ * is none. With SSE2, sixteen bytes are checked per iteration; otherwise
+ * memchr (which is vectorized by most C libraries) is used.
+ */
+static size_t find_escape(const char *p, size_t n)
+{
+    size_t ii = 0;
+    const char *found;
+
+#ifdef LCBEX_HAVE_SSE2_SCAN
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; ii + 16 <= n; ii += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + ii));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash));
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    found = memchr(p + ii, '\\', n - ii);
+    return found ? (size_t)(found - p) : n;
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static long read_hex4(const char *p)
+{
+    long ret = 0;
+    int ii;
+    for (ii = 0; ii < 4; ii++) {
+        int v = hexval(p[ii]);
+        if (v < 0) {
+            return -1;
+        }
+        ret = (ret << 4) | v;
+    }
+    return ret;
+}
+
+static size_t put_utf8(char *out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vrow_unescape(const char *str, size_t nstr, char *buf,
+                                const char **out, size_t *nout)
+{
+    const char *body;
+    size_t nbody, ii = 0, nw = 0;
+
+    if (nstr < 2 || str[0] != '"' || str[nstr - 1] != '"') {
+        return LCB_EINVAL;
+    }
+
+    body = str + 1;
+    nbody = nstr - 2;
+
+    ii = find_escape(body, nbody);
+    if (ii == nbody) {
+        *out = body;
+        *nout = nbody;
+        return LCB_SUCCESS;
+    }
+
+    memcpy(buf, body, ii);
+    nw = ii;
+
+    while (ii < nbody) {
+        size_t span;
+        long cp;
+
+        /* body[ii] is a backslash */
+        if (ii + 1 >= nbody) {
+            return LCB_EINVAL;
+        }
+
+        switch (body[ii + 1]) {
+        case '"':
+        case '\\':
+        case '/':
+            buf[nw++] = body[ii + 1];
+            break;
+        case 'b':
+            buf[nw++] = '\b';
+            break;
+        case 'f':
+            buf[nw++] = '\f';
+            break;
+        case 'n':
+            buf[nw++] = '\n';
+            break;
+        case 'r':
+            buf[nw++] = '\r';
+            break;
+        case 't':
+            buf[nw++] = '\t';
+            break;
+        case 'u':
+            if (ii + 6 > nbody || (cp = read_hex4(body + ii + 2)) < 0) {
+                return LCB_EINVAL;
+            }
+            if (cp >= 0xD800 && cp <= 0xDBFF && ii + 12 <= nbody &&
+                    body[ii + 6] == '\\' && body[ii + 7] == 'u') {
+                long lo = read_hex4(body + ii + 8);
+                if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    ii += 6;
+                }
+            }
+            nw += put_utf8(buf + nw, (unsigned long)cp);
+            ii += 4;
+            break;
+        default:
+            return LCB_EINVAL;
+        }
+        ii += 2;
+
+        /* copy everything up to the next escape in one go */
+        span = find_escape(body + ii, nbody - ii);
+        memcpy(buf + nw, body + ii, span);
+        nw += span;
+        ii += span;
+    }
+
+    *out = buf;
+    *nout = nw;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vrow_get_id(const lcbex_vrow_t *row, char *buf,
+                              const char **out, size_t *nout)
+{
+    if (!row->id) {
+        return LCB_KEY_ENOENT;
+    }
+    return lcbex_vrow_unescape(row->id, row->nid, buf, out, nout);
+}
+
+
+struct lcbex_vrow_parser_st {
+    char *buf;
+    size_t nbuf;
+    size_t nalloc;
+    /* how much of buf has been scanned */
+    size_t pos;
+
+    int depth;
+    int in_str;
+    int escaped;
+    int in_rows;
+    /* offset of the current row's opening brace */
+    size_t row_start;
+
+    /* the most recent string at depth 1, and the current member name */
+    char laststr[16];
+    size_t nlaststr;
+    char curkey[16];
+    size_t ncurkey;
+
+    char numbuf[32];
+    size_t nnum;
+
+    size_t total_rows;
+    size_t nrows;
+    lcbex_vrow_callback callback;
+    void *cookie;
+};
+
+static int is_ws(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Returns a pointer just past the JSON value starting at p, or NULL if it
+ * does not end before 'end'.
+ */
+static const char *skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    if (*p != '"' && *p != '[' && *p != '{') {
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && !is_ws(*p)) {
+            p++;
+        }
+        return p;
+    }
+
+    for (; p < end; p++) {
+        switch (*p) {
+        case '"':
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') {
+                    p++;
+                }
+            }
+            if (p >= end) {
+                return NULL;
+            }
+            if (depth == 0) {
+                return p + 1;
+            }
+            break;
+        case '[':
+        case '{':
+            depth++;
+            break;
+        case ']':
+        case '}':
+            if (--depth == 0) {
+                return p + 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+static lcb_error_t emit_row(lcbex_vrow_parser_t *parser,
+                            const char *p, const char *end)
+{
+    lcbex_vrow_t row;
+    lcb_uint64_t t0;
+    memset(&row, 0, sizeof(row));
+
+    /* skip the opening brace */
+    p++;
+
+    for (;;) {
+        const char *name, *value, *vend;
+        size_t nname;
+
+        while (p < end && (is_ws(*p) || *p == ',')) {
+            p++;
+        }
+        if (p >= end || *p == '}') {
+            break;
+        }
+        if (*p != '"' || (vend = skip_value(p, end)) == NULL) {
+            return LCB_EINVAL;
+        }
+        name = p + 1;
+        nname = vend - p - 2;
+
+        p = vend;
+        while (p < end && (is_ws(*p) || *p == ':')) {
+            p++;
+        }
+        value = p;
+        if ((vend = skip_value(p, end)) == NULL) {
+            return LCB_EINVAL;
+        }
+        p = vend;
+
+        if (nname == 3 && memcmp(name, "key", 3) == 0) {
+            row.key = value;
+            row.nkey = vend - value;
+        } else if (nname == 2 && memcmp(name, "id", 2) == 0) {
+            row.id = value;
+            row.nid = vend - value;
+        } else if (nname == 5 && memcmp(name, "value", 5) == 0) {
+            row.value = value;
+            row.nvalue = vend - value;
+        } else if (nname == 3 && memcmp(name, "doc", 3) == 0) {
+            row.doc = value;
+            row.ndoc = vend - value;
+        }
+    }
+
+    parser->nrows++;
+    t0 = LCBEX_TRACE_START();
+    parser->callback(parser, &row, parser->cookie);
+    LCBEX_TRACE_END(LCBEX_TRACE_CALLBACK, t0);
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vrow_parser_create(lcbex_vrow_parser_t **parser,
+                                     lcbex_vrow_callback callback,
+                                     void *cookie)
+{
+    lcbex_vrow_parser_t *ret;
+
+    if (!callback) {
+        return LCB_EINVAL;
+    }
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ret->callback = callback;
+    ret->cookie = cookie;
+    ret->total_rows = SIZE_MAX;
+    *parser = ret;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Handles a structural or scalar character outside of a string at depth 1
+ * (i.e. a member of the top-level response object)
+ */
+static void handle_toplevel(lcbex_vrow_parser_t *parser, char c)
+{
+    if (c == ':') {
+        memcpy(parser->curkey, parser->laststr, parser->nlaststr);
+        parser->ncurkey = parser->nlaststr;
+        parser->nnum = 0;
+
+    } else if (c == ',' || c == '}') {
+        if (parser->nnum && parser->ncurkey == 10 &&
+                memcmp(parser->curkey, "total_rows", 10) == 0) {
+            parser->numbuf[parser->nnum] = '\0';
+            parser->total_rows = (size_t)strtoul(parser->numbuf, NULL, 10);
+        }
+        parser->ncurkey = 0;
+        parser->nnum = 0;
+
+    } else if ((c >= '0' && c <= '9') || c == '-') {
+        if (parser->nnum < sizeof(parser->numbuf) - 1) {
+            parser->numbuf[parser->nnum++] = c;
+        }
+    }
+}
+
+static lcb_error_t parser_feed(lcbex_vrow_parser_t *parser,
+                               const void *data, size_t ndata)
+{
+    size_t keep;
+
+    if (parser->nbuf + ndata > parser->nalloc) {
+        size_t n_alloc = parser->nalloc ? parser->nalloc : 4096;
+        char *tmp;
+        while (n_alloc < parser->nbuf + ndata) {
+            n_alloc *= 2;
+        }
+        if ((tmp = realloc(parser->buf, n_alloc)) == NULL) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        parser->buf = tmp;
+        parser->nalloc = n_alloc;
+    }
+    memcpy(parser->buf + parser->nbuf, data, ndata);
+    parser->nbuf += ndata;
+
+    for (; parser->pos < parser->nbuf; parser->pos++) {
+        char c = parser->buf[parser->pos];
+
+        if (parser->in_str) {
+            if (parser->escaped) {
+                parser->escaped = 0;
+            } else if (c == '\\') {
+                parser->escaped = 1;
+            } else if (c == '"') {
+                parser->in_str = 0;
+                continue;
+            }
+            if (parser->depth == 1 &&
+                    parser->nlaststr < sizeof(parser->laststr)) {
+                parser->laststr[parser->nlaststr++] = c;
+            }
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+            parser->in_str = 1;
+            parser->nlaststr = 0;
+            break;
+
+        case '[':
+        case '{':
+            if (parser->depth == 1 && c == '[' && parser->ncurkey == 4 &&
+                    memcmp(parser->curkey, "rows", 4) == 0) {
+                parser->in_rows = 1;
+            } else if (parser->in_rows && parser->depth == 2) {
+                parser->row_start = parser->pos;
+            }
+            parser->depth++;
+            break;
+
+        case ']':
+        case '}':
+            if (parser->depth == 0) {
+                return LCB_EINVAL;
+            }
+            parser->depth--;
+            if (parser->in_rows && parser->depth == 2) {
+                lcb_error_t err = emit_row(parser,
+                                           parser->buf + parser->row_start,
+                                           parser->buf + parser->pos + 1);
+                if (err != LCB_SUCCESS) {
+                    return err;
+                }
+            } else if (parser->in_rows && parser->depth == 1) {
+                parser->in_rows = 0;
+            } else if (parser->depth == 0) {
+                handle_toplevel(parser, c);
+            }
+            break;
+
+        default:
+            if (parser->depth == 1) {
+                handle_toplevel(parser, c);
+            }
+            break;
+        }
+    }
+
+    /**
+     * Discard everything which has been scanned, except for a partial row
+     * which will be needed once it completes.
+     */
+    if (parser->in_rows && parser->depth > 2) {
+        keep = parser->row_start;
+    } else {
+        keep = parser->nbuf;
+    }
+    if (keep) {
+        memmove(parser->buf, parser->buf + keep, parser->nbuf - keep);
+        parser->nbuf -= keep;
+        parser->pos -= keep;
+        parser->row_start -= keep < parser->row_start ? keep : parser->row_start;
+    }
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_vrow_parser_feed(lcbex_vrow_parser_t *parser,
+                                   const void *data, size_t ndata)
+{
+    lcb_uint64_t t0 = LCBEX_TRACE_START();
+    lcb_error_t err = parser_feed(parser, data, ndata);
+    LCBEX_TRACE_END(LCBEX_TRACE_PARSE, t0);
+    return err;
+}
+
+LCBEX_API
+size_t lcbex_vrow_parser_total_rows(const lcbex_vrow_parser_t *parser)
+{
+    return parser->total_rows;
+}
+
+LCBEX_API
+size_t lcbex_vrow_parser_nrows(const lcbex_vrow_parser_t *parser)
+{
+    return parser->nrows;
+}
+
+LCBEX_API
+void lcbex_vrow_parser_reset(lcbex_vrow_parser_t *parser)
+{
+    char *buf = parser->buf;
+    size_t nalloc = parser->nalloc;
+    lcbex_vrow_callback callback = parser->callback;
+    void *cookie = parser->cookie;
+
+    memset(parser, 0, sizeof(*parser));
+    parser->buf = buf;
+    parser->nalloc = nalloc;
+    parser->callback = callback;
+    parser->cookie = cookie;
+    parser->total_rows = SIZE_MAX;
+}
+
+LCBEX_API
+void lcbex_vrow_parser_destroy(lcbex_vrow_parser_t *parser)
+{
+    if (!parser) {
+        return;
+    }
+    free(parser->buf);
+    free(parser);
+}
@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2013 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config_static.h"
+#include <lcbex/warmer.h>
+#include <lcbex/viewopts.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * View index warmer
+ * @author Mark Nunberg
+ */
+
+typedef struct {
+    char *uri;
+    lcbex_warmer_status_t status;
+    unsigned int attempts;
+    lcb_uint64_t started;
+} warm_entry;
+
+struct lcbex_warmer_st {
+    warm_entry *entries;
+    size_t nentries;
+    size_t nalloc;
+
+    /* next entry to consider for submission */
+    size_t cursor;
+    size_t ninflight;
+    size_t nremaining;
+    size_t nfailed;
+
+    size_t max_inflight;
+    unsigned int max_attempts;
+
+    lcbex_warmer_submit_cb submit;
+    lcbex_warmer_ready_cb ready;
+    void *cookie;
+
+    int started;
+    /* set while we're inside schedule(), to avoid recursing through
+     * lcbex_warmer_done() being called from the submit callback */
+    int scheduling;
+};
+
+/**
+ * Builds the 'stale=update_after&limit=0' query for a design document.
+ * The options are assigned by constant, so they go through the regular
+ * stale and numeric validation handlers.
+ */
+static char *make_warm_uri(const char *design, size_t ndesign,
+                           const char *view, size_t nview)
+{
+    lcbex_vopt_t vopts[2];
+    const lcbex_vopt_t *vopt_list[2];
+    int optid;
+    int limit = 0;
+    char *errstr;
+    char *ret = NULL;
+
+    optid = LCBEX_VOPT_OPT_STALE;
+    if (lcbex_vopt_assign(&vopts[0], &optid, 0, "update_after", -1,
+                          LCBEX_VOPT_F_OPTNAME_NUMERIC,
+                          &errstr) != LCB_SUCCESS) {
+        lcbex_vopt_cleanup(&vopts[0]);
+        return NULL;
+    }
+
+    optid = LCBEX_VOPT_OPT_LIMIT;
+    if (lcbex_vopt_assign(&vopts[1], &optid, 0, &limit, 0,
+                          LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                          LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                          &errstr) == LCB_SUCCESS) {
+        vopt_list[0] = &vopts[0];
+        vopt_list[1] = &vopts[1];
+        ret = lcbex_vqstr_make_uri(design, ndesign, view, nview,
+                                   vopt_list, 2);
+    }
+
+    lcbex_vopt_cleanup(&vopts[0]);
+    lcbex_vopt_cleanup(&vopts[1]);
+    return ret;
+}
+
+LCBEX_API
+lcb_error_t lcbex_warmer_create(lcbex_warmer_t **warmer,
+                                size_t max_inflight,
+                                unsigned int max_attempts,
+                                lcbex_warmer_submit_cb submit,
+                                lcbex_warmer_ready_cb ready,
+                                void *cookie)
+{
+    lcbex_warmer_t *ret;
+
+    *warmer = NULL;
+    if (!submit) {
+        return LCB_EINVAL;
+    }
+
+    ret = calloc(1, sizeof(*ret));
+    if (!ret) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    ret->max_inflight = max_inflight ? max_inflight : 1;
+    ret->max_attempts = max_attempts ? max_attempts : 1;
+    ret->submit = submit;
+    ret->ready = ready;
+    ret->cookie = cookie;
+
+    *warmer = ret;
+    return LCB_SUCCESS;
+}
+
+LCBEX_API
+lcb_error_t lcbex_warmer_add(lcbex_warmer_t *warmer,
+                             const char *design, size_t ndesign,
+                             const char *view, size_t nview)
+{
+    warm_entry *ent;
+
+    if (warmer->started) {
+        return LCB_EINVAL;
+    }
+
+    if (ndesign == SIZE_MAX) {
+        ndesign = strlen(design);
+    }
+    if (nview == SIZE_MAX) {
+        nview = strlen(view);
+    }
+    if (!ndesign || !nview) {
+        return LCB_EINVAL;
+    }
+
+    if (warmer->nentries == warmer->nalloc) {
+        size_t n_alloc = warmer->nalloc ? warmer->nalloc * 2 : 8;
+        warm_entry *tmp = realloc(warmer->entries,
+                                  n_alloc * sizeof(*tmp));
+        if (!tmp) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        warmer->entries = tmp;
+        warmer->nalloc = n_alloc;
+    }
+
+    ent = warmer->entries + warmer->nentries;
+    memset(ent, 0, sizeof(*ent));
+    ent->uri = make_warm_uri(design, ndesign, view, nview);
+    if (!ent->uri) {
+        return LCB_CLIENT_ENOMEM;
+    }
+
+    warmer->nentries++;
+    warmer->nremaining++;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Finds the next pending entry, starting from the cursor. Entries which are
+ * retried go back to PENDING and are picked up on the next pass, so a
+ * design document that keeps failing does not starve the others.
+ */
+static warm_entry *next_pending(lcbex_warmer_t *warmer, size_t *index)
+{
+    size_t ii;
+    for (ii = 0; ii < warmer->nentries; ii++) {
+        size_t cur = (warmer->cursor + ii) % warmer->nentries;
+        if (warmer->entries[cur].status == LCBEX_WARMER_S_PENDING) {
+            warmer->cursor = cur + 1;
+            *index = cur;
+            return warmer->entries + cur;
+        }
+    }
+    return NULL;
+}
+
+static void schedule(lcbex_warmer_t *warmer)
+{
+    if (warmer->scheduling) {
+        return;
+    }
+
+    warmer->scheduling = 1;
+    while (warmer->ninflight < warmer->max_inflight) {
+        size_t index;
+        warm_entry *ent = next_pending(warmer, &index);
+        if (!ent) {
+            break;
+        }
+
+        if (!ent->attempts) {
+            ent->started = lcbex_hrtime();
+        }
+        ent->attempts++;
+        ent->status = LCBEX_WARMER_S_INFLIGHT;
+        warmer->ninflight++;
+        warmer->submit(warmer, index, ent->uri, warmer->cookie);
+    }
+    warmer->scheduling = 0;
+}
+
+LCBEX_API
+void lcbex_warmer_start(lcbex_warmer_t *warmer)
+{
+    warmer->started = 1;
+    schedule(warmer);
+}
+
+LCBEX_API
+void lcbex_warmer_done(lcbex_warmer_t *warmer,
+                       size_t index,
+                       lcb_error_t err,
+                       short http_status)
+{
+    warm_entry *ent;
+
+    if (index >= warmer->nentries) {
+        return;
+    }
+
+    ent = warmer->entries + index;
+    if (ent->status != LCBEX_WARMER_S_INFLIGHT) {
+        return;
+    }
+
+    warmer->ninflight--;
+
+    if (err == LCB_SUCCESS && http_status != 200) {
+        err = LCB_ERROR;
+    }
+
+    if (err == LCB_SUCCESS) {
+        ent->status = LCBEX_WARMER_S_READY;
+
+    } else if (ent->attempts < warmer->max_attempts) {
+        ent->status = LCBEX_WARMER_S_PENDING;
+
+    } else {
+        ent->status = LCBEX_WARMER_S_FAILED;
+        warmer->nfailed++;
+    }
+
+    if (ent->status != LCBEX_WARMER_S_PENDING) {
+        warmer->nremaining--;
+        if (warmer->ready) {
+            warmer->ready(warmer, index, err,
+                          lcbex_hrtime() - ent->started,
+                          warmer->cookie);
+        }
+    }
+
+    schedule(warmer);
+}
+
+LCBEX_API
+lcbex_warmer_status_t lcbex_warmer_get_status(const lcbex_warmer_t *warmer,
+                                              size_t index)
+{
+    if (index >= warmer->nentries) {
+        return LCBEX_WARMER_S_FAILED;
+    }
+    return warmer->entries[index].status;
+}
+
+LCBEX_API
+size_t lcbex_warmer_remaining(const lcbex_warmer_t *warmer)
+{
+    return warmer->nremaining;
+}
+
+LCBEX_API
+size_t lcbex_warmer_failed(const lcbex_warmer_t *warmer)
+{
+    return warmer->nfailed;
+}
+
+LCBEX_API
+void lcbex_warmer_destroy(lcbex_warmer_t *warmer)
+{
+    size_t ii;
+
+    if (!warmer) {
+        return;
+    }
+
+    for (ii = 0; ii < warmer->nentries; ii++) {
+        free(warmer->entries[ii].uri);
+    }
+    free(warmer->entries);
+    free(warmer);
+}
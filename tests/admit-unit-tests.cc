@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+#include <lcbex/admit.h>
+
+class AdmitUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_admit_t *adm;
+
+    void create(unsigned int concurrency) {
+        lcbex_admit_config_t config;
+        lcbex_admit_config_init(&config);
+        config.concurrency = concurrency;
+        config.initial_latency = 100;
+        config.decay = 1000;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_admit_create(&adm, &config));
+    }
+
+    virtual void SetUp() {
+        adm = NULL;
+    }
+
+    virtual void TearDown() {
+        if (adm) {
+            lcbex_admit_destroy(adm);
+        }
+    }
+
+    lcbex_admit_decision_t request(lcb_uint64_t deadline, int flags,
+                                   lcb_uint64_t now,
+                                   lcbex_admit_ticket_t *ticket,
+                                   lcb_uint64_t *estimate = NULL) {
+        return lcbex_admit_request(adm, "ddoc", -1, "view", -1, deadline,
+                                   flags, now, ticket, estimate);
+    }
+};
+
+/**
+ * @test Verify queued work delays new queries
+ * @pre Admit two queries into two slots, then request a third which must
+ * complete within 150ns
+ * @post The third is estimated to complete at 200ns and is rejected, even
+ * if it may be downgraded, as stale latency is unknown
+ *
+ * @pre Request it without a deadline
+ * @post It is admitted
+ */
+TEST_F(AdmitUnitTests, testQueueDepth)
+{
+    lcbex_admit_ticket_t t1, t2, t3;
+    lcbex_admit_stats_t stats;
+    lcb_uint64_t estimate;
+    lcbex_admit_config_t config;
+
+    lcbex_admit_config_init(&config);
+    config.concurrency = 0;
+    ASSERT_EQ(LCB_EINVAL, lcbex_admit_create(&adm, &config));
+    create(2);
+
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(150, 0, 0, &t1, &estimate));
+    ASSERT_EQ(100, estimate);
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(150, 0, 0, &t2));
+
+    ASSERT_EQ(LCBEX_ADMIT_REJECT, request(150, 0, 0, &t3, &estimate));
+    ASSERT_EQ(200, estimate);
+    ASSERT_EQ(LCBEX_ADMIT_REJECT,
+              request(100, LCBEX_ADMIT_F_CAN_DOWNGRADE, 0, &t3));
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(0, 0, 0, &t3));
+
+    lcbex_admit_get_stats(adm, &stats);
+    ASSERT_EQ(3, stats.accepted);
+    ASSERT_EQ(2, stats.rejected);
+    ASSERT_EQ(3, stats.queued);
+
+    lcbex_admit_cancel(adm, &t1);
+    lcbex_admit_cancel(adm, &t2);
+    lcbex_admit_cancel(adm, &t3);
+    lcbex_admit_get_stats(adm, &stats);
+    ASSERT_EQ(0, stats.queued);
+}
+
+/**
+ * @test Verify queries in flight count only their remaining work
+ * @pre Start a query in a single slot and request another at 0 and at 80
+ * @post It would complete at 200 and misses a deadline of 150; at 80 it
+ * still completes at 200 (not 280), as the first query has run for 80
+ *
+ * @pre Complete the first query at 120, after its deadline
+ * @post Its latency becomes the view's average and it is counted late
+ */
+TEST_F(AdmitUnitTests, testInflight)
+{
+    lcbex_admit_ticket_t t1, t2;
+    lcbex_admit_stats_t stats;
+    lcb_uint64_t estimate;
+
+    create(1);
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(110, 0, 0, &t1));
+    lcbex_admit_start(adm, &t1, 0);
+
+    ASSERT_EQ(LCBEX_ADMIT_REJECT, request(150, 0, 0, &t2, &estimate));
+    ASSERT_EQ(200, estimate);
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(250, 0, 80, &t2, &estimate));
+    ASSERT_EQ(200, estimate);
+
+    lcbex_admit_done(adm, &t1, LCB_SUCCESS, 120);
+    ASSERT_EQ(120, lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 0));
+
+    lcbex_admit_get_stats(adm, &stats);
+    ASSERT_EQ(1, stats.completed);
+    ASSERT_EQ(1, stats.late);
+    ASSERT_EQ(1, stats.queued);
+    ASSERT_EQ(0, stats.inflight);
+
+    /* failures other than timeouts leave the average alone */
+    lcbex_admit_start(adm, &t2, 120);
+    lcbex_admit_done(adm, &t2, LCB_KEY_ENOENT, 5000);
+    ASSERT_EQ(120, lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 0));
+}
+
+/**
+ * @test Verify downgrading to stale queries
+ * @pre Learn a fresh latency of 1000ns, and request a query which must
+ * complete within 500ns
+ * @post It is rejected, or downgraded if allowed
+ *
+ * @pre Complete the stale query in 50ns
+ * @post The stale average is 50; the fresh average is unchanged
+ *
+ * @pre Complete a fresh query in 200ns, immediately and after many decay
+ * periods
+ * @post A sample close to the previous one moves the average by at least
+ * 1/8 of the difference; an old average is replaced
+ */
+TEST_F(AdmitUnitTests, testDowngrade)
+{
+    lcbex_admit_ticket_t ticket;
+    lcbex_admit_stats_t stats;
+    lcb_uint64_t latency;
+
+    create(4);
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(0, 0, 0, &ticket));
+    lcbex_admit_start(adm, &ticket, 0);
+    lcbex_admit_done(adm, &ticket, LCB_SUCCESS, 1000);
+
+    ASSERT_EQ(LCBEX_ADMIT_REJECT, request(1500, 0, 1000, &ticket));
+    ASSERT_EQ(LCBEX_ADMIT_DOWNGRADE,
+              request(1500, LCBEX_ADMIT_F_CAN_DOWNGRADE, 1000, &ticket));
+    lcbex_admit_start(adm, &ticket, 1000);
+    lcbex_admit_done(adm, &ticket, LCB_SUCCESS, 1050);
+
+    ASSERT_EQ(50, lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 1));
+    ASSERT_EQ(1000, lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 0));
+
+    lcbex_admit_get_stats(adm, &stats);
+    ASSERT_EQ(1, stats.accepted);
+    ASSERT_EQ(1, stats.downgraded);
+    ASSERT_EQ(1, stats.rejected);
+
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(0, 0, 1000, &ticket));
+    lcbex_admit_start(adm, &ticket, 800);
+    lcbex_admit_done(adm, &ticket, LCB_SUCCESS, 1000);
+    latency = lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 0);
+    ASSERT_EQ(900, latency);
+
+    ASSERT_EQ(LCBEX_ADMIT_ACCEPT, request(0, 0, 100000, &ticket));
+    lcbex_admit_start(adm, &ticket, 99800);
+    lcbex_admit_done(adm, &ticket, LCB_SUCCESS, 100000);
+    latency = lcbex_admit_get_latency(adm, "ddoc", -1, "view", -1, 0);
+    ASSERT_EQ(200, latency);
+
+    /* unknown views get the initial latency */
+    ASSERT_EQ(100, lcbex_admit_get_latency(adm, "ddoc", -1, "other", -1, 0));
+}
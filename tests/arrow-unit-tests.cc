@@ -0,0 +1,274 @@
+#include <gtest/gtest.h>
+#include <lcbex/arrow.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class ArrowUnitTests : public ::testing::Test
+{
+};
+
+static lcb_error_t to_string(const void *data, size_t ndata, void *cookie)
+{
+    ((string *)cookie)->append((const char *)data, ndata);
+    return LCB_SUCCESS;
+}
+
+static lcb_error_t failing_sink(const void *, size_t, void *)
+{
+    return LCB_ERROR;
+}
+
+/**
+ * Just enough of a flatbuffer and IPC reader to check the output
+ */
+static uint32_t rd32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t rd64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static const char *fb_deref(const char *p)
+{
+    return p + rd32(p);
+}
+
+/* returns the position of a table's field, or NULL if absent */
+static const char *fb_field(const char *table, int id)
+{
+    const char *vt = table - (int32_t)rd32(table);
+    uint16_t vtsize, off;
+    memcpy(&vtsize, vt, 2);
+    if (4 + 2 * id >= vtsize) {
+        return NULL;
+    }
+    memcpy(&off, vt + 4 + 2 * id, 2);
+    return off ? table + off : NULL;
+}
+
+struct message {
+    int type;
+    const char *header;
+    const char *body;
+    uint64_t body_len;
+};
+
+/* splits a stream into messages; returns false if malformed */
+static bool read_stream(const string &s, vector<message> &msgs)
+{
+    size_t pos = 0;
+    while (pos + 8 <= s.size()) {
+        const char *p = s.data() + pos;
+        uint32_t nmeta = rd32(p + 4);
+        const char *msg;
+        message m;
+
+        if (rd32(p) != 0xFFFFFFFF || nmeta % 8) {
+            return false;
+        }
+        if (nmeta == 0) {
+            return pos + 8 == s.size();
+        }
+        msg = fb_deref(p + 8);
+        if (*(const int16_t *)fb_field(msg, 0) != 4) {
+            return false;
+        }
+        m.type = *(const uint8_t *)fb_field(msg, 1);
+        m.header = fb_deref(fb_field(msg, 2));
+        m.body_len = fb_field(msg, 3) ? rd64(fb_field(msg, 3)) : 0;
+        m.body = p + 8 + nmeta;
+        if ((m.body - s.data()) % 8) {
+            return false;
+        }
+        msgs.push_back(m);
+        pos += 8 + nmeta + m.body_len;
+    }
+    return false;
+}
+
+static string field_name(const char *schema, int ii)
+{
+    const char *fields = fb_deref(fb_field(schema, 1));
+    const char *field = fb_deref(fields + 4 + 4 * ii);
+    const char *name = fb_deref(fb_field(field, 0));
+    return string(name + 4, rd32(name));
+}
+
+static int field_type(const char *schema, int ii)
+{
+    const char *fields = fb_deref(fb_field(schema, 1));
+    const char *field = fb_deref(fields + 4 + 4 * ii);
+    return *(const uint8_t *)fb_field(field, 2);
+}
+
+/* returns the bytes of buffer 'ii' of a record batch */
+static const char *batch_buffer(const message &m, int ii, uint64_t *len)
+{
+    const char *buffers = fb_deref(fb_field(m.header, 2));
+    *len = rd64(buffers + 4 + 16 * ii + 8);
+    return m.body + rd64(buffers + 4 + 16 * ii);
+}
+
+static lcbex_vrow_t make_row(const char *key, const char *id,
+                             const char *value)
+{
+    lcbex_vrow_t row;
+    memset(&row, 0, sizeof(row));
+    row.key = key;
+    row.nkey = strlen(key);
+    if (id) {
+        row.id = id;
+        row.nid = strlen(id);
+    }
+    row.value = value;
+    row.nvalue = strlen(value);
+    return row;
+}
+
+/**
+ * @test Verify the schema and a record batch
+ * @pre Write three rows with an extracted integer and string column
+ * @post The stream has a schema with the fixed and extracted columns, one
+ * batch whose buffers hold the expected values and nulls, and an
+ * end-of-stream marker
+ */
+TEST_F(ArrowUnitTests, testSchemaAndBatch)
+{
+    lcbex_arrow_writer_t *writer;
+    lcbex_vrow_t rows[3];
+    vector<message> msgs;
+    const char *buf;
+    uint64_t len;
+    string out;
+
+    rows[0] = make_row("1", "\"a\\\"b\"", "{\"n\":10,\"s\":\"x\"}");
+    rows[1] = make_row("2", NULL, "{\"n\":1.5}");
+    rows[2] = make_row("3", "\"c\"", "{\"n\":-7,\"s\":[1]}");
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_create(&writer, to_string, &out));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_add_column(
+                  writer, "n", "n", LCBEX_ARROW_INT64));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_add_column(
+                  writer, "s", "s", LCBEX_ARROW_UTF8));
+    for (int ii = 0; ii < 3; ii++) {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_add_row(writer, rows + ii));
+    }
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_finish(writer));
+    lcbex_arrow_writer_destroy(writer);
+
+    ASSERT_TRUE(read_stream(out, msgs));
+    ASSERT_EQ(2, msgs.size());
+
+    /* schema */
+    ASSERT_EQ(1, msgs[0].type);
+    ASSERT_EQ("key", field_name(msgs[0].header, 0));
+    ASSERT_EQ("id", field_name(msgs[0].header, 1));
+    ASSERT_EQ("value", field_name(msgs[0].header, 2));
+    ASSERT_EQ("n", field_name(msgs[0].header, 3));
+    ASSERT_EQ("s", field_name(msgs[0].header, 4));
+    ASSERT_EQ(5, field_type(msgs[0].header, 0));
+    ASSERT_EQ(2, field_type(msgs[0].header, 3));
+    ASSERT_EQ(5, field_type(msgs[0].header, 4));
+
+    /* record batch */
+    ASSERT_EQ(3, msgs[1].type);
+    ASSERT_EQ(3, rd64(fb_field(msgs[1].header, 0)));
+
+    /* id: validity, offsets, data */
+    buf = batch_buffer(msgs[1], 3, &len);
+    ASSERT_EQ(1, len);
+    ASSERT_EQ(5, *buf);
+    buf = batch_buffer(msgs[1], 4, &len);
+    ASSERT_EQ(16, len);
+    ASSERT_EQ(0, rd32(buf));
+    ASSERT_EQ(3, rd32(buf + 4));
+    ASSERT_EQ(3, rd32(buf + 8));
+    ASSERT_EQ(4, rd32(buf + 12));
+    buf = batch_buffer(msgs[1], 5, &len);
+    ASSERT_EQ("a\"bc", string(buf, len));
+
+    /* value has no nulls, so no validity bitmap */
+    batch_buffer(msgs[1], 6, &len);
+    ASSERT_EQ(0, len);
+
+    /* n: 10, null (not an integer), -7 */
+    buf = batch_buffer(msgs[1], 9, &len);
+    ASSERT_EQ(5, *buf);
+    buf = batch_buffer(msgs[1], 10, &len);
+    ASSERT_EQ(24, len);
+    ASSERT_EQ(10, (int64_t)rd64(buf));
+    ASSERT_EQ(-7, (int64_t)rd64(buf + 16));
+
+    /* s: "x", null, and non-strings as JSON */
+    buf = batch_buffer(msgs[1], 13, &len);
+    ASSERT_EQ("x[1]", string(buf, len));
+}
+
+/**
+ * @test Verify batching
+ * @pre Write five rows with a batch size of two; then try to add a column
+ * @post Three record batches of 2, 2 and 1 rows are written, and columns
+ * can no longer be added
+ */
+TEST_F(ArrowUnitTests, testBatches)
+{
+    lcbex_arrow_writer_t *writer;
+    lcbex_vrow_t row = make_row("1", "\"a\"", "true");
+    vector<message> msgs;
+    string out;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_create(&writer, to_string, &out));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_add_column(
+                  writer, "flag", NULL, LCBEX_ARROW_BOOL));
+    lcbex_arrow_writer_set_batch_rows(writer, 2);
+    for (int ii = 0; ii < 5; ii++) {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_add_row(writer, &row));
+    }
+    ASSERT_EQ(LCB_EINVAL, lcbex_arrow_writer_add_column(
+                  writer, "late", NULL, LCBEX_ARROW_DOUBLE));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_finish(writer));
+    lcbex_arrow_writer_destroy(writer);
+
+    ASSERT_TRUE(read_stream(out, msgs));
+    ASSERT_EQ(4, msgs.size());
+    ASSERT_EQ(2, rd64(fb_field(msgs[1].header, 0)));
+    ASSERT_EQ(2, rd64(fb_field(msgs[2].header, 0)));
+    ASSERT_EQ(1, rd64(fb_field(msgs[3].header, 0)));
+}
+
+/**
+ * @test Verify an empty result and sink errors
+ * @pre Finish a writer without rows; then write to a failing sink
+ * @post The empty stream holds only the schema and end marker; the sink's
+ * error is returned
+ */
+TEST_F(ArrowUnitTests, testEmptyAndErrors)
+{
+    lcbex_arrow_writer_t *writer;
+    vector<message> msgs;
+    string out;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_create(&writer, to_string, &out));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_arrow_writer_finish(writer));
+    lcbex_arrow_writer_destroy(writer);
+    ASSERT_TRUE(read_stream(out, msgs));
+    ASSERT_EQ(1, msgs.size());
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_arrow_writer_create(&writer, failing_sink, NULL));
+    ASSERT_EQ(LCB_ERROR, lcbex_arrow_writer_finish(writer));
+    lcbex_arrow_writer_destroy(writer);
+
+    ASSERT_EQ(LCB_EINVAL, lcbex_arrow_writer_create(&writer, NULL, NULL));
+}
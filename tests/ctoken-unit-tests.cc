@@ -0,0 +1,187 @@
+#include <gtest/gtest.h>
+#include <lcbex/ctoken.h>
+#include <string>
+
+using namespace std;
+
+static const unsigned char key1[LCBEX_CTOKEN_KEY_SIZE] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+static const unsigned char key2[LCBEX_CTOKEN_KEY_SIZE] = {
+    1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
+
+class CtokenUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_vopt_t opts[4];
+    const lcbex_vopt_t *optlist[4];
+    size_t nopts;
+
+    virtual void SetUp() {
+        memset(opts, 0, sizeof(opts));
+        nopts = 0;
+    }
+
+    virtual void TearDown() {
+        for (size_t ii = 0; ii < nopts; ii++) {
+            lcbex_vopt_cleanup(&opts[ii]);
+        }
+    }
+
+    void addOption(const char *name, const char *value, int flags = 0) {
+        char *errstr;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&opts[nopts], name, -1,
+                                                 value, -1, flags, &errstr));
+        optlist[nopts] = &opts[nopts];
+        nopts++;
+    }
+
+    lcb_uint64_t fingerprint() {
+        return lcbex_ctoken_fingerprint("d", -1, "v", -1, optlist, nopts);
+    }
+
+    string encode(const lcbex_ctoken_t *token, const unsigned char *key,
+                  lcb_uint64_t fp) {
+        char *out;
+        size_t nout;
+        EXPECT_EQ(LCB_SUCCESS, lcbex_ctoken_encode(token, key, fp,
+                                                   &out, &nout));
+        string ret(out, nout);
+        EXPECT_EQ(strlen(out), nout);
+        free(out);
+        return ret;
+    }
+};
+
+/**
+ * @test Verify a token round trip
+ * @pre Make a token from a row with an escaped document ID, encode and
+ * decode it
+ * @post The token is URL safe and decodes to the row's key, unescaped
+ * document ID and direction; the page URI starts at them
+ */
+TEST_F(CtokenUnitTests, testRoundTrip)
+{
+    lcbex_ctoken_t token, decoded;
+    lcbex_vrow_t row;
+    lcb_uint64_t fp;
+    string str;
+    char *uri;
+
+    addOption("stale", "false");
+    addOption("limit", "21");
+    fp = fingerprint();
+
+    memset(&row, 0, sizeof(row));
+    row.key = "[\"2014-03-01\",42]";
+    row.nkey = strlen(row.key);
+    row.id = "\"doc\\\"1\"";
+    row.nid = strlen(row.id);
+
+    memset(&token, 0, sizeof(token));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_ctoken_from_row(&token, &row,
+                                                 LCBEX_CTOKEN_F_DESCENDING));
+    ASSERT_EQ("doc\"1", string(token.startkey_docid, token.nstartkey_docid));
+
+    str = encode(&token, key1, fp);
+    ASSERT_EQ(string::npos, str.find_first_not_of(
+                  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                  "0123456789-_"));
+    /* version, flags, two lengths and the MAC take 12 bytes */
+    ASSERT_EQ(((row.nkey + 5 + 12) * 4 + 2) / 3, str.size());
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_ctoken_decode(&decoded, str.c_str(), -1,
+                                               key1, fp));
+    ASSERT_EQ(string(row.key, row.nkey),
+              string(decoded.startkey, decoded.nstartkey));
+    ASSERT_EQ("doc\"1",
+              string(decoded.startkey_docid, decoded.nstartkey_docid));
+    ASSERT_EQ(LCBEX_CTOKEN_F_DESCENDING, decoded.flags);
+
+    uri = lcbex_ctoken_make_uri(&decoded, "d", -1, "v", -1, optlist, nopts);
+    ASSERT_STREQ("_design/d/_view/v?stale=false&limit=21"
+                 "&startkey=%5B%222014-03-01%22%2C42%5D"
+                 "&startkey_docid=doc%221&descending=true", uri);
+    free(uri);
+
+    /* reduced rows have no document ID */
+    row.id = NULL;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_ctoken_from_row(&token, &row, 0));
+    ASSERT_TRUE(token.startkey_docid == NULL);
+    str = encode(&token, key1, fp);
+    lcbex_ctoken_cleanup(&decoded);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_ctoken_decode(&decoded, str.c_str(), -1,
+                                               key1, fp));
+    ASSERT_TRUE(decoded.startkey_docid == NULL);
+    ASSERT_EQ(0, decoded.flags);
+
+    lcbex_ctoken_cleanup(&decoded);
+    lcbex_ctoken_cleanup(&token);
+}
+
+/**
+ * @test Verify tokens can't be forged or reused with other queries
+ * @pre Decode a token with another key, another fingerprint, with a
+ * character changed, and truncated
+ * @post All are rejected
+ *
+ * @pre Fingerprint the same options in another order, encoding and page
+ * size
+ * @post The fingerprint is the same; changing a value changes it
+ */
+TEST_F(CtokenUnitTests, testIntegrity)
+{
+    lcbex_ctoken_t token, decoded;
+    lcb_uint64_t fp, fp2;
+    string str, bad;
+    size_t ii;
+
+    addOption("startkey", "\"a\"");
+    addOption("endkey", "\"m\"");
+    addOption("reduce", "false");
+    fp = fingerprint();
+
+    memset(&token, 0, sizeof(token));
+    token.startkey = "\"c\"";
+    token.nstartkey = 3;
+    str = encode(&token, key1, fp);
+
+    ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_decode(&decoded, str.c_str(), -1,
+                                              key2, fp));
+    lcbex_ctoken_cleanup(&decoded);
+    ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_decode(&decoded, str.c_str(), -1,
+                                              key1, fp + 1));
+    lcbex_ctoken_cleanup(&decoded);
+    for (ii = 0; ii < str.size(); ii++) {
+        bad = str;
+        bad[ii] = bad[ii] == 'A' ? 'B' : 'A';
+        ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_decode(&decoded, bad.c_str(),
+                                                  bad.size(), key1, fp));
+        lcbex_ctoken_cleanup(&decoded);
+        ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_decode(&decoded, str.c_str(), ii,
+                                                  key1, fp));
+        lcbex_ctoken_cleanup(&decoded);
+    }
+    ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_decode(&decoded, "a+b/", -1,
+                                              key1, fp));
+    lcbex_ctoken_cleanup(&decoded);
+
+    memset(&token, 0, sizeof(token));
+    ASSERT_EQ(LCB_EINVAL, lcbex_ctoken_encode(&token, key1, fp, NULL, NULL));
+
+    /* same query, rebuilt differently */
+    TearDown();
+    SetUp();
+    addOption("limit", "10");
+    addOption("reduce", "false");
+    addOption("endkey", "\"m\"", LCBEX_VOPT_F_PCTENCODE_RFC3986);
+    fp2 = fingerprint();
+    ASSERT_EQ(fp, fp2);
+
+    TearDown();
+    SetUp();
+    addOption("reduce", "false");
+    addOption("endkey", "\"n\"");
+    ASSERT_NE(fp, fingerprint());
+}
@@ -0,0 +1,225 @@
+#include <gtest/gtest.h>
+#include <lcbex/export.h>
+#include <lcbex/jsoncur.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+class ExportUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_vopt_t *vopt_list;
+    lcbex_vopt_t *vopt_ptrs[16];
+    size_t nvopts;
+    char dir[64];
+
+    virtual void SetUp() {
+        char *errstr;
+        strcpy(dir, "/tmp/lcbex-export-XXXXXX");
+        ASSERT_TRUE(mkdtemp(dir) != NULL);
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_vopt_createv(&vopt_list, &nvopts, &errstr,
+                                     "startkey", "0", "endkey", "100",
+                                     "reduce", "false", NULL));
+        for (size_t ii = 0; ii < nvopts; ii++) {
+            vopt_ptrs[ii] = vopt_list + ii;
+        }
+    }
+
+    virtual void TearDown() {
+        string cmd = string("rm -rf ") + dir;
+        lcbex_vopt_cleanup_list(&vopt_list, nvopts, 1);
+        free(vopt_list);
+        system(cmd.c_str());
+    }
+
+    string readFile(const string &name) {
+        ifstream in((string(dir) + "/" + name).c_str());
+        stringstream ss;
+        ss << in.rdbuf();
+        return ss.str();
+    }
+};
+
+/**
+ * Response with rows for the keys start, start+step... below end
+ */
+static string make_response(int start, int end, int step)
+{
+    string s = "{\"total_rows\":20000,\"rows\":[";
+    char buf[128];
+    for (int k = start; k < end; k += step) {
+        sprintf(buf, "%s{\"id\":\"doc%d\",\"key\":%d,\"value\":{\"v\":%d}}",
+                k == start ? "" : ",", k, k, k * 2);
+        s += buf;
+    }
+    return s + "]}";
+}
+
+struct part_job {
+    lcbex_export_part_t *part;
+    int start;
+    lcb_error_t err;
+};
+
+static void *run_part(void *arg)
+{
+    part_job *job = (part_job *)arg;
+    string resp = make_response(job->start, job->start + 25, 1);
+
+    /* feed in uneven chunks, as a network would */
+    for (size_t pos = 0; pos < resp.size(); pos += 37) {
+        size_t n = min((size_t)37, resp.size() - pos);
+        if ((job->err = lcbex_export_part_feed(job->part, resp.data() + pos,
+                                               n)) != LCB_SUCCESS) {
+            return NULL;
+        }
+    }
+    job->err = lcbex_export_part_done(job->part, LCB_SUCCESS);
+    return NULL;
+}
+
+/**
+ * @test Verify a partitioned export
+ * @pre Export a range partitioned query into four parts, each fed by its
+ * own thread, then write the manifest
+ * @post Each file holds its partition's rows as JSON lines, and the
+ * manifest lists the parts in order with their ranges and row counts
+ */
+TEST_F(ExportUnitTests, testPartitioned)
+{
+    lcbex_plan_config_t config;
+    lcbex_plan_t plan;
+    lcbex_export_t *exp;
+    part_job jobs[4];
+    pthread_t thr[4];
+    lcbex_json_index_t *idx;
+    lcbex_jsoncur_t root, parts, part, field;
+    double d;
+
+    lcbex_plan_config_init(&config);
+    config.max_parallelism = 4;
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, &config, vopt_ptrs, nvopts, 20000));
+    ASSERT_EQ(LCBEX_PLAN_RANGE_PARTITIONED, plan.strategy);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_create(&exp, dir, &plan, "d", -1,
+                                               "v", -1, vopt_ptrs, nvopts));
+    ASSERT_EQ(4, lcbex_export_nparts(exp));
+    ASSERT_TRUE(lcbex_export_get_part(exp, 4) == NULL);
+
+    char *uri = lcbex_export_part_make_uri(lcbex_export_get_part(exp, 1));
+    ASSERT_STREQ("_design/d/_view/v?reduce=false&startkey=25&endkey=50"
+                 "&inclusive_end=false", uri);
+    free(uri);
+
+    /* not all parts are done */
+    ASSERT_EQ(LCB_EINVAL, lcbex_export_write_manifest(exp));
+
+    for (int ii = 0; ii < 4; ii++) {
+        jobs[ii].part = lcbex_export_get_part(exp, ii);
+        jobs[ii].start = ii * 25;
+        ASSERT_EQ(0, pthread_create(thr + ii, NULL, run_part, jobs + ii));
+    }
+    for (int ii = 0; ii < 4; ii++) {
+        pthread_join(thr[ii], NULL);
+        ASSERT_EQ(LCB_SUCCESS, jobs[ii].err);
+        ASSERT_EQ(25, lcbex_export_part_rows(jobs[ii].part));
+    }
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_write_manifest(exp));
+    lcbex_export_destroy(exp);
+
+    string part1 = readFile("part-00001");
+    ASSERT_EQ(0, part1.find("{\"id\":\"doc25\",\"key\":25,\"value\":{\"v\":50}}\n"
+                            "{\"id\":\"doc26\",\"key\":26,"));
+    ASSERT_EQ(25, count(part1.begin(), part1.end(), '\n'));
+
+    string manifest = readFile("manifest.json");
+    ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_create(&idx));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_json_index_build(idx, manifest.data(), manifest.size()));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_root(idx, &root));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&root, "parts", -1, &parts));
+
+    for (int ii = 0; ii < 4; ii++) {
+        const char *raw;
+        size_t nraw;
+        char fname[32];
+
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_at(&parts, ii, &part));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&part, "file", -1, &field));
+        lcbex_jsoncur_raw(&field, &raw, &nraw);
+        sprintf(fname, "\"part-%05d\"", ii);
+        ASSERT_EQ(fname, string(raw, nraw));
+
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&part, "start_key", &field));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+        ASSERT_EQ(ii * 25, d);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&part, "end_key", &field));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+        ASSERT_EQ(ii * 25 + 25, d);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&part, "rows", &field));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+        ASSERT_EQ(25, d);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&part, "last_key", &field));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+        ASSERT_EQ(ii * 25 + 24, d);
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_jsoncur_path(&part, "inclusive_end", &field));
+        ASSERT_EQ(ii == 3 ? LCBEX_JSON_TRUE : LCBEX_JSON_FALSE,
+                  lcbex_jsoncur_type(&field));
+    }
+    lcbex_json_index_destroy(idx);
+    ASSERT_NE(0, access((string(dir) + "/manifest.json.tmp").c_str(), F_OK));
+}
+
+/**
+ * @test Verify failed parts and retries
+ * @pre Export a single-part plan; fail the part, retry it after a reset,
+ * and complete it with an empty result
+ * @post The manifest is refused while the part is failed; after the retry
+ * the file is empty and the manifest has null bounds and keys
+ */
+TEST_F(ExportUnitTests, testRetryAndEmpty)
+{
+    lcbex_plan_t plan;
+    lcbex_export_t *exp;
+    lcbex_export_part_t *part;
+    string resp = make_response(0, 10, 1);
+    const char *empty = "{\"total_rows\":0,\"rows\":[]}";
+
+    memset(&plan, 0, sizeof(plan));
+    plan.strategy = LCBEX_PLAN_KEYS_CHUNKED;
+    ASSERT_EQ(LCB_EINVAL, lcbex_export_create(&exp, dir, &plan, "d", -1,
+                                              "v", -1, vopt_ptrs, nvopts));
+    plan.strategy = LCBEX_PLAN_SINGLE;
+    plan.nparts = 1;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_create(&exp, dir, &plan, "d", -1,
+                                               "v", -1, vopt_ptrs, nvopts));
+    part = lcbex_export_get_part(exp, 0);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_part_feed(part, resp.data(), 40));
+    ASSERT_EQ(LCB_ETIMEDOUT, lcbex_export_part_done(part, LCB_ETIMEDOUT));
+    ASSERT_EQ(LCB_ETIMEDOUT, lcbex_export_write_manifest(exp));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_part_reset(part));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_part_feed(part, empty,
+                                                  strlen(empty)));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_part_done(part, LCB_SUCCESS));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_export_write_manifest(exp));
+    lcbex_export_destroy(exp);
+
+    ASSERT_EQ("", readFile("part-00000"));
+    ASSERT_EQ("{\"design\":\"d\",\"view\":\"v\",\"parts\":[\n"
+              "{\"file\":\"part-00000\",\"start_key\":null,\"end_key\":null,"
+              "\"inclusive_end\":true,\"rows\":0,\"first_key\":null,"
+              "\"last_key\":null}]}\n", readFile("manifest.json"));
+}
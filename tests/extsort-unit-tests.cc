@@ -0,0 +1,191 @@
+#include <gtest/gtest.h>
+#include <lcbex/extsort.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class ExtsortUnitTests : public ::testing::Test
+{
+protected:
+    struct test_row {
+        string key;
+        string id;
+        string value;
+    };
+
+    vector<test_row> rows;
+
+    void addRows(lcbex_extsort_t *sorter) {
+        vector<lcbex_vrow_t> vrows(rows.size());
+        for (size_t ii = 0; ii < rows.size(); ii++) {
+            memset(&vrows[ii], 0, sizeof(vrows[ii]));
+            vrows[ii].key = rows[ii].key.c_str();
+            vrows[ii].nkey = rows[ii].key.size();
+            if (!rows[ii].id.empty()) {
+                vrows[ii].id = rows[ii].id.c_str();
+                vrows[ii].nid = rows[ii].id.size();
+            }
+            vrows[ii].value = rows[ii].value.c_str();
+            vrows[ii].nvalue = rows[ii].value.size();
+        }
+        /* in batches of 100 */
+        for (size_t ii = 0; ii < vrows.size(); ii += 100) {
+            size_t n = min((size_t)100, vrows.size() - ii);
+            ASSERT_EQ(LCB_SUCCESS,
+                      lcbex_extsort_add_rows(sorter, &vrows[ii], n));
+        }
+    }
+
+    /**
+     * Reads every row from the sorter, returning their keys
+     */
+    vector<string> readKeys(lcbex_extsort_t *sorter) {
+        vector<string> ret;
+        const lcbex_vrow_t *row;
+        while (lcbex_extsort_next(sorter, &row) == LCB_SUCCESS && row) {
+            ret.push_back(string(row->key, row->nkey));
+        }
+        return ret;
+    }
+};
+
+/**
+ * @test Verify a numeric sort in memory
+ * @pre Sort rows by a nested numeric field, ascending and descending,
+ * with some rows lacking the field
+ * @post Rows are in order of the field, ties in the order they were
+ * added, and rows without the field last; nothing is written to disk
+ */
+TEST_F(ExtsortUnitTests, testNumeric)
+{
+    lcbex_extsort_config_t config;
+    lcbex_extsort_t *sorter;
+    lcbex_extsort_stats_t stats;
+    static const char *values[] = {
+        "{\"s\":{\"n\":3}}", "{\"s\":{\"n\":-1.5}}", "{\"s\":{}}",
+        "{\"s\":{\"n\":3}}", "{\"s\":{\"n\":\"x\"}}", "{\"s\":{\"n\":1e2}}",
+        "[]", "{\"s\":{\"n\":0}}"
+    };
+    const char *asc[] = { "1", "7", "0", "3", "5", "2", "4", "6" };
+    const char *desc[] = { "5", "0", "3", "7", "1", "2", "4", "6" };
+
+    for (size_t ii = 0; ii < 8; ii++) {
+        test_row row;
+        char buf[16];
+        sprintf(buf, "%d", (int)ii);
+        row.key = buf;
+        row.id = string("\"") + buf + "\"";
+        row.value = values[ii];
+        rows.push_back(row);
+    }
+
+    lcbex_extsort_config_init(&config);
+    config.path = "s.n";
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_create(&sorter, &config));
+    addRows(sorter);
+
+    const lcbex_vrow_t *row;
+    ASSERT_EQ(LCB_EINVAL, lcbex_extsort_next(sorter, &row));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_finish(sorter));
+    ASSERT_EQ(LCB_EINVAL, lcbex_extsort_add_rows(sorter, NULL, 0));
+    ASSERT_EQ(vector<string>(asc, asc + 8), readKeys(sorter));
+
+    lcbex_extsort_get_stats(sorter, &stats);
+    ASSERT_EQ(8, stats.rows);
+    ASSERT_EQ(3, stats.unsorted);
+    ASSERT_EQ(0, stats.runs);
+    lcbex_extsort_destroy(sorter);
+
+    config.descending = 1;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_create(&sorter, &config));
+    addRows(sorter);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_finish(sorter));
+    ASSERT_EQ(vector<string>(desc, desc + 8), readKeys(sorter));
+
+    /* reusable after a reset */
+    lcbex_extsort_reset(sorter);
+    ASSERT_EQ(0, lcbex_extsort_memory(sorter));
+    rows.resize(2);
+    addRows(sorter);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_finish(sorter));
+    ASSERT_EQ(2, readKeys(sorter).size());
+    lcbex_extsort_destroy(sorter);
+}
+
+struct collate_less {
+    bool operator()(const pair<string, size_t> &a,
+                    const pair<string, size_t> &b) const {
+        return lcbex_vrow_collate(a.first.data(), a.first.size(),
+                                  b.first.data(), b.first.size()) < 0;
+    }
+};
+
+/**
+ * @test Verify a sort spilled to several runs and merged in passes
+ * @pre Sort 20000 rows by a string field in collation order, with a
+ * small memory limit and a fan-in of 4
+ * @post Runs are written and merged in more than one pass; rows come back
+ * complete, in collation order and stable
+ */
+TEST_F(ExtsortUnitTests, testSpill)
+{
+    lcbex_extsort_config_t config;
+    lcbex_extsort_t *sorter;
+    lcbex_extsort_stats_t stats;
+    vector<pair<string, size_t> > expected;
+    char buf[128];
+
+    for (size_t ii = 0; ii < 20000; ii++) {
+        test_row row;
+        /* 997 distinct names, so there are many ties */
+        sprintf(buf, "\"name %d\"", (int)((ii * 7919) % 997));
+        string name = buf;
+        sprintf(buf, "[\"k\",%d]", (int)ii);
+        row.key = buf;
+        if (ii % 10) {
+            sprintf(buf, "\"doc%d\"", (int)ii);
+            row.id = buf;
+        }
+        row.value = "{\"name\":" + name + ",\"n\":" + row.key + "}";
+        rows.push_back(row);
+        expected.push_back(make_pair(name, ii));
+    }
+
+    lcbex_extsort_config_init(&config);
+    config.path = "name";
+    config.compare = LCBEX_EXTSORT_COLLATE;
+    config.memory_limit = 128 * 1024;
+    config.max_fanin = 4;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_create(&sorter, &config));
+    addRows(sorter);
+    ASSERT_TRUE(lcbex_extsort_memory(sorter) <= config.memory_limit);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_extsort_finish(sorter));
+
+    stable_sort(expected.begin(), expected.end(), collate_less());
+
+    const lcbex_vrow_t *row;
+    size_t nread = 0;
+    while (lcbex_extsort_next(sorter, &row) == LCB_SUCCESS && row) {
+        const test_row &exp = rows[expected[nread].second];
+        ASSERT_EQ(exp.key, string(row->key, row->nkey));
+        ASSERT_EQ(exp.value, string(row->value, row->nvalue));
+        if (exp.id.empty()) {
+            ASSERT_TRUE(row->id == NULL);
+        } else {
+            ASSERT_EQ(exp.id, string(row->id, row->nid));
+        }
+        nread++;
+    }
+    ASSERT_EQ(20000, nread);
+
+    lcbex_extsort_get_stats(sorter, &stats);
+    ASSERT_GT(stats.runs, 16);
+    ASSERT_GE(stats.merge_passes, 2);
+    ASSERT_GT(stats.spilled_bytes, 20000 * 40);
+    lcbex_extsort_destroy(sorter);
+}
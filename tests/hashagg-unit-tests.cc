@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+#include <lcbex/hashagg.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef map<string, lcbex_hashagg_result_t> AggResults;
+
+extern "C" {
+    static void aggCallback(lcbex_hashagg_t *, const char *key, size_t nkey,
+                            const lcbex_hashagg_result_t *res, void *cookie)
+    {
+        AggResults *results = (AggResults *)cookie;
+        string k(key, nkey);
+        EXPECT_EQ(0, results->count(k)) << "duplicate group " << k;
+        (*results)[k] = *res;
+    }
+}
+
+class HashaggUnitTests : public ::testing::Test
+{
+protected:
+    vector<string> keys;
+    vector<string> values;
+
+    void addRow(const string &key, const string &value) {
+        keys.push_back(key);
+        values.push_back(value);
+    }
+
+    void flush(lcbex_hashagg_t *agg) {
+        if (keys.empty()) {
+            return;
+        }
+        vector<lcbex_vrow_t> rows(keys.size());
+        for (size_t ii = 0; ii < keys.size(); ii++) {
+            memset(&rows[ii], 0, sizeof(rows[ii]));
+            rows[ii].key = keys[ii].c_str();
+            rows[ii].nkey = keys[ii].size();
+            rows[ii].value = values[ii].c_str();
+            rows[ii].nvalue = values[ii].size();
+        }
+        ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_add_rows(agg, &rows[0],
+                                                      rows.size()));
+        keys.clear();
+        values.clear();
+    }
+};
+
+/**
+ * @test Verify grouping by key prefix
+ * @pre Aggregate rows with array keys at group level 2
+ * @post Groups are the two-element prefixes; non-array keys and shorter
+ * arrays are grouped as they are
+ */
+TEST_F(HashaggUnitTests, testKeyPrefix)
+{
+    lcbex_hashagg_config_t config;
+    lcbex_hashagg_t *agg;
+    AggResults results;
+
+    lcbex_hashagg_config_init(&config);
+    config.group_level = 2;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_create(&agg, &config));
+
+    addRow("[2013,1,5]", "10");
+    addRow("[2013,1,9]", "-2.5");
+    addRow("[2013, 2, 1]", "4");
+    addRow("[2013,1,[1,2]]", "\"n/a\"");
+    addRow("[2014]", "7");
+    addRow("\"other\"", "1");
+    flush(agg);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_finish(agg, aggCallback, &results));
+    ASSERT_EQ(4, results.size());
+
+    const lcbex_hashagg_result_t &jan = results["[2013,1]"];
+    ASSERT_EQ(3, jan.count);
+    ASSERT_EQ(2, jan.nvalues);
+    ASSERT_EQ(7.5, jan.sum);
+    ASSERT_EQ(-2.5, jan.min);
+    ASSERT_EQ(10, jan.max);
+    ASSERT_EQ(3.75, jan.mean);
+
+    ASSERT_EQ(1, results["[2013, 2]"].count);
+    ASSERT_EQ(7, results["[2014]"].sum);
+    ASSERT_EQ(1, results["\"other\""].count);
+
+    // the aggregator is reset and may be reused
+    results.clear();
+    addRow("[1,2,3]", "1");
+    flush(agg);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_finish(agg, aggCallback, &results));
+    ASSERT_EQ(1, results.size());
+    ASSERT_EQ(1, results["[1,2]"].count);
+
+    lcbex_hashagg_destroy(agg);
+}
+
+/**
+ * @test Verify grouping by a value field
+ * @pre Aggregate rows grouped by value.type, measuring value.amount
+ * @post Rows without the field are skipped and counted
+ */
+TEST_F(HashaggUnitTests, testValueField)
+{
+    lcbex_hashagg_config_t config;
+    lcbex_hashagg_t *agg;
+    lcbex_hashagg_stats_t stats;
+    AggResults results;
+
+    lcbex_hashagg_config_init(&config);
+    config.group_by = LCBEX_HASHAGG_GROUP_VALUE_FIELD;
+    config.group_path = "type";
+    config.measure_path = "amount";
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_create(&agg, &config));
+
+    addRow("1", "{\"type\":\"sale\",\"amount\":5}");
+    addRow("2", "{\"amount\":100,\"type\":\"sale\"}");
+    addRow("3", "{\"type\":\"refund\",\"amount\":-5}");
+    addRow("4", "{\"amount\":1}");
+    addRow("5", "{\"type\":\"refund\"}");
+    flush(agg);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_finish(agg, aggCallback, &results));
+    ASSERT_EQ(2, results.size());
+    ASSERT_EQ(2, results["\"sale\""].count);
+    ASSERT_EQ(105, results["\"sale\""].sum);
+    ASSERT_EQ(2, results["\"refund\""].count);
+    ASSERT_EQ(1, results["\"refund\""].nvalues);
+    ASSERT_EQ(-5, results["\"refund\""].mean);
+
+    lcbex_hashagg_get_stats(agg, &stats);
+    ASSERT_EQ(5, stats.rows);
+    ASSERT_EQ(1, stats.skipped);
+    ASSERT_EQ(2, stats.groups);
+    ASSERT_EQ(0, stats.spills);
+    lcbex_hashagg_destroy(agg);
+
+    config.group_path = NULL;
+    ASSERT_EQ(LCB_EINVAL, lcbex_hashagg_create(&agg, &config));
+}
+
+/**
+ * @test Verify spilling
+ * @pre Aggregate many more groups (with long keys) than fit in the memory
+ * limit, each group's rows spread over several batches
+ * @post The table stays within the limit, and the results match an
+ * in-memory aggregation
+ */
+TEST_F(HashaggUnitTests, testSpill)
+{
+    lcbex_hashagg_config_t config;
+    lcbex_hashagg_t *agg;
+    lcbex_hashagg_stats_t stats;
+    AggResults results;
+    const int ngroups = 5000;
+
+    lcbex_hashagg_config_init(&config);
+    config.memory_limit = 32 * 1024;
+    config.npartitions = 4;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_create(&agg, &config));
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (int ii = 0; ii < ngroups; ii++) {
+            char key[64], value[32];
+            sprintf(key, "\"a fairly long group key number %d\"", ii);
+            sprintf(value, "%d", ii * 3 + pass);
+            addRow(key, value);
+            if (keys.size() == 100) {
+                flush(agg);
+                ASSERT_LE(lcbex_hashagg_memory(agg), config.memory_limit);
+            }
+        }
+    }
+    flush(agg);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hashagg_finish(agg, aggCallback, &results));
+    ASSERT_EQ(ngroups, results.size());
+
+    for (int ii = 0; ii < ngroups; ii++) {
+        char key[64];
+        sprintf(key, "\"a fairly long group key number %d\"", ii);
+        const lcbex_hashagg_result_t &res = results[key];
+        ASSERT_EQ(3, res.count);
+        ASSERT_EQ(ii * 9 + 3, res.sum);
+        ASSERT_EQ(ii * 3, res.min);
+        ASSERT_EQ(ii * 3 + 2, res.max);
+    }
+
+    lcbex_hashagg_get_stats(agg, &stats);
+    ASSERT_GT(stats.spills, 0);
+    ASSERT_GT(stats.spilled_bytes, 0);
+    ASSERT_EQ(ngroups, stats.groups);
+    lcbex_hashagg_destroy(agg);
+}
@@ -0,0 +1,203 @@
+#include <gtest/gtest.h>
+#include <lcbex/jsoncur.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class JsoncurUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_json_index_t *index;
+    lcbex_jsoncur_t root;
+
+    virtual void SetUp() {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_create(&index));
+    }
+
+    virtual void TearDown() {
+        lcbex_json_index_destroy(index);
+    }
+
+    void build(const char *json) {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_build(index, json,
+                                                      strlen(json)));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_root(index, &root));
+    }
+
+    std::string raw(const lcbex_jsoncur_t *cur) {
+        const char *s;
+        size_t n;
+        lcbex_jsoncur_raw(cur, &s, &n);
+        return std::string(s, n);
+    }
+
+    std::string rawPath(const char *path) {
+        lcbex_jsoncur_t cur;
+        lcb_error_t err = lcbex_jsoncur_path(&root, path, &cur);
+        if (err != LCB_SUCCESS) {
+            return "<error>";
+        }
+        return raw(&cur);
+    }
+};
+
+static const char *sampleDoc =
+    "{ \"name\" : \"Mark\",\n"
+    "  \"skip\": {\"a\": [1, {\"city\": \"wrong\"}, \"]}\"], \"b\": null},\n"
+    "  \"address\": { \"street\": \"1 Main St\", \"city\": \"Reno\" },\n"
+    "  \"tags\": [ \"x\", [true, false], 42 , -1.5e3 ],\n"
+    "  \"caf\\u00e9\": 1,\n"
+    "  \"empty\": {}, \"none\": []\n"
+    "}";
+
+/**
+ * @test Verify path navigation
+ * @pre Follow paths through objects and arrays in a document with nested
+ * decoys
+ * @post Each path resolves to the raw text of the right value
+ */
+TEST_F(JsoncurUnitTests, testPath)
+{
+    build(sampleDoc);
+
+    ASSERT_EQ("\"Reno\"", rawPath("address.city"));
+    ASSERT_EQ("\"Mark\"", rawPath("name"));
+    ASSERT_EQ("\"x\"", rawPath("tags.0"));
+    ASSERT_EQ("false", rawPath("tags.1.1"));
+    ASSERT_EQ("42", rawPath("tags.2"));
+    ASSERT_EQ("-1.5e3", rawPath("tags.3"));
+    ASSERT_EQ("null", rawPath("skip.b"));
+    ASSERT_EQ("\"]}\"", rawPath("skip.a.2"));
+    ASSERT_EQ("{}", rawPath("empty"));
+    ASSERT_EQ("1", rawPath("caf\xc3\xa9"));
+
+    ASSERT_EQ("<error>", rawPath("address.zip"));
+    ASSERT_EQ("<error>", rawPath("tags.4"));
+    ASSERT_EQ("<error>", rawPath("name.first"));
+    ASSERT_EQ("<error>", rawPath("empty.x"));
+    ASSERT_EQ("<error>", rawPath("none.0"));
+}
+
+/**
+ * @test Verify typed accessors
+ * @pre Read strings and numbers through a cursor
+ * @post Values are decoded; type mismatches return LCB_EINVAL
+ */
+TEST_F(JsoncurUnitTests, testAccessors)
+{
+    lcbex_jsoncur_t cur;
+    char buf[64];
+    const char *s;
+    size_t n;
+    double d;
+
+    build(sampleDoc);
+    ASSERT_EQ(LCBEX_JSON_OBJECT, lcbex_jsoncur_type(&root));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&root, "address.street", &cur));
+    ASSERT_EQ(LCBEX_JSON_STRING, lcbex_jsoncur_type(&cur));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_string(&cur, buf, &s, &n));
+    ASSERT_EQ("1 Main St", std::string(s, n));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_double(&cur, &d));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_name(&cur, &s, &n));
+    ASSERT_EQ("\"street\"", std::string(s, n));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&root, "tags.3", &cur));
+    ASSERT_EQ(LCBEX_JSON_NUMBER, lcbex_jsoncur_type(&cur));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&cur, &d));
+    ASSERT_EQ(-1500.0, d);
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_string(&cur, buf, &s, &n));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_name(&cur, &s, &n));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&root, "tags.1.0", &cur));
+    ASSERT_EQ(LCBEX_JSON_TRUE, lcbex_jsoncur_type(&cur));
+
+    build("[01, 1.]");
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_at(&root, 0, &cur));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_double(&cur, &d));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_at(&root, 1, &cur));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_double(&cur, &d));
+
+    build("  7  ");
+    ASSERT_EQ("7", raw(&root));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&root, &d));
+    ASSERT_EQ(7.0, d);
+
+    /* the same as strtod, whether or not it is needed */
+    static const char *numbers[] = {
+        "0", "-0", "0.000", "123", "-42.5", "0.1", "3.14159", "1e22",
+        "1e23", "9007199254740993", "1234567890123456789", "4.5E-3",
+        "0.0000000000000000000001", "123456.789e-20", "1e400", "2.5e+2",
+        "17976931348623157e292", "1.00000000000000000000000001"
+    };
+    for (size_t ii = 0; ii < sizeof(numbers) / sizeof(numbers[0]); ii++) {
+        build(numbers[ii]);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&root, &d));
+        ASSERT_EQ(strtod(numbers[ii], NULL), d) << numbers[ii];
+    }
+    build("-0");
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&root, &d));
+    ASSERT_TRUE(signbit(d));
+}
+
+/**
+ * @test Verify iteration
+ * @pre Iterate over the members of an object and elements of an array
+ * @post Each member/element is visited once, in order
+ */
+TEST_F(JsoncurUnitTests, testIteration)
+{
+    lcbex_jsoncur_t cur;
+    std::string names;
+    lcb_error_t err;
+    size_t count = 0;
+
+    build(sampleDoc);
+    for (err = lcbex_jsoncur_first(&root, &cur); err == LCB_SUCCESS;
+            err = lcbex_jsoncur_next(&cur, &cur)) {
+        const char *s;
+        size_t n;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_name(&cur, &s, &n));
+        names += std::string(s, n) + ",";
+    }
+    ASSERT_EQ(LCB_KEY_ENOENT, err);
+    ASSERT_EQ("\"name\",\"skip\",\"address\",\"tags\",\"caf\\u00e9\","
+              "\"empty\",\"none\",", names);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&root, "tags", -1, &cur));
+    for (err = lcbex_jsoncur_first(&cur, &cur); err == LCB_SUCCESS;
+            err = lcbex_jsoncur_next(&cur, &cur)) {
+        count++;
+    }
+    ASSERT_EQ(4, count);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&root, "none", -1, &cur));
+    ASSERT_EQ(LCB_KEY_ENOENT, lcbex_jsoncur_first(&cur, &cur));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&root, "name", -1, &cur));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_first(&cur, &cur));
+}
+
+/**
+ * @test Verify malformed input is rejected
+ * @pre Index unbalanced brackets and unterminated strings
+ * @post LCB_EINVAL is returned
+ */
+TEST_F(JsoncurUnitTests, testMalformed)
+{
+    const char *bad[] = {
+        "{", "[1,2", "{\"a\":1]", "]", "\"abc", "{\"a\\\":1}"
+    };
+    for (size_t ii = 0; ii < sizeof(bad) / sizeof(bad[0]); ii++) {
+        ASSERT_EQ(LCB_EINVAL, lcbex_json_index_build(index, bad[ii],
+                                                     strlen(bad[ii])))
+                << bad[ii];
+    }
+
+    lcbex_jsoncur_t cur;
+    build("{1:2}");
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_first(&root, &cur));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_build(index, " ", 1));
+    ASSERT_EQ(LCB_EINVAL, lcbex_jsoncur_root(index, &cur));
+}
@@ -0,0 +1,227 @@
+#include <gtest/gtest.h>
+#include <lcbex/keyfilter.h>
+#include <stdio.h>
+#include <string.h>
+
+class KeyfilterUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_keyfilter_t *filter;
+
+    virtual void SetUp() {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_keyfilter_create(&filter, 1000));
+    }
+
+    virtual void TearDown() {
+        lcbex_keyfilter_destroy(filter);
+    }
+
+    /**
+     * Builds the filter with the keys ["user",0] .. ["user",n-1]
+     */
+    void buildFilter(int n) {
+        char buf[64];
+        ASSERT_EQ(LCB_SUCCESS, lcbex_keyfilter_rebuild_begin(filter, n, 0));
+        for (int ii = 0; ii < n; ii++) {
+            sprintf(buf, "[\"user\",%d]", ii);
+            ASSERT_EQ(LCB_SUCCESS,
+                      lcbex_keyfilter_rebuild_add(filter, buf, strlen(buf)));
+        }
+        ASSERT_EQ(LCB_SUCCESS, lcbex_keyfilter_rebuild_commit(filter, 100));
+    }
+
+    int mayContain(const char *key) {
+        return lcbex_keyfilter_may_contain(filter, key, strlen(key));
+    }
+};
+
+/**
+ * @test Verify there are no false negatives and few false positives
+ * @pre Build a filter with 10000 keys, look up all of them and 10000 absent
+ * keys
+ * @post All present keys pass, and fewer than 3% of absent keys do
+ */
+TEST_F(KeyfilterUnitTests, testLookups)
+{
+    char buf[64];
+    int nfp = 0;
+
+    // no filter yet; everything may be present
+    ASSERT_NE(0, mayContain("\"anything\""));
+    buildFilter(10000);
+
+    for (int ii = 0; ii < 10000; ii++) {
+        sprintf(buf, "[\"user\",%d]", ii);
+        ASSERT_NE(0, mayContain(buf));
+    }
+    for (int ii = 10000; ii < 20000; ii++) {
+        sprintf(buf, "[\"user\",%d]", ii);
+        nfp += mayContain(buf) ? 1 : 0;
+    }
+    ASSERT_LT(nfp, 300);
+
+    lcbex_keyfilter_stats_t stats;
+    lcbex_keyfilter_get_stats(filter, &stats);
+    ASSERT_EQ(20001, stats.lookups);
+    ASSERT_EQ(10000 - nfp, stats.negatives);
+    ASSERT_EQ(10000, stats.nkeys);
+    ASSERT_EQ(1, stats.rebuilds);
+}
+
+/**
+ * @test Verify key canonicalization
+ * @pre Look up present keys with extra whitespace
+ * @post They pass the filter
+ * @pre Look up absent keys which have several possible encodings
+ * @post They are never reported as absent
+ * @pre Look up integers with more than 15 digits
+ * @post They are never reported as absent
+ */
+TEST_F(KeyfilterUnitTests, testCanonicalKeys)
+{
+    buildFilter(100);
+    ASSERT_NE(0, mayContain("[ \"user\" , 42 ]"));
+    ASSERT_NE(0, mayContain("[\"user\",4200.0]"));
+    ASSERT_NE(0, mayContain("[\"us\\u0065r\",4200]"));
+    ASSERT_EQ(0, mayContain("[\"user\",4200]"));
+    ASSERT_EQ(0, mayContain("[\"user\",true]"));
+
+    // the server reads these as the same double
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_keyfilter_rebuild_begin(filter, 1, 0));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_keyfilter_rebuild_add(filter, "9007199254740992", 16));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_keyfilter_rebuild_commit(filter, 0));
+    ASSERT_NE(0, mayContain("9007199254740993"));
+    ASSERT_NE(0, mayContain("[\"user\",-1234567890123456]"));
+    ASSERT_EQ(0, mayContain("123456789012345"));
+}
+
+/**
+ * @test Verify checking view options
+ * @pre Check queries with a single present key, a single absent key
+ * (percent-encoded), and a 'keys' query
+ * @post Only the absent single key query is short-circuited
+ */
+TEST_F(KeyfilterUnitTests, testCheckVopts)
+{
+    lcbex_vopt_t vopt_key, vopt_keys;
+    const lcbex_vopt_t *vopt_list[2];
+    char *errstr;
+
+    buildFilter(100);
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&vopt_key, "key", -1, "[\"user\",5]", -1,
+                                LCBEX_VOPT_F_PCTENCODE, &errstr));
+    vopt_list[0] = &vopt_key;
+    ASSERT_NE(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 1));
+    lcbex_vopt_cleanup(&vopt_key);
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&vopt_key, "key", -1, "[\"user\", 500]", -1,
+                                LCBEX_VOPT_F_PCTENCODE, &errstr));
+    ASSERT_EQ(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 1));
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&vopt_keys, "keys", -1, "[[\"user\",5]]", -1,
+                                0, &errstr));
+    vopt_list[1] = &vopt_keys;
+    ASSERT_NE(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 2));
+
+    lcbex_vopt_cleanup(&vopt_key);
+    lcbex_vopt_cleanup(&vopt_keys);
+}
+
+/**
+ * @test Verify passthrough options disable the check
+ * @pre Check a present key assigned as a percent-encoded passthrough
+ * option
+ * @post The query is not short-circuited
+ */
+TEST_F(KeyfilterUnitTests, testCheckVoptsPassthrough)
+{
+    lcbex_vopt_t vopt_key;
+    const lcbex_vopt_t *vopt_list[1] = { &vopt_key };
+    char *errstr;
+
+    buildFilter(100);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&vopt_key, "key", -1, "[\"user\",5]", -1,
+                                LCBEX_VOPT_F_PASSTHROUGH |
+                                LCBEX_VOPT_F_PCTENCODE, &errstr));
+    ASSERT_NE(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 1));
+    lcbex_vopt_cleanup(&vopt_key);
+}
+
+/**
+ * @test Verify range and reduce options disable the check
+ * @pre Check an absent key together with each range or reduce-related
+ * option
+ * @post None of the queries is short-circuited
+ */
+TEST_F(KeyfilterUnitTests, testCheckVoptsExcluded)
+{
+    static const char *excluded[][2] = {
+        { "startkey", "[\"user\",0]" },
+        { "endkey", "[\"user\",9999]" },
+        { "startkey_docid", "user::0" },
+        { "endkey_docid", "user::9999" },
+        { "inclusive_end", "false" },
+        { "reduce", "true" },
+        { "group", "true" },
+        { "group_level", "1" },
+        { "bbox", "0,0,10,10" },
+        { "start_range", "[0,0]" },
+        { "end_range", "[10,10]" }
+    };
+    lcbex_vopt_t vopt_key, vopt_other;
+    const lcbex_vopt_t *vopt_list[2];
+    char *errstr;
+
+    buildFilter(100);
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&vopt_key, "key", -1, "[\"user\",500]", -1,
+                                0, &errstr));
+    vopt_list[0] = &vopt_key;
+    vopt_list[1] = &vopt_other;
+    ASSERT_EQ(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 1));
+
+    for (size_t ii = 0; ii < sizeof(excluded) / sizeof(excluded[0]); ii++) {
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_vopt_assign(&vopt_other, excluded[ii][0], -1,
+                                    excluded[ii][1], -1, 0, &errstr))
+                << excluded[ii][0];
+        ASSERT_NE(0, lcbex_keyfilter_check_vopts(filter, vopt_list, 2))
+                << excluded[ii][0];
+        lcbex_vopt_cleanup(&vopt_other);
+    }
+
+    lcbex_vopt_cleanup(&vopt_key);
+}
+
+/**
+ * @test Verify rebuild scheduling and incremental adds
+ * @pre Check needs_rebuild before the first build, after it, and after the
+ * refresh interval
+ * @post A rebuild is requested initially and after the interval only
+ * @pre Add a new key to the committed filter
+ * @post It passes the filter
+ */
+TEST_F(KeyfilterUnitTests, testRebuild)
+{
+    ASSERT_NE(0, lcbex_keyfilter_needs_rebuild(filter, 0));
+    buildFilter(10);
+    ASSERT_EQ(0, lcbex_keyfilter_needs_rebuild(filter, 500));
+    ASSERT_NE(0, lcbex_keyfilter_needs_rebuild(filter, 1100));
+
+    ASSERT_EQ(0, mayContain("\"new\""));
+    lcbex_keyfilter_add(filter, "\"new\"", 5);
+    ASSERT_NE(0, mayContain("\"new\""));
+
+    lcbex_keyfilter_report_empty(filter);
+    lcbex_keyfilter_stats_t stats;
+    lcbex_keyfilter_get_stats(filter, &stats);
+    ASSERT_EQ(1, stats.false_positives);
+}
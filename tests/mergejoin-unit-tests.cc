@@ -0,0 +1,266 @@
+#include <gtest/gtest.h>
+#include <lcbex/mergejoin.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct JoinResult {
+    vector<string> groups;
+};
+
+extern "C" {
+    static void joinCallback(lcbex_mergejoin_t *, const char *key, size_t nkey,
+                             const lcbex_vrow_t *left, size_t nleft,
+                             const lcbex_vrow_t *right, size_t nright,
+                             void *cookie)
+    {
+        JoinResult *res = (JoinResult *)cookie;
+        string s = string(key, nkey) + ":";
+        for (size_t ii = 0; ii < nleft; ii++) {
+            s += string(left[ii].value, left[ii].nvalue);
+        }
+        s += "|";
+        for (size_t ii = 0; ii < nright; ii++) {
+            s += string(right[ii].value, right[ii].nvalue);
+        }
+        res->groups.push_back(s);
+    }
+}
+
+class MergejoinUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_mergejoin_t *join;
+    JoinResult result;
+
+    void create(int flags) {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_mergejoin_create(&join, flags,
+                                                      joinCallback, &result));
+    }
+
+    virtual void TearDown() {
+        lcbex_mergejoin_destroy(join);
+    }
+
+    lcb_error_t add(int side, const char *key, const char *value) {
+        lcbex_vrow_t row;
+        memset(&row, 0, sizeof(row));
+        row.key = key;
+        row.nkey = strlen(key);
+        row.value = value;
+        row.nvalue = strlen(value);
+        return lcbex_mergejoin_add_row(join, side, &row);
+    }
+
+    /**
+     * Feeds "key=value" rows to both sides, alternating between them
+     */
+    void feed(const char **left, const char **right) {
+        while (*left || *right) {
+            const char **cur[2] = { left, right };
+            for (int side = 0; side < 2; side++) {
+                const char *row = *cur[side];
+                if (!row) {
+                    continue;
+                }
+                const char *eq = strchr(row, '=');
+                string key(row, eq - row);
+                ASSERT_EQ(LCB_SUCCESS, add(side, key.c_str(), eq + 1));
+            }
+            if (*left) {
+                left++;
+            }
+            if (*right) {
+                right++;
+            }
+        }
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_mergejoin_side_done(join, LCBEX_MERGEJOIN_LEFT));
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_mergejoin_side_done(join, LCBEX_MERGEJOIN_RIGHT));
+    }
+};
+
+static const char *orders[] = {
+    "\"alice\"=o1", "\"alice\"=o2", "\"bob\"=o3", "\"dave\"=o4",
+    "\"dave\"=o5", "\"dave\"=o6", NULL
+};
+
+static const char *payments[] = {
+    "\"alice\"=p1", "\"carol\"=p2", "\"dave\"=p3", "\"eve\"=p4", NULL
+};
+
+/**
+ * @test Verify an inner join
+ * @pre Join two sorted streams with repeated and unmatched keys
+ * @post One group is emitted per key present on both sides, with all of
+ * its rows
+ */
+TEST_F(MergejoinUnitTests, testInnerJoin)
+{
+    create(0);
+    feed(orders, payments);
+
+    ASSERT_EQ(2, result.groups.size());
+    ASSERT_EQ("\"alice\":o1o2|p1", result.groups[0]);
+    ASSERT_EQ("\"dave\":o4o5o6|p3", result.groups[1]);
+
+    ASSERT_EQ(0, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_LEFT));
+    ASSERT_EQ(0, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_RIGHT));
+}
+
+/**
+ * @test Verify a full outer join
+ * @pre Join the same streams with LCBEX_MERGEJOIN_F_FULL_OUTER
+ * @post Unmatched groups are emitted with an empty side, in key order
+ */
+TEST_F(MergejoinUnitTests, testOuterJoin)
+{
+    create(LCBEX_MERGEJOIN_F_FULL_OUTER);
+    feed(orders, payments);
+
+    ASSERT_EQ(5, result.groups.size());
+    ASSERT_EQ("\"alice\":o1o2|p1", result.groups[0]);
+    ASSERT_EQ("\"bob\":o3|", result.groups[1]);
+    ASSERT_EQ("\"carol\":|p2", result.groups[2]);
+    ASSERT_EQ("\"dave\":o4o5o6|p3", result.groups[3]);
+    ASSERT_EQ("\"eve\":|p4", result.groups[4]);
+}
+
+/**
+ * @test Verify groups are emitted as soon as they are complete
+ * @pre Feed one side entirely before the other, then interleave
+ * @post Rows are only held until their group can be emitted; keys are
+ * compared by collation rather than bytes
+ */
+TEST_F(MergejoinUnitTests, testStreaming)
+{
+    create(LCBEX_MERGEJOIN_F_LEFT_OUTER);
+
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_LEFT, "9", "a"));
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_LEFT, "10", "b"));
+    ASSERT_EQ(0, result.groups.size());
+
+    // 9 < 10 in collation order
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_RIGHT, "10", "x"));
+    ASSERT_EQ(1, result.groups.size());
+    ASSERT_EQ("9:a|", result.groups[0]);
+
+    // the right group for 10 may not be complete yet
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_LEFT, "11", "c"));
+    ASSERT_EQ(1, result.groups.size());
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_RIGHT, "10", "y"));
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_RIGHT, "12", "z"));
+    ASSERT_EQ(2, result.groups.size());
+    ASSERT_EQ("10:b|xy", result.groups[1]);
+    // more left rows for 11 may still arrive
+    ASSERT_EQ(1, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_LEFT));
+    ASSERT_EQ(1, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_RIGHT));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_mergejoin_side_done(join,
+                                                     LCBEX_MERGEJOIN_LEFT));
+    ASSERT_EQ(3, result.groups.size());
+    ASSERT_EQ("11:c|", result.groups[2]);
+    ASSERT_EQ(0, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_LEFT));
+    ASSERT_EQ(0, lcbex_mergejoin_buffered(join, LCBEX_MERGEJOIN_RIGHT));
+
+    lcbex_mergejoin_stats_t stats;
+    lcbex_mergejoin_get_stats(join, &stats);
+    ASSERT_EQ(3, stats.rows[LCBEX_MERGEJOIN_LEFT]);
+    ASSERT_EQ(3, stats.rows[LCBEX_MERGEJOIN_RIGHT]);
+    ASSERT_EQ(3, stats.groups);
+    ASSERT_EQ(5, stats.max_buffered);
+}
+
+/**
+ * @test Verify descending joins and order checking
+ * @pre Join descending streams, then feed a row out of order
+ * @post Groups are emitted in descending order; the out-of-order row is
+ * rejected with LCB_EINVAL
+ */
+TEST_F(MergejoinUnitTests, testDescending)
+{
+    const char *left[] = { "[2,\"b\"]=l1", "[1]=l2", NULL };
+    const char *right[] = { "[2,\"b\"]=r1", "[2,\"a\"]=r2", "[1]=r3", NULL };
+
+    create(LCBEX_MERGEJOIN_F_DESCENDING);
+    feed(left, right);
+    ASSERT_EQ(2, result.groups.size());
+    ASSERT_EQ("[2,\"b\"]:l1|r1", result.groups[0]);
+    ASSERT_EQ("[1]:l2|r3", result.groups[1]);
+
+    lcbex_mergejoin_destroy(join);
+    create(0);
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_LEFT, "2", "a"));
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_LEFT, "1", "b"));
+    ASSERT_EQ(LCB_EINVAL, add(2, "3", "c"));
+}
+
+/**
+ * @test Verify keys the server may order differently fail the join
+ * @pre Feed the server-ordered keys "a", "B", "c" to both sides
+ * @post "B" is refused, and the join fails for both sides instead of
+ * reporting the "B" rows as unmatched
+ * @pre Feed a key with a space
+ * @post It is refused
+ */
+TEST_F(MergejoinUnitTests, testCollation)
+{
+    create(LCBEX_MERGEJOIN_F_FULL_OUTER);
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_LEFT, "\"a\"", "l1"));
+    ASSERT_EQ(LCB_SUCCESS, add(LCBEX_MERGEJOIN_RIGHT, "\"a\"", "r1"));
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_LEFT, "\"B\"", "l2"));
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_RIGHT, "\"B\"", "r2"));
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_LEFT, "\"c\"", "l3"));
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_RIGHT, "\"c\"", "r3"));
+    ASSERT_EQ(LCB_EINVAL,
+              lcbex_mergejoin_side_done(join, LCBEX_MERGEJOIN_LEFT));
+    ASSERT_EQ(LCB_EINVAL,
+              lcbex_mergejoin_side_done(join, LCBEX_MERGEJOIN_RIGHT));
+    ASSERT_EQ(0, result.groups.size());
+
+    lcbex_mergejoin_destroy(join);
+    create(0);
+    ASSERT_EQ(LCB_EINVAL, add(LCBEX_MERGEJOIN_LEFT, "\"a b\"", "l1"));
+}
+
+/**
+ * @test Verify URI creation
+ * @pre Create URIs with compatible and incompatible options
+ * @post skip, limit, keys and a mismatched descending are rejected
+ */
+TEST_F(MergejoinUnitTests, testMakeUri)
+{
+    lcbex_vopt_t opts[2];
+    const lcbex_vopt_t *optlist[2] = { &opts[0], &opts[1] };
+    char *errstr, *uri;
+
+    create(0);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&opts[0], "startkey", -1,
+                                             "\"a\"", -1, 0, &errstr));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&opts[1], "limit", -1,
+                                             "10", -1, 0, &errstr));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_mergejoin_make_uri(join, "d", -1, "v", -1,
+                                                    optlist, 1, &uri));
+    ASSERT_STREQ("_design/d/_view/v?startkey=\"a\"", uri);
+    free(uri);
+    ASSERT_EQ(LCB_EINVAL, lcbex_mergejoin_make_uri(join, "d", -1, "v", -1,
+                                                   optlist, 2, &uri));
+    lcbex_vopt_cleanup(&opts[1]);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&opts[1], "descending", -1,
+                                             "true", -1, 0, &errstr));
+    ASSERT_EQ(LCB_EINVAL, lcbex_mergejoin_make_uri(join, "d", -1, "v", -1,
+                                                   optlist, 2, &uri));
+    lcbex_mergejoin_destroy(join);
+    create(LCBEX_MERGEJOIN_F_DESCENDING);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_mergejoin_make_uri(join, "d", -1, "v", -1,
+                                                    optlist, 2, &uri));
+    free(uri);
+
+    lcbex_vopt_cleanup(&opts[0]);
+    lcbex_vopt_cleanup(&opts[1]);
+}
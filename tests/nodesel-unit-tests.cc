@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+#include <lcbex/nodesel.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class NodeselUnitTests : public ::testing::Test
+{
+};
+
+typedef pair<lcb_uint64_t, size_t> pending_t;
+typedef priority_queue<pending_t, vector<pending_t>,
+                       greater<pending_t> > pending_queue;
+
+/**
+ * Sends a request every 'interval' ns for 'nreqs' requests; node i takes
+ * latencies[i] ns to answer. Returns the time after the last request.
+ */
+static lcb_uint64_t simulate(lcbex_nodesel_t *sel,
+                             const vector<lcb_uint64_t> &latencies,
+                             lcb_uint64_t start, lcb_uint64_t interval,
+                             int nreqs)
+{
+    pending_queue pending;
+    lcb_uint64_t now = start;
+
+    for (int ii = 0; ii < nreqs; ii++, now += interval) {
+        while (!pending.empty() && pending.top().first <= now) {
+            pending_t p = pending.top();
+            pending.pop();
+            lcbex_nodesel_done(sel, p.second, latencies[p.second], 0,
+                               p.first);
+        }
+        size_t node = lcbex_nodesel_pick(sel, now);
+        pending.push(make_pair(now + latencies[node], node));
+    }
+    while (!pending.empty()) {
+        pending_t p = pending.top();
+        pending.pop();
+        lcbex_nodesel_done(sel, p.second, latencies[p.second], 0, p.first);
+        now = max(now, p.first);
+    }
+    return now;
+}
+
+/**
+ * @test Verify that a slow node is avoided
+ * @pre Three nodes answer in 1ms and one in 50ms; send 20000 requests,
+ * one every 100us
+ * @post The slow node gets a small share of the requests, and the shares
+ * of the fast nodes are similar
+ */
+TEST_F(NodeselUnitTests, testSlowNode)
+{
+    lcbex_nodesel_t *sel;
+    lcbex_nodesel_stats_t stats;
+    vector<lcb_uint64_t> latencies(4, 1000000);
+    lcb_uint64_t total = 0;
+
+    latencies[3] = 50000000;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_create(&sel, 4, 0, 42));
+    simulate(sel, latencies, 1000, 100000, 20000);
+
+    for (size_t ii = 0; ii < 4; ii++) {
+        lcbex_nodesel_get_stats(sel, ii, &stats);
+        ASSERT_EQ(0, stats.inflight);
+        ASSERT_EQ(stats.selected, stats.completed);
+        ASSERT_EQ(latencies[ii], stats.latency);
+        if (ii < 3) {
+            ASSERT_GT(stats.share, 0.3);
+        } else {
+            ASSERT_LT(stats.share, 0.02);
+        }
+        total += stats.selected;
+    }
+    ASSERT_EQ(20000, total);
+    lcbex_nodesel_destroy(sel);
+}
+
+/**
+ * @test Verify selection by requests in flight
+ * @pre Pick 300 times from three nodes without completing anything
+ * @post Each node has 100 requests in flight
+ */
+TEST_F(NodeselUnitTests, testInflight)
+{
+    lcbex_nodesel_t *sel;
+    lcbex_nodesel_stats_t stats;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_create(&sel, 3, 0, 1));
+    for (int ii = 0; ii < 300; ii++) {
+        ASSERT_LT(lcbex_nodesel_pick(sel, 1000), 3);
+    }
+    for (size_t ii = 0; ii < 3; ii++) {
+        lcbex_nodesel_get_stats(sel, ii, &stats);
+        /* two choices keep the counts close, though not exactly even */
+        ASSERT_NEAR(100, stats.inflight, 5);
+        ASSERT_NEAR(1.0 / 3, stats.share, 0.02);
+    }
+    lcbex_nodesel_destroy(sel);
+}
+
+/**
+ * @test Verify recovery, failures and resizing
+ * @pre A node fails for a while and then answers quickly again; later a
+ * node is added and one removed
+ * @post The node's share drops while failing and recovers afterwards; the
+ * new node starts with the average latency; completions for a removed
+ * node are ignored
+ */
+TEST_F(NodeselUnitTests, testRecoveryAndResize)
+{
+    lcbex_nodesel_t *sel;
+    lcbex_nodesel_stats_t before, after;
+    vector<lcb_uint64_t> latencies(2, 1000000);
+    lcb_uint64_t now = 1000, mean;
+    size_t node;
+
+    /* 1 second time constant */
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_create(&sel, 2, 1000000000, 7));
+
+    /* node 1 fails: a penalty is recorded */
+    for (int ii = 0; ii < 10; ii++) {
+        node = lcbex_nodesel_pick(sel, now);
+        lcbex_nodesel_done(sel, node, 1000, node == 1, now);
+    }
+    lcbex_nodesel_get_stats(sel, 1, &before);
+    ASSERT_GT(before.errors, 0);
+    ASSERT_EQ(LCBEX_NODESEL_ERROR_PENALTY, before.latency);
+
+    now = simulate(sel, latencies, now, 100000, 1000);
+    lcbex_nodesel_get_stats(sel, 1, &after);
+    ASSERT_LT(after.selected - before.selected, 50);
+
+    /* after a few time constants it is tried again, and is fast; its
+     * average comes back down over the following time constants */
+    now = simulate(sel, latencies, now + 5000000000ULL, 100000, 30000);
+    lcbex_nodesel_get_stats(sel, 1, &before);
+    ASSERT_GT(before.selected - after.selected, 6000);
+    ASSERT_LT(before.latency, 1500000);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_resize(sel, 3));
+    lcbex_nodesel_get_stats(sel, 0, &after);
+    mean = (after.latency + before.latency) / 2;
+    lcbex_nodesel_get_stats(sel, 2, &after);
+    ASSERT_EQ(0, after.selected);
+    ASSERT_NEAR(mean, after.latency, 1);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_resize(sel, 1));
+    lcbex_nodesel_done(sel, 2, 1000, 0, now);
+    lcbex_nodesel_get_stats(sel, 2, &after);
+    ASSERT_EQ(0, after.selected);
+    ASSERT_EQ(0, lcbex_nodesel_pick(sel, now));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_nodesel_resize(sel, 0));
+    ASSERT_EQ(SIZE_MAX, lcbex_nodesel_pick(sel, now));
+    lcbex_nodesel_destroy(sel);
+}
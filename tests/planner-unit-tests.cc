@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+#include <lcbex/planner.h>
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+class PlannerUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_vopt_t *vopt_list;
+    lcbex_vopt_t *vopt_ptrs[16];
+    size_t nvopts;
+
+    virtual void SetUp() {
+        vopt_list = NULL;
+        nvopts = 0;
+    }
+
+    virtual void TearDown() {
+        if (vopt_list) {
+            lcbex_vopt_cleanup_list(&vopt_list, nvopts, 1);
+            free(vopt_list);
+        }
+    }
+
+    void setOptions(lcbex_vopt_t *list, size_t n) {
+        vopt_list = list;
+        nvopts = n;
+        for (size_t ii = 0; ii < n; ii++) {
+            vopt_ptrs[ii] = list + ii;
+        }
+    }
+
+    string partUri(const lcbex_plan_t *plan, size_t index) {
+        char *uri = lcbex_plan_make_part_uri(plan, index, "d", -1, "v", -1,
+                                             vopt_ptrs, nvopts);
+        EXPECT_FALSE(uri == NULL);
+        string ret = uri ? uri : "";
+        free(uri);
+        return ret;
+    }
+};
+
+/**
+ * @test Verify small queries run as a single request
+ * @pre Plan a limited query, and a reduce without grouping
+ * @post The SINGLE strategy is chosen
+ */
+TEST_F(PlannerUnitTests, testSingle)
+{
+    lcbex_vopt_t *list;
+    size_t n;
+    char *errstr;
+    lcbex_plan_t plan;
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv(&list, &n, &errstr,
+                                 "startkey", "0", "endkey", "1000000",
+                                 "reduce", "true", NULL));
+    setOptions(list, n);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, NULL, vopt_ptrs, nvopts, 5000000));
+    ASSERT_EQ(LCBEX_PLAN_SINGLE, plan.strategy);
+    ASSERT_EQ(1, plan.estimated_rows);
+    ASSERT_EQ(1, plan.nparts);
+    ASSERT_EQ("_design/d/_view/v?startkey=0&endkey=1000000&reduce=true",
+              partUri(&plan, 0));
+}
+
+/**
+ * @test Verify large numeric ranges are partitioned
+ * @pre Plan a reduce=false query over a numeric range of a large view
+ * @post The RANGE_PARTITIONED strategy is chosen, and partitions cover the
+ * range without overlapping
+ * @pre Partition a range whose bounds need an exponent
+ * @post The bounds are written without a '+'
+ */
+TEST_F(PlannerUnitTests, testRangePartitioned)
+{
+    lcbex_vopt_t *list;
+    size_t n;
+    char *errstr;
+    lcbex_plan_t plan;
+    lcbex_plan_config_t config;
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv(&list, &n, &errstr,
+                                 "startkey", "0", "endkey", "100",
+                                 "reduce", "false", NULL));
+    setOptions(list, n);
+
+    lcbex_plan_config_init(&config);
+    config.max_parallelism = 4;
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, &config, vopt_ptrs, nvopts, 20000));
+    ASSERT_EQ(LCBEX_PLAN_RANGE_PARTITIONED, plan.strategy);
+    ASSERT_EQ(4, plan.nparts);
+    ASSERT_EQ(4, plan.parallelism);
+
+    ASSERT_EQ("_design/d/_view/v?startkey=0&reduce=false&endkey=25"
+              "&inclusive_end=false", partUri(&plan, 0));
+    ASSERT_EQ("_design/d/_view/v?reduce=false&startkey=25&endkey=50"
+              "&inclusive_end=false", partUri(&plan, 1));
+    ASSERT_EQ("_design/d/_view/v?endkey=100&reduce=false&startkey=75",
+              partUri(&plan, 3));
+
+    double start, end;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_plan_get_part_range(&plan, 1, &start, &end));
+    ASSERT_EQ(25, start);
+    ASSERT_EQ(50, end);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_plan_get_part_range(&plan, 3, &start, &end));
+    ASSERT_EQ(75, start);
+    ASSERT_EQ(100, end);
+    ASSERT_EQ(LCB_EINVAL, lcbex_plan_get_part_range(&plan, 4, &start, &end));
+
+    // without a probe, the size is unknown and we don't split
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, &config, vopt_ptrs, nvopts, SIZE_MAX));
+    ASSERT_NE(LCBEX_PLAN_RANGE_PARTITIONED, plan.strategy);
+
+    // bounds must not be written with a '+' in the exponent
+    lcbex_vopt_cleanup(&list[1]);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&list[1], "endkey", -1, "4e20", -1, 0,
+                                &errstr));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, &config, vopt_ptrs, nvopts, 20000));
+    ASSERT_EQ("_design/d/_view/v?startkey=0&reduce=false&endkey=1e20"
+              "&inclusive_end=false", partUri(&plan, 0));
+}
+
+/**
+ * @test Verify large 'keys' queries are chunked
+ * @pre Plan a query with 1000 keys and a chunk size of 256
+ * @post KEYS_CHUNKED is chosen with 4 chunks; the last chunk contains the
+ * remaining keys
+ */
+TEST_F(PlannerUnitTests, testKeysChunked)
+{
+    lcbex_vopt_t *list;
+    size_t n;
+    char *errstr;
+    lcbex_plan_t plan;
+    string keys = "[";
+    char buf[32];
+
+    for (int ii = 0; ii < 1000; ii++) {
+        sprintf(buf, "%s[\"k\",%d]", ii ? "," : "", ii);
+        keys += buf;
+    }
+    keys += "]";
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv(&list, &n, &errstr,
+                                 "keys", keys.c_str(), "reduce", "false",
+                                 NULL));
+    setOptions(list, n);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, NULL, vopt_ptrs, nvopts, SIZE_MAX));
+    ASSERT_EQ(1000, plan.nkeys);
+    ASSERT_EQ(LCBEX_PLAN_KEYS_CHUNKED, plan.strategy);
+    ASSERT_EQ(4, plan.nparts);
+
+    string last = partUri(&plan, 3);
+    string expected = "_design/d/_view/v?reduce=false&keys=[[\"k\",768]";
+    ASSERT_EQ(0, last.compare(0, expected.size(), expected));
+    ASSERT_NE(string::npos, last.find(",[\"k\",999]]"));
+    ASSERT_EQ(string::npos, last.find("[\"k\",767]"));
+
+    char explain[512];
+    lcbex_plan_explain(&plan, explain, sizeof(explain));
+    ASSERT_NE((const char *)NULL, strstr(explain, "strategy: keys_chunked"));
+}
+
+/**
+ * @test Verify large unsplittable queries are paginated
+ * @pre Plan a query over a large view with no range
+ * @post PAGINATED is chosen; page URIs continue from the last row, with
+ * the document ID unescaped
+ * @pre Build a page URI from a malformed document ID
+ * @post NULL is returned
+ * @pre Plan a query with a limit larger than a single request
+ * @post It is not paginated, as the pages would return more rows than the
+ * limit
+ */
+TEST_F(PlannerUnitTests, testPaginated)
+{
+    lcbex_vopt_t *list;
+    size_t n;
+    char *errstr;
+    lcbex_plan_t plan;
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv(&list, &n, &errstr, "stale", "ok", NULL));
+    setOptions(list, n);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, NULL, vopt_ptrs, nvopts, 50000));
+    ASSERT_EQ(LCBEX_PLAN_PAGINATED, plan.strategy);
+    ASSERT_EQ(50, plan.nparts);
+
+    char *uri = lcbex_plan_make_page_uri(&plan, "d", -1, "v", -1,
+                                         vopt_ptrs, nvopts,
+                                         NULL, 0, NULL, 0);
+    ASSERT_STREQ("_design/d/_view/v?stale=ok&limit=1000", uri);
+    free(uri);
+
+    uri = lcbex_plan_make_page_uri(&plan, "d", -1, "v", -1,
+                                   vopt_ptrs, nvopts,
+                                   "[1,2]", 5, "\"doc 1\"", 7);
+    ASSERT_STREQ("_design/d/_view/v?stale=ok&limit=1000&skip=1"
+                 "&startkey=%5B1%2C2%5D&startkey_docid=doc%201", uri);
+    free(uri);
+
+    uri = lcbex_plan_make_page_uri(&plan, "d", -1, "v", -1,
+                                   vopt_ptrs, nvopts,
+                                   "3", 1, "\"a\\\"b\\u00e9\"", 12);
+    ASSERT_STREQ("_design/d/_view/v?stale=ok&limit=1000&skip=1"
+                 "&startkey=3&startkey_docid=a%22b%C3%A9", uri);
+    free(uri);
+
+    uri = lcbex_plan_make_page_uri(&plan, "d", -1, "v", -1,
+                                   vopt_ptrs, nvopts,
+                                   "3", 1, "\"a\\x\"", 5);
+    ASSERT_EQ((char *)NULL, uri);
+
+    lcbex_vopt_cleanup(&list[0]);
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&list[0], "limit", -1, "15500", -1, 0,
+                                &errstr));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, NULL, vopt_ptrs, nvopts, 50000));
+    ASSERT_EQ(LCBEX_PLAN_SINGLE, plan.strategy);
+    ASSERT_EQ(15500, plan.estimated_rows);
+    ASSERT_EQ(1, plan.nparts);
+}
@@ -0,0 +1,281 @@
+#include <gtest/gtest.h>
+#include <lcbex/prefetch.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class PrefetchUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_prefetch_t *pf;
+    lcbex_rcache_t *cache;
+
+    virtual void SetUp() {
+        pf = NULL;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 1 << 20));
+    }
+
+    virtual void TearDown() {
+        if (pf) {
+            lcbex_prefetch_destroy(pf);
+        }
+        lcbex_rcache_destroy(cache);
+    }
+
+    void create(unsigned int max_inflight = 2, size_t max_tracked = 256) {
+        lcbex_prefetch_config_t config;
+        lcbex_prefetch_config_init(&config);
+        config.max_inflight = max_inflight;
+        config.max_tracked = max_tracked;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_prefetch_create(&pf, &config));
+    }
+
+    /**
+     * Builds the options from "name", "value" pairs
+     */
+    void assign(vector<lcbex_vopt_t> &opts, const char *const *pairs,
+                int flags) {
+        char *errstr;
+        for (size_t ii = 0; pairs[ii]; ii += 2) {
+            lcbex_vopt_t opt;
+            memset(&opt, 0, sizeof(opt));
+            EXPECT_EQ(LCB_SUCCESS,
+                      lcbex_vopt_assign(&opt, pairs[ii], -1, pairs[ii + 1],
+                                        -1, flags, &errstr));
+            opts.push_back(opt);
+        }
+    }
+
+    /**
+     * Returns the URI the application builds for the options
+     */
+    string makeUri(const char *const *pairs, int flags = 0) {
+        vector<lcbex_vopt_t> opts;
+        vector<const lcbex_vopt_t *> ptrs;
+        assign(opts, pairs, flags);
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            ptrs.push_back(&opts[ii]);
+        }
+        char *uri = lcbex_vqstr_make_uri("d", -1, "v", -1, &ptrs[0],
+                                         ptrs.size());
+        string ret(uri);
+        free(uri);
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            lcbex_vopt_cleanup(&opts[ii]);
+        }
+        return ret;
+    }
+
+    void observe(const char *const *pairs, int flags = 0) {
+        vector<lcbex_vopt_t> opts;
+        vector<const lcbex_vopt_t *> ptrs;
+        assign(opts, pairs, flags);
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            ptrs.push_back(&opts[ii]);
+        }
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_prefetch_observe(pf, "d", -1, "v", -1, &ptrs[0],
+                                         ptrs.size(), 0));
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            lcbex_vopt_cleanup(&opts[ii]);
+        }
+    }
+
+    void observeSkip(const char *skip) {
+        const char *pairs[] = { "limit", "20", "skip", skip, NULL };
+        observe(pairs);
+    }
+
+    lcbex_rowblock_t *buildBlock() {
+        lcbex_rowblock_builder_t *builder;
+        lcbex_rowblock_t *block;
+        lcbex_vrow_t vrow;
+
+        memset(&vrow, 0, sizeof(vrow));
+        vrow.key = "1";
+        vrow.nkey = 1;
+        vrow.id = "\"doc\"";
+        vrow.nid = 5;
+        vrow.value = "null";
+        vrow.nvalue = 4;
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_create(&builder, 0, 0));
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_add(builder, &vrow));
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_finish(builder, &block));
+        lcbex_rowblock_builder_destroy(builder);
+        return block;
+    }
+
+    /**
+     * Takes the next prefetch and completes it
+     * @return its URI, or an empty string if there was none
+     */
+    string fetchNext() {
+        lcb_uint64_t id;
+        size_t nuri;
+        const char *uri = lcbex_prefetch_next(pf, &id, &nuri);
+        if (!uri) {
+            return "";
+        }
+        string ret(uri, nuri);
+        EXPECT_EQ(LCB_SUCCESS, lcbex_prefetch_done(pf, id, cache, LCB_SUCCESS,
+                                                   buildBlock(), 0));
+        return ret;
+    }
+};
+
+/**
+ * @test Verify prefetching of the next page
+ * @pre Query skip=0, 20 and 40
+ * @post Nothing is predicted after two queries; skip=60 is predicted after
+ * the third, and its result is stored in the cache under the URI the
+ * application builds
+ *
+ * @pre Query skip=60
+ * @post It is counted as a hit, and skip=80 is predicted
+ */
+TEST_F(PrefetchUnitTests, testNextPage)
+{
+    lcbex_prefetch_stats_t stats;
+    const char *page4[] = { "limit", "20", "skip", "60", NULL };
+    const char *page5[] = { "limit", "20", "skip", "80", NULL };
+    string uri;
+
+    create();
+    observeSkip("0");
+    observeSkip("20");
+    ASSERT_EQ("", fetchNext());
+
+    observeSkip("40");
+    uri = fetchNext();
+    ASSERT_EQ(makeUri(page4), uri);
+    ASSERT_EQ("_design/d/_view/v?limit=20&skip=60", uri);
+    ASSERT_TRUE(lcbex_rcache_get(cache, uri.c_str(), -1, 0) != NULL);
+
+    observeSkip("60");
+    ASSERT_EQ(makeUri(page5), fetchNext());
+
+    lcbex_prefetch_get_stats(pf, &stats);
+    ASSERT_EQ(4, stats.observed);
+    ASSERT_EQ(2, stats.predicted);
+    ASSERT_EQ(2, stats.issued);
+    ASSERT_EQ(2, stats.completed);
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(0.5, stats.hit_rate);
+
+    /* paging backwards stops at the first page */
+    observeSkip("40");
+    observeSkip("20");
+    observeSkip("0");
+    lcbex_prefetch_get_stats(pf, &stats);
+    ASSERT_EQ(3, stats.predicted);
+}
+
+/**
+ * @test Verify prefetching of adjacent key ranges
+ * @pre Query percent-encoded ranges of [2014,m] to [2014,m+1] for months
+ * 3, 4 and 5, interleaved with queries of another stream
+ * @post The range of month 6 is predicted, encoded as the application
+ * encodes it
+ *
+ * @pre Query months 1, 3 and 4
+ * @post Uneven steps predict nothing
+ */
+TEST_F(PrefetchUnitTests, testKeyRanges)
+{
+    const char *m3[] = { "startkey", "[2014,3]", "endkey", "[2014,4]", NULL };
+    const char *m4[] = { "startkey", "[2014,4]", "endkey", "[2014,5]", NULL };
+    const char *m5[] = { "startkey", "[2014,5]", "endkey", "[2014,6]", NULL };
+    const char *m6[] = { "startkey", "[2014,6]", "endkey", "[2014,7]", NULL };
+    const char *m1[] = { "startkey", "[2014,1]", "endkey", "[2014,2]", NULL };
+    const char *other[] = { "startkey", "\"a\"", NULL };
+    string uri;
+
+    create();
+    observe(m3, LCBEX_VOPT_F_PCTENCODE);
+    observe(other);
+    observe(m4, LCBEX_VOPT_F_PCTENCODE);
+    observe(other);
+    observe(m5, LCBEX_VOPT_F_PCTENCODE);
+
+    uri = fetchNext();
+    ASSERT_EQ(makeUri(m6, LCBEX_VOPT_F_PCTENCODE), uri);
+    ASSERT_NE(string::npos, uri.find("%5B2014%2C6%5D"));
+
+    observe(m1, LCBEX_VOPT_F_PCTENCODE);
+    observe(m3, LCBEX_VOPT_F_PCTENCODE);
+    observe(m4, LCBEX_VOPT_F_PCTENCODE);
+    ASSERT_EQ("", fetchNext());
+}
+
+/**
+ * @test Verify prefetching of key ranges assigned as passthrough options
+ * @pre Query percent-encoded passthrough ranges for months 3, 4 and 5
+ * @post The range of month 6 is predicted, encoded as the application
+ * encodes it
+ */
+TEST_F(PrefetchUnitTests, testKeyRangesPassthrough)
+{
+    const char *m3[] = { "startkey", "[2014,3]", "endkey", "[2014,4]", NULL };
+    const char *m4[] = { "startkey", "[2014,4]", "endkey", "[2014,5]", NULL };
+    const char *m5[] = { "startkey", "[2014,5]", "endkey", "[2014,6]", NULL };
+    const char *m6[] = { "startkey", "[2014,6]", "endkey", "[2014,7]", NULL };
+    int flags = LCBEX_VOPT_F_PASSTHROUGH | LCBEX_VOPT_F_PCTENCODE;
+    string uri;
+
+    create();
+    observe(m3, flags);
+    observe(m4, flags);
+    observe(m5, flags);
+
+    uri = fetchNext();
+    ASSERT_EQ(makeUri(m6, flags), uri);
+    ASSERT_NE(string::npos, uri.find("%5B2014%2C6%5D"));
+}
+
+/**
+ * @test Verify the prefetch limits and accounting
+ * @pre Allow one prefetch in flight, and predict two pages
+ * @post Only one prefetch is handed out until it completes; an
+ * application query of it while in flight counts as late
+ *
+ * @pre Track a single prefetched result, and complete two
+ * @post The first is counted as wasted
+ */
+TEST_F(PrefetchUnitTests, testLimits)
+{
+    lcbex_prefetch_stats_t stats;
+    lcb_uint64_t id, id2;
+    const char *uri;
+
+    create(1, 1);
+    observeSkip("0");
+    observeSkip("10");
+    observeSkip("20");
+    observeSkip("50");
+    observeSkip("80");
+
+    uri = lcbex_prefetch_next(pf, &id, NULL);
+    ASSERT_STREQ("_design/d/_view/v?limit=20&skip=110", uri);
+    ASSERT_TRUE(lcbex_prefetch_next(pf, &id2, NULL) == NULL);
+    lcbex_prefetch_get_stats(pf, &stats);
+    ASSERT_EQ(1, stats.pending);
+    ASSERT_EQ(1, stats.inflight);
+
+    observeSkip("110");
+    ASSERT_EQ(LCB_KEY_ENOENT, lcbex_prefetch_done(pf, id + 1, cache,
+                                                  LCB_SUCCESS, NULL, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_prefetch_done(pf, id, cache, LCB_ETIMEDOUT,
+                                               NULL, 0));
+
+    /* skip=140 was predicted by the query of skip=110 */
+    ASSERT_EQ("_design/d/_view/v?limit=20&skip=140", fetchNext());
+    ASSERT_EQ("_design/d/_view/v?limit=20&skip=30", fetchNext());
+
+    lcbex_prefetch_get_stats(pf, &stats);
+    ASSERT_EQ(1, stats.late);
+    ASSERT_EQ(1, stats.failed);
+    ASSERT_EQ(2, stats.completed);
+    ASSERT_EQ(1, stats.wasted);
+    ASSERT_EQ(0, stats.hits);
+}
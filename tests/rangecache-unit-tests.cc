@@ -0,0 +1,461 @@
+#include <gtest/gtest.h>
+#include <lcbex/rangecache.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RangecacheUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_rangecache_t *cache;
+    vector<lcbex_vopt_t> opts;
+
+    virtual void SetUp() {
+        cache = NULL;
+    }
+
+    virtual void TearDown() {
+        clearOptions();
+        if (cache) {
+            lcbex_rangecache_destroy(cache);
+        }
+    }
+
+    void clearOptions() {
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            lcbex_vopt_cleanup(&opts[ii]);
+        }
+        opts.clear();
+    }
+
+    void addOption(const char *name, const char *value, int flags = 0) {
+        lcbex_vopt_t opt;
+        char *errstr;
+        memset(&opt, 0, sizeof(opt));
+        ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&opt, name, -1, value, -1,
+                                                 flags, &errstr));
+        opts.push_back(opt);
+    }
+
+    /**
+     * Sets the options to a range; NULL for an unbounded end
+     */
+    void setRange(const char *start, const char *end) {
+        clearOptions();
+        addOption("reduce", "false");
+        if (start) {
+            addOption("startkey", start);
+        }
+        if (end) {
+            addOption("endkey", end);
+        }
+    }
+
+    lcb_error_t lookup(lcbex_rangecache_req_t **req, lcb_uint64_t now = 0) {
+        vector<const lcbex_vopt_t *> ptrs;
+        for (size_t ii = 0; ii < opts.size(); ii++) {
+            ptrs.push_back(&opts[ii]);
+        }
+        return lcbex_rangecache_lookup(cache, "d", -1, "v", -1,
+                                       ptrs.empty() ? NULL : &ptrs[0],
+                                       ptrs.size(), now, req);
+    }
+
+    /**
+     * Builds a block of rows with the keys first..last, and a second row
+     * at each key divisible by 10
+     */
+    lcbex_rowblock_t *buildBlock(int first, int last) {
+        lcbex_rowblock_builder_t *builder;
+        lcbex_rowblock_t *block;
+        char keybuf[32], idbuf[32];
+
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_create(&builder, 0, 0));
+        for (int ii = first; ii <= last; ii++) {
+            for (int jj = 0; jj < (ii % 10 ? 1 : 2); jj++) {
+                lcbex_vrow_t vrow;
+                memset(&vrow, 0, sizeof(vrow));
+                sprintf(keybuf, "%d", ii);
+                sprintf(idbuf, "\"doc%d_%d\"", ii, jj);
+                vrow.key = keybuf;
+                vrow.nkey = strlen(keybuf);
+                vrow.id = idbuf;
+                vrow.nid = strlen(idbuf);
+                vrow.value = "null";
+                vrow.nvalue = 4;
+                EXPECT_EQ(LCB_SUCCESS,
+                          lcbex_rowblock_builder_add(builder, &vrow));
+            }
+        }
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_finish(builder, &block));
+        lcbex_rowblock_builder_destroy(builder);
+        return block;
+    }
+
+    /**
+     * Builds a block with one row for each of the given JSON keys
+     */
+    lcbex_rowblock_t *buildKeyBlock(const char **keys, size_t nkeys) {
+        lcbex_rowblock_builder_t *builder;
+        lcbex_rowblock_t *block;
+
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_create(&builder, 0, 0));
+        for (size_t ii = 0; ii < nkeys; ii++) {
+            lcbex_vrow_t vrow;
+            memset(&vrow, 0, sizeof(vrow));
+            vrow.key = keys[ii];
+            vrow.nkey = strlen(keys[ii]);
+            vrow.id = "\"doc\"";
+            vrow.nid = 5;
+            vrow.value = "null";
+            vrow.nvalue = 4;
+            EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_add(builder, &vrow));
+        }
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_finish(builder, &block));
+        lcbex_rowblock_builder_destroy(builder);
+        return block;
+    }
+
+    /**
+     * Returns the rows as "key/id" strings
+     */
+    vector<string> rows(const lcbex_rowblock_t *block) {
+        vector<string> ret;
+        lcbex_rowblock_iter_t iter;
+        const lcbex_vrow_t *row;
+        lcbex_rowblock_iter_init(&iter, block);
+        while (lcbex_rowblock_iter_next(&iter, &row)) {
+            ret.push_back(string(row->key, row->nkey) + "/" +
+                          string(row->id, row->nid));
+        }
+        lcbex_rowblock_iter_cleanup(&iter);
+        return ret;
+    }
+
+    /**
+     * Runs a range query, filling each gap with rows first..last
+     * @return the rows
+     */
+    vector<string> query(const char *start, const char *end,
+                         const int *gaps, size_t ngaps) {
+        lcbex_rangecache_req_t *req;
+        const lcbex_rowblock_t *result;
+        vector<string> ret;
+
+        setRange(start, end);
+        EXPECT_EQ(LCB_SUCCESS, lookup(&req));
+        EXPECT_EQ(ngaps, lcbex_rangecache_req_ngaps(req));
+        for (size_t ii = 0; ii < ngaps; ii++) {
+            EXPECT_EQ(LCB_SUCCESS, lcbex_rangecache_req_fill(
+                          req, ii, buildBlock(gaps[ii * 2], gaps[ii * 2 + 1])));
+        }
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 0, &result));
+        ret = rows(result);
+        lcbex_rangecache_req_destroy(req);
+        return ret;
+    }
+};
+
+/**
+ * @test Verify sub-ranges and gaps
+ * @pre Cache the range 10..20, then query 12..15
+ * @post The sub-range is answered from the cache
+ *
+ * @pre Query 5..25
+ * @post Only 5..10 (excluding 10) and 20..25 are queried; the rows at the
+ * exclusive bound 20 are not repeated, and the ranges join into one
+ * interval
+ *
+ * @pre Cache 0..3 and 30.., then query everything
+ * @post The three gaps between the intervals are queried, and the rows are
+ * in key order
+ */
+TEST_F(RangecacheUnitTests, testGaps)
+{
+    lcbex_rangecache_req_t *req;
+    lcbex_rangecache_stats_t stats;
+    vector<string> result;
+    int gap1[] = { 10, 20 };
+    int gap2[] = { 5, 9, 20, 25 };
+    int gap3[] = { 0, 3 };
+    int gap4[] = { 30, 40 };
+    int gap5[] = { -5, -1, 4, 4, 26, 29 };
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_create(&cache, 1 << 20, 0));
+
+    setRange("10", "20");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    ASSERT_STREQ("_design/d/_view/v?reduce=false&startkey=10&endkey=20"
+                 "&inclusive_end=true",
+                 lcbex_rangecache_req_gap_uri(req, 0));
+    lcbex_rangecache_req_destroy(req);
+
+    result = query("10", "20", gap1, 1);
+    ASSERT_EQ(13, result.size());
+    ASSERT_EQ("10/\"doc10_0\"", result[0]);
+    ASSERT_EQ("20/\"doc20_1\"", result[12]);
+
+    result = query("12", "15", NULL, 0);
+    ASSERT_EQ(4, result.size());
+    ASSERT_EQ("12/\"doc12_0\"", result[0]);
+
+    setRange("5", "25");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(2, lcbex_rangecache_req_ngaps(req));
+    ASSERT_STREQ("_design/d/_view/v?reduce=false&startkey=5&endkey=10"
+                 "&inclusive_end=false",
+                 lcbex_rangecache_req_gap_uri(req, 0));
+    ASSERT_STREQ("_design/d/_view/v?reduce=false&startkey=20&endkey=25"
+                 "&inclusive_end=true",
+                 lcbex_rangecache_req_gap_uri(req, 1));
+    lcbex_rangecache_req_destroy(req);
+
+    result = query("5", "25", gap2, 2);
+    ASSERT_EQ(23, result.size());
+    ASSERT_EQ("5/\"doc5_0\"", result[0]);
+    ASSERT_EQ("20/\"doc20_1\"", result[17]);
+    ASSERT_EQ("21/\"doc21_0\"", result[18]);
+
+    lcbex_rangecache_get_stats(cache, &stats);
+    ASSERT_EQ(1, stats.intervals);
+    /* the lookups without queries count too */
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(2, stats.partial);
+    ASSERT_EQ(2, stats.misses);
+    ASSERT_EQ(4 + 13, stats.rows_cached);
+
+    query("0", "3", gap3, 1);
+    query("30", NULL, gap4, 1);
+
+    setRange(NULL, NULL);
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(3, lcbex_rangecache_req_ngaps(req));
+    ASSERT_STREQ("_design/d/_view/v?reduce=false&endkey=0"
+                 "&inclusive_end=false",
+                 lcbex_rangecache_req_gap_uri(req, 0));
+    lcbex_rangecache_req_destroy(req);
+
+    result = query(NULL, NULL, gap5, 3);
+    ASSERT_EQ(46 + 5, result.size());
+    for (size_t ii = 1; ii < result.size(); ii++) {
+        ASSERT_LE(atoi(result[ii - 1].c_str()), atoi(result[ii].c_str()));
+    }
+
+    lcbex_rangecache_get_stats(cache, &stats);
+    ASSERT_EQ(1, stats.intervals);
+}
+
+/**
+ * @test Verify refused queries, shapes and invalidation
+ * @pre Look up queries with limit, descending=true and reduce=true
+ * @post They are refused; reduce=true with group=true is accepted
+ *
+ * @pre Cache a range, and query a sub-range with the options reordered
+ * @post It is the same shape, and hits
+ *
+ * @pre Query the range with another stale value
+ * @post The other shape misses
+ *
+ * @pre Start a query, invalidate the design document, and finish it
+ * @post The intervals are dropped and the query's rows are not cached
+ */
+TEST_F(RangecacheUnitTests, testShapes)
+{
+    lcbex_rangecache_req_t *req;
+    lcbex_rangecache_stats_t stats;
+    const lcbex_rowblock_t *result;
+    int gap[] = { 1, 5 };
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_create(&cache, 1 << 20, 0));
+
+    setRange("1", "5");
+    addOption("limit", "10");
+    ASSERT_EQ(LCB_EINVAL, lookup(&req));
+    setRange("1", "5");
+    addOption("descending", "true");
+    ASSERT_EQ(LCB_EINVAL, lookup(&req));
+    clearOptions();
+    addOption("reduce", "true");
+    ASSERT_EQ(LCB_EINVAL, lookup(&req));
+    addOption("group", "true");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    lcbex_rangecache_req_destroy(req);
+
+    query("1", "5", gap, 1);
+    clearOptions();
+    addOption("endkey", "5");
+    addOption("startkey", "2");
+    addOption("reduce", "false");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(0, lcbex_rangecache_req_ngaps(req));
+    lcbex_rangecache_req_destroy(req);
+
+    setRange("1", "5");
+    addOption("stale", "ok");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_fill(req, 0,
+                                                     buildBlock(1, 5)));
+    ASSERT_EQ(LCB_EINVAL, lcbex_rangecache_req_fill(req, 0, NULL));
+    ASSERT_EQ(LCB_EINVAL, lcbex_rangecache_req_fill(req, 1, NULL));
+
+    ASSERT_EQ(1, lcbex_rangecache_invalidate(cache, "d", -1));
+    ASSERT_EQ(0, lcbex_rangecache_invalidate(cache, "other", -1));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 0, &result));
+    ASSERT_EQ(5, lcbex_rowblock_nrows(result));
+    lcbex_rangecache_req_destroy(req);
+
+    lcbex_rangecache_get_stats(cache, &stats);
+    ASSERT_EQ(0, stats.intervals);
+    ASSERT_EQ(0, stats.memory);
+}
+
+/**
+ * @test Verify keys are limited to those ordered as the server does
+ * @pre Look up ranges bounded by strings with spaces, accents, mixed case,
+ * and objects
+ * @post They are refused
+ *
+ * @pre Cache a range of lowercase strings, then look up an uppercase range
+ * @post The uppercase range is refused, as its keys would not order
+ * consistently with the cached ones
+ *
+ * @pre Look up a cached range with percent-encoded passthrough bounds
+ * @post The bounds are decoded, and the range hits
+ *
+ * @pre Fill the gap of a numeric range with rows keyed by mixed-case
+ * strings
+ * @post The rows are refused
+ */
+TEST_F(RangecacheUnitTests, testCollation)
+{
+    static const char *refused[][2] = {
+        { "\"a b\"", "\"c\"" },
+        { "\"caf\u00e9\"", "\"d\"" },
+        { "\"Abc\"", "\"abd\"" },
+        { "[1,\"x\"]", "[1,\"X\"]" },
+        { "{\"a\":1}", NULL }
+    };
+    static const char *lower[] = { "\"apple\"", "\"banana\"", "\"cherry1\"" };
+    static const char *mixed[] = { "150", "\"Hello\"", "\"hello\"" };
+    lcbex_rangecache_req_t *req;
+    const lcbex_rowblock_t *result;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_create(&cache, 1 << 20, 0));
+
+    for (size_t ii = 0; ii < sizeof(refused) / sizeof(refused[0]); ii++) {
+        setRange(refused[ii][0], refused[ii][1]);
+        ASSERT_EQ(LCB_EINVAL, lookup(&req)) << refused[ii][0];
+    }
+
+    setRange("\"a\"", "\"d\"");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_rangecache_req_fill(req, 0, buildKeyBlock(lower, 3)));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 0, &result));
+    lcbex_rangecache_req_destroy(req);
+
+    setRange("\"b\"", "\"c\"");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(0, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 0, &result));
+    ASSERT_EQ(1, lcbex_rowblock_nrows(result));
+    lcbex_rangecache_req_destroy(req);
+
+    setRange("\"B\"", "\"C\"");
+    ASSERT_EQ(LCB_EINVAL, lookup(&req));
+
+    clearOptions();
+    addOption("reduce", "false");
+    addOption("startkey", "\"b\"",
+              LCBEX_VOPT_F_PASSTHROUGH | LCBEX_VOPT_F_PCTENCODE);
+    addOption("endkey", "\"c\"",
+              LCBEX_VOPT_F_PASSTHROUGH | LCBEX_VOPT_F_PCTENCODE);
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    ASSERT_EQ(0, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 0, &result));
+    ASSERT_EQ(1, lcbex_rowblock_nrows(result));
+    lcbex_rangecache_req_destroy(req);
+
+    setRange("100", "200");
+    addOption("stale", "ok");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req));
+    lcbex_rowblock_t *block = buildKeyBlock(mixed, 3);
+    ASSERT_EQ(LCB_EINVAL, lcbex_rangecache_req_fill(req, 0, block));
+    lcbex_rowblock_free(block);
+    lcbex_rangecache_req_destroy(req);
+}
+
+/**
+ * @test Verify expiry and eviction
+ * @pre Cache a range with a time to live of 100ns, and look it up at 100
+ * @post It has expired
+ *
+ * @pre Cache a range at 0, extend it with a lookup at 99 which is
+ * finished at 150, and look up a part of the original range at 240
+ * @post The reused rows expire with the range they came from
+ *
+ * @pre Cache three ranges in a cache with room for two, using the first
+ * before adding the third
+ * @post The second range is evicted
+ */
+TEST_F(RangecacheUnitTests, testExpiry)
+{
+    lcbex_rangecache_req_t *req;
+    lcbex_rangecache_stats_t stats;
+    const lcbex_rowblock_t *result;
+    int gap1[] = { 0, 9 };
+    int gap2[] = { 20, 29 };
+    int gap3[] = { 40, 49 };
+    size_t memory;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_create(&cache, 1 << 20, 100));
+    query("0", "9", gap1, 1);
+    lcbex_rangecache_get_stats(cache, &stats);
+    memory = stats.memory;
+
+    setRange("0", "9");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req, 99));
+    ASSERT_EQ(0, lcbex_rangecache_req_ngaps(req));
+    lcbex_rangecache_req_destroy(req);
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req, 100));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_EINVAL, lcbex_rangecache_req_finish(req, 100, &result));
+    lcbex_rangecache_req_destroy(req);
+    lcbex_rangecache_get_stats(cache, &stats);
+    ASSERT_EQ(1, stats.expired);
+
+    query("0", "9", gap1, 1);
+    setRange("0", "19");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req, 99));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_rangecache_req_fill(req, 0, buildBlock(10, 19)));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_req_finish(req, 150, &result));
+    ASSERT_EQ(22, rows(result).size());
+    lcbex_rangecache_req_destroy(req);
+    setRange("0", "5");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req, 240));
+    ASSERT_EQ(1, lcbex_rangecache_req_ngaps(req));
+    lcbex_rangecache_req_destroy(req);
+    lcbex_rangecache_destroy(cache);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rangecache_create(&cache,
+                                                   memory * 5 / 2, 0));
+    query("0", "9", gap1, 1);
+    query("20", "29", gap2, 1);
+    setRange("0", "9");
+    ASSERT_EQ(LCB_SUCCESS, lookup(&req, 10));
+    lcbex_rangecache_req_destroy(req);
+    query("40", "49", gap3, 1);
+
+    lcbex_rangecache_get_stats(cache, &stats);
+    ASSERT_EQ(1, stats.evicted);
+    ASSERT_EQ(2, stats.intervals);
+    query("0", "9", NULL, 0);
+    query("20", "29", gap2, 1);
+}
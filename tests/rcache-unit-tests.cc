@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+#include <lcbex/rcache.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RcacheUnitTests : public ::testing::Test
+{
+protected:
+    /**
+     * Builds a block with a row for each document ID, or a single reduced
+     * row if there are none
+     */
+    lcbex_rowblock_t *buildBlock(const vector<string> &ids) {
+        lcbex_rowblock_builder_t *builder;
+        lcbex_rowblock_t *block;
+        char keybuf[32];
+
+        EXPECT_EQ(LCB_SUCCESS,
+                  lcbex_rowblock_builder_create(&builder, 0, 0));
+        for (size_t ii = 0; ii < ids.size() || ii == 0; ii++) {
+            lcbex_vrow_t vrow;
+            memset(&vrow, 0, sizeof(vrow));
+            sprintf(keybuf, "%d", (int)ii);
+            vrow.key = keybuf;
+            vrow.nkey = strlen(keybuf);
+            if (!ids.empty()) {
+                vrow.id = ids[ii].c_str();
+                vrow.nid = ids[ii].size();
+            }
+            vrow.value = "1";
+            vrow.nvalue = 1;
+            EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_add(builder, &vrow));
+        }
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_finish(builder, &block));
+        lcbex_rowblock_builder_destroy(builder);
+        return block;
+    }
+
+    vector<string> docs(const char *a, const char *b = NULL,
+                        const char *c = NULL) {
+        vector<string> ret;
+        ret.push_back(a);
+        if (b) {
+            ret.push_back(b);
+        }
+        if (c) {
+            ret.push_back(c);
+        }
+        return ret;
+    }
+};
+
+/**
+ * @test Verify invalidation by document ID
+ * @pre Cache three results sharing some documents, and a reduced result;
+ * report mutations of documents
+ * @post Exactly the results containing the document (and the reduced
+ * result) are dropped; escaped IDs match their raw form
+ */
+TEST_F(RcacheUnitTests, testInvalidate)
+{
+    lcbex_rcache_t *cache;
+    lcbex_rcache_stats_t stats;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 1 << 20));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q1", -1,
+              buildBlock(docs("\"a\"", "\"b\"", "\"b\"")), 0, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q2", -1,
+              buildBlock(docs("\"b\"", "\"c\"")), 0, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q3", -1,
+              buildBlock(docs("\"say \\\"hi\\\"\"")), 0, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "reduce", -1,
+              buildBlock(vector<string>()), 0, 0));
+
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q1", -1, 0) != NULL);
+    ASSERT_EQ(3, lcbex_rowblock_nrows(lcbex_rcache_get(cache, "q1", 2, 0)));
+
+    /* an unknown document only drops the reduced result */
+    ASSERT_EQ(1, lcbex_rcache_invalidate(cache, "zzz", -1));
+    ASSERT_TRUE(lcbex_rcache_get(cache, "reduce", -1, 0) == NULL);
+
+    ASSERT_EQ(2, lcbex_rcache_invalidate(cache, "b", -1));
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q1", -1, 0) == NULL);
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q2", -1, 0) == NULL);
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q3", -1, 0) != NULL);
+    ASSERT_EQ(0, lcbex_rcache_invalidate(cache, "a", -1));
+
+    ASSERT_EQ(1, lcbex_rcache_invalidate(cache, "say \"hi\"", -1));
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q3", -1, 0) == NULL);
+
+    lcbex_rcache_get_stats(cache, &stats);
+    ASSERT_EQ(0, stats.entries);
+    ASSERT_EQ(0, stats.memory);
+    ASSERT_EQ(4, stats.invalidated);
+    ASSERT_EQ(3, stats.hits);
+    ASSERT_EQ(4, stats.misses);
+    lcbex_rcache_destroy(cache);
+}
+
+/**
+ * @test Verify expiry, replacement and the memory limit
+ * @pre Cache results with and without a TTL, replace one, and add more
+ * than fit
+ * @post Expired results miss; a replaced result is no longer invalidated
+ * by its old documents; the least recently used results are evicted
+ */
+TEST_F(RcacheUnitTests, testExpiryAndEviction)
+{
+    lcbex_rcache_t *cache;
+    lcbex_rcache_stats_t stats;
+    lcbex_rowblock_t *block;
+    char uri[32], id[32];
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 1 << 20));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "ttl", -1,
+              buildBlock(docs("\"a\"")), 100, 1000));
+    ASSERT_TRUE(lcbex_rcache_get(cache, "ttl", -1, 1099) != NULL);
+    ASSERT_TRUE(lcbex_rcache_get(cache, "ttl", -1, 1100) == NULL);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q", -1,
+              buildBlock(docs("\"a\"")), 0, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q", -1,
+              buildBlock(docs("\"b\"")), 0, 0));
+    ASSERT_EQ(0, lcbex_rcache_invalidate(cache, "a", -1));
+    ASSERT_EQ(1, lcbex_rcache_invalidate(cache, "b", -1));
+    ASSERT_EQ(0, lcbex_rcache_remove(cache, "q", -1));
+
+    lcbex_rcache_get_stats(cache, &stats);
+    ASSERT_EQ(1, stats.expired);
+    ASSERT_EQ(0, stats.entries);
+    lcbex_rcache_destroy(cache);
+
+    block = buildBlock(docs("\"doc000\""));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 1));
+    ASSERT_EQ(LCB_E2BIG, lcbex_rcache_put(cache, "q000", -1, block, 0, 0));
+    lcbex_rcache_destroy(cache);
+
+    /* room for ten results like this one */
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 1 << 20));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, "q000", -1, block, 0, 0));
+    lcbex_rcache_get_stats(cache, &stats);
+    lcbex_rcache_destroy(cache);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, stats.memory * 10));
+
+    for (int ii = 0; ii < 1000; ii++) {
+        sprintf(uri, "q%03d", ii);
+        sprintf(id, "\"doc%03d\"", ii);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, uri, -1,
+                  buildBlock(docs(id)), 0, 0));
+        /* keep the first result in use */
+        ASSERT_TRUE(lcbex_rcache_get(cache, "q000", -1, 0) != NULL);
+    }
+
+    lcbex_rcache_get_stats(cache, &stats);
+    ASSERT_EQ(10, stats.entries);
+    ASSERT_EQ(990, stats.evicted);
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q999", -1, 0) != NULL);
+    ASSERT_TRUE(lcbex_rcache_get(cache, "q990", -1, 0) == NULL);
+    ASSERT_EQ(0, lcbex_rcache_invalidate(cache, "doc005", -1));
+    ASSERT_EQ(1, lcbex_rcache_invalidate(cache, "doc000", -1));
+    ASSERT_EQ(1, lcbex_rcache_invalidate(cache, "doc995", -1));
+    lcbex_rcache_destroy(cache);
+}
+
+/**
+ * @test Verify the index with many documents and results
+ * @pre Cache 200 results of 50 documents each, overlapping, then
+ * invalidate every document
+ * @post Each invalidation drops the results containing the document, and
+ * the cache ends up empty
+ */
+TEST_F(RcacheUnitTests, testManyDocuments)
+{
+    lcbex_rcache_t *cache;
+    lcbex_rcache_stats_t stats;
+    char buf[32];
+    size_t total = 0;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_create(&cache, 64 << 20));
+    for (int ii = 0; ii < 200; ii++) {
+        vector<string> ids;
+        for (int jj = 0; jj < 50; jj++) {
+            sprintf(buf, "\"doc%d\"", ii * 10 + jj);
+            ids.push_back(buf);
+        }
+        sprintf(buf, "q%d", ii);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_rcache_put(cache, buf, -1,
+                                                buildBlock(ids), 0, 0));
+    }
+
+    /* doc 100 is in results 6..10 */
+    ASSERT_EQ(5, lcbex_rcache_invalidate(cache, "doc100", -1));
+    total += 5;
+    for (int ii = 0; ii < 2040; ii++) {
+        sprintf(buf, "doc%d", ii);
+        total += lcbex_rcache_invalidate(cache, buf, -1);
+    }
+    ASSERT_EQ(200, total);
+
+    lcbex_rcache_get_stats(cache, &stats);
+    ASSERT_EQ(0, stats.entries);
+    ASSERT_EQ(0, stats.memory);
+    lcbex_rcache_destroy(cache);
+}
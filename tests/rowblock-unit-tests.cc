@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+#include <lcbex/rowblock.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RowblockUnitTests : public ::testing::Test
+{
+protected:
+    struct test_row {
+        string key;
+        string id;
+        string value;
+    };
+
+    vector<test_row> rows;
+
+    /**
+     * Generates sorted rows with compound keys sharing long prefixes
+     * @param n how many rows
+     */
+    void generateRows(int n) {
+        char buf[128];
+        rows.clear();
+        for (int ii = 0; ii < n; ii++) {
+            test_row row;
+            sprintf(buf, "[\"unitedstates\",\"nevada\",%d]", ii);
+            row.key = buf;
+            sprintf(buf, "\"customer::0000%06d\"", ii);
+            row.id = buf;
+            sprintf(buf, "{\"n\":%d}", ii);
+            row.value = buf;
+            rows.push_back(row);
+        }
+    }
+
+    lcbex_rowblock_t *buildBlock(unsigned int interval, int flags = 0) {
+        lcbex_rowblock_builder_t *builder;
+        lcbex_rowblock_t *block;
+
+        EXPECT_EQ(LCB_SUCCESS,
+                  lcbex_rowblock_builder_create(&builder, interval, flags));
+        for (size_t ii = 0; ii < rows.size(); ii++) {
+            lcbex_vrow_t vrow;
+            memset(&vrow, 0, sizeof(vrow));
+            vrow.key = rows[ii].key.c_str();
+            vrow.nkey = rows[ii].key.size();
+            vrow.id = rows[ii].id.c_str();
+            vrow.nid = rows[ii].id.size();
+            vrow.value = rows[ii].value.c_str();
+            vrow.nvalue = rows[ii].value.size();
+            EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_add(builder, &vrow));
+        }
+        EXPECT_EQ(LCB_SUCCESS, lcbex_rowblock_builder_finish(builder, &block));
+        lcbex_rowblock_builder_destroy(builder);
+        return block;
+    }
+
+    void assertRowEquals(const test_row &expected, const lcbex_vrow_t *row) {
+        ASSERT_EQ(expected.key, string(row->key, row->nkey));
+        ASSERT_EQ(expected.id, string(row->id, row->nid));
+        ASSERT_EQ(expected.value, string(row->value, row->nvalue));
+        ASSERT_TRUE(row->doc == NULL);
+    }
+};
+
+/**
+ * @test Verify rows round-trip and are stored compactly
+ * @pre Build a block from 1000 rows with shared key and id prefixes
+ * @post Iterating returns identical rows, and the block is smaller than the
+ * raw rows
+ */
+TEST_F(RowblockUnitTests, testRoundTrip)
+{
+    size_t raw_size = 0;
+    generateRows(1000);
+    for (size_t ii = 0; ii < rows.size(); ii++) {
+        raw_size += rows[ii].key.size() + rows[ii].id.size() +
+                    rows[ii].value.size();
+    }
+
+    lcbex_rowblock_t *block = buildBlock(16);
+    ASSERT_EQ(1000, lcbex_rowblock_nrows(block));
+    ASSERT_LT(lcbex_rowblock_size(block), raw_size / 2);
+
+    lcbex_rowblock_iter_t iter;
+    const lcbex_vrow_t *row;
+    size_t count = 0;
+    lcbex_rowblock_iter_init(&iter, block);
+    while (lcbex_rowblock_iter_next(&iter, &row)) {
+        assertRowEquals(rows[count], row);
+        count++;
+    }
+    ASSERT_EQ(1000, count);
+
+    lcbex_rowblock_iter_cleanup(&iter);
+    lcbex_rowblock_free(block);
+}
+
+/**
+ * @test Verify seeking
+ * @pre Seek to every key, to a key between two rows, before the first and
+ * past the last row
+ * @post The iterator is positioned at the first row not sorting before the
+ * key
+ */
+TEST_F(RowblockUnitTests, testSeek)
+{
+    lcbex_rowblock_iter_t iter;
+    const lcbex_vrow_t *row;
+    const char *key;
+
+    generateRows(200);
+    lcbex_rowblock_t *block = buildBlock(32);
+    lcbex_rowblock_iter_init(&iter, block);
+
+    for (size_t ii = 0; ii < rows.size(); ii++) {
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_rowblock_iter_seek(&iter, rows[ii].key.c_str(),
+                                           rows[ii].key.size()));
+        ASSERT_EQ(1, lcbex_rowblock_iter_next(&iter, &row));
+        assertRowEquals(rows[ii], row);
+    }
+
+    key = "[\"unitedstates\",\"nevada\",99.5]";
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    ASSERT_EQ(1, lcbex_rowblock_iter_next(&iter, &row));
+    assertRowEquals(rows[100], row);
+
+    key = "[\"unitedstates\"]";
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    ASSERT_EQ(1, lcbex_rowblock_iter_next(&iter, &row));
+    assertRowEquals(rows[0], row);
+
+    key = "[\"unitedstates\",\"texas\"]";
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    ASSERT_EQ(0, lcbex_rowblock_iter_next(&iter, &row));
+
+    lcbex_rowblock_iter_cleanup(&iter);
+    lcbex_rowblock_free(block);
+}
+
+/**
+ * @test Verify seeking in descending blocks
+ * @pre Build a block from rows in descending order, and seek
+ * @post The iterator is positioned according to descending order
+ */
+TEST_F(RowblockUnitTests, testSeekDescending)
+{
+    lcbex_rowblock_iter_t iter;
+    const lcbex_vrow_t *row;
+    const char *key = "[\"unitedstates\",\"nevada\",49.5]";
+
+    generateRows(100);
+    vector<test_row> reversed(rows.rbegin(), rows.rend());
+    rows = reversed;
+
+    lcbex_rowblock_t *block = buildBlock(16, LCBEX_ROWBLOCK_F_DESCENDING);
+    lcbex_rowblock_iter_init(&iter, block);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    ASSERT_EQ(1, lcbex_rowblock_iter_next(&iter, &row));
+    ASSERT_EQ("[\"unitedstates\",\"nevada\",49]", string(row->key, row->nkey));
+
+    lcbex_rowblock_iter_cleanup(&iter);
+    lcbex_rowblock_free(block);
+}
+
+/**
+ * @test Verify seeking is refused where the server's collation may differ
+ * @pre Seek a lowercase block with an uppercase key, a key with
+ * punctuation, and an object. Build a block whose keys mix cases and seek
+ * it with a plain number
+ * @post Each seek returns LCB_EINVAL
+ */
+TEST_F(RowblockUnitTests, testSeekCollation)
+{
+    lcbex_rowblock_iter_t iter;
+    const char *key;
+
+    generateRows(50);
+    lcbex_rowblock_t *block = buildBlock(16);
+    lcbex_rowblock_iter_init(&iter, block);
+
+    key = "[\"UNITEDSTATES\"]";
+    ASSERT_EQ(LCB_EINVAL, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    key = "[\"united states\"]";
+    ASSERT_EQ(LCB_EINVAL, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+    key = "{\"a\":1}";
+    ASSERT_EQ(LCB_EINVAL, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+
+    lcbex_rowblock_iter_cleanup(&iter);
+    lcbex_rowblock_free(block);
+
+    rows[10].key = "[\"unitedstates\",\"Nevada\",10]";
+    block = buildBlock(16);
+    lcbex_rowblock_iter_init(&iter, block);
+    key = "5";
+    ASSERT_EQ(LCB_EINVAL, lcbex_rowblock_iter_seek(&iter, key, strlen(key)));
+
+    lcbex_rowblock_iter_cleanup(&iter);
+    lcbex_rowblock_free(block);
+}
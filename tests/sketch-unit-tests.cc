@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+#include <lcbex/sketch.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class SketchUnitTests : public ::testing::Test
+{
+};
+
+/**
+ * @test Verify HyperLogLog estimates
+ * @pre Add 100000 distinct items, each twice, and a handful of items to
+ * another sketch
+ * @post Estimates are within 3% for large counts and near-exact for small
+ * ones
+ */
+TEST_F(SketchUnitTests, testHllCount)
+{
+    lcbex_hll_t *hll;
+    char buf[32];
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hll_create(&hll, 0));
+    ASSERT_EQ(0, lcbex_hll_count(hll));
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int ii = 0; ii < 100000; ii++) {
+            sprintf(buf, "\"doc:%d\"", ii);
+            lcbex_hll_add(hll, buf, strlen(buf));
+        }
+    }
+    ASSERT_NEAR(100000, lcbex_hll_count(hll), 3000);
+
+    lcbex_hll_reset(hll);
+    for (int ii = 0; ii < 50; ii++) {
+        sprintf(buf, "%d", ii % 10);
+        lcbex_hll_add(hll, buf, strlen(buf));
+    }
+    ASSERT_NEAR(10, lcbex_hll_count(hll), 0.5);
+    lcbex_hll_destroy(hll);
+
+    ASSERT_EQ(LCB_EINVAL, lcbex_hll_create(&hll, 3));
+    ASSERT_EQ(LCB_EINVAL, lcbex_hll_create(&hll, 19));
+}
+
+/**
+ * @test Verify HyperLogLog merging and row fields
+ * @pre Count overlapping partitions of rows separately, then merge
+ * @post The merged estimate matches the union; precisions must agree
+ */
+TEST_F(SketchUnitTests, testHllMerge)
+{
+    lcbex_hll_t *a, *b, *other;
+    char key[32], id[32];
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hll_create(&a, 12));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hll_create(&b, 12));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hll_create(&other, 10));
+
+    // keys 0..29999 in a, 20000..49999 in b; ids are all the same
+    for (int ii = 0; ii < 50000; ii++) {
+        lcbex_vrow_t row;
+        memset(&row, 0, sizeof(row));
+        sprintf(key, "[%d]", ii);
+        sprintf(id, "\"x\"");
+        row.key = key;
+        row.nkey = strlen(key);
+        row.id = id;
+        row.nid = strlen(id);
+        if (ii < 30000) {
+            lcbex_hll_add_row(a, &row, LCBEX_SKETCH_KEY);
+        }
+        if (ii >= 20000) {
+            lcbex_hll_add_row(b, &row, LCBEX_SKETCH_KEY);
+        }
+        lcbex_hll_add_row(other, &row, LCBEX_SKETCH_ID);
+        // no value: ignored
+        lcbex_hll_add_row(other, &row, LCBEX_SKETCH_VALUE);
+    }
+
+    ASSERT_NEAR(30000, lcbex_hll_count(a), 1500);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_hll_merge(a, b));
+    ASSERT_NEAR(50000, lcbex_hll_count(a), 2500);
+    ASSERT_NEAR(1, lcbex_hll_count(other), 0.1);
+    ASSERT_EQ(LCB_EINVAL, lcbex_hll_merge(a, other));
+
+    lcbex_hll_destroy(a);
+    lcbex_hll_destroy(b);
+    lcbex_hll_destroy(other);
+}
+
+/**
+ * @test Verify t-digest quantiles
+ * @pre Add a shuffled uniform sequence of 100000 values
+ * @post Quantiles are within 0.5% of the range, and tighter at the tails
+ */
+TEST_F(SketchUnitTests, testTdigestQuantiles)
+{
+    lcbex_tdigest_t *td;
+    vector<double> values;
+
+    for (int ii = 0; ii < 100000; ii++) {
+        values.push_back(ii);
+    }
+    srand(42);
+    random_shuffle(values.begin(), values.end());
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_create(&td, 0));
+    ASSERT_TRUE(isnan(lcbex_tdigest_quantile(td, 0.5)));
+    for (size_t ii = 0; ii < values.size(); ii++) {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_add(td, values[ii], 1));
+    }
+
+    ASSERT_EQ(100000, lcbex_tdigest_count(td));
+    ASSERT_EQ(0, lcbex_tdigest_min(td));
+    ASSERT_EQ(99999, lcbex_tdigest_max(td));
+    ASSERT_EQ(0, lcbex_tdigest_quantile(td, 0));
+    ASSERT_EQ(99999, lcbex_tdigest_quantile(td, 1));
+
+    ASSERT_NEAR(50000, lcbex_tdigest_quantile(td, 0.5), 500);
+    ASSERT_NEAR(25000, lcbex_tdigest_quantile(td, 0.25), 500);
+    ASSERT_NEAR(99000, lcbex_tdigest_quantile(td, 0.99), 50);
+    ASSERT_NEAR(99900, lcbex_tdigest_quantile(td, 0.999), 25);
+    ASSERT_NEAR(100, lcbex_tdigest_quantile(td, 0.001), 25);
+
+    ASSERT_EQ(LCB_EINVAL, lcbex_tdigest_add(td, 1, 0));
+    lcbex_tdigest_destroy(td);
+}
+
+/**
+ * @test Verify t-digest merging and row values
+ * @pre Digest two partitions of rows (values as numbers and in a field)
+ * and merge them
+ * @post The merged digest estimates the quantiles of the union
+ */
+TEST_F(SketchUnitTests, testTdigestMerge)
+{
+    lcbex_tdigest_t *a, *b;
+    char value[64];
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_create(&a, 0));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_create(&b, 0));
+
+    for (int ii = 0; ii < 20000; ii++) {
+        lcbex_vrow_t row;
+        memset(&row, 0, sizeof(row));
+        row.value = value;
+        if (ii % 2) {
+            sprintf(value, "%d", ii);
+            row.nvalue = strlen(value);
+            ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_add_row(a, &row, NULL));
+        } else {
+            sprintf(value, "{\"ms\":%d}", ii);
+            row.nvalue = strlen(value);
+            ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_add_row(b, &row, "ms"));
+            ASSERT_EQ(LCB_EINVAL, lcbex_tdigest_add_row(b, &row, "nope"));
+        }
+    }
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_tdigest_merge(a, b));
+    ASSERT_EQ(20000, lcbex_tdigest_count(a));
+    ASSERT_EQ(0, lcbex_tdigest_min(a));
+    ASSERT_EQ(19999, lcbex_tdigest_max(a));
+    ASSERT_NEAR(10000, lcbex_tdigest_quantile(a, 0.5), 100);
+    ASSERT_NEAR(19800, lcbex_tdigest_quantile(a, 0.99), 20);
+
+    lcbex_tdigest_destroy(a);
+    lcbex_tdigest_destroy(b);
+}
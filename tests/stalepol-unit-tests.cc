@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+#include <lcbex/stalepol.h>
+#include <string>
+
+using namespace std;
+
+class StalePolicyUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_stalepol_t *policy;
+
+    virtual void SetUp() {
+        ASSERT_EQ(LCB_SUCCESS, lcbex_stalepol_create(&policy));
+    }
+
+    virtual void TearDown() {
+        lcbex_stalepol_destroy(policy);
+    }
+
+    /**
+     * Selects a stale value and returns it as a string
+     * @param design the design document
+     * @param window the maximum staleness
+     * @param now the current time
+     * @param is_refresh set to whether the query is a refresh
+     */
+    string select(const char *design, lcb_uint64_t window,
+                  lcb_uint64_t now, int *is_refresh) {
+        lcbex_vopt_t vopt;
+        EXPECT_EQ(LCB_SUCCESS,
+                  lcbex_stalepol_select(policy, design, -1, window, now,
+                                        &vopt, is_refresh));
+        EXPECT_STREQ("stale", vopt.optname);
+        string ret(vopt.optval, vopt.noptval);
+        lcbex_vopt_cleanup(&vopt);
+        return ret;
+    }
+};
+
+/**
+ * @test Verify the stale=false/update_after/ok progression
+ * @pre Query a design document for the first time
+ * @post stale=false is selected and the query is marked as a refresh
+ *
+ * @pre Query again while the refresh is outstanding
+ * @post stale=update_after is selected
+ *
+ * @pre Report the refresh as done, and query within the window
+ * @post stale=ok is selected
+ *
+ * @pre Query after the window has expired
+ * @post stale=false is selected again
+ */
+TEST_F(StalePolicyUnitTests, testWindow)
+{
+    int is_refresh;
+
+    ASSERT_EQ("false", select("ddoc", 100, 1000, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+
+    ASSERT_EQ("update_after", select("ddoc", 100, 1010, &is_refresh));
+    ASSERT_EQ(0, is_refresh);
+
+    lcbex_stalepol_refreshed(policy, "ddoc", -1, LCB_SUCCESS);
+    ASSERT_EQ("ok", select("ddoc", 100, 1050, &is_refresh));
+    ASSERT_EQ(0, is_refresh);
+    ASSERT_EQ("ok", select("ddoc", 100, 1100, &is_refresh));
+
+    // window is measured from when the refresh was issued
+    ASSERT_EQ("false", select("ddoc", 100, 1101, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+}
+
+/**
+ * @test Verify design documents are tracked independently
+ * @pre Refresh one design document, then query another
+ * @post The other design document is refreshed as well
+ */
+TEST_F(StalePolicyUnitTests, testPerDesign)
+{
+    int is_refresh;
+
+    ASSERT_EQ("false", select("ddoc1", 100, 1000, &is_refresh));
+    lcbex_stalepol_refreshed(policy, "ddoc1", -1, LCB_SUCCESS);
+    ASSERT_EQ("false", select("ddoc2", 100, 1000, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+    ASSERT_EQ("ok", select("ddoc1", 100, 1000, &is_refresh));
+
+    lcbex_stalepol_reset(policy, "ddoc1", -1);
+    ASSERT_EQ("false", select("ddoc1", 100, 1000, &is_refresh));
+}
+
+/**
+ * @test Verify failed and lost refreshes
+ * @pre Report a refresh as failed
+ * @post The next query is a refresh again
+ *
+ * @pre Never report a refresh, and query after the window
+ * @post The next query takes over the refresh
+ */
+TEST_F(StalePolicyUnitTests, testFailedRefresh)
+{
+    int is_refresh;
+
+    ASSERT_EQ("false", select("ddoc", 100, 1000, &is_refresh));
+    lcbex_stalepol_refreshed(policy, "ddoc", -1, LCB_ETIMEDOUT);
+    ASSERT_EQ("false", select("ddoc", 100, 1001, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+
+    ASSERT_EQ("update_after", select("ddoc", 100, 1050, &is_refresh));
+    ASSERT_EQ("false", select("ddoc", 100, 1200, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+}
+
+/**
+ * @test Verify a zero tolerance
+ * @pre Query with a staleness of zero after a successful refresh
+ * @post stale=false is used
+ */
+TEST_F(StalePolicyUnitTests, testZeroStaleness)
+{
+    int is_refresh;
+
+    ASSERT_EQ("false", select("ddoc", 0, 1000, &is_refresh));
+    lcbex_stalepol_refreshed(policy, "ddoc", -1, LCB_SUCCESS);
+    ASSERT_EQ("false", select("ddoc", 0, 1000, &is_refresh));
+    ASSERT_NE(0, is_refresh);
+    ASSERT_EQ("false", select("ddoc", 0, 1000, &is_refresh));
+    ASSERT_EQ(0, is_refresh);
+}
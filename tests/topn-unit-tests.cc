@@ -0,0 +1,252 @@
+#include <gtest/gtest.h>
+#include <lcbex/topn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class TopnUnitTests : public ::testing::Test
+{
+protected:
+    lcbex_vopt_t *vopt_list;
+    lcbex_vopt_t *vopt_ptrs[16];
+    size_t nvopts;
+
+    virtual void SetUp() {
+        char *errstr;
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_vopt_createv(&vopt_list, &nvopts, &errstr,
+                                     "startkey", "0", "endkey", "1000",
+                                     "reduce", "false", NULL));
+        for (size_t ii = 0; ii < nvopts; ii++) {
+            vopt_ptrs[ii] = vopt_list + ii;
+        }
+    }
+
+    virtual void TearDown() {
+        lcbex_vopt_cleanup_list(&vopt_list, nvopts, 1);
+        free(vopt_list);
+    }
+};
+
+/* scores repeat every 500 keys; every seventh row has no score */
+static int score_of(int k)
+{
+    return (k * 389) % 500;
+}
+
+static string make_response(int start, int end)
+{
+    string s = "{\"total_rows\":20000,\"rows\":[";
+    char buf[128];
+    for (int k = start; k < end; k++) {
+        if (k % 7 == 3) {
+            sprintf(buf, "%s{\"id\":\"doc%d\",\"key\":%d,\"value\":{}}",
+                    k == start ? "" : ",", k, k);
+        } else {
+            sprintf(buf, "%s{\"id\":\"doc%d\",\"key\":%d,"
+                    "\"value\":{\"stats\":{\"score\":%d.5}}}",
+                    k == start ? "" : ",", k, k, score_of(k));
+        }
+        s += buf;
+    }
+    return s + "]}";
+}
+
+struct part_job {
+    lcbex_topn_part_t *part;
+    int start;
+    int end;
+    lcb_error_t err;
+};
+
+static void *run_part(void *arg)
+{
+    part_job *job = (part_job *)arg;
+    string resp = make_response(job->start, job->end);
+
+    for (size_t pos = 0; pos < resp.size(); pos += 1000) {
+        size_t n = min((size_t)1000, resp.size() - pos);
+        if ((job->err = lcbex_topn_part_feed(job->part, resp.data() + pos,
+                                             n)) != LCB_SUCCESS) {
+            return NULL;
+        }
+    }
+    job->err = lcbex_topn_part_done(job->part, LCB_SUCCESS);
+    return NULL;
+}
+
+/**
+ * @test Verify top-N over a partitioned scan
+ * @pre Partition a 0..1000 range into four parts, each fed by its own
+ * thread with rows scored by a nested field, some without it
+ * @post The merged rows are the 25 best, best first, with ties in key
+ * order; rows without a score are skipped
+ */
+TEST_F(TopnUnitTests, testPartitioned)
+{
+    lcbex_plan_config_t config;
+    lcbex_plan_t plan;
+    lcbex_topn_t *topn;
+    part_job jobs[4];
+    pthread_t thr[4];
+    const lcbex_topn_row_t *rows;
+    size_t nrows;
+    vector<pair<int, int> > expected;
+
+    lcbex_plan_config_init(&config);
+    config.max_parallelism = 4;
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_plan_create(&plan, &config, vopt_ptrs, nvopts, 20000));
+    ASSERT_EQ(LCBEX_PLAN_RANGE_PARTITIONED, plan.strategy);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_create(&topn, 25, "stats.score", 0,
+                                             &plan, "d", -1, "v", -1,
+                                             vopt_ptrs, nvopts));
+    ASSERT_EQ(plan.nparts, lcbex_topn_nparts(topn));
+    ASSERT_EQ(4, plan.nparts);
+
+    char *uri = lcbex_topn_part_make_uri(lcbex_topn_get_part(topn, 3));
+    /* the last partition keeps the query's endkey */
+    ASSERT_STREQ("_design/d/_view/v?endkey=1000&reduce=false&startkey=750",
+                 uri);
+    free(uri);
+
+    for (size_t ii = 0; ii < 4; ii++) {
+        double start, end;
+        ASSERT_EQ(LCB_SUCCESS,
+                  lcbex_plan_get_part_range(&plan, ii, &start, &end));
+        jobs[ii].part = lcbex_topn_get_part(topn, ii);
+        jobs[ii].start = (int)start;
+        /* the last partition includes its end */
+        jobs[ii].end = (int)end + (ii == 3);
+        ASSERT_EQ(0, pthread_create(&thr[ii], NULL, run_part, &jobs[ii]));
+    }
+    for (size_t ii = 0; ii < 4; ii++) {
+        pthread_join(thr[ii], NULL);
+        ASSERT_EQ(LCB_SUCCESS, jobs[ii].err);
+    }
+
+    lcb_uint64_t nread, nskipped;
+    lcbex_topn_part_get_counts(lcbex_topn_get_part(topn, 0), &nread,
+                               &nskipped);
+    ASSERT_EQ(250, nread);
+    ASSERT_EQ(36, nskipped);
+
+    /* best score first, then lowest key */
+    for (int k = 0; k <= 1000; k++) {
+        if (k % 7 != 3) {
+            expected.push_back(make_pair(-score_of(k), k));
+        }
+    }
+    sort(expected.begin(), expected.end());
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(25, nrows);
+    for (size_t ii = 0; ii < nrows; ii++) {
+        char key[32], id[32];
+        sprintf(key, "%d", expected[ii].second);
+        sprintf(id, "\"doc%d\"", expected[ii].second);
+        ASSERT_EQ(-expected[ii].first + 0.5, rows[ii].value);
+        ASSERT_EQ(string(key), string(rows[ii].row.key, rows[ii].row.nkey));
+        ASSERT_EQ(string(id), string(rows[ii].row.id, rows[ii].row.nid));
+    }
+
+    /* a failed part must be retried before merging */
+    lcbex_topn_part_t *part = lcbex_topn_get_part(topn, 2);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_reset(part));
+    ASSERT_EQ(LCB_EINVAL, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(LCB_ETIMEDOUT, lcbex_topn_part_done(part, LCB_ETIMEDOUT));
+    ASSERT_EQ(LCB_ETIMEDOUT, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_reset(part));
+    jobs[2].err = LCB_ERROR;
+    run_part(&jobs[2]);
+    ASSERT_EQ(LCB_SUCCESS, jobs[2].err);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(25, nrows);
+    ASSERT_EQ(-expected[24].first + 0.5, rows[24].value);
+
+    lcbex_topn_destroy(topn);
+}
+
+/**
+ * @test Verify bottom-N of plain numeric values
+ * @pre Offer rows whose values are numbers (and some which are not) to a
+ * single part, keeping the 3 lowest
+ * @post The lowest values are returned, lowest first; equal values keep
+ * the order they were offered in; fewer rows than N are all returned
+ */
+TEST_F(TopnUnitTests, testAscending)
+{
+    lcbex_plan_t plan;
+    lcbex_topn_t *topn;
+    const lcbex_topn_row_t *rows;
+    size_t nrows;
+    static const char *values[] = {
+        "5", "-2.5", "\"str\"", "7", "1e-3", "-2.5", "null", "[1]", "100"
+    };
+
+    memset(&plan, 0, sizeof(plan));
+    plan.strategy = LCBEX_PLAN_PAGINATED;
+    ASSERT_EQ(LCB_EINVAL, lcbex_topn_create(&topn, 3, NULL, 0, &plan,
+                                            "d", -1, "v", -1, NULL, 0));
+    plan.strategy = LCBEX_PLAN_SINGLE;
+    plan.nparts = 1;
+    ASSERT_EQ(LCB_EINVAL, lcbex_topn_create(&topn, 0, NULL, 0, &plan,
+                                            "d", -1, "v", -1, NULL, 0));
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_topn_create(&topn, 3, NULL, LCBEX_TOPN_F_ASCENDING,
+                                &plan, "d", -1, "v", -1, NULL, 0));
+    ASSERT_EQ(1, lcbex_topn_nparts(topn));
+    lcbex_topn_part_t *part = lcbex_topn_get_part(topn, 0);
+
+    /* fewer rows than N */
+    lcbex_vrow_t row;
+    memset(&row, 0, sizeof(row));
+    row.key = "0";
+    row.nkey = 1;
+    row.value = values[0];
+    row.nvalue = 1;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_add_row(part, &row));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_done(part, LCB_SUCCESS));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(1, nrows);
+    ASSERT_EQ(5.0, rows[0].value);
+    ASSERT_EQ(LCB_EINVAL, lcbex_topn_part_add_row(part, &row));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_reset(part));
+    for (size_t ii = 0; ii < sizeof(values) / sizeof(values[0]); ii++) {
+        char key[8];
+        sprintf(key, "%d", (int)ii);
+        row.key = key;
+        row.nkey = strlen(key);
+        row.value = values[ii];
+        row.nvalue = strlen(values[ii]);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_add_row(part, &row));
+    }
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_part_done(part, LCB_SUCCESS));
+
+    lcb_uint64_t nread, nskipped;
+    lcbex_topn_part_get_counts(part, &nread, &nskipped);
+    ASSERT_EQ(9, nread);
+    ASSERT_EQ(3, nskipped);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_topn_merge(topn, &rows, &nrows));
+    ASSERT_EQ(3, nrows);
+    ASSERT_EQ(-2.5, rows[0].value);
+    ASSERT_EQ("1", string(rows[0].row.key, rows[0].row.nkey));
+    ASSERT_EQ(-2.5, rows[1].value);
+    ASSERT_EQ("5", string(rows[1].row.key, rows[1].row.nkey));
+    ASSERT_EQ(0.001, rows[2].value);
+    ASSERT_EQ("1e-3", string(rows[2].row.value, rows[2].row.nvalue));
+    ASSERT_TRUE(rows[2].row.id == NULL);
+
+    lcbex_topn_destroy(topn);
+}
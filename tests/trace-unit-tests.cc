@@ -0,0 +1,294 @@
+#include <gtest/gtest.h>
+#include <lcbex/trace.h>
+#include <lcbex/viewopts.h>
+#include <lcbex/vrow.h>
+#include <lcbex/jsoncur.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class TraceUnitTests : public ::testing::Test
+{
+protected:
+    virtual void TearDown() {
+        lcbex_trace_disable();
+        lcbex_trace_set_query(0);
+        lcbex_trace_cleanup();
+    }
+};
+
+static void collect(const lcbex_trace_event_t *events, size_t n, void *cookie)
+{
+    vector<lcbex_trace_event_t> *v = (vector<lcbex_trace_event_t> *)cookie;
+    v->insert(v->end(), events, events + n);
+}
+
+static void ignore_row(lcbex_vrow_parser_t *, const lcbex_vrow_t *, void *)
+{
+}
+
+/**
+ * @test Verify the phases lcbex instruments itself
+ * @pre Enable tracing, set a query ID, assign an option, build a URI and
+ * parse a response with two rows, then flush
+ * @post Each phase has a span tagged with the query ID; a second flush
+ * exports nothing
+ */
+TEST_F(TraceUnitTests, testBuiltinSpans)
+{
+    vector<lcbex_trace_event_t> events;
+    lcbex_vopt_t opt, *optp = &opt;
+    lcbex_vrow_parser_t *parser;
+    char *errstr = NULL, *uri;
+    lcb_uint64_t dropped = 1;
+    const char *resp = "{\"total_rows\":2,\"rows\":["
+            "{\"id\":\"a\",\"key\":1,\"value\":null},"
+            "{\"id\":\"b\",\"key\":2,\"value\":null}]}";
+    map<string, int> counts;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_trace_enable(0));
+    lcbex_trace_set_query(42);
+    ASSERT_EQ(42, lcbex_trace_get_query());
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_assign(&opt, "limit", -1, "10", -1, 0, &errstr));
+    uri = lcbex_vqstr_make_uri("dd", -1, "v", -1, &optp, 1);
+    ASSERT_TRUE(uri != NULL);
+    free(uri);
+    lcbex_vopt_cleanup(&opt);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_parser_create(&parser, ignore_row, NULL));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_parser_feed(parser, resp, strlen(resp)));
+    lcbex_vrow_parser_destroy(parser);
+
+    ASSERT_EQ(5, lcbex_trace_flush(collect, &events, &dropped));
+    ASSERT_EQ(0, dropped);
+    for (size_t ii = 0; ii < events.size(); ii++) {
+        ASSERT_EQ(42, events[ii].query_id);
+        ASSERT_EQ('X', events[ii].phase);
+        ASSERT_NE(0, events[ii].thread_id);
+        counts[events[ii].name]++;
+    }
+    ASSERT_EQ(1, counts[LCBEX_TRACE_OPTIONS]);
+    ASSERT_EQ(1, counts[LCBEX_TRACE_URI]);
+    ASSERT_EQ(1, counts[LCBEX_TRACE_PARSE]);
+    ASSERT_EQ(2, counts[LCBEX_TRACE_CALLBACK]);
+
+    /* callbacks run inside the parse span */
+    ASSERT_STREQ(LCBEX_TRACE_PARSE, events[4].name);
+    ASSERT_LE(events[4].start, events[2].start);
+    ASSERT_GE(events[4].start + events[4].duration,
+              events[3].start + events[3].duration);
+
+    events.clear();
+    ASSERT_EQ(0, lcbex_trace_flush(collect, &events, NULL));
+
+    /* nothing is recorded while disabled */
+    lcbex_trace_disable();
+    ASSERT_EQ(0, lcbex_trace_now());
+    lcbex_trace_mark(LCBEX_TRACE_FIRST_BYTE);
+    ASSERT_EQ(0, lcbex_trace_flush(collect, &events, NULL));
+}
+
+/**
+ * @test Verify ring overflow
+ * @pre Use rings of 8 events and record 20 before flushing
+ * @post The newest 8 are exported in order and 12 are reported dropped
+ */
+TEST_F(TraceUnitTests, testOverflow)
+{
+    vector<lcbex_trace_event_t> events;
+    lcb_uint64_t dropped;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_trace_enable(8));
+    for (int ii = 0; ii < 20; ii++) {
+        lcbex_trace_span_at("span", 1000 * ii, 1000 * ii + 10);
+    }
+    ASSERT_EQ(8, lcbex_trace_flush(collect, &events, &dropped));
+    ASSERT_EQ(12, dropped);
+    for (int ii = 0; ii < 8; ii++) {
+        ASSERT_EQ(1000 * (ii + 12), events[ii].start);
+        ASSERT_EQ(10, events[ii].duration);
+    }
+}
+
+struct recorder {
+    pthread_t thr;
+    lcb_uint64_t query;
+};
+
+static void *record_spans(void *arg)
+{
+    recorder *r = (recorder *)arg;
+    lcbex_trace_set_query(r->query);
+    for (lcb_uint64_t ii = 1; ii <= 20000; ii++) {
+        lcbex_trace_span_at("work", ii, ii + 1);
+    }
+    return NULL;
+}
+
+/**
+ * @test Verify concurrent recording and flushing
+ * @pre Four threads each record 20000 spans into small rings while the
+ * main thread flushes repeatedly
+ * @post Every span is either exported intact or counted as dropped; each
+ * thread's spans arrive in order and carry its own query ID
+ */
+TEST_F(TraceUnitTests, testThreads)
+{
+    recorder rec[4];
+    vector<lcbex_trace_event_t> events;
+    lcb_uint64_t dropped, total_dropped = 0;
+    size_t total = 0;
+    map<lcb_uint64_t, lcb_uint64_t> last;
+    map<lcb_uint64_t, lcb_uint32_t> tids;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_trace_enable(256));
+    for (int ii = 0; ii < 4; ii++) {
+        rec[ii].query = ii + 1;
+        ASSERT_EQ(0, pthread_create(&rec[ii].thr, NULL, record_spans,
+                                    rec + ii));
+    }
+    for (int ii = 0; ii < 200; ii++) {
+        total += lcbex_trace_flush(collect, &events, &dropped);
+        total_dropped += dropped;
+    }
+    for (int ii = 0; ii < 4; ii++) {
+        pthread_join(rec[ii].thr, NULL);
+    }
+    total += lcbex_trace_flush(collect, &events, &dropped);
+    total_dropped += dropped;
+
+    ASSERT_EQ(80000, total + total_dropped);
+    ASSERT_EQ(total, events.size());
+    for (size_t ii = 0; ii < events.size(); ii++) {
+        const lcbex_trace_event_t &ev = events[ii];
+        ASSERT_STREQ("work", ev.name);
+        ASSERT_EQ(1, ev.duration);
+        ASSERT_GT(ev.start, last[ev.query_id]);
+        last[ev.query_id] = ev.start;
+        if (tids.count(ev.query_id)) {
+            ASSERT_EQ(tids[ev.query_id], ev.thread_id);
+        }
+        tids[ev.query_id] = ev.thread_id;
+    }
+    /* the last spans of each thread are always kept */
+    for (lcb_uint64_t q = 1; q <= 4; q++) {
+        ASSERT_EQ(20000, last[q]);
+    }
+}
+
+static void *record_and_exit(void *arg)
+{
+    lcbex_trace_set_query(*(lcb_uint64_t *)arg);
+    lcbex_trace_span_at("short", 1, 2);
+    return NULL;
+}
+
+/**
+ * @test Verify the rings of exited threads are reclaimed
+ * @pre Start and join 64 threads in turn, each recording one span, while
+ * the main thread records too; flush after each thread
+ * @post Every thread's span is exported exactly once; the main thread's
+ * ring survives the flushes
+ */
+TEST_F(TraceUnitTests, testThreadExit)
+{
+    vector<lcbex_trace_event_t> events;
+    size_t total = 0;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_trace_enable(16));
+    for (lcb_uint64_t ii = 1; ii <= 64; ii++) {
+        pthread_t thr;
+        ASSERT_EQ(0, pthread_create(&thr, NULL, record_and_exit, &ii));
+        pthread_join(thr, NULL);
+        lcbex_trace_mark("main");
+        total += lcbex_trace_flush(collect, &events, NULL);
+        /* already drained and freed */
+        ASSERT_EQ(0, lcbex_trace_flush(collect, &events, NULL));
+    }
+
+    ASSERT_EQ(128, total);
+    ASSERT_EQ(total, events.size());
+    map<lcb_uint64_t, int> seen;
+    set<lcb_uint32_t> main_tids;
+    for (size_t ii = 0; ii < events.size(); ii++) {
+        if (strcmp(events[ii].name, "main") == 0) {
+            main_tids.insert(events[ii].thread_id);
+        } else {
+            seen[events[ii].query_id]++;
+        }
+    }
+    ASSERT_EQ(1, main_tids.size());
+    ASSERT_EQ(64, seen.size());
+    for (lcb_uint64_t ii = 1; ii <= 64; ii++) {
+        ASSERT_EQ(1, seen[ii]);
+    }
+}
+
+/**
+ * @test Verify the Chrome trace-event exporter
+ * @pre Record a span and an instant event and export them to a file
+ * @post The file is a JSON array of events with the expected fields
+ */
+TEST_F(TraceUnitTests, testChromeExport)
+{
+    lcbex_trace_chrome_t ctx;
+    lcbex_json_index_t *idx;
+    lcbex_jsoncur_t root, ev, field;
+    vector<char> buf(4096), sbuf(256);
+    const char *s;
+    size_t n, ns;
+    double d;
+    FILE *fp = tmpfile();
+
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_trace_enable(0));
+    lcbex_trace_set_query(7);
+    lcbex_trace_span_at(LCBEX_TRACE_CONNECT, 1500, 4250);
+    lcbex_trace_set_query(0);
+    lcbex_trace_mark(LCBEX_TRACE_FIRST_BYTE);
+
+    lcbex_trace_chrome_begin(&ctx, fp);
+    ASSERT_EQ(2, lcbex_trace_flush(lcbex_trace_chrome_export, &ctx, NULL));
+    lcbex_trace_chrome_end(&ctx);
+
+    rewind(fp);
+    n = fread(&buf[0], 1, buf.size(), fp);
+    fclose(fp);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_create(&idx));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_json_index_build(idx, &buf[0], n));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_root(idx, &root));
+    ASSERT_EQ(LCBEX_JSON_ARRAY, lcbex_jsoncur_type(&root));
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_at(&root, 0, &ev));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&ev, "name", -1, &field));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_string(&field, &sbuf[0], &s, &ns));
+    ASSERT_EQ(string(LCBEX_TRACE_CONNECT), string(s, ns));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&ev, "ts", -1, &field));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+    ASSERT_DOUBLE_EQ(1.5, d);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&ev, "dur", -1, &field));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+    ASSERT_DOUBLE_EQ(2.75, d);
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_path(&ev, "args.query", &field));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_double(&field, &d));
+    ASSERT_EQ(7, d);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_at(&root, 1, &ev));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_get(&ev, "ph", -1, &field));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_jsoncur_string(&field, &sbuf[0], &s, &ns));
+    ASSERT_EQ(string("i"), string(s, ns));
+    ASSERT_EQ(LCB_KEY_ENOENT, lcbex_jsoncur_get(&ev, "args", -1, &field));
+    ASSERT_EQ(LCB_KEY_ENOENT, lcbex_jsoncur_at(&root, 2, &ev));
+
+    lcbex_json_index_destroy(idx);
+}
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <lcbex/viewopts.h>
+#include <pthread.h>
+#include <float.h>
 #include <iostream>
 #include <list>
+#include <string>
 
 using namespace std;
 
@@ -435,6 +438,77 @@ TEST_F(VoptUnitTests, testPercentEncoding)
     lcbex_vopt_cleanup(&vopt);
 }
 
+/**
+ * @test Verify the percent-encoding profiles
+ * @pre Assign a JSON array key with each of the encoding profiles
+ * @post The PHP profile escapes all punctuation, RFC 3986 additionally
+ * leaves '~' alone, and the query-safe profile leaves JSON punctuation alone
+ * but still escapes query separators and spaces
+ */
+TEST_F(VoptUnitTests, testPercentEncodingProfiles)
+{
+    lcbex_vopt_t vopt;
+    const char *key = "[\"a~b\",\"c d\",\"e&f=g+h\"]";
+
+    ASSERT_EQ(LCB_SUCCESS,
+              voptAssignSS(&vopt, "startkey", key, LCBEX_VOPT_F_PCTENCODE));
+    assertKvEquals(&vopt, "startkey",
+                   "%5B%22a%7Eb%22%2C%22c%20d%22%2C%22e%26f%3Dg%2Bh%22%5D");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_SUCCESS,
+              voptAssignSS(&vopt, "startkey", key,
+                           LCBEX_VOPT_F_PCTENCODE_RFC3986));
+    assertKvEquals(&vopt, "startkey",
+                   "%5B%22a~b%22%2C%22c%20d%22%2C%22e%26f%3Dg%2Bh%22%5D");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_SUCCESS,
+              voptAssignSS(&vopt, "startkey", key,
+                           LCBEX_VOPT_F_PCTENCODE_QUERYSAFE));
+    assertKvEquals(&vopt, "startkey",
+                   "[\"a~b\",\"c%20d\",\"e%26f%3Dg%2Bh\"]");
+    lcbex_vopt_cleanup(&vopt);
+
+    // nothing to escape; value is used as is
+    ASSERT_EQ(LCB_SUCCESS,
+              voptAssignSS(&vopt, "key", "[\"a\",\"b\"]",
+                           LCBEX_VOPT_F_PCTENCODE_QUERYSAFE));
+    assertKvEquals(&vopt, "key", "[\"a\",\"b\"]");
+    lcbex_vopt_cleanup(&vopt);
+}
+
+/**
+ * @test Verify passing flags to the varargs builder
+ * @pre Call createv_flags with the query-safe profile
+ * @post All string options are encoded with the profile
+ */
+TEST_F(VoptUnitTests, testCreateVarArgsFlags)
+{
+    lcbex_vopt_t *vopt_list = NULL;
+    lcbex_vopt_t *vopt_ptrs[2];
+    size_t nvopts = 0;
+    char *errstr;
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv_flags(&vopt_list, &nvopts,
+                                       LCBEX_VOPT_F_PCTENCODE_QUERYSAFE,
+                                       &errstr,
+                                       "startkey", "[\"a b\",1]",
+                                       "limit", "10",
+                                       NULL));
+    ASSERT_EQ(2, nvopts);
+    vopt_ptrs[0] = vopt_list;
+    vopt_ptrs[1] = vopt_list + 1;
+
+    char *uri = lcbex_vqstr_make_uri("ddoc", -1, "vdoc", -1, vopt_ptrs, 2);
+    ASSERT_STREQ("_design/ddoc/_view/vdoc?startkey=[\"a%20b\",1]&limit=10",
+                 uri);
+    free(uri);
+    lcbex_vopt_cleanup_list(&vopt_list, nvopts, 1);
+    free(vopt_list);
+}
+
 /**
  * @test Verify that a complete URI path can be generated from a list of
  * lcb_vopt_t
@@ -498,6 +572,9 @@ TEST_F(VoptUnitTests, testNoAlloc)
  * @test Check passthrough options
  * @pre Pass unrecognized view options using the F_PASSTHROUGH flag
  * @post The assignment does not fail and the URI is serialized as expected
+ * @pre Assign passthrough options with PCTENCODE and OPTVAL_CONSTANT
+ * @post The flags are kept on the option; the value decodes to the
+ * original, and a constant value is not freed
  * @pre Pass unrecognized view option IDs using the F_PASSTHROUGH flag
  * @post Assignment returns LCB_EINVAL
  */
@@ -515,6 +592,26 @@ TEST_F(VoptUnitTests, testPassthrough)
     assertKvEquals(&vopt, "dummy_option", "dummy_value");
     lcbex_vopt_cleanup(&vopt);
 
+    // the flags are kept, so that the value can be decoded again
+    err = voptAssignSS(&vopt, "dummy_key", "\"a b\"",
+                       LCBEX_VOPT_F_PASSTHROUGH | LCBEX_VOPT_F_PCTENCODE);
+    ASSERT_EQ(LCB_SUCCESS, err);
+    assertKvEquals(&vopt, "dummy_key", "%22a%20b%22");
+    ASSERT_NE(0, vopt.flags & LCBEX_VOPT_F_PASSTHROUGH);
+    ASSERT_NE(0, vopt.flags & LCBEX_VOPT_F_PCTENCODE);
+    char decoded[16];
+    size_t ndecoded = lcbex_vopt_decode(&vopt, decoded);
+    ASSERT_EQ("\"a b\"", string(decoded, ndecoded));
+    lcbex_vopt_cleanup(&vopt);
+
+    // a constant value is not freed
+    err = voptAssignSS(&vopt, "dummy_option", "dummy_value",
+                       LCBEX_VOPT_F_PASSTHROUGH |
+                       LCBEX_VOPT_F_OPTVAL_CONSTANT);
+    ASSERT_EQ(LCB_SUCCESS, err);
+    ASSERT_NE(0, vopt.flags & LCBEX_VOPT_F_OPTVAL_CONSTANT);
+    lcbex_vopt_cleanup(&vopt);
+
     optval = 0;
     optid = 50;
     err = lcbex_vopt_assign(&vopt, &optid, 0,
@@ -638,3 +735,374 @@ TEST_F(VoptUnitTests, testZeroLength)
     ASSERT_EQ(LCB_EINVAL, err);
     lcbex_vopt_cleanup(&vopt);
 }
+
+/**
+ * @test Verify the option list helpers
+ * @pre Find options by name, decode a percent-encoded value, and build a
+ * URI with some options overridden
+ * @post The expected option is found, its value is decoded, and overridden
+ * options are replaced
+ */
+TEST_F(VoptUnitTests, testListHelpers)
+{
+    lcbex_vopt_t *vopt_list = NULL;
+    lcbex_vopt_t *vopt_ptrs[3];
+    lcbex_vopt_t limit;
+    const lcbex_vopt_t *override_list[1];
+    size_t nvopts = 0;
+    char *errstr;
+    char buf[64];
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_vopt_createv_flags(&vopt_list, &nvopts,
+                                       LCBEX_VOPT_F_PCTENCODE, &errstr,
+                                       "startkey", "[\"a b\"]",
+                                       "limit", "10",
+                                       "stale", "ok",
+                                       NULL));
+    for (size_t ii = 0; ii < nvopts; ii++) {
+        vopt_ptrs[ii] = vopt_list + ii;
+    }
+
+    const lcbex_vopt_t *found = lcbex_vopt_find(vopt_ptrs, nvopts, "startkey");
+    ASSERT_EQ(vopt_list, found);
+    ASSERT_TRUE(lcbex_vopt_find(vopt_ptrs, nvopts, "endkey") == NULL);
+
+    size_t n = lcbex_vopt_decode(found, buf);
+    ASSERT_EQ("[\"a b\"]", string(buf, n));
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&limit, "limit", "20"));
+    override_list[0] = &limit;
+    char *uri = lcbex_vqstr_make_uri_override("d", -1, "v", -1,
+                                              vopt_ptrs, nvopts,
+                                              override_list, 1);
+    ASSERT_STREQ("_design/d/_view/v?startkey=%5B%22a%20b%22%5D&stale=ok&limit=20",
+                 uri);
+    free(uri);
+    lcbex_vopt_cleanup(&limit);
+    lcbex_vopt_cleanup_list(&vopt_list, nvopts, 1);
+    free(vopt_list);
+}
+
+/**
+ * @test Test shortest round-trip double formatting
+ * @pre Format typical coordinates, values needing 16/17 digits, large and
+ * small exponents, DBL_MAX, subnormals and non-finite values
+ * @post Output is the shortest string reading back as the same value, and
+ * never contains a '+'
+ */
+TEST_F(VoptUnitTests, testFormatDouble)
+{
+    char buf[LCBEX_VOPT_DOUBLE_BUFSIZE];
+
+    ASSERT_EQ(3, lcbex_vopt_format_double(0.1, buf));
+    ASSERT_STREQ("0.1", buf);
+    lcbex_vopt_format_double(-122.4194, buf);
+    ASSERT_STREQ("-122.4194", buf);
+    lcbex_vopt_format_double(90, buf);
+    ASSERT_STREQ("90", buf);
+    lcbex_vopt_format_double(0.1 + 0.2, buf);
+    ASSERT_STREQ("0.30000000000000004", buf);
+    lcbex_vopt_format_double(1e21, buf);
+    ASSERT_STREQ("1e21", buf);
+    lcbex_vopt_format_double(-2.5e-10, buf);
+    ASSERT_STREQ("-2.5e-10", buf);
+    lcbex_vopt_format_double(DBL_MAX, buf);
+    ASSERT_STREQ("1.7976931348623157e308", buf);
+
+    // subnormals have fewer significant digits than DBL_DIG
+    lcbex_vopt_format_double(5e-324, buf);
+    ASSERT_STREQ("5e-324", buf);
+    lcbex_vopt_format_double(-1.5e-320, buf);
+    ASSERT_STREQ("-1.5e-320", buf);
+    lcbex_vopt_format_double(DBL_MIN - 5e-324, buf);
+    ASSERT_STREQ("2.225073858507201e-308", buf);
+
+    double vals[] = { 1.0 / 3, 123456.789e200, 5e-324, 1.7976931348623157e308 };
+    for (size_t ii = 0; ii < sizeof(vals) / sizeof(vals[0]); ii++) {
+        lcbex_vopt_format_double(vals[ii], buf);
+        ASSERT_EQ(vals[ii], strtod(buf, NULL)) << buf;
+    }
+
+    double zero = 0;
+    ASSERT_EQ(0, lcbex_vopt_format_double(1 / zero, buf));
+    ASSERT_EQ(0, lcbex_vopt_format_double(zero / zero, buf));
+}
+
+/**
+ * @test Test spatial options
+ * @pre Assign bbox/start_range/end_range from strings and from arrays of
+ * doubles, valid and invalid
+ * @post bbox is written as a bare list and ranges as arrays; malformed
+ * lists are rejected
+ */
+TEST_F(VoptUnitTests, testSpatialOptions)
+{
+    lcbex_vopt_t vopt;
+    char *errstr;
+    int optid;
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&vopt, "bbox", "-180, -90, 180, 90"));
+    assertKvEquals(&vopt, "bbox", "-180,-90,180,90");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&vopt, "bbox", "[0,0,1e+2,1.5]"));
+    assertKvEquals(&vopt, "bbox", "0,0,1e2,1.5");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&vopt, "start_range", "[1, null]"));
+    assertKvEquals(&vopt, "start_range", "[1,null]");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&vopt, "end_range", "[1,2]",
+                                        LCBEX_VOPT_F_PCTENCODE));
+    assertKvEquals(&vopt, "end_range", "%5B1%2C2%5D");
+    lcbex_vopt_cleanup(&vopt);
+
+    const char *bad[][2] = {
+        { "bbox", "1,2,3" },
+        { "bbox", "1,2,3,null" },
+        { "bbox", "1,2,3,4,5" },
+        { "start_range", "[]" },
+        { "start_range", "[1,2" },
+        { "start_range", "[1,abc]" },
+        { "end_range", "[1.]" },
+        { "end_range", "[1] x" }
+    };
+    for (size_t ii = 0; ii < sizeof(bad) / sizeof(bad[0]); ii++) {
+        ASSERT_EQ(LCB_EINVAL, voptAssignSS(&vopt, bad[ii][0], bad[ii][1]))
+                << bad[ii][0] << "=" << bad[ii][1];
+    }
+
+    double box[] = { -122.5, 37.7, -122.25, 37.8 };
+    optid = LCBEX_VOPT_OPT_BBOX;
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&vopt, &optid, 0, box, 4,
+                                             LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                                             LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                                             &errstr));
+    assertKvEquals(&vopt, "bbox", "-122.5,37.7,-122.25,37.8");
+    lcbex_vopt_cleanup(&vopt);
+
+    ASSERT_EQ(LCB_EINVAL, lcbex_vopt_assign(&vopt, &optid, 0, box, 3,
+                                            LCBEX_VOPT_F_OPTNAME_NUMERIC |
+                                            LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                                            &errstr));
+
+    double zero = 0;
+    double range[] = { 0.1, zero / zero };
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_assign(&vopt, "start_range", -1,
+                                             range, 2,
+                                             LCBEX_VOPT_F_OPTVAL_NUMERIC,
+                                             &errstr));
+    assertKvEquals(&vopt, "start_range", "[0.1,null]");
+    lcbex_vopt_cleanup(&vopt);
+}
+
+/**
+ * @test Test spatial URI creation
+ * @pre Create a spatial query URI with a bbox
+ * @post The path uses _spatial
+ */
+TEST_F(VoptUnitTests, testSpatialUri)
+{
+    lcbex_vopt_t bbox, limit;
+    lcbex_vopt_t *vopt_list[2] = { &bbox, &limit };
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&bbox, "bbox", "0,0,10,10"));
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&limit, "limit", "5"));
+
+    char *uri = lcbex_vqstr_make_spatial_uri("geo", -1, "points", -1,
+                                             vopt_list, 2);
+    ASSERT_STREQ("_design/geo/_spatial/points?bbox=0,0,10,10&limit=5", uri);
+    free(uri);
+    lcbex_vopt_cleanup_list(vopt_list, 2, 0);
+}
+
+struct tls_uri_result {
+    const lcbex_vopt_t *const *options;
+    const char *uri;
+    string copy;
+};
+
+static void *make_tls_uri(void *arg)
+{
+    tls_uri_result *res = (tls_uri_result *)arg;
+    res->uri = lcbex_vqstr_make_uri_tls("other", -1, "v", -1,
+                                        res->options, 1, NULL);
+    res->copy = res->uri;
+    /* no release; the buffer is freed at thread exit */
+    return NULL;
+}
+
+/**
+ * @test Verify URIs built in the thread-local buffer
+ * @pre Build several URIs, growing the buffer once, and one from another
+ * thread
+ * @post The URIs are correct; the buffer is reused until it must grow;
+ * the other thread uses its own buffer, which is freed (without a release
+ * call) when it exits
+ */
+TEST_F(VoptUnitTests, testTlsUri)
+{
+    lcbex_vopt_t limit, startkey;
+    lcbex_vopt_t *vopt_list[2] = { &limit, &startkey };
+    const char *uri, *uri2;
+    string longkey(1000, 'x');
+    tls_uri_result res;
+    pthread_t thr;
+    size_t n;
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&limit, "limit", "5"));
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&startkey, "startkey",
+                                        ("\"" + longkey + "\"").c_str()));
+
+    uri = lcbex_vqstr_make_uri_tls("dd", -1, "view", -1, vopt_list, 1, &n);
+    ASSERT_STREQ("_design/dd/_view/view?limit=5", uri);
+    ASSERT_EQ(strlen(uri), n);
+
+    uri2 = lcbex_vqstr_make_spatial_uri_tls("dd", 2, "geo", 3,
+                                            vopt_list, 0, &n);
+    ASSERT_EQ(uri, uri2);
+    ASSERT_STREQ("_design/dd/_spatial/geo", uri2);
+    ASSERT_EQ(23, n);
+
+    /* the same URI as the allocating version, once the buffer grows */
+    uri = lcbex_vqstr_make_uri_tls("dd", -1, "view", -1, vopt_list, 2, &n);
+    char *expected = lcbex_vqstr_make_uri("dd", -1, "view", -1, vopt_list, 2);
+    ASSERT_STREQ(expected, uri);
+    ASSERT_EQ(strlen(expected), n);
+    free(expected);
+
+    res.options = vopt_list;
+    ASSERT_EQ(0, pthread_create(&thr, NULL, make_tls_uri, &res));
+    pthread_join(thr, NULL);
+    ASSERT_NE(uri, res.uri);
+    ASSERT_EQ("_design/other/_view/v?limit=5", res.copy);
+    ASSERT_EQ(0, strncmp("_design/dd/_view/view?limit=5&startkey=", uri, 39));
+
+    lcbex_vqstr_tls_release();
+    lcbex_vopt_cleanup_list(vopt_list, 2, 0);
+}
+
+struct memo_thread_arg {
+    int failures;
+};
+
+static void *assign_memoized(void *arg)
+{
+    memo_thread_arg *res = (memo_thread_arg *)arg;
+    static const char *keys[] = { "[\"cust 1\"]", "[\"cust 2\"]",
+                                  "\"2013-06-01\"", "42" };
+    static const char *encoded[] = { "[\"cust%201\"]", "[\"cust%202\"]",
+                                     "\"2013-06-01\"", "42" };
+    char *errstr;
+
+    for (int ii = 0; ii < 2000; ii++) {
+        lcbex_vopt_t vopt;
+        if (lcbex_vopt_assign(&vopt, "startkey", -1, keys[ii % 4], -1,
+                              LCBEX_VOPT_F_PCTENCODE_QUERYSAFE,
+                              &errstr) != LCB_SUCCESS ||
+                strcmp(encoded[ii % 4], vopt.optval) != 0) {
+            res->failures++;
+        }
+        lcbex_vopt_cleanup(&vopt);
+    }
+    return NULL;
+}
+
+/**
+ * @test Verify memoized percent-encoding of option values
+ * @pre Assign the same values repeatedly, with different encodings, more
+ * distinct values than fit, and from several threads at once
+ * @post Repeated values share one encoded copy; encodings are kept apart;
+ * values evicted or left over after disabling the memo stay valid
+ */
+TEST_F(VoptUnitTests, testValueMemo)
+{
+    lcbex_vopt_t a, b, c, plain;
+    lcbex_vopt_memo_stats_t stats;
+    memo_thread_arg args[4];
+    pthread_t thr[4];
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_memo_enable(32));
+    lcbex_vopt_memo_get_stats(&stats);
+    ASSERT_EQ(32, stats.capacity);
+    ASSERT_EQ(0, stats.entries);
+
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&a, "key", "\"foo bar\"",
+                                        LCBEX_VOPT_F_PCTENCODE));
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&b, "key", "\"foo bar\"",
+                                        LCBEX_VOPT_F_PCTENCODE));
+    ASSERT_STREQ("%22foo%20bar%22", a.optval);
+    ASSERT_EQ(15, a.noptval);
+    ASSERT_EQ(a.optval, b.optval);
+    ASSERT_NE(0, b.flags & LCBEX_VOPT_F_OPTVAL_SHARED);
+
+    /* a different encoding of the same bytes */
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&c, "key", "\"foo bar\"",
+                                        LCBEX_VOPT_F_PCTENCODE_QUERYSAFE));
+    ASSERT_STREQ("\"foo%20bar\"", c.optval);
+
+    /* unencoded values don't use the memo */
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&plain, "key", "\"foo bar\""));
+    ASSERT_EQ(0, plain.flags & LCBEX_VOPT_F_OPTVAL_SHARED);
+
+    lcbex_vopt_memo_get_stats(&stats);
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(2, stats.misses);
+    ASSERT_EQ(2, stats.entries);
+
+    lcbex_vopt_cleanup(&b);
+    lcbex_vopt_cleanup(&plain);
+
+    /* push everything out; 'a' and 'c' keep their values */
+    for (int ii = 0; ii < 200; ii++) {
+        lcbex_vopt_t vopt;
+        char buf[32];
+        sprintf(buf, "\"key %d\"", ii);
+        ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&vopt, "key", buf,
+                                            LCBEX_VOPT_F_PCTENCODE));
+        lcbex_vopt_cleanup(&vopt);
+    }
+    lcbex_vopt_memo_get_stats(&stats);
+    ASSERT_EQ(32, stats.entries);
+    ASSERT_EQ(200 + 2 - 32, stats.evictions);
+    ASSERT_STREQ("%22foo%20bar%22", a.optval);
+
+    /* values longer than LCBEX_VOPT_MEMO_MAXVALUE bypass the memo */
+    string longkey(LCBEX_VOPT_MEMO_MAXVALUE + 1, 'x');
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&b, "key", longkey.c_str(),
+                                        LCBEX_VOPT_F_PCTENCODE));
+    ASSERT_EQ(0, b.flags & LCBEX_VOPT_F_OPTVAL_SHARED);
+    lcbex_vopt_cleanup(&b);
+
+    /* the flag can't be forced by the caller */
+    ASSERT_EQ(LCB_SUCCESS, voptAssignSS(&b, "key", "\"x\"",
+                                        LCBEX_VOPT_F_OPTVAL_SHARED));
+    ASSERT_EQ(0, b.flags & LCBEX_VOPT_F_OPTVAL_SHARED);
+    lcbex_vopt_cleanup(&b);
+
+    lcbex_vopt_memo_disable();
+    lcbex_vopt_memo_get_stats(&stats);
+    ASSERT_EQ(0, stats.capacity);
+    ASSERT_STREQ("\"foo%20bar\"", c.optval);
+    lcbex_vopt_cleanup(&a);
+    lcbex_vopt_cleanup(&c);
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vopt_memo_enable(0));
+    for (int ii = 0; ii < 4; ii++) {
+        args[ii].failures = 0;
+        ASSERT_EQ(0, pthread_create(&thr[ii], NULL, assign_memoized,
+                                    &args[ii]));
+    }
+    for (int ii = 0; ii < 4; ii++) {
+        pthread_join(thr[ii], NULL);
+        ASSERT_EQ(0, args[ii].failures);
+    }
+    lcbex_vopt_memo_get_stats(&stats);
+    ASSERT_EQ(LCBEX_VOPT_MEMO_DEFAULT, stats.capacity);
+    ASSERT_EQ(8000, stats.hits + stats.misses);
+    ASSERT_LE(4, stats.misses);
+    ASSERT_EQ(4, stats.entries);
+    lcbex_vopt_memo_disable();
+}
@@ -0,0 +1,210 @@
+#include <gtest/gtest.h>
+#include <lcbex/vrow.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class VrowUnitTests : public ::testing::Test
+{
+protected:
+    int collate(const char *a, const char *b) {
+        int rv = lcbex_vrow_collate(a, strlen(a), b, strlen(b));
+        return rv < 0 ? -1 : (rv > 0 ? 1 : 0);
+    }
+};
+
+/**
+ * @test Verify collation across types
+ * @pre Compare values of each JSON type
+ * @post null < false < true < numbers < strings < arrays < objects
+ */
+TEST_F(VrowUnitTests, testCollateTypes)
+{
+    const char *ordered[] = {
+        "null", "false", "true", "-5", "1", "2.5", "10", "\"a\"", "\"b\"",
+        "[]", "[1]", "[1,2]", "[2]", "{}", "{\"a\":1}"
+    };
+    size_t n = sizeof(ordered) / sizeof(ordered[0]);
+
+    for (size_t ii = 0; ii < n; ii++) {
+        for (size_t jj = 0; jj < n; jj++) {
+            int expected = ii < jj ? -1 : (ii > jj ? 1 : 0);
+            ASSERT_EQ(expected, collate(ordered[ii], ordered[jj]))
+                    << ordered[ii] << " vs " << ordered[jj];
+        }
+    }
+}
+
+/**
+ * @test Verify collation is not byte-wise
+ * @pre Compare numbers, strings with escapes, and values with whitespace
+ * @post Values are compared by meaning rather than by their encoding
+ */
+TEST_F(VrowUnitTests, testCollateEncoding)
+{
+    ASSERT_EQ(-1, collate("9", "10"));
+    ASSERT_EQ(0, collate("1.0", "1"));
+    ASSERT_EQ(0, collate("1e2", "100"));
+    ASSERT_EQ(0, collate("\"A\"", "\"\\u0041\""));
+    ASSERT_EQ(0, collate("[ 1 , \"x\" ]", "[1,\"x\"]"));
+    ASSERT_EQ(-1, collate("[\"US\",\"Nevada\"]", "[\"US\",\"Nevada\",1]"));
+    ASSERT_EQ(1, collate("[\"US\",\"Texas\"]", "[\"US\",\"Nevada\",1]"));
+    ASSERT_EQ(-1, collate("\"ab\"", "\"abc\""));
+    // U+00E9 (two bytes of UTF-8) vs U+1F600 (surrogate pair)
+    ASSERT_EQ(-1, collate("\"\xc3\xa9\"", "\"\\ud83d\\ude00\""));
+    ASSERT_EQ(0, collate("\"\xf0\x9f\x98\x80\"", "\"\\ud83d\\ude00\""));
+}
+
+/**
+ * @test Verify strings without escapes are not copied
+ * @pre Unescape a plain string, including one longer than a SIMD block
+ * @post The result points into the input
+ */
+TEST_F(VrowUnitTests, testUnescapeZeroCopy)
+{
+    const char *strs[] = {
+        "\"\"", "\"docid\"", "\"a somewhat longer document id::0123456789\""
+    };
+    char buf[64];
+
+    for (size_t ii = 0; ii < sizeof(strs) / sizeof(strs[0]); ii++) {
+        const char *out;
+        size_t nout, n = strlen(strs[ii]);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_unescape(strs[ii], n, buf,
+                                                   &out, &nout));
+        ASSERT_EQ(strs[ii] + 1, out);
+        ASSERT_EQ(n - 2, nout);
+    }
+}
+
+/**
+ * @test Verify escape sequences are decoded
+ * @pre Unescape strings with simple escapes, \u escapes and surrogate
+ * pairs, with escapes before and after a full SIMD block
+ * @post The decoded contents are written to the buffer
+ */
+TEST_F(VrowUnitTests, testUnescape)
+{
+    struct {
+        const char *in;
+        const char *out;
+    } cases[] = {
+        { "\"a\\\"b\"", "a\"b" },
+        { "\"\\\\\\/\\b\\f\\n\\r\\t\"", "\\/\b\f\n\r\t" },
+        { "\"caf\\u00e9\"", "caf\xc3\xa9" },
+        { "\"\\u20AC\"", "\xe2\x82\xac" },
+        { "\"\\ud83d\\ude00!\"", "\xf0\x9f\x98\x80!" },
+        { "\"0123456789abcdefghij\\nklmnopqrstuvwxyz\\t\"",
+          "0123456789abcdefghij\nklmnopqrstuvwxyz\t" }
+    };
+    char buf[64];
+
+    for (size_t ii = 0; ii < sizeof(cases) / sizeof(cases[0]); ii++) {
+        const char *out;
+        size_t nout;
+        ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_unescape(cases[ii].in,
+                                                   strlen(cases[ii].in),
+                                                   buf, &out, &nout));
+        ASSERT_EQ(std::string(cases[ii].out), std::string(out, nout));
+    }
+}
+
+/**
+ * @test Verify malformed strings are rejected
+ * @pre Unescape unquoted strings, trailing backslashes, bad escapes and
+ * truncated \u sequences
+ * @post LCB_EINVAL is returned
+ */
+TEST_F(VrowUnitTests, testUnescapeInvalid)
+{
+    const char *strs[] = {
+        "abc", "\"", "\"abc\\\"", "\"\\x\"", "\"\\u12\"", "\"\\u12G4\""
+    };
+    char buf[16];
+
+    for (size_t ii = 0; ii < sizeof(strs) / sizeof(strs[0]); ii++) {
+        const char *out;
+        size_t nout;
+        ASSERT_EQ(LCB_EINVAL, lcbex_vrow_unescape(strs[ii], strlen(strs[ii]),
+                                                  buf, &out, &nout))
+                << strs[ii];
+    }
+}
+
+struct ParsedRows {
+    std::vector<std::string> keys;
+    std::vector<std::string> ids;
+    std::vector<std::string> values;
+};
+
+extern "C" {
+    static void rowCallback(lcbex_vrow_parser_t *, const lcbex_vrow_t *row,
+                            void *cookie)
+    {
+        ParsedRows *rows = (ParsedRows *)cookie;
+        char buf[256];
+        const char *id;
+        size_t nid;
+
+        rows->keys.push_back(std::string(row->key, row->nkey));
+        rows->values.push_back(std::string(row->value, row->nvalue));
+        if (lcbex_vrow_get_id(row, buf, &id, &nid) == LCB_SUCCESS) {
+            rows->ids.push_back(std::string(id, nid));
+        } else {
+            rows->ids.push_back("<none>");
+        }
+    }
+}
+
+/**
+ * @test Verify the streaming row parser
+ * @pre Feed a view response in chunks of every size from 1 to its length
+ * @post Each row is emitted once with the correct fields, and total_rows
+ * is parsed
+ */
+TEST_F(VrowUnitTests, testRowParser)
+{
+    const char *resp =
+        "{\"total_rows\":1234,\"rows\":[\n"
+        "{\"id\":\"doc\\\"1\",\"key\":[\"a\",{\"b\":\"}\"}],\"value\":null},\n"
+        "{\"id\":\"doc2\",\"key\":2,\"value\":{\"rows\":[1,2]}},\n"
+        "{\"key\" : \"k\" , \"value\" : 42}\n"
+        "]\n}";
+    size_t nresp = strlen(resp);
+    lcbex_vrow_parser_t *parser;
+    ParsedRows rows;
+
+    ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_parser_create(&parser, rowCallback,
+                                                    &rows));
+
+    for (size_t chunk = 1; chunk <= nresp; chunk++) {
+        rows = ParsedRows();
+        lcbex_vrow_parser_reset(parser);
+        ASSERT_EQ(SIZE_MAX, lcbex_vrow_parser_total_rows(parser));
+
+        for (size_t off = 0; off < nresp; off += chunk) {
+            size_t n = nresp - off < chunk ? nresp - off : chunk;
+            ASSERT_EQ(LCB_SUCCESS, lcbex_vrow_parser_feed(parser, resp + off,
+                                                          n));
+        }
+
+        ASSERT_EQ(1234, lcbex_vrow_parser_total_rows(parser));
+        ASSERT_EQ(3, lcbex_vrow_parser_nrows(parser));
+        ASSERT_EQ(3, rows.keys.size());
+
+        ASSERT_EQ("[\"a\",{\"b\":\"}\"}]", rows.keys[0]);
+        ASSERT_EQ("doc\"1", rows.ids[0]);
+        ASSERT_EQ("null", rows.values[0]);
+
+        ASSERT_EQ("2", rows.keys[1]);
+        ASSERT_EQ("doc2", rows.ids[1]);
+        ASSERT_EQ("{\"rows\":[1,2]}", rows.values[1]);
+
+        ASSERT_EQ("\"k\"", rows.keys[2]);
+        ASSERT_EQ("<none>", rows.ids[2]);
+        ASSERT_EQ("42", rows.values[2]);
+    }
+
+    lcbex_vrow_parser_destroy(parser);
+}
@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+#include <lcbex/warmer.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class WarmerUnitTests : public ::testing::Test
+{
+};
+
+struct warm_ctx {
+    vector<size_t> submitted;
+    vector<string> uris;
+    vector<size_t> ready;
+    vector<lcb_error_t> ready_errs;
+    size_t max_seen_inflight;
+    size_t cur_inflight;
+    /* if set, complete every query synchronously with this status */
+    short sync_status;
+
+    warm_ctx() : max_seen_inflight(0), cur_inflight(0), sync_status(0) {}
+};
+
+static void submit_cb(lcbex_warmer_t *warmer, size_t index,
+                      const char *uri, void *cookie)
+{
+    warm_ctx *ctx = (warm_ctx *)cookie;
+    ctx->submitted.push_back(index);
+    ctx->uris.push_back(uri);
+    ctx->cur_inflight++;
+    if (ctx->cur_inflight > ctx->max_seen_inflight) {
+        ctx->max_seen_inflight = ctx->cur_inflight;
+    }
+    if (ctx->sync_status) {
+        ctx->cur_inflight--;
+        lcbex_warmer_done(warmer, index, LCB_SUCCESS, ctx->sync_status);
+    }
+}
+
+static void ready_cb(lcbex_warmer_t *, size_t index, lcb_error_t err,
+                     lcb_uint64_t, void *cookie)
+{
+    warm_ctx *ctx = (warm_ctx *)cookie;
+    ctx->ready.push_back(index);
+    ctx->ready_errs.push_back(err);
+}
+
+/**
+ * @test Verify the warming query
+ * @pre Add a design document and start the warmer
+ * @post The submitted URI uses stale=update_after and limit=0
+ */
+TEST_F(WarmerUnitTests, testUri)
+{
+    warm_ctx ctx;
+    lcbex_warmer_t *warmer;
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_warmer_create(&warmer, 1, 1, submit_cb, ready_cb, &ctx));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_warmer_add(warmer, "ddoc", -1, "view", -1));
+    lcbex_warmer_start(warmer);
+
+    ASSERT_EQ(1, ctx.uris.size());
+    ASSERT_STREQ("_design/ddoc/_view/view?stale=update_after&limit=0",
+                 ctx.uris[0].c_str());
+
+    // can't add once started
+    ASSERT_EQ(LCB_EINVAL, lcbex_warmer_add(warmer, "other", -1, "v", -1));
+    lcbex_warmer_destroy(warmer);
+}
+
+/**
+ * @test Verify bounded concurrency and readiness reporting
+ * @pre Add five design documents with a concurrency of two, complete them
+ * one at a time
+ * @post Never more than two queries are outstanding, and remaining() drops
+ * to zero once all have completed
+ */
+TEST_F(WarmerUnitTests, testConcurrency)
+{
+    warm_ctx ctx;
+    lcbex_warmer_t *warmer;
+    char name[32];
+
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_warmer_create(&warmer, 2, 1, submit_cb, ready_cb, &ctx));
+    for (int ii = 0; ii < 5; ii++) {
+        sprintf(name, "ddoc%d", ii);
+        ASSERT_EQ(LCB_SUCCESS, lcbex_warmer_add(warmer, name, -1, "v", -1));
+    }
+
+    lcbex_warmer_start(warmer);
+    ASSERT_EQ(2, ctx.submitted.size());
+    ASSERT_EQ(5, lcbex_warmer_remaining(warmer));
+
+    for (size_t ii = 0; ii < ctx.submitted.size(); ii++) {
+        size_t index = ctx.submitted[ii];
+        ASSERT_EQ(LCBEX_WARMER_S_INFLIGHT,
+                  lcbex_warmer_get_status(warmer, index));
+        ctx.cur_inflight--;
+        lcbex_warmer_done(warmer, index, LCB_SUCCESS, 200);
+        ASSERT_EQ(LCBEX_WARMER_S_READY,
+                  lcbex_warmer_get_status(warmer, index));
+    }
+
+    ASSERT_EQ(5, ctx.submitted.size());
+    ASSERT_EQ(2, ctx.max_seen_inflight);
+    ASSERT_EQ(5, ctx.ready.size());
+    ASSERT_EQ(0, lcbex_warmer_remaining(warmer));
+    ASSERT_EQ(0, lcbex_warmer_failed(warmer));
+    lcbex_warmer_destroy(warmer);
+}
+
+/**
+ * @test Verify retries
+ * @pre Complete every query synchronously with an HTTP error, allowing
+ * three attempts
+ * @post Each design document is submitted three times and then reported as
+ * failed
+ */
+TEST_F(WarmerUnitTests, testRetries)
+{
+    warm_ctx ctx;
+    lcbex_warmer_t *warmer;
+
+    ctx.sync_status = 500;
+    ASSERT_EQ(LCB_SUCCESS,
+              lcbex_warmer_create(&warmer, 4, 3, submit_cb, ready_cb, &ctx));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_warmer_add(warmer, "a", -1, "v", -1));
+    ASSERT_EQ(LCB_SUCCESS, lcbex_warmer_add(warmer, "b", -1, "v", -1));
+    lcbex_warmer_start(warmer);
+
+    ASSERT_EQ(6, ctx.submitted.size());
+    ASSERT_EQ(2, ctx.ready.size());
+    ASSERT_NE(LCB_SUCCESS, ctx.ready_errs[0]);
+    ASSERT_EQ(LCBEX_WARMER_S_FAILED, lcbex_warmer_get_status(warmer, 0));
+    ASSERT_EQ(0, lcbex_warmer_remaining(warmer));
+    ASSERT_EQ(2, lcbex_warmer_failed(warmer));
+    lcbex_warmer_destroy(warmer);
+}